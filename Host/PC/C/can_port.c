@@ -0,0 +1,520 @@
+#include "can_port.h"
+
+#ifdef __linux__
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+// id layout, must match bootloader can transport
+#define CAN_ID_BASE 0x1B000000U
+#define CAN_ID_BASE_MASK 0x1FF00000U
+#define CAN_ID_TYPE_MASK 0x000F0000U
+#define CAN_ID_LOW_MASK 0x0000FFFFU
+#define CAN_ID_HOST_DATA 0x00000000U   // host to node stream, low bits node id
+#define CAN_ID_NODE_DATA 0x00010000U   // node to host stream, low bits node id
+#define CAN_ID_BCAST_DATA 0x00020000U  // host to all, low bits segment no
+#define CAN_ID_BCAST_CTRL 0x00030000U  // host to all, low bits 0
+#define CAN_ID_NODE_STATUS 0x00040000U // node to host, low bits node id
+
+// broadcast control, first data byte
+#define CAN_CTRL_START 0x01    // [START + tag + 2-byte len]
+#define CAN_CTRL_STATUS 0x02   // [STATUS + tag], reply [STATUS + tag + 2-byte missing + 2-byte first + 2-byte window mask]
+#define CAN_CTRL_DISCOVER 0x03 // [DISCOVER], reply [DISCOVER + joined]
+
+#define CAN_NO_FRAME 0xFFFF // missing count of a node that did not see frame start
+#define CAN_SEGMENT_SIZE 8
+#define CAN_STATUS_WINDOW 16 // segments per status frame, bit i of mask set if segment first + i is missing
+#define CAN_STATUS_FRAMES 8  // status frames a node sends per request at most
+#define CAN_MAX_SEGMENTS 8192 // 2-byte len in frame start
+
+#define CAN_RX_QUEUE 16384     // per node, holds largest reply
+#define CAN_DISCOVER_TIME 200  // ms nodes have to answer discovery
+#define CAN_BROADCAST_ROUNDS 16 // status rounds before nodes still missing segments are given up
+
+struct CAN_Node
+{
+   uint16_t id;
+   uint8_t queue[CAN_RX_QUEUE];
+   uint32_t head;
+   uint32_t tail;
+   uint8_t status_tag;     // of status frames since last request
+   uint32_t status_frames;
+   uint32_t missing;       // segments node is missing
+   uint32_t covered;       // missing segments in windows so far
+   uint16_t window_first[CAN_STATUS_FRAMES];
+   uint16_t window_mask[CAN_STATUS_FRAMES];
+};
+
+struct CAN_Port
+{
+   int fd;
+   uint32_t timeout; // ms
+   uint8_t all;      // port named every node
+   uint8_t discovered;
+   uint8_t tag;      // of last broadcast
+   struct CAN_Node *selected;
+   uint32_t node_count;
+   struct CAN_Node node[CAN_MAX_NODES];
+};
+
+static uint64_t CAN_Millis(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct CAN_Node *CAN_Node_Get(CAN_Port_t *can, uint16_t id)
+{
+   for (uint32_t i = 0; i < can->node_count; i++)
+   {
+      if (can->node[i].id == id)
+      {
+         return &can->node[i];
+      }
+   }
+
+   if (can->node_count == CAN_MAX_NODES)
+   {
+      return NULL;
+   }
+
+   struct CAN_Node *node = &can->node[can->node_count++];
+
+   node->id = id;
+   node->head = 0;
+   node->tail = 0;
+   node->status_frames = 0;
+
+   return node;
+}
+
+// send one frame, waits while interface tx queue is full
+static uint8_t CAN_Send(CAN_Port_t *can, uint32_t id, const uint8_t *data, uint32_t len)
+{
+   struct can_frame frame = {0};
+   uint64_t start = CAN_Millis();
+
+   frame.can_id = id | CAN_EFF_FLAG;
+   frame.can_dlc = len;
+   memcpy(frame.data, data, len);
+
+   while (write(can->fd, &frame, sizeof(frame)) != sizeof(frame))
+   {
+      if ((errno != ENOBUFS && errno != EAGAIN) || CAN_Millis() - start >= can->timeout)
+      {
+         return 0;
+      }
+
+      // no wakeup for tx queue space on can sockets
+      usleep(100);
+   }
+
+   return 1;
+}
+
+// every status frame of last request is in once its windows hold all missing segments
+static uint8_t CAN_Status_Complete(CAN_Port_t *can, struct CAN_Node *node)
+{
+   return node->status_frames && node->status_tag == can->tag &&
+          (node->missing == CAN_NO_FRAME || node->covered >= node->missing || node->status_frames == CAN_STATUS_FRAMES);
+}
+
+// take one frame within timeout ms, node data and status go to queue of sending node
+static uint8_t CAN_Receive(CAN_Port_t *can, uint32_t timeout)
+{
+   struct pollfd pfd = {can->fd, POLLIN, 0};
+   struct can_frame frame;
+
+   if (poll(&pfd, 1, timeout) <= 0 || read(can->fd, &frame, sizeof(frame)) != sizeof(frame))
+   {
+      return 0;
+   }
+
+   uint32_t id = frame.can_id & CAN_EFF_MASK;
+   uint32_t type = id & CAN_ID_TYPE_MASK;
+
+   if (!(frame.can_id & CAN_EFF_FLAG) || (id & CAN_ID_BASE_MASK) != CAN_ID_BASE ||
+       (type != CAN_ID_NODE_DATA && type != CAN_ID_NODE_STATUS))
+   {
+      return 1;
+   }
+
+   struct CAN_Node *node = CAN_Node_Get(can, id & CAN_ID_LOW_MASK);
+
+   if (node == NULL)
+   {
+      return 1;
+   }
+
+   if (type == CAN_ID_NODE_STATUS)
+   {
+      // discovery reply only makes node known
+      if (frame.can_dlc == 8 && frame.data[0] == CAN_CTRL_STATUS && node->status_frames < CAN_STATUS_FRAMES)
+      {
+         uint16_t mask = frame.data[6] << 8 | frame.data[7];
+
+         node->status_tag = frame.data[1];
+         node->missing = frame.data[2] << 8 | frame.data[3];
+         node->window_first[node->status_frames] = frame.data[4] << 8 | frame.data[5];
+         node->window_mask[node->status_frames++] = mask;
+         node->covered += __builtin_popcount(mask);
+      }
+   }
+   else
+   {
+      for (uint32_t i = 0; i < frame.can_dlc && node->head - node->tail < CAN_RX_QUEUE; i++)
+      {
+         node->queue[node->head++ % CAN_RX_QUEUE] = frame.data[i];
+      }
+   }
+
+   return 1;
+}
+
+CAN_Port_t *CAN_Port_Config(char *port)
+{
+   char name[256];
+   struct ifreq ifr = {0};
+   struct sockaddr_can addr = {0};
+   CAN_Port_t *can = calloc(1, sizeof(CAN_Port_t));
+
+   if (can == NULL)
+   {
+      return NULL;
+   }
+
+   can->fd = -1;
+   can->timeout = 100;
+   can->tag = time(NULL);
+
+   // can:<interface>:<node>
+   snprintf(name, sizeof(name), "%s", port);
+
+   char *dev = &name[4];
+   char *id = strchr(dev, ':');
+
+   // interface name is not cut short, that could name another interface
+   if (strncmp(name, "can:", 4) == 0 && id && id - dev < IFNAMSIZ)
+   {
+      *id++ = 0;
+
+      if (strcmp(id, "*") == 0)
+      {
+         can->all = 1;
+      }
+      else
+      {
+         can->selected = CAN_Node_Get(can, strtoul(id, NULL, 16));
+      }
+
+      memcpy(ifr.ifr_name, dev, strlen(dev) + 1);
+      can->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+   }
+
+   if (can->fd != -1)
+   {
+      // node data and status only
+      struct can_filter filter[2] = {
+          {CAN_ID_BASE | CAN_ID_NODE_DATA | CAN_EFF_FLAG, CAN_ID_BASE_MASK | CAN_ID_TYPE_MASK | CAN_EFF_FLAG},
+          {CAN_ID_BASE | CAN_ID_NODE_STATUS | CAN_EFF_FLAG, CAN_ID_BASE_MASK | CAN_ID_TYPE_MASK | CAN_EFF_FLAG},
+      };
+
+      addr.can_family = AF_CAN;
+
+      if (ioctl(can->fd, SIOCGIFINDEX, &ifr) == -1 ||
+          setsockopt(can->fd, SOL_CAN_RAW, CAN_RAW_FILTER, filter, sizeof(filter)) == -1)
+      {
+         close(can->fd);
+         can->fd = -1;
+      }
+      else
+      {
+         addr.can_ifindex = ifr.ifr_ifindex;
+
+         if (bind(can->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+         {
+            close(can->fd);
+            can->fd = -1;
+         }
+      }
+   }
+
+   if (can->fd == -1)
+   {
+      free(can);
+      return NULL;
+   }
+
+   return can;
+}
+
+uint32_t CAN_Port_Write(CAN_Port_t *can, uint8_t *str, uint32_t len)
+{
+   uint32_t count = 0;
+
+   if (can->selected == NULL)
+   {
+      return 0;
+   }
+
+   while (count < len)
+   {
+      uint32_t chunk = (len - count < CAN_SEGMENT_SIZE) ? len - count : CAN_SEGMENT_SIZE;
+
+      if (!CAN_Send(can, CAN_ID_BASE | CAN_ID_HOST_DATA | can->selected->id, str + count, chunk))
+      {
+         break;
+      }
+
+      count += chunk;
+   }
+
+   return count;
+}
+
+uint32_t CAN_Port_Read(CAN_Port_t *can, uint8_t *buf, uint32_t len)
+{
+   struct CAN_Node *node = can->selected;
+   uint64_t start = CAN_Millis();
+   uint32_t count = 0;
+
+   if (node == NULL)
+   {
+      return 0;
+   }
+
+   // frames of other nodes arriving meanwhile stay queued for them
+   while (node->head == node->tail)
+   {
+      uint64_t elapsed = CAN_Millis() - start;
+
+      if (elapsed >= can->timeout || !CAN_Receive(can, can->timeout - elapsed))
+      {
+         return 0;
+      }
+   }
+
+   while (count < len && node->tail != node->head)
+   {
+      buf[count++] = node->queue[node->tail++ % CAN_RX_QUEUE];
+   }
+
+   return count;
+}
+
+void CAN_Port_Close(CAN_Port_t *can)
+{
+   close(can->fd);
+   free(can);
+}
+
+void CAN_Port_Timeout(CAN_Port_t *can, uint32_t timeout)
+{
+   can->timeout = timeout;
+}
+
+uint32_t CAN_Port_Nodes(CAN_Port_t *can, uint16_t *nodes, uint32_t max)
+{
+   if (can->all && !can->discovered)
+   {
+      uint8_t discover = CAN_CTRL_DISCOVER;
+      uint64_t start = CAN_Millis();
+
+      can->discovered = 1;
+
+      if (CAN_Send(can, CAN_ID_BASE | CAN_ID_BCAST_CTRL, &discover, 1))
+      {
+         while (CAN_Millis() - start < CAN_DISCOVER_TIME)
+         {
+            CAN_Receive(can, CAN_DISCOVER_TIME - (CAN_Millis() - start));
+         }
+      }
+   }
+
+   uint32_t count = 0;
+
+   for (uint32_t i = 0; i < can->node_count && count < max; i++)
+   {
+      nodes[count++] = can->node[i].id;
+   }
+
+   return count;
+}
+
+void CAN_Port_Select(CAN_Port_t *can, uint16_t node)
+{
+   can->selected = CAN_Node_Get(can, node);
+}
+
+uint32_t CAN_Port_Broadcast(CAN_Port_t *can, const uint8_t *data, uint32_t len, const uint16_t *nodes, uint8_t *done, uint32_t count)
+{
+   static uint8_t resend[CAN_MAX_SEGMENTS];
+   uint32_t segments = (len + CAN_SEGMENT_SIZE - 1) / CAN_SEGMENT_SIZE;
+   uint32_t done_count = 0;
+   uint8_t start = 1;
+
+   if (segments == 0 || segments > CAN_MAX_SEGMENTS)
+   {
+      return 0;
+   }
+
+   can->tag++;
+   memset(resend, 1, segments);
+
+   for (uint32_t round = 0; round < CAN_BROADCAST_ROUNDS; round++)
+   {
+      uint8_t ctrl[4] = {CAN_CTRL_START, can->tag, len >> 8, len};
+
+      if (start && !CAN_Send(can, CAN_ID_BASE | CAN_ID_BCAST_CTRL, ctrl, 4))
+      {
+         break;
+      }
+
+      // segment no in id, a node fills its holes from any round
+      for (uint32_t i = 0; i < segments; i++)
+      {
+         uint32_t chunk = (len - i * CAN_SEGMENT_SIZE < CAN_SEGMENT_SIZE) ? len - i * CAN_SEGMENT_SIZE : CAN_SEGMENT_SIZE;
+
+         if (resend[i] && !CAN_Send(can, CAN_ID_BASE | CAN_ID_BCAST_DATA | i, &data[i * CAN_SEGMENT_SIZE], chunk))
+         {
+            return done_count;
+         }
+      }
+
+      // every node not done yet reports its holes
+      for (uint32_t i = 0; i < count; i++)
+      {
+         struct CAN_Node *node = CAN_Node_Get(can, nodes[i]);
+
+         if (node)
+         {
+            node->status_frames = 0;
+            node->covered = 0;
+         }
+      }
+
+      ctrl[0] = CAN_CTRL_STATUS;
+
+      if (!CAN_Send(can, CAN_ID_BASE | CAN_ID_BCAST_CTRL, ctrl, 2))
+      {
+         break;
+      }
+
+      uint64_t status_start = CAN_Millis();
+      uint32_t waiting = count - done_count;
+
+      // a node busy programming answers once it waits for input again
+      while (waiting && CAN_Millis() - status_start < can->timeout)
+      {
+         CAN_Receive(can, can->timeout - (CAN_Millis() - status_start));
+
+         waiting = 0;
+
+         for (uint32_t i = 0; i < count; i++)
+         {
+            struct CAN_Node *node = CAN_Node_Get(can, nodes[i]);
+
+            if (!done[i] && node && !CAN_Status_Complete(can, node))
+            {
+               waiting++;
+            }
+         }
+      }
+
+      memset(resend, 0, segments);
+      start = 0;
+
+      for (uint32_t i = 0; i < count; i++)
+      {
+         struct CAN_Node *node = CAN_Node_Get(can, nodes[i]);
+
+         // silent node is left out of later rounds
+         if (done[i] || node == NULL || !node->status_frames || node->status_tag != can->tag)
+         {
+            continue;
+         }
+
+         if (node->missing == 0)
+         {
+            done[i] = 1;
+            done_count++;
+         }
+         else if (node->missing == CAN_NO_FRAME)
+         {
+            start = 1;
+            memset(resend, 1, segments);
+         }
+         else
+         {
+            for (uint32_t w = 0; w < node->status_frames; w++)
+            {
+               for (uint32_t k = 0; k < CAN_STATUS_WINDOW; k++)
+               {
+                  if ((node->window_mask[w] >> k & 1) && node->window_first[w] + k < segments)
+                  {
+                     resend[node->window_first[w] + k] = 1;
+                  }
+               }
+            }
+         }
+      }
+
+      if (done_count == count || (!start && memchr(resend, 1, segments) == NULL))
+      {
+         break;
+      }
+   }
+
+   return done_count;
+}
+
+#else
+
+CAN_Port_t *CAN_Port_Config(char *port)
+{
+   printf("can needs linux socketcan\n");
+   return NULL;
+}
+
+uint32_t CAN_Port_Write(CAN_Port_t *can, uint8_t *str, uint32_t len)
+{
+   return 0;
+}
+
+uint32_t CAN_Port_Read(CAN_Port_t *can, uint8_t *buf, uint32_t len)
+{
+   return 0;
+}
+
+void CAN_Port_Close(CAN_Port_t *can)
+{
+}
+
+void CAN_Port_Timeout(CAN_Port_t *can, uint32_t timeout)
+{
+}
+
+uint32_t CAN_Port_Nodes(CAN_Port_t *can, uint16_t *nodes, uint32_t max)
+{
+   return 0;
+}
+
+void CAN_Port_Select(CAN_Port_t *can, uint16_t node)
+{
+}
+
+uint32_t CAN_Port_Broadcast(CAN_Port_t *can, const uint8_t *data, uint32_t len, const uint16_t *nodes, uint8_t *done, uint32_t count)
+{
+   return 0;
+}
+
+#endif
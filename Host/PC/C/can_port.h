@@ -0,0 +1,31 @@
+#ifndef __CAN_PORT_H
+#define __CAN_PORT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+// socketcan link to bootloader can transport, 29-bit ids, bitrate is set on the interface with ip link
+// port is "can:can0:1a2b" for one node by its hex node id, or "can:can0:*" for every node answering discovery
+// stream to selected node is cut into 8-byte frames, replies of each node are queued apart
+typedef struct CAN_Port CAN_Port_t;
+
+#define CAN_MAX_NODES 64
+
+CAN_Port_t *CAN_Port_Config(char *port);
+uint32_t CAN_Port_Write(CAN_Port_t *can, uint8_t *str, uint32_t len);
+uint32_t CAN_Port_Read(CAN_Port_t *can, uint8_t *buf, uint32_t len);
+void CAN_Port_Close(CAN_Port_t *can);
+void CAN_Port_Timeout(CAN_Port_t *can, uint32_t timeout);
+
+// node named in port, or every node found by discovery for "*", returns no of nodes
+uint32_t CAN_Port_Nodes(CAN_Port_t *can, uint16_t *nodes, uint32_t max);
+
+// node written to and read from
+void CAN_Port_Select(CAN_Port_t *can, uint16_t node);
+
+// sends stream chunk once to all nodes, then resends segments each node reports missing
+// done[i] is set once nodes[i] holds all of it, returns no of nodes done
+uint32_t CAN_Port_Broadcast(CAN_Port_t *can, const uint8_t *data, uint32_t len, const uint16_t *nodes, uint8_t *done, uint32_t count);
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+
+#include "serial_port.h"
+#include "rs485_port.h"
+
+// envelope header, must match bootloader uart transport in rs485 mode
+// [SYNC + 1-byte address + 2-byte len + 1-byte check], check is ~(address ^ len hi ^ len lo)
+#define RS485_SYNC_CHAR '#'
+#define RS485_HEADER_SIZE 5
+
+#define RS485_MAX_SPAN 4096 // chars per envelope, stream is cut into as many as needed
+
+struct RS485_Port
+{
+   SERIAL_HANDLE handle;
+   uint8_t selected;
+   uint32_t node_count;
+   uint16_t node[RS485_MAX_NODES];
+   uint8_t envelope[RS485_HEADER_SIZE + RS485_MAX_SPAN];
+};
+
+// "12", "1-20" or "1-20,22", hex addresses from 1 to 254
+static uint32_t RS485_Parse_Nodes(RS485_Port_t *rs485, char *list)
+{
+   while (*list)
+   {
+      char *end;
+      uint32_t first = strtoul(list, &end, 16);
+      uint32_t last = first;
+
+      if (*end == '-')
+      {
+         last = strtoul(end + 1, &end, 16);
+      }
+
+      if (end == list || (*end && *end != ',') || first < 1 || last >= RS485_BROADCAST || first > last)
+      {
+         return 0;
+      }
+
+      for (uint32_t address = first; address <= last && rs485->node_count < RS485_MAX_NODES; address++)
+      {
+         rs485->node[rs485->node_count++] = address;
+      }
+
+      list = (*end == ',') ? end + 1 : end;
+   }
+
+   return rs485->node_count;
+}
+
+// one write per envelope so adapter sends it without gaps
+static uint32_t RS485_Send(RS485_Port_t *rs485, uint8_t address, uint8_t *str, uint32_t len)
+{
+   uint32_t sent = 0;
+
+   while (sent < len)
+   {
+      uint32_t span = (len - sent < RS485_MAX_SPAN) ? len - sent : RS485_MAX_SPAN;
+
+      rs485->envelope[0] = RS485_SYNC_CHAR;
+      rs485->envelope[1] = address;
+      rs485->envelope[2] = span >> 8 & 0xFF;
+      rs485->envelope[3] = span & 0xFF;
+      rs485->envelope[4] = ~(rs485->envelope[1] ^ rs485->envelope[2] ^ rs485->envelope[3]);
+      memcpy(&rs485->envelope[RS485_HEADER_SIZE], &str[sent], span);
+
+      if (Serial_Port_Write(rs485->handle, rs485->envelope, RS485_HEADER_SIZE + span) != RS485_HEADER_SIZE + span)
+      {
+         break;
+      }
+
+      sent += span;
+   }
+
+   return sent;
+}
+
+RS485_Port_t *RS485_Port_Config(char *port, uint32_t baud)
+{
+   RS485_Port_t *rs485 = calloc(1, sizeof(RS485_Port_t));
+
+   if (rs485 == NULL)
+   {
+      return NULL;
+   }
+
+   // rs485:<device>:<nodes>, device may hold no ':'
+   char *dev = strdup(&port[6]);
+   char *list = dev ? strrchr(dev, ':') : NULL;
+
+   if (strncmp(port, "rs485:", 6) != 0 || list == NULL)
+   {
+      printf("rs485 port is rs485:<device>:<hex address or list>\n");
+      free(dev);
+      free(rs485);
+      return NULL;
+   }
+
+   *list++ = 0;
+
+   if (!RS485_Parse_Nodes(rs485, list))
+   {
+      printf("rs485 addresses are hex from 1 to FE, like 12 or 1-20,22\n");
+      free(dev);
+      free(rs485);
+      return NULL;
+   }
+
+   rs485->selected = rs485->node[0];
+   rs485->handle = Serial_Port_Config((uint8_t *)dev, baud);
+   free(dev);
+
+#ifdef _WIN32
+   if (rs485->handle == INVALID_HANDLE_VALUE)
+#else
+   if (rs485->handle == -1)
+#endif
+   {
+      free(rs485);
+      return NULL;
+   }
+
+   return rs485;
+}
+
+uint32_t RS485_Port_Write(RS485_Port_t *rs485, uint8_t *str, uint32_t len)
+{
+   return RS485_Send(rs485, rs485->selected, str, len);
+}
+
+// only selected node drives the bus, its replies are not wrapped
+uint32_t RS485_Port_Read(RS485_Port_t *rs485, uint8_t *buf, uint32_t len)
+{
+   return Serial_Port_Read(rs485->handle, buf, len);
+}
+
+void RS485_Port_Close(RS485_Port_t *rs485)
+{
+   Serial_Port_Close(rs485->handle);
+   free(rs485);
+}
+
+void RS485_Port_Timeout(RS485_Port_t *rs485, uint32_t timeout)
+{
+   Serial_Port_Timeout(rs485->handle, timeout);
+}
+
+uint32_t RS485_Port_Nodes(RS485_Port_t *rs485, uint16_t *nodes, uint32_t max)
+{
+   for (uint32_t i = 0; i < rs485->node_count && i < max; i++)
+   {
+      nodes[i] = rs485->node[i];
+   }
+
+   return rs485->node_count;
+}
+
+void RS485_Port_Select(RS485_Port_t *rs485, uint16_t node)
+{
+   rs485->selected = node;
+}
+
+uint32_t RS485_Port_Broadcast(RS485_Port_t *rs485, uint8_t *str, uint32_t len)
+{
+   return RS485_Send(rs485, RS485_BROADCAST, str, len);
+}
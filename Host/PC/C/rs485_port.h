@@ -0,0 +1,31 @@
+#ifndef __RS485_PORT_H
+#define __RS485_PORT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+// serial port on a multi-drop rs485 bus, adapter switches direction by itself
+// port is "rs485:/dev/ttyUSB0:12" for one node by its hex address, or "rs485:/dev/ttyUSB0:1-20,22" for several
+// stream to selected node goes out in envelopes carrying its address, only that node answers
+typedef struct RS485_Port RS485_Port_t;
+
+#define RS485_MAX_NODES 254
+#define RS485_BROADCAST 0xFF
+
+RS485_Port_t *RS485_Port_Config(char *port, uint32_t baud);
+uint32_t RS485_Port_Write(RS485_Port_t *rs485, uint8_t *str, uint32_t len);
+uint32_t RS485_Port_Read(RS485_Port_t *rs485, uint8_t *buf, uint32_t len);
+void RS485_Port_Close(RS485_Port_t *rs485);
+void RS485_Port_Timeout(RS485_Port_t *rs485, uint32_t timeout);
+
+// nodes named in port, up to max of them copied, returns no of nodes named
+uint32_t RS485_Port_Nodes(RS485_Port_t *rs485, uint16_t *nodes, uint32_t max);
+
+// node written to
+void RS485_Port_Select(RS485_Port_t *rs485, uint16_t node);
+
+// sends stream chunk once to every node, none of them replies to it
+uint32_t RS485_Port_Broadcast(RS485_Port_t *rs485, uint8_t *str, uint32_t len);
+
+#endif
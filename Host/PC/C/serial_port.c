@@ -47,6 +47,26 @@ uint32_t Serial_Port_Write(SERIAL_HANDLE hComm, uint8_t *str, uint32_t len)
     return bytes_count;
 }
 
+// no gathered write on windows, chunks go out one after another
+uint32_t Serial_Port_Write_Chunks(SERIAL_HANDLE hComm, const Serial_Chunk_t *chunks, uint32_t count)
+{
+    uint32_t bytes_count = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t written = Serial_Port_Write(hComm, (uint8_t *)chunks[i].data, chunks[i].len);
+
+        bytes_count += written;
+
+        if (written != chunks[i].len)
+        {
+            break;
+        }
+    }
+
+    return bytes_count;
+}
+
 uint32_t Serial_Port_Read(SERIAL_HANDLE hComm, uint8_t *buf, uint32_t len)
 {
 
@@ -70,14 +90,59 @@ void Serial_Port_Timeout(SERIAL_HANDLE hComm, uint32_t len)
     timeouts.ReadTotalTimeoutConstant = len;
     SetCommTimeouts(hComm, &timeouts);
 }
+
+uint64_t Serial_Port_Millis(void)
+{
+    return GetTickCount64();
+}
 #endif
 
 #ifdef __linux__
 
+#define SERIAL_MAX_PORTS 16
+#define SERIAL_RX_BUFFER 4096
+
+// whatever kernel holds is taken in one read, following reads are served from here
+struct Serial_Buffer
+{
+    SERIAL_HANDLE fd;
+    uint8_t used;
+    uint32_t timeout;   // ms
+    uint32_t char_time; // us per char on the line
+    uint32_t head;
+    uint32_t tail;
+    uint8_t data[SERIAL_RX_BUFFER];
+};
+
+static struct Serial_Buffer Serial_Buffers[SERIAL_MAX_PORTS];
+
+uint64_t Serial_Port_Millis(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct Serial_Buffer *Serial_Buffer_Get(SERIAL_HANDLE fd)
+{
+    for (uint32_t i = 0; i < SERIAL_MAX_PORTS; i++)
+    {
+        if (Serial_Buffers[i].used && Serial_Buffers[i].fd == fd)
+        {
+            return &Serial_Buffers[i];
+        }
+    }
+
+    return NULL;
+}
+
 SERIAL_HANDLE Serial_Port_Config(uint8_t *port, uint32_t baud)
 {
     SERIAL_HANDLE fd;   /* File Descriptor */
     struct termios tty; /* Create the structure */
+    struct Serial_Buffer *sb = NULL;
+    uint32_t bps = baud;
 
     switch (baud)
     {
@@ -105,6 +170,7 @@ SERIAL_HANDLE Serial_Port_Config(uint8_t *port, uint32_t baud)
 
     default:
         baud = B115200;
+        bps = 115200;
         break;
     }
 
@@ -129,11 +195,33 @@ SERIAL_HANDLE Serial_Port_Config(uint8_t *port, uint32_t baud)
                            // tty.c_oflag &= ~OXTABS; // Prevent conversion of tabs to spaces (NOT PRESENT ON LINUX)
                            // tty.c_oflag &= ~ONOEOT; // Prevent removal of C-d chars (0x004) in output (NOT PRESENT ON LINUX)
 
-    tty.c_cc[VTIME] = 10; // Wait for up to 1s (10 deciseconds), returning as soon as any data is received.
-    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0; // read never blocks, waiting is done by poll with ms timeout
+    tty.c_cc[VMIN] = 0;
 
     if (fd != -1)
     {
+        for (uint32_t i = 0; i < SERIAL_MAX_PORTS && sb == NULL; i++)
+        {
+            if (!Serial_Buffers[i].used)
+            {
+                sb = &Serial_Buffers[i];
+            }
+        }
+
+        if (sb == NULL)
+        {
+            printf("too many serial ports open\n");
+            close(fd);
+            return -1;
+        }
+
+        sb->fd = fd;
+        sb->used = 1;
+        sb->timeout = 1000;
+        sb->char_time = 10000000 / bps; // start + 8 data + stop bits
+        sb->head = 0;
+        sb->tail = 0;
+
         tcsetattr(fd, TCSANOW, &tty);
         tcflush(fd, TCIOFLUSH);
     }
@@ -150,29 +238,122 @@ bytes_count = write(fd, str, len);
 return bytes_count;
 }
 
+// all chunks in one writev, usb adapters get them as one transfer instead of one per chunk
+uint32_t Serial_Port_Write_Chunks(SERIAL_HANDLE fd, const Serial_Chunk_t *chunks, uint32_t count)
+{
+    struct iovec iov[SERIAL_MAX_CHUNKS];
+
+    if (count > SERIAL_MAX_CHUNKS)
+    {
+        count = SERIAL_MAX_CHUNKS;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        iov[i].iov_base = (void *)chunks[i].data;
+        iov[i].iov_len = chunks[i].len;
+    }
+
+    ssize_t bytes_count = writev(fd, iov, count);
+
+    return (bytes_count < 0) ? 0 : bytes_count;
+}
+
+// waits for all len chars, deadline is timeout plus the time len chars take on the line
+// returns fewer only when deadline passes
 uint32_t Serial_Port_Read(SERIAL_HANDLE fd, uint8_t *buf, uint32_t len)
 {
-    uint32_t bytes_count = -1; // No of bytes read from the port
+    struct Serial_Buffer *sb = Serial_Buffer_Get(fd);
+    uint32_t count = 0;
+
+    if (sb == NULL)
+    {
+        return 0;
+    }
 
-    bytes_count = read(fd, buf, 1);
+    uint64_t deadline = Serial_Port_Millis() + sb->timeout + (uint64_t)len * sb->char_time / 1000;
 
-    return bytes_count;
+    while (count < len)
+    {
+        if (sb->tail == sb->head)
+        {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            uint64_t now = Serial_Port_Millis();
+            ssize_t rx_count;
+
+            // chars already in kernel are taken even once deadline passed, so 0 timeout reads without waiting
+            int ready = poll(&pfd, 1, (now < deadline) ? deadline - now : 0);
+
+            if (ready < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (ready <= 0)
+            {
+                break;
+            }
+
+            // big reads skip the copy
+            if (len - count >= SERIAL_RX_BUFFER)
+            {
+                rx_count = read(fd, buf + count, len - count);
+
+                if (rx_count <= 0)
+                {
+                    break;
+                }
+
+                count += rx_count;
+                continue;
+            }
+
+            rx_count = read(fd, sb->data, SERIAL_RX_BUFFER);
+
+            if (rx_count <= 0)
+            {
+                break;
+            }
+
+            sb->head = rx_count;
+            sb->tail = 0;
+        }
+
+        uint32_t chunk = sb->head - sb->tail;
+
+        if (chunk > len - count)
+        {
+            chunk = len - count;
+        }
+
+        memcpy(buf + count, &sb->data[sb->tail], chunk);
+        sb->tail += chunk;
+        count += chunk;
+    }
+
+    return count;
 }
 
 void Serial_Port_Close(SERIAL_HANDLE fd)
 {
+    struct Serial_Buffer *sb = Serial_Buffer_Get(fd);
+
+    if (sb)
+    {
+        sb->used = 0;
+    }
+
     close(fd); //Closing the Serial Port
 }
 
 void Serial_Port_Timeout(SERIAL_HANDLE fd, uint32_t len)
 {
-    struct termios tty;
-
-    tcgetattr(fd, &tty);
+    struct Serial_Buffer *sb = Serial_Buffer_Get(fd);
 
-    tty.c_cc[VTIME] = len /100;
-
-    tcsetattr(fd, TCSANOW, &tty);
+    if (sb)
+    {
+        sb->timeout = len;
+    }
 }
 
 #endif
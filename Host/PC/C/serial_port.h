@@ -14,14 +14,33 @@
 
 #ifdef __linux__
 #define SERIAL_HANDLE int
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <termios.h>
+#include <time.h>
+#include <sys/uio.h>
 #endif
 
+#define SERIAL_MAX_CHUNKS 16
+
+// piece of a frame, pieces are written together without copying them into one buffer
+typedef struct
+{
+    const uint8_t *data;
+    uint32_t len;
+} Serial_Chunk_t;
+
 SERIAL_HANDLE Serial_Port_Config(uint8_t *port, uint32_t baud);
 uint32_t Serial_Port_Write(SERIAL_HANDLE handle, uint8_t *str, uint32_t len);
+uint32_t Serial_Port_Write_Chunks(SERIAL_HANDLE handle, const Serial_Chunk_t *chunks, uint32_t count);
 uint32_t Serial_Port_Read(SERIAL_HANDLE handle, uint8_t *buf, uint32_t len);
 void Serial_Port_Close(SERIAL_HANDLE handle);
+
+// ms to wait on a read beyond the time its chars take on the line
 void Serial_Port_Timeout(SERIAL_HANDLE handle, uint32_t len);
 
+// ms from a clock that does not follow wall clock changes, for deadlines
+uint64_t Serial_Port_Millis(void);
+
 #endif
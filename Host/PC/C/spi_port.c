@@ -0,0 +1,304 @@
+#include "spi_port.h"
+
+#ifdef __linux__
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include <linux/gpio.h>
+
+// spidev default buffer size, longer writes and reads are split into several transfers
+#define SPI_MAX_TRANSFER 4096
+
+// clocked out by master while reading, slave skips it while waiting for a sync char
+#define SPI_FILLER 0xFF
+
+struct SPI_Port
+{
+   int fd;           // spidev, or byte stream in loopback
+   int ready_fd;     // gpio line event handle for ready line, -1 in loopback
+   uint8_t loopback;
+   uint32_t speed;   // sck in Hz
+   uint32_t timeout; // ms to wait for ready
+};
+
+static int SPI_Ready_Open(char *chip, uint32_t offset)
+{
+   struct gpioevent_request req = {0};
+   int chip_fd = open(chip, O_RDWR);
+
+   if (chip_fd == -1)
+   {
+      return -1;
+   }
+
+   req.lineoffset = offset;
+   req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+   req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+   strcpy(req.consumer_label, "stm32_bootloader");
+
+   int status = ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req);
+   close(chip_fd);
+
+   return (status == -1) ? -1 : req.fd;
+}
+
+// wait until slave is ready for next transfer, rising edge event wakes poll
+// in loopback a read is ready once stream has data and a write is always ready
+static uint8_t SPI_Wait_Ready(SPI_Port_t *spi, uint8_t reading)
+{
+   struct pollfd pfd;
+
+   if (spi->loopback)
+   {
+      if (!reading)
+      {
+         return 1;
+      }
+
+      pfd.fd = spi->fd;
+      pfd.events = POLLIN;
+
+      return poll(&pfd, 1, spi->timeout) > 0;
+   }
+
+   pfd.fd = spi->ready_fd;
+   pfd.events = POLLIN;
+
+   while (1)
+   {
+      struct gpiohandle_data data;
+
+      if (ioctl(spi->ready_fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) == -1)
+      {
+         return 0;
+      }
+
+      if (data.values[0])
+      {
+         return 1;
+      }
+
+      if (poll(&pfd, 1, spi->timeout) <= 0)
+      {
+         return 0;
+      }
+
+      // drain edge event, level is checked again
+      struct gpioevent_data event;
+      if (read(spi->ready_fd, &event, sizeof(event)) != sizeof(event))
+      {
+         return 0;
+      }
+   }
+}
+
+// one transaction, chip select framed by spidev, rx may be NULL
+static uint8_t SPI_Transfer(SPI_Port_t *spi, const uint8_t *tx, uint8_t *rx, uint32_t len)
+{
+   if (spi->loopback)
+   {
+      // mosi goes down the stream, miso is what slave has queued on it
+      if (write(spi->fd, tx, len) != (ssize_t)len)
+      {
+         return 0;
+      }
+
+      uint32_t count = 0;
+
+      while (rx && count < len)
+      {
+         struct pollfd pfd = {spi->fd, POLLIN, 0};
+
+         if (poll(&pfd, 1, spi->timeout) <= 0)
+         {
+            return 0;
+         }
+
+         ssize_t rx_count = read(spi->fd, rx + count, len - count);
+
+         if (rx_count <= 0)
+         {
+            return 0;
+         }
+
+         count += rx_count;
+      }
+
+      return 1;
+   }
+
+   struct spi_ioc_transfer tr = {0};
+
+   tr.tx_buf = (uintptr_t)tx;
+   tr.rx_buf = (uintptr_t)rx;
+   tr.len = len;
+   tr.speed_hz = spi->speed;
+   tr.bits_per_word = 8;
+
+   return ioctl(spi->fd, SPI_IOC_MESSAGE(1), &tr) != -1;
+}
+
+SPI_Port_t *SPI_Port_Config(char *port, uint32_t speed)
+{
+   char name[256];
+   SPI_Port_t *spi = calloc(1, sizeof(SPI_Port_t));
+
+   if (spi == NULL)
+   {
+      return NULL;
+   }
+
+   spi->fd = -1;
+   spi->ready_fd = -1;
+   spi->speed = speed;
+   spi->timeout = 100;
+
+   snprintf(name, sizeof(name), "%s", port);
+
+   if (strncmp(name, "spiloop:", 8) == 0)
+   {
+      struct termios tty;
+
+      spi->loopback = 1;
+      spi->fd = open(&name[8], O_RDWR | O_NOCTTY);
+
+      // raw stream, a tty is put in raw mode
+      if (spi->fd != -1 && tcgetattr(spi->fd, &tty) == 0)
+      {
+         cfmakeraw(&tty);
+         tcsetattr(spi->fd, TCSANOW, &tty);
+         tcflush(spi->fd, TCIOFLUSH);
+      }
+   }
+   else if (strncmp(name, "spi:", 4) == 0)
+   {
+      // spi:<spidev>:<gpiochip>:<line>
+      char *dev = &name[4];
+      char *chip = strchr(dev, ':');
+      char *line = chip ? strchr(chip + 1, ':') : NULL;
+
+      if (line)
+      {
+         uint8_t mode = SPI_MODE_0;
+         uint8_t bits = 8;
+
+         *chip++ = 0;
+         *line++ = 0;
+
+         spi->fd = open(dev, O_RDWR);
+         spi->ready_fd = SPI_Ready_Open(chip, atoi(line));
+
+         if (spi->fd != -1 &&
+             (ioctl(spi->fd, SPI_IOC_WR_MODE, &mode) == -1 ||
+              ioctl(spi->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) == -1 ||
+              ioctl(spi->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) == -1 ||
+              spi->ready_fd == -1))
+         {
+            close(spi->fd);
+            spi->fd = -1;
+         }
+      }
+   }
+
+   if (spi->fd == -1)
+   {
+      if (spi->ready_fd != -1)
+      {
+         close(spi->ready_fd);
+      }
+
+      free(spi);
+      return NULL;
+   }
+
+   return spi;
+}
+
+uint32_t SPI_Port_Write(SPI_Port_t *spi, uint8_t *str, uint32_t len)
+{
+   uint32_t count = 0;
+
+   while (count < len)
+   {
+      uint32_t chunk = (len - count < SPI_MAX_TRANSFER) ? len - count : SPI_MAX_TRANSFER;
+
+      if (!SPI_Wait_Ready(spi, 0) || !SPI_Transfer(spi, str + count, NULL, chunk))
+      {
+         break;
+      }
+
+      count += chunk;
+   }
+
+   return count;
+}
+
+uint32_t SPI_Port_Read(SPI_Port_t *spi, uint8_t *buf, uint32_t len)
+{
+   static uint8_t filler[SPI_MAX_TRANSFER];
+   uint32_t count = 0;
+
+   memset(filler, SPI_FILLER, sizeof(filler));
+
+   while (count < len)
+   {
+      uint32_t chunk = (len - count < SPI_MAX_TRANSFER) ? len - count : SPI_MAX_TRANSFER;
+
+      if (!SPI_Wait_Ready(spi, 1) || !SPI_Transfer(spi, filler, buf + count, chunk))
+      {
+         break;
+      }
+
+      count += chunk;
+   }
+
+   return count;
+}
+
+void SPI_Port_Close(SPI_Port_t *spi)
+{
+   if (spi->ready_fd != -1)
+   {
+      close(spi->ready_fd);
+   }
+
+   close(spi->fd);
+   free(spi);
+}
+
+void SPI_Port_Timeout(SPI_Port_t *spi, uint32_t timeout)
+{
+   spi->timeout = timeout;
+}
+
+#else
+
+SPI_Port_t *SPI_Port_Config(char *port, uint32_t speed)
+{
+   printf("spi needs linux spidev\n");
+   return NULL;
+}
+
+uint32_t SPI_Port_Write(SPI_Port_t *spi, uint8_t *str, uint32_t len)
+{
+   return 0;
+}
+
+uint32_t SPI_Port_Read(SPI_Port_t *spi, uint8_t *buf, uint32_t len)
+{
+   return 0;
+}
+
+void SPI_Port_Close(SPI_Port_t *spi)
+{
+}
+
+void SPI_Port_Timeout(SPI_Port_t *spi, uint32_t timeout)
+{
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __SPI_PORT_H
+#define __SPI_PORT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+// spi master talking to bootloader spi slave, every transfer waits on the slave ready line
+// port is "spi:/dev/spidev0.0:/dev/gpiochip0:17" for spidev plus ready line gpio chip and offset
+// or "spiloop:/dev/ttyX" for loopback shim carrying spi transfers over a byte stream, ready is emulated
+typedef struct SPI_Port SPI_Port_t;
+
+SPI_Port_t *SPI_Port_Config(char *port, uint32_t speed);
+uint32_t SPI_Port_Write(SPI_Port_t *spi, uint8_t *str, uint32_t len);
+uint32_t SPI_Port_Read(SPI_Port_t *spi, uint8_t *buf, uint32_t len);
+void SPI_Port_Close(SPI_Port_t *spi);
+void SPI_Port_Timeout(SPI_Port_t *spi, uint32_t timeout);
+
+#endif
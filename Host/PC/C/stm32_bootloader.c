@@ -4,71 +4,37 @@
 #include <stdint.h>
 #include <sys/timeb.h>
 
-#include "serial_port.h"
-
-#define USER_APP_ADDRESS 0x08008000 // 0x08004000->8K, 0x08004000->16k, 0x08008000->32k botloader size
-#define FLASH_SIZE 496000           //+ 512000 //uncomment for 407VG
-
-/*
-CMD_WRITE, CMD_VERIFY Frame
-[SYNC_CHAR + frame len] frame len = 9 + payload len
-[1-byte cmd + 1-byte no of bytes to write + 0x00 + 0x00 + 4-byte addes +  payload + 1-byte CRC]
-*/
-
-/*
-CMD_READ Frame
-[SYNC_CHAR + frame len] frame len = 9
-[1-byte cmd + 1-byte no of bytes to read + 0x00 + 0x00 + 4-byte addes + 1-byte CRC]
-*/
-
-/*
-CMD_ERASE, CMD_RESET, CMD_JUMP Frame
-[SYNC_CHAR + frame len] frame len = 2
-[1-byte cmd + 1-byte CRC]
-*/
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
 
-#define CMD_WRITE 0x50
-#define CMD_READ 0x51
-#define CMD_ERASE 0x52
-#define CMD_RESET 0x53
-#define CMD_JUMP 0x54
-#define CMD_VERIFY 0x55
+#include "stm32bl.h"
 
-#define CMD_ACK 0x90
-#define CMD_NACK 0x91
-#define CMD_ERROR 0x92
+// command line front end of libstm32bl, protocol lives in stm32bl.c
 
-#define CMD_HELP 0x40
+#define MAX_NODES 256
 
-#define CMD_CONNECT 0x7F
+// serial ports flashed together, one per board on a line station
+#define MAX_TARGETS 16
 
-#define SYNC_CHAR '$'
+// board on one port of a multi target run
+typedef struct
+{
+   char *port;
+   stm32bl_session_t *session;
+   int status;
+   uint8_t running;
+   uint32_t done;
+   uint32_t total;
+   uint64_t end_time;
+} stm32_target_t;
 
 char *com_port = NULL;
 uint32_t baud_rate = 0;
 char *cmd = NULL;
 
-SERIAL_HANDLE Serial_Handle;
-
-uint8_t Open_Serial_port(char *port, uint32_t baud)
-{
-   uint8_t status = 1;
-   Serial_Handle = Serial_Port_Config(port, baud);
-
-#ifdef _WIN32
-   if (Serial_Handle == INVALID_HANDLE_VALUE)
-   {
-      status = 0;
-   }
-#elif __linux__
-   if (Serial_Handle == -1)
-   {
-      status = 0;
-   }
-#endif
-
-   return status;
-}
+stm32bl_session_t *session = NULL;
 
 uint64_t system_current_time_millis()
 {
@@ -83,580 +49,703 @@ uint64_t system_current_time_millis()
    return (uint64_t)(((timebuffer.time * 1000) + timebuffer.millitm));
 }
 
-/*Maxim APPLICATION NOTE 27 */
-uint8_t CRC8_Table[] =
-    {
-        0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83, 0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41,
-        0x9D, 0xC3, 0x21, 0x7F, 0xFC, 0xA2, 0x40, 0x1E, 0x5F, 0x01, 0xE3, 0xBD, 0x3E, 0x60, 0x82, 0xDC,
-        0x23, 0x7D, 0x9F, 0xC1, 0x42, 0x1C, 0xFE, 0xA0, 0xE1, 0xBF, 0x5D, 0x03, 0x80, 0xDE, 0x3C, 0x62,
-        0xBE, 0xE0, 0x02, 0x5C, 0xDF, 0x81, 0x63, 0x3D, 0x7C, 0x22, 0xC0, 0x9E, 0x1D, 0x43, 0xA1, 0xFF,
-        0x46, 0x18, 0xFA, 0xA4, 0x27, 0x79, 0x9B, 0xC5, 0x84, 0xDA, 0x38, 0x66, 0xE5, 0xBB, 0x59, 0x07,
-        0xDB, 0x85, 0x67, 0x39, 0xBA, 0xE4, 0x06, 0x58, 0x19, 0x47, 0xA5, 0xFB, 0x78, 0x26, 0xC4, 0x9A,
-        0x65, 0x3B, 0xD9, 0x87, 0x04, 0x5A, 0xB8, 0xE6, 0xA7, 0xF9, 0x1B, 0x45, 0xC6, 0x98, 0x7A, 0x24,
-        0xF8, 0xA6, 0x44, 0x1A, 0x99, 0xC7, 0x25, 0x7B, 0x3A, 0x64, 0x86, 0xD8, 0x5B, 0x05, 0xE7, 0xB9,
-        0x8C, 0xD2, 0x30, 0x6E, 0xED, 0xB3, 0x51, 0x0F, 0x4E, 0x10, 0xF2, 0xAC, 0x2F, 0x71, 0x93, 0xCD,
-        0x11, 0x4F, 0xAD, 0xF3, 0x70, 0x2E, 0xCC, 0x92, 0xD3, 0x8D, 0x6F, 0x31, 0xB2, 0xEC, 0x0E, 0x50,
-        0xAF, 0xF1, 0x13, 0x4D, 0xCE, 0x90, 0x72, 0x2C, 0x6D, 0x33, 0xD1, 0x8F, 0x0C, 0x52, 0xB0, 0xEE,
-        0x32, 0x6C, 0x8E, 0xD0, 0x53, 0x0D, 0xEF, 0xB1, 0xF0, 0xAE, 0x4C, 0x12, 0x91, 0xCF, 0x2D, 0x73,
-        0xCA, 0x94, 0x76, 0x28, 0xAB, 0xF5, 0x17, 0x49, 0x08, 0x56, 0xB4, 0xEA, 0x69, 0x37, 0xD5, 0x8B,
-        0x57, 0x09, 0xEB, 0xB5, 0x36, 0x68, 0x8A, 0xD4, 0x95, 0xCB, 0x29, 0x77, 0xF4, 0xAA, 0x48, 0x16,
-        0xE9, 0xB7, 0x55, 0x0B, 0x88, 0xD6, 0x34, 0x6A, 0x2B, 0x75, 0x97, 0xC9, 0x4A, 0x14, 0xF6, 0xA8,
-        0x74, 0x2A, 0xC8, 0x96, 0x15, 0x4B, 0xA9, 0xF7, 0xB6, 0xE8, 0x0A, 0x54, 0xD7, 0x89, 0x6B, 0x35};
-
-uint8_t CRC8(uint8_t *data, uint8_t len)
+void stm32_log(void *user, const char *line)
+{
+   (void)user;
+
+   printf("%s\n", line);
+}
+
+// remaining in 10 % steps rounded up, 0 % once operation is done, next operation starts over
+int stm32_progress(void *user, const char *operation, uint32_t done, uint32_t total)
 {
-   uint8_t crc = 0;
+   static uint32_t last_step = 11;
 
-   for (uint8_t i = 0; i < len; i++)
+   (void)user;
+   (void)operation;
+
+   uint32_t step = (total && done < total) ? (uint32_t)((10ULL * (total - done) + total - 1) / total) : 0;
+
+   if (step != last_step)
    {
-      crc = CRC8_Table[crc ^ data[i]];
+      printf("remaining %u %%\n", step * 10);
    }
 
-   return crc;
+   last_step = (step == 0) ? 11 : step;
+
+   return 0;
 }
 
-void stm32_send_cmd(uint8_t cmd)
+// size of input file, 0 if it can not be read
+uint32_t stm32_file_size(char *input_file)
 {
-   uint8_t temp[1];
-
-   temp[0] = cmd;
-   uint8_t crc = CRC8(temp, 1);
+   FILE *fp = fopen(input_file, "rb");
 
-   temp[0] = SYNC_CHAR;
-   Serial_Port_Write(Serial_Handle, temp, 1);
+   if (fp == NULL)
+   {
+      printf("can not read %s\n", input_file);
+      return 0;
+   }
 
-   temp[0] = 2;
-   Serial_Port_Write(Serial_Handle, temp, 1);
+   fseek(fp, 0L, SEEK_END);
+   uint32_t f_file_size = ftell(fp);
+   fclose(fp);
 
-   temp[0] = cmd;
-   Serial_Port_Write(Serial_Handle, temp, 1);
+   printf("file size %u\n", f_file_size);
 
-   temp[0] = crc;
-   Serial_Port_Write(Serial_Handle, temp, 1);
+   return f_file_size;
 }
 
-void stm32_send_ack()
+// prints error of operation, with address where device reported one, returns 1 on success
+uint8_t stm32_status(int status, const char *operation)
 {
-   uint8_t temp[1];
-   temp[0] = CMD_ACK;
-   Serial_Port_Write(Serial_Handle, temp, 1);
+   if (status == STM32BL_OK)
+   {
+      return 1;
+   }
+
+   if (status == STM32BL_ERR_WRITE || status == STM32BL_ERR_ERASE || status == STM32BL_ERR_READ ||
+       status == STM32BL_ERR_VERIFY || status == STM32BL_ERR_CRC)
+   {
+      printf("%s at 0X%0x\n", stm32bl_strerror(status), stm32bl_error_address(session));
+   }
+   else
+   {
+      printf("%s %s\n", operation, stm32bl_strerror(status));
+   }
+
+   return 0;
 }
 
-uint8_t stm32_read_ack()
+void stm32_speed(const char *operation, uint32_t start_time, uint32_t len)
 {
-   uint8_t rx_char;
-   Serial_Port_Read(Serial_Handle, &rx_char, 1);
-
-   return (rx_char == CMD_ACK);
+   uint32_t elapsed_time = system_current_time_millis() - start_time;
+   printf("elapsed time = %ums\n", elapsed_time);
+   printf("%s speed = %ukB/S\n", operation, len / (elapsed_time ? elapsed_time : 1));
 }
 
-void stm32_erase()
+uint8_t stm32_erase(char *input_file)
 {
+   uint32_t f_file_size = 0;
 
-   Serial_Port_Timeout(Serial_Handle, 10000);
+   if (input_file)
+   {
+      // erase only footprint of input file
+      f_file_size = stm32_file_size(input_file);
 
-   stm32_send_cmd(CMD_ERASE);
+      if (f_file_size == 0)
+      {
+         return 0;
+      }
 
-   if (stm32_read_ack())
-   {
-      printf("flash erase success\n");
+      stm32bl_info_t info;
+      stm32bl_info(session, &info);
+      printf("erasing %u bytes from 0X%0x\n", f_file_size, info.app_start);
    }
-   else
+
+   if (!stm32_status(stm32bl_erase(session, f_file_size), "flash erase"))
    {
-      printf("flash erase error\n");
+      return 0;
    }
 
-   Serial_Port_Timeout(Serial_Handle, 100);
+   printf("flash erase success\n");
+   return 1;
 }
 
 void stm32_get_help()
 {
    printf("supported commands\n"
-          "write  -> write application to mcu.\n"
-          "erase  -> erase mcu flash.\n"
+          "write  -> write application to mcu, erases flash on the fly.\n"
+          "erase  -> erase mcu flash, only footprint of input file if given.\n"
           "reset  -> reset mcu.\n"
           "jump   -> jump to user application.\n"
           "read   -> read flash from mcu.\n"
-          "verify -> verify mcu content.\n");
+          "verify -> verify mcu content.\n"
+          "write_window -> write application with pipelined frames.\n"
+          "info   -> print device info.\n"
+          "checksum -> print crc32 of flash, only footprint of input file if given.\n"
+          "cmds joined by ',' run in one connection, like erase,write,verify,jump\n"
+          "each may name its own file, like \"write app.bin,verify app.bin\"\n");
 }
 
-void stm32_reset()
+uint8_t stm32_reset()
 {
-   stm32_send_cmd(CMD_RESET);
-
-   if (stm32_read_ack())
-   {
-      printf("mcu reset\n");
-   }
-   else
+   if (stm32bl_reset(session) != STM32BL_OK)
    {
       printf("mcu reset failed\n");
+      return 0;
    }
+
+   printf("mcu reset\n");
+   return 1;
 }
 
-void stm32_jump()
+uint8_t stm32_jump()
 {
-   stm32_send_cmd(CMD_JUMP);
-
-   if (stm32_read_ack())
-   {
-      printf("entering user application\n");
-   }
-   else
+   if (stm32bl_jump(session) != STM32BL_OK)
    {
       printf("user application failed\n");
+      return 0;
    }
+
+   printf("entering user application\n");
+   return 1;
 }
 
-void stm32_read_flash()
+uint8_t stm32_read_flash()
 {
-   FILE *fp = NULL;
-
    uint32_t start_time = system_current_time_millis();
-   uint32_t remaining_bytes = FLASH_SIZE;
-   uint32_t stm32_app_address = USER_APP_ADDRESS;
-
-   uint8_t bl_packet[10];
-   uint8_t rx_buffer[256];
+   stm32bl_info_t info;
 
-   fp = fopen("output_file.bin", "wb");
+   stm32bl_info(session, &info);
 
-   if (fp == NULL)
+   if (!stm32_status(stm32bl_read_file(session, "output_file.bin"), "flash read"))
    {
-      printf("can not create bin file\n");
-      return;
+      return 0;
    }
 
-   while (remaining_bytes > 0)
-   {
+   printf("flash read successfull, jolly good!!!!\n");
+   stm32_speed("read", start_time, info.app_end - info.app_start);
+   return 1;
+}
+
+// crc32 of app region, or of its first file size bytes
+uint8_t stm32_checksum(char *input_file)
+{
+   stm32bl_info_t info;
+   uint32_t crc = 0;
+
+   stm32bl_info(session, &info);
 
-      uint8_t bl_packet_index;
-      uint8_t read_block_size = 240;
-      uint8_t temp[1];
+   uint32_t len = info.app_end - info.app_start;
 
-      if (remaining_bytes < read_block_size)
+   if (input_file)
+   {
+      len = stm32_file_size(input_file);
+
+      if (len == 0)
       {
-         read_block_size = remaining_bytes;
+         return 0;
       }
+   }
 
-      memset(bl_packet, 0x00, 10);
-      memset(rx_buffer, 0x00, 256);
-
-      bl_packet_index = 0;
+   if (!stm32_status(stm32bl_checksum(session, info.app_start, len, &crc), "checksum"))
+   {
+      return 0;
+   }
 
-      // assemble cmd
-      bl_packet[bl_packet_index++] = CMD_READ;
+   printf("crc32 0X%08x of %u bytes from 0X%0x\n", crc, len, info.app_start);
+   return 1;
+}
 
-      // no of char to receive from stm32
-      bl_packet[bl_packet_index++] = read_block_size;
+uint8_t stm32_write(char *input_file, uint8_t window)
+{
+   uint32_t start_time = system_current_time_millis();
 
-      // 2 bytes padding for stm32 word alignment
-      bl_packet[bl_packet_index++] = 0x00;
-      bl_packet[bl_packet_index++] = 0x00;
+   printf("opening file...\n");
 
-      // assemble address
-      bl_packet[bl_packet_index++] = (stm32_app_address >> 24 & 0xFF);
-      bl_packet[bl_packet_index++] = (stm32_app_address >> 16 & 0xFF);
-      bl_packet[bl_packet_index++] = (stm32_app_address >> 8 & 0xFF);
-      bl_packet[bl_packet_index++] = (stm32_app_address >> 0 & 0xFF);
+   uint32_t f_file_size = stm32_file_size(input_file);
 
-      // calculate crc
-      uint8_t crc = CRC8(bl_packet, bl_packet_index);
+   if (f_file_size == 0)
+   {
+      return 0;
+   }
 
-      // assemble crc
-      bl_packet[bl_packet_index++] = crc;
+   int status = window ? stm32bl_write_window_file(session, input_file) : stm32bl_write_file(session, input_file);
 
-      // send sync char
-      temp[0] = SYNC_CHAR;
-      Serial_Port_Write(Serial_Handle, temp, 1);
+   uint8_t ok = stm32_status(status, "flash write");
 
-      // send no of chars in bl_packet
-      temp[0] = bl_packet_index;
-      Serial_Port_Write(Serial_Handle, temp, 1);
+   if (ok)
+   {
+      printf("flash write successfull, jolly good!!!!\n");
+      stm32_speed("write", start_time, f_file_size);
+   }
 
-      // send bl_packet
-      Serial_Port_Write(Serial_Handle, bl_packet, bl_packet_index);
+   printf("closing file\n");
 
-      if (stm32_read_ack())
-      {
-         uint8_t crc_recvd;
+   return ok;
+}
 
-         for (size_t i = 0; i < read_block_size; i++)
-         {
-            Serial_Port_Read(Serial_Handle, rx_buffer + i, 1);
-         }
+uint8_t stm32_verify(char *input_file)
+{
+   uint32_t start_time = system_current_time_millis();
 
-         Serial_Port_Read(Serial_Handle, &crc_recvd, 1);
+   printf("opening file...\n");
 
-         uint8_t crc_calc = CRC8(rx_buffer, read_block_size);
+   uint32_t f_file_size = stm32_file_size(input_file);
 
-         if (crc_recvd == crc_calc)
-         {
-            fwrite(rx_buffer, 1, read_block_size, fp);
-            //printf("flash read succsess at 0X%0x\n", stm32_app_address);
-            remaining_bytes -= read_block_size;
-            stm32_app_address += read_block_size;
-            if ((100 * remaining_bytes) % FLASH_SIZE == 0)
-            {
-               printf("remaining %u %%\n", (100 * remaining_bytes / FLASH_SIZE));
-            }
-         }
-         else
-         {
-            printf("crc mismatch\n");
-            break;
-         }
-      }
-      else
-      {
-         printf("flash read error at 0X%0x\n", stm32_app_address);
-         break;
-      }
+   if (f_file_size == 0)
+   {
+      return 0;
    }
 
-   if (remaining_bytes == 0)
+   uint8_t ok = stm32_status(stm32bl_verify_file(session, input_file), "verify");
+
+   if (ok)
    {
-      printf("flash read successfull, jolly good!!!!\n");
-      rewind(fp);
-      fseek(fp, 0L, SEEK_END);
-      uint32_t f_file_size = ftell(fp);
-      uint32_t elapsed_time = system_current_time_millis() - start_time;
-      printf("elapsed time = %ums\n", elapsed_time);
-      printf("read speed = %ukB/S\n", f_file_size / elapsed_time);
+      printf("verify successfull, jolly good!!!!\n");
+      stm32_speed("verify", start_time, f_file_size);
    }
 
-   fclose(fp);
+   printf("closing file\n");
+
+   return ok;
 }
 
-void stm32_write(char *input_file)
+// writes file to every connected node, each frame is sent once for all of them
+void stm32_broadcast_write(char *input_file, const uint16_t *nodes, uint32_t node_count)
 {
-   FILE *fp = NULL;
-
    uint32_t start_time = system_current_time_millis();
-   uint32_t stm32_app_address = USER_APP_ADDRESS;
-
-   uint8_t bl_packet[256];
+   uint32_t written = 0;
 
    printf("opening file...\n");
 
-   fp = fopen(input_file, "rb");
+   uint32_t f_file_size = stm32_file_size(input_file);
 
-   if (fp == NULL)
+   if (f_file_size == 0)
    {
-      printf("can not open %s\n", input_file);
+      return;
    }
-   else
-   {
-      fseek(fp, 0L, SEEK_END);
-      uint32_t f_file_size = ftell(fp);
-      rewind(fp);
-      printf("file size %u\n", f_file_size);
-      uint32_t remaining_bytes = f_file_size;
-      uint8_t write_block_size = 240;
-
-      while (remaining_bytes > 0)
-      {
-         uint8_t bl_packet_index;
-         uint8_t temp[1];
 
-         if (remaining_bytes < write_block_size)
-         {
-            write_block_size = remaining_bytes;
-         }
+   int status = stm32bl_broadcast_write_file(session, input_file);
 
-         memset(bl_packet, 0x00, 256);
-         bl_packet_index = 0;
+   // failed nodes are listed below
+   if (status != STM32BL_ERR_NODES)
+   {
+      stm32_status(status, "flash write");
+   }
 
-         // assemble cmd
-         bl_packet[bl_packet_index++] = CMD_WRITE;
+   for (uint32_t i = 0; i < node_count; i++)
+   {
+      written += stm32bl_node_ok(session, i);
+      printf("node %04X %s\n", nodes[i], stm32bl_node_ok(session, i) ? "written" : "failed");
+   }
 
-         // no of char to flash to stm32
-         bl_packet[bl_packet_index++] = write_block_size;
+   if (written)
+   {
+      printf("%u of %u nodes written, jolly good!!!!\n", written, node_count);
+      stm32_speed("write", start_time, f_file_size);
+   }
 
-         // 2 bytes padding for stm32 word alignment
-         bl_packet[bl_packet_index++] = 0x00;
-         bl_packet[bl_packet_index++] = 0x00;
+   printf("closing file\n");
+}
 
-         // assemble address
-         bl_packet[bl_packet_index++] = (stm32_app_address >> 24 & 0xFF);
-         bl_packet[bl_packet_index++] = (stm32_app_address >> 16 & 0xFF);
-         bl_packet[bl_packet_index++] = (stm32_app_address >> 8 & 0xFF);
-         bl_packet[bl_packet_index++] = (stm32_app_address & 0xFF);
+// runs one cmd on connected device, returns 1 on success
+uint8_t stm32_run(char *cmd, char *input_file)
+{
+   if (strncmp(cmd, "write_window", 20) == 0 || strncmp(cmd, "write", 10) == 0)
+   {
+      if (input_file == NULL)
+      {
+         printf("please enter input file\n");
+         return 0;
+      }
 
-         // assemble payload
-         fread(&bl_packet[bl_packet_index], 1, write_block_size, fp);
-         bl_packet_index += write_block_size;
+      printf("input file = %s\n", input_file);
+      return stm32_write(input_file, strncmp(cmd, "write_window", 20) == 0);
+   }
+   else if (strncmp(cmd, "erase", 10) == 0)
+   {
+      if (input_file)
+      {
+         printf("input file = %s\n", input_file);
+      }
 
-         // calculate crc
-         uint8_t crc = CRC8(bl_packet, bl_packet_index);
+      return stm32_erase(input_file);
+   }
+   else if (strncmp(cmd, "reset", 10) == 0)
+   {
+      return stm32_reset();
+   }
+   else if (strncmp(cmd, "jump", 10) == 0)
+   {
+      return stm32_jump();
+   }
+   else if (strncmp(cmd, "info", 10) == 0)
+   {
+      // already printed after connect
+      return 1;
+   }
+   else if (strncmp(cmd, "help", 10) == 0)
+   {
+      stm32_get_help();
+      return 1;
+   }
+   else if (strncmp(cmd, "read", 10) == 0)
+   {
+      return stm32_read_flash();
+   }
+   else if (strncmp(cmd, "checksum", 10) == 0)
+   {
+      return stm32_checksum(input_file);
+   }
+   else if (strncmp(cmd, "verify", 10) == 0)
+   {
+      if (input_file == NULL)
+      {
+         printf("please enter input file to verfy\n");
+         return 0;
+      }
 
-         // assemble crc
-         bl_packet[bl_packet_index++] = crc;
+      printf("input file = %s\n", input_file);
+      return stm32_verify(input_file);
+   }
 
-         // send sync char
-         temp[0] = SYNC_CHAR;
-         Serial_Port_Write(Serial_Handle, temp, 1);
+   printf("Invalid cmd\n");
+   return 0;
+}
 
-         // send no of char in bl_packet
-         temp[0] = bl_packet_index;
-         Serial_Port_Write(Serial_Handle, temp, 1);
+// connects every node found on can bus or named in rs485 port, then runs cmd on all of them
+// write is broadcast once for all nodes, other cmds run node by node
+void stm32_all_nodes(char *cmd, char *input_file)
+{
+   uint16_t nodes[MAX_NODES];
+   uint32_t node_count = stm32bl_nodes(session, nodes, MAX_NODES);
 
-         // send in bl_packet
-         Serial_Port_Write(Serial_Handle, bl_packet, bl_packet_index);
+   if (node_count > MAX_NODES)
+   {
+      node_count = MAX_NODES;
+   }
 
-         if (stm32_read_ack())
-         {
-            //printf("flash write success at 0X%0x\n", stm32_app_address);
-         }
-         else
-         {
-            printf("flash write error at 0X%0x\n", stm32_app_address);
-            break;
-         }
+   stm32bl_connect_nodes(session);
 
-         remaining_bytes -= write_block_size;
-         stm32_app_address += write_block_size;
+   if (strncmp(cmd, "write", 10) == 0 && input_file)
+   {
+      printf("input file = %s\n", input_file);
+      stm32_broadcast_write(input_file, nodes, node_count);
+      return;
+   }
 
-         if ((100 * remaining_bytes) % f_file_size == 0)
-         {
-            printf("remaining %u %%\n", (100 * remaining_bytes / f_file_size));
-         }
+   for (uint32_t i = 0; i < node_count; i++)
+   {
+      if (!stm32bl_node_ok(session, i))
+      {
+         continue;
       }
 
-      if (remaining_bytes == 0)
+      stm32bl_select(session, nodes[i]);
+      printf("node %04X\n", nodes[i]);
+
+      if (strncmp(cmd, "verify", 10) == 0 && input_file)
       {
-         printf("flash write successfull, jolly good!!!!\n");
-         uint32_t elapsed_time = system_current_time_millis() - start_time;
-         printf("elapsed time = %ums\n", elapsed_time);
-         printf("write speed = %ukB/S\n", f_file_size / elapsed_time);
+         stm32_verify(input_file);
+      }
+      else if (strncmp(cmd, "reset", 10) == 0)
+      {
+         stm32_reset();
+      }
+      else if (strncmp(cmd, "jump", 10) == 0)
+      {
+         stm32_jump();
+      }
+      else if (strncmp(cmd, "info", 10) != 0)
+      {
+         printf("cmd not supported on every node, write, verify, reset, jump or info\n");
+         break;
       }
-
-      fclose(fp);
-      printf("closing file\n");
    }
 }
 
-void stm32_verify(char *input_file)
+#ifdef __linux__
+// log lines of each board carry its port
+void stm32_target_log(void *user, const char *line)
 {
-   FILE *fp = NULL;
+   printf("%s: %s\n", ((stm32_target_t *)user)->port, line);
+}
 
-   uint32_t start_time = system_current_time_millis();
-   uint32_t stm32_app_address = USER_APP_ADDRESS;
+int stm32_target_progress(void *user, const char *operation, uint32_t done, uint32_t total)
+{
+   stm32_target_t *target = user;
 
-   uint8_t bl_packet[256];
+   (void)operation;
 
-   printf("opening file...\n");
+   target->done = done;
+   target->total = total;
 
-   fp = fopen(input_file, "rb");
+   return 0;
+}
 
-   if (fp == NULL)
-   {
-      printf("can not open %s\n", input_file);
-   }
-   else
+void stm32_target_table(stm32_target_t *targets, uint32_t count, uint32_t len, uint64_t start_time)
+{
+   printf("%-24s %-8s %-10s %-8s %s\n", "port", "result", "ms", "kB/S", "error");
+
+   for (uint32_t i = 0; i < count; i++)
    {
-      fseek(fp, 0L, SEEK_END);
-      uint32_t f_file_size = ftell(fp);
-      rewind(fp);
-      printf("file size %u\n", f_file_size);
-      uint32_t remaining_bytes = f_file_size;
-      uint8_t write_block_size = 240;
+      stm32_target_t *target = &targets[i];
+      uint32_t elapsed_time = target->end_time - start_time;
 
-      while (remaining_bytes > 0)
+      if (target->status == STM32BL_OK)
       {
+         printf("%-24s %-8s %-10u %-8u\n", target->port, "ok", elapsed_time, len / (elapsed_time ? elapsed_time : 1));
+      }
+      else if (target->status == STM32BL_ERR_WRITE || target->status == STM32BL_ERR_VERIFY)
+      {
+         printf("%-24s %-8s %-10u %-8s %s at 0X%0x\n", target->port, "failed", elapsed_time, "-",
+                stm32bl_strerror(target->status), stm32bl_error_address(target->session));
+      }
+      else
+      {
+         printf("%-24s %-8s %-10u %-8s %s\n", target->port, "failed", elapsed_time, "-", stm32bl_strerror(target->status));
+      }
+   }
+}
 
-         uint8_t bl_packet_index;
-         uint8_t temp[1];
-
-         if (remaining_bytes < write_block_size)
-         {
-            write_block_size = remaining_bytes;
-         }
-
-         memset(bl_packet, 0x00, 256);
-         bl_packet_index = 0;
-
-         // assemble cmd
-         bl_packet[bl_packet_index++] = CMD_VERIFY;
+// writes or verifies file on boards on every serial port in list, all driven from one epoll loop
+// each port waits only on its own replies, a dead or failing board does not hold up the others
+void stm32_multi(char *port_list, char *cmd, char *input_file)
+{
+   stm32_target_t targets[MAX_TARGETS] = {0};
+   struct epoll_event events[MAX_TARGETS];
+   uint32_t count = 0;
+   uint32_t pending = 0;
+   uint32_t passed = 0;
+   uint8_t write = (strncmp(cmd, "write", 10) == 0);
+
+   if (!write && strncmp(cmd, "verify", 10) != 0)
+   {
+      printf("cmd not supported on port list, write or verify\n");
+      return;
+   }
 
-         // no of char to flash to stm32
-         bl_packet[bl_packet_index++] = write_block_size;
+   if (input_file == NULL)
+   {
+      printf("please enter input file\n");
+      return;
+   }
 
-         // 2 bytes padding for stm32 word alignment
-         bl_packet[bl_packet_index++] = 0x00;
-         bl_packet[bl_packet_index++] = 0x00;
+   printf("input file = %s\n", input_file);
 
-         // assemble address
-         bl_packet[bl_packet_index++] = (stm32_app_address >> 24 & 0xFF);
-         bl_packet[bl_packet_index++] = (stm32_app_address >> 16 & 0xFF);
-         bl_packet[bl_packet_index++] = (stm32_app_address >> 8 & 0xFF);
-         bl_packet[bl_packet_index++] = (stm32_app_address >> 0 & 0xFF);
+   // image read once, every session sends from same copy
+   uint32_t f_file_size = stm32_file_size(input_file);
+   uint8_t *f_data = f_file_size ? malloc(f_file_size) : NULL;
+   FILE *fp = f_data ? fopen(input_file, "rb") : NULL;
 
-         // assemble payload
-         fread(&bl_packet[bl_packet_index], 1, write_block_size, fp);
-         bl_packet_index += write_block_size;
+   if (fp == NULL || fread(f_data, 1, f_file_size, fp) != f_file_size)
+   {
+      printf("can not read %s\n", input_file);
 
-         // calculate crc
-         uint8_t crc = CRC8(bl_packet, bl_packet_index);
+      if (fp)
+      {
+         fclose(fp);
+      }
 
-         // assemble crc
-         bl_packet[bl_packet_index++] = crc;
+      free(f_data);
+      return;
+   }
 
-         // send sync char
-         temp[0] = SYNC_CHAR;
-         Serial_Port_Write(Serial_Handle, temp, 1);
+   fclose(fp);
 
-         // send no of char in bl_packet
-         temp[0] = bl_packet_index;
-         Serial_Port_Write(Serial_Handle, temp, 1);
+   int epoll_fd = epoll_create1(0);
+   uint64_t start_time = system_current_time_millis();
 
-         // send bl_packet
-         Serial_Port_Write(Serial_Handle, bl_packet, bl_packet_index);
+   char *port = strtok(port_list, ",");
 
-         if (stm32_read_ack())
-         {
-            //printf("verify success at 0X%0x\n", stm32_app_address);
-         }
-         else
-         {
-            printf("verify error at 0X%0x\n", stm32_app_address);
-            break;
-         }
+   for (; port && count < MAX_TARGETS; port = strtok(NULL, ","))
+   {
+      stm32_target_t *target = &targets[count++];
 
-         remaining_bytes -= write_block_size;
-         stm32_app_address += write_block_size;
-         if ((100 * remaining_bytes) % f_file_size == 0)
-         {
-            printf("remaining %u %%\n", (100 * remaining_bytes / f_file_size));
-         }
-      }
+      target->port = port;
+      target->session = stm32bl_session_open(port, baud_rate);
+      target->status = STM32BL_ERR_PORT;
+      target->end_time = start_time;
 
-      if (remaining_bytes == 0)
+      if (target->session == NULL || stm32bl_fd(target->session) == -1)
       {
-         printf("verify successfull, jolly good!!!!\n");
-         uint32_t elapsed_time = system_current_time_millis() - start_time;
-         printf("elapsed time = %ums\n", elapsed_time);
-         printf("verify speed = %ukB/S\n", f_file_size / elapsed_time);
+         continue;
       }
 
-      fclose(fp);
-      printf("closing file\n");
-   }
-}
+      stm32bl_set_callbacks(target->session, stm32_target_progress, stm32_target_log, target);
 
-int main(int argc, char *argv[])
-{
-   printf("path = %s\n", argv[0]);
+      struct epoll_event event = {.events = EPOLLIN, .data.ptr = target};
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stm32bl_fd(target->session), &event);
 
-   if (argc == 1)
-   {
-      printf("please enter port, baud, cmd and optional input file\n");
+      target->status = write ? stm32bl_write_start(target->session, f_data, f_file_size)
+                             : stm32bl_verify_start(target->session, f_data, f_file_size);
+      target->running = (target->status == STM32BL_PENDING);
+      pending += target->running;
    }
 
-   if (argc >= 4)
+   if (port)
    {
-      com_port = argv[1];
-      baud_rate = atoi(argv[2]);
-      cmd = argv[3];
-
-      printf("com port = %s\n", com_port);
-      printf("baud rate = %u\n", baud_rate);
-      printf("cmd = %s\n", cmd);
+      printf("only first %u ports used\n", MAX_TARGETS);
    }
 
-   if (Open_Serial_port(com_port, baud_rate))
-   {
-      printf("port open success\n");
+   printf("%u ports\n", count);
 
-      // CMD_CONNECT used for auto baud detection on stm32
-      uint8_t temp = CMD_CONNECT;
-      uint8_t retry = 10;
-      uint8_t connected = 0;
+   uint64_t report_time = start_time;
 
-      while (retry--)
-      {
-         Serial_Port_Write(Serial_Handle, &temp, 1);
+   while (pending)
+   {
+      // wake for first reply or first deadline, progress once a second
+      uint32_t timeout = 1000;
 
-         if (!stm32_read_ack())
-         {
-            uint32_t delay = system_current_time_millis();
-            while (system_current_time_millis() - delay < 100)
-               ;
-         }
-         else
+      for (uint32_t i = 0; i < count; i++)
+      {
+         if (targets[i].status == STM32BL_PENDING)
          {
-            connected = 1;
-            break;
+            uint32_t step_timeout = stm32bl_step_timeout(targets[i].session);
+            timeout = (step_timeout < timeout) ? step_timeout : timeout;
          }
       }
 
-      if (!connected)
-      {
-         printf("stm32 device connection failed\n");
-      }
-      else
+      int ready = epoll_wait(epoll_fd, events, MAX_TARGETS, timeout);
+
+      for (int k = 0; k < ready; k++)
       {
-         printf("connected to stm32 device\n");
+         stm32_target_t *target = events[k].data.ptr;
 
-         if (strncmp(cmd, "write", strnlen("write", 10)) == 0)
-         {
-            if (argc >= 5)
-            {
-               char *bin_file = argv[4];
-               printf("input file = %s\n", bin_file);
-               stm32_write(bin_file);
-            }
-            else
-            {
-               printf("please enter input file\n");
-            }
-         }
-         else if (strncmp(cmd, "erase", 10) == 0)
-         {
-            stm32_erase();
-         }
-         else if (strncmp(cmd, "reset", 10) == 0)
+         if (target->status == STM32BL_PENDING)
          {
-            stm32_reset();
+            target->status = stm32bl_step(target->session);
          }
-         else if (strncmp(cmd, "jump", 10) == 0)
+
+         // adapter unplugged or other end gone, port stays readable without chars
+         if (target->status == STM32BL_PENDING && (events[k].events & (EPOLLHUP | EPOLLERR)))
          {
-            stm32_jump();
+            target->status = STM32BL_ERR_PORT;
          }
-         else if (strncmp(cmd, "help", 10) == 0)
+      }
+
+      // deadlines that passed without a reply
+      for (uint32_t i = 0; i < count; i++)
+      {
+         stm32_target_t *target = &targets[i];
+
+         if (target->status == STM32BL_PENDING && stm32bl_step_timeout(target->session) == 0)
          {
-            stm32_get_help();
+            target->status = stm32bl_step(target->session);
          }
-         else if (strncmp(cmd, "read", 10) == 0)
+
+         if (target->running && target->status != STM32BL_PENDING)
          {
-            stm32_read_flash();
+            target->running = 0;
+            target->end_time = system_current_time_millis();
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stm32bl_fd(target->session), NULL);
+            pending--;
          }
-         else if (strncmp(cmd, "verify", 10) == 0)
+      }
+
+      if (system_current_time_millis() - report_time >= 1000 && pending)
+      {
+         report_time = system_current_time_millis();
+         printf("remaining");
+
+         for (uint32_t i = 0; i < count; i++)
          {
-            if (argc >= 5)
+            stm32_target_t *target = &targets[i];
+
+            if (target->status == STM32BL_PENDING)
             {
-               char *bin_file = argv[4];
-               printf("input file = %s\n", bin_file);
-               stm32_verify(bin_file);
+               printf(" %s %u %%", target->port, target->total ? (uint32_t)(100ULL * (target->total - target->done) / target->total) : 100);
             }
             else
             {
-               printf("please enter input file to verfy\n");
+               printf(" %s %s", target->port, (target->status == STM32BL_OK) ? "done" : "failed");
             }
          }
-         else
-         {
-            printf("Invalid cmd\n");
-         }
+
+         printf("\n");
       }
+   }
+
+   close(epoll_fd);
+
+   stm32_target_table(targets, count, f_file_size, start_time);
 
-      printf("closing port\n");
-      Serial_Port_Close(Serial_Handle);
+   for (uint32_t i = 0; i < count; i++)
+   {
+      passed += (targets[i].status == STM32BL_OK);
+      stm32bl_session_close(targets[i].session);
    }
-   else
+
+   if (passed)
+   {
+      printf("%u of %u boards %s, jolly good!!!!\n", passed, count, write ? "written" : "verified");
+   }
+
+   free(f_data);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+   printf("path = %s\n", argv[0]);
+
+   if (argc < 4)
+   {
+      printf("please enter port, baud, cmd and optional input file\n"
+             "port may be a comma separated list of serial ports to write or verify all of them\n");
+      return 0;
+   }
+
+   com_port = argv[1];
+   baud_rate = atoi(argv[2]);
+   cmd = argv[3];
+
+   printf("com port = %s\n", com_port);
+   printf("baud rate = %u\n", baud_rate);
+   printf("cmd = %s\n", cmd);
+
+   char *bin_file = (argc >= 5) ? argv[4] : NULL;
+
+   // several serial ports like /dev/ttyUSB0,/dev/ttyUSB1, one board on each
+   if (strchr(com_port, ',') && strncmp(com_port, "rs485:", 6) != 0 && strncmp(com_port, "can:", 4) != 0)
+   {
+#ifdef __linux__
+      stm32_multi(com_port, cmd, bin_file);
+#else
+      printf("port list needs epoll, linux only\n");
+#endif
+      return 0;
+   }
+
+   session = stm32bl_session_open(com_port, baud_rate);
+
+   if (session == NULL)
    {
       printf("Not valid port\n");
+      return 0;
+   }
+
+   printf("port open success\n");
+   stm32bl_set_callbacks(session, stm32_progress, stm32_log, NULL);
+
+   // every node on can bus or several on rs485 bus, connected one by one
+   if ((strncmp(com_port, "can:", 4) == 0 && strcmp(strrchr(com_port, ':'), ":*") == 0) ||
+       (strncmp(com_port, "rs485:", 6) == 0 && stm32bl_nodes(session, NULL, 0) > 1))
+   {
+      stm32_all_nodes(cmd, bin_file);
+   }
+   else if (stm32bl_connect(session) != STM32BL_OK)
+   {
+      printf("stm32 device connection failed\n");
    }
+   else
+   {
+      printf("connected to stm32 device\n");
+
+      // each cmd of a list runs on this connection, first failing one stops the rest
+      for (char *step = strtok(cmd, ","); step; step = strtok(NULL, ","))
+      {
+         step += strspn(step, " ");
+
+         char *step_file = strchr(step, ' ');
+
+         if (step_file)
+         {
+            *step_file++ = 0;
+         }
+
+         if (!stm32_run(step, step_file ? step_file : bin_file))
+         {
+            printf("%s failed, skipping remaining cmds\n", step);
+            break;
+         }
+      }
+   }
+
+   printf("closing port\n");
+   stm32bl_session_close(session);
 
    return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,2645 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "stm32bl.h"
+#include "serial_port.h"
+#include "spi_port.h"
+#include "can_port.h"
+#include "rs485_port.h"
+
+// defaults for bootloader without CMD_GET_INFO
+#define USER_APP_ADDRESS 0x08008000 // 0x08004000->8K, 0x08004000->16k, 0x08008000->32k botloader size
+#define FLASH_SIZE 496000           //+ 512000 //uncomment for 407VG
+
+/*
+CMD_WRITE, CMD_VERIFY Frame
+[SYNC_CHAR + frame len] frame len = 9 + payload len
+[1-byte cmd + 1-byte no of bytes to write + 0x00 + 0x00 + 4-byte addes +  payload + 1-byte CRC]
+*/
+
+/*
+CMD_WRITE Frame with WRITE_FLAG_DEFER in flags byte, frame is acked before it is programmed
+response [ACK] or [ERROR + 4-byte address of failed frame + 1-byte CRC] for a previous frame
+frame with no payload at the end collects status of last frame, old bootloader just acks it
+with WRITE_FLAG_ERASE each page or sector is erased on first write into it, no separate erase needed
+with WRITE_FLAG_END on first frame 4-byte image end goes between payload and crc, not counted in len,
+first write into a page or sector then starts erase of next one if it is below image end
+*/
+
+/*
+CMD_WRITE_WINDOW Frame
+[SYNC_CHAR + frame len] frame len = 9 + payload len
+[1-byte cmd + 1-byte no of bytes to write + 1-byte seq + 1-byte flags + 4-byte addes +  payload + 1-byte CRC]
+response [ACK or NACK + 1-byte next expected seq] for each frame as it is programmed, next frame goes out on each ack
+each transfer starts at a new seq, so device tells it from a resent start frame
+with WRITE_FLAG_ERASE nothing follows a frame that starts a page or sector till it is acked
+*/
+
+/*
+CMD_READ Frame
+[SYNC_CHAR + frame len] frame len = 9
+[1-byte cmd + 1-byte no of bytes to read + 0x00 + 0x00 + 4-byte addes + 1-byte CRC]
+*/
+
+/*
+CMD_ERASE, CMD_RESET, CMD_JUMP Frame
+[SYNC_CHAR + frame len] frame len = 2
+[1-byte cmd + 1-byte CRC]
+*/
+
+/*
+CMD_ERASE_RANGE Frame, no of bytes to erase sent as 4-byte payload
+[SYNC_CHAR + frame len] frame len = 13
+[1-byte cmd + 0x04 + 0x00 + 0x00 + 4-byte addes + 4-byte no of bytes to erase + 1-byte CRC]
+response [ACK] or [NACK], no response from old bootloader
+*/
+
+/*
+CMD_GET_INFO Frame, sent right after connect
+[SYNC_CHAR + frame len] frame len = 2
+[1-byte cmd + 1-byte CRC]
+response [ACK + 2-byte info len + info + 1-byte CRC of info], no response from old bootloader
+info
+[1-byte info version + 4-byte device id + 12-byte unique id + 4-byte flash size + 4-byte app start +
+ 4-byte app end + 4-byte max payload + 1-byte window size + 4-byte capabilities +
+ 1-byte region count + region count * (4-byte page or sector size + 2-byte count) +
+ 1-byte baud count + baud count * 4-byte baud rate]
+*/
+
+/*
+CMD_CHECKSUM Frame, no of bytes sent as 4-byte payload
+[SYNC_CHAR + frame len] frame len = 13
+[1-byte cmd + 0x04 + 0x00 + 0x00 + 4-byte addes + 4-byte no of bytes + 1-byte CRC]
+response [ACK + 4-byte CRC32 + 1-byte CRC of CRC32] or [NACK]
+CRC32 of stm32 crc unit, poly 0x04C11DB7, init 0xFFFFFFFF, little endian words, tail padded with 0xFF
+*/
+
+/*
+CMD_PAGE_HASH Frame, same as CMD_CHECKSUM
+response [ACK + 2-byte count + count * 4-byte CRC32 + 1-byte CRC of count and CRC32s] or [NACK]
+one CRC32 for every whole page or sector overlapping the span
+*/
+
+/*
+CMD_WRITE_COMPRESSED Frame, payload is 4-byte no of bytes to write + lz4 block decompressing to them
+[SYNC_CHAR + frame len] frame len = 13 + lz4 block len
+[1-byte cmd + 1-byte payload len + 0x00 + 1-byte flags + 4-byte addes + 4-byte no of bytes + lz4 block + 1-byte CRC]
+flags and response as CMD_WRITE, sent only when block is smaller than data
+*/
+
+/*
+CMD_FRAME_FORMAT Frame, sent after CMD_GET_INFO
+[SYNC_CHAR + frame len] frame len = 3
+[1-byte cmd + 1-byte frame version + 1-byte CRC]
+response [ACK + 1-byte frame version + 2-byte max payload + 1-byte CRC], no response from old bootloader
+*/
+
+/*
+v2 Frame, 2-byte frame len and 4-byte no of bytes appended to header
+[SYNC_CHAR + 2-byte frame len] frame len = 13 + payload len
+[1-byte cmd + 0x00 + 1-byte seq + 1-byte flags + 4-byte addes + 4-byte no of bytes + payload + 1-byte CRC]
+*/
+
+#define CMD_WRITE 0x50
+#define CMD_READ 0x51
+#define CMD_ERASE 0x52
+#define CMD_RESET 0x53
+#define CMD_JUMP 0x54
+#define CMD_VERIFY 0x55
+#define CMD_WRITE_WINDOW 0x57
+#define CMD_FRAME_FORMAT 0x58
+#define CMD_ERASE_RANGE 0x59
+#define CMD_GET_INFO 0x5A
+#define CMD_CHECKSUM 0x5B
+#define CMD_PAGE_HASH 0x5C
+#define CMD_WRITE_COMPRESSED 0x5D
+
+#define CMD_ACK 0x90
+#define CMD_NACK 0x91
+#define CMD_ERROR 0x92
+
+#define CMD_HELP 0x40
+
+#define CMD_CONNECT 0x7F
+
+#define SYNC_CHAR '$'
+
+#define FRAME_V1 1
+#define FRAME_V2 2
+
+// v1 payload, 1-byte frame len
+#define V1_PAYLOAD 240
+// largest payload accepted from bootloader in v2
+#define MAX_PAYLOAD (4 * 1024)
+#define FRAME_BUFFER_SIZE (MAX_PAYLOAD + 20)
+// 4-byte no of bytes to write + lz4 block of a payload that did not compress
+#define LZ4_BLOCK_SIZE (4 + MAX_PAYLOAD + MAX_PAYLOAD / 255 + 16)
+
+#define WINDOW_FLAG_START 0x01
+#define WRITE_FLAG_DEFER 0x02
+#define WRITE_FLAG_ERASE 0x04
+#define WRITE_FLAG_END 0x10
+
+// frames in flight for write_window, must not exceed BL_WINDOW_SIZE on mcu
+#define WINDOW_SIZE 4
+#define WINDOW_RETRY 5
+
+// CMD_GET_INFO capabilities
+#define CAP_WINDOW 0x0001
+#define CAP_FRAME_V2 0x0002
+#define CAP_DEFER_WRITE 0x0004
+#define CAP_ERASE_RANGE 0x0008
+#define CAP_LAZY_ERASE 0x0010
+#define CAP_AUTO_BAUD 0x0020
+#define CAP_CHECKSUM 0x0040
+#define CAP_PAGE_HASH 0x0080
+#define CAP_COMPRESSED 0x0100
+#define CAP_ADDRESSED 0x0200
+#define CAP_IMAGE_END 0x0400
+
+// nodes one write is broadcast to, can discovery or rs485 address list
+#define MAX_NODES 256
+
+#define MAX_UNITS 1024
+
+// CMD_GET_INFO reply
+#define INFO_SIZE 512
+
+// frame sent without copying its payload, sync char, frame len and fields go ahead of it,
+// image end if any and crc after it
+typedef struct
+{
+   uint8_t head[16];
+   uint8_t tail[5];
+   stm32bl_chunk_t chunk[3];
+} stm32_frame_t;
+
+// steps of a non-blocking operation, each waits for one reply
+enum
+{
+   JOB_IDLE,
+   JOB_CONNECT,
+   JOB_INFO_HEAD,
+   JOB_INFO,
+   JOB_FORMAT,
+   JOB_WRITE,
+   JOB_WRITE_ERROR,
+   JOB_CHECKSUM,
+   JOB_DONE
+};
+
+// operation started by stm32bl_write_start or stm32bl_verify_start, moved on by stm32bl_step
+typedef struct
+{
+   uint8_t state;
+   uint8_t write; // 0 checks crc32 only
+   uint8_t retry;
+   int status;
+   const uint8_t *data;
+   uint32_t len;
+   uint32_t offset; // bytes acked
+   uint32_t block;  // bytes in frame waiting for ack
+   uint32_t sent_bytes;
+   uint64_t deadline;
+   uint32_t need; // chars of reply
+   uint32_t count;
+   uint8_t reply[3 + INFO_SIZE + 1];
+} stm32_job_t;
+
+struct stm32bl_session
+{
+   stm32bl_transport_t transport;
+   stm32bl_progress_fn progress;
+   stm32bl_log_fn log;
+   void *user;
+
+   // negotiated with CMD_FRAME_FORMAT after connect
+   uint8_t frame_version;
+   uint32_t max_payload;
+
+   // reported by CMD_GET_INFO after connect, defaults for old bootloader
+   uint32_t user_app_address;
+   uint32_t flash_size;
+   uint32_t window_size;
+   uint32_t capabilities;
+   uint8_t write_flags;
+   stm32bl_info_t info;
+
+   // seq of first frame of next write_window, device tells a new transfer from a resent start frame by it
+   uint8_t window_seq;
+
+   uint32_t error_address;
+
+   // nodes connected by stm32bl_connect_nodes
+   uint16_t nodes[MAX_NODES];
+   uint8_t alive[MAX_NODES];
+   uint32_t node_count;
+
+   // frames gathered for transports taking one buffer, and for broadcast
+   uint8_t stream[WINDOW_SIZE * (FRAME_BUFFER_SIZE + 3)];
+   uint32_t hashes[MAX_UNITS];
+
+   stm32_job_t job;
+};
+
+static const char *stm32bl_errors[] = {
+    "ok",
+    "port can not be opened or went away",
+    "connection failed",
+    "file can not be read or created",
+    "file larger than flash",
+    "not acked",
+    "flash write error",
+    "flash erase error",
+    "flash read error",
+    "verify error",
+    "crc mismatch",
+    "not supported",
+    "out of memory",
+    "cancelled",
+    "not every node made it",
+    "bad argument",
+    "still running"};
+
+// transports behind port strings, each port api wrapped for stm32bl_transport_t
+
+static uint32_t Serial_Write(void *ctx, const uint8_t *buf, uint32_t len)
+{
+   return Serial_Port_Write(*(SERIAL_HANDLE *)ctx, (uint8_t *)buf, len);
+}
+
+static uint32_t Serial_Write_Chunks(void *ctx, const stm32bl_chunk_t *chunks, uint32_t count)
+{
+   Serial_Chunk_t serial_chunks[SERIAL_MAX_CHUNKS];
+
+   if (count > SERIAL_MAX_CHUNKS)
+   {
+      count = SERIAL_MAX_CHUNKS;
+   }
+
+   for (uint32_t i = 0; i < count; i++)
+   {
+      serial_chunks[i].data = chunks[i].data;
+      serial_chunks[i].len = chunks[i].len;
+   }
+
+   return Serial_Port_Write_Chunks(*(SERIAL_HANDLE *)ctx, serial_chunks, count);
+}
+
+static uint32_t Serial_Read(void *ctx, uint8_t *buf, uint32_t len)
+{
+   return Serial_Port_Read(*(SERIAL_HANDLE *)ctx, buf, len);
+}
+
+static void Serial_Timeout(void *ctx, uint32_t ms)
+{
+   Serial_Port_Timeout(*(SERIAL_HANDLE *)ctx, ms);
+}
+
+static void Serial_Close(void *ctx)
+{
+   Serial_Port_Close(*(SERIAL_HANDLE *)ctx);
+   free(ctx);
+}
+
+#ifdef __linux__
+static int Serial_Fd(void *ctx)
+{
+   return *(SERIAL_HANDLE *)ctx;
+}
+#endif
+
+static uint32_t SPI_Write(void *ctx, const uint8_t *buf, uint32_t len)
+{
+   return SPI_Port_Write(ctx, (uint8_t *)buf, len);
+}
+
+static uint32_t SPI_Read(void *ctx, uint8_t *buf, uint32_t len)
+{
+   return SPI_Port_Read(ctx, buf, len);
+}
+
+static void SPI_Timeout(void *ctx, uint32_t ms)
+{
+   SPI_Port_Timeout(ctx, ms);
+}
+
+static void SPI_Close(void *ctx)
+{
+   SPI_Port_Close(ctx);
+}
+
+static uint32_t CAN_Write(void *ctx, const uint8_t *buf, uint32_t len)
+{
+   return CAN_Port_Write(ctx, (uint8_t *)buf, len);
+}
+
+static uint32_t CAN_Read(void *ctx, uint8_t *buf, uint32_t len)
+{
+   return CAN_Port_Read(ctx, buf, len);
+}
+
+static void CAN_Timeout(void *ctx, uint32_t ms)
+{
+   CAN_Port_Timeout(ctx, ms);
+}
+
+static void CAN_Close(void *ctx)
+{
+   CAN_Port_Close(ctx);
+}
+
+static uint32_t CAN_Nodes(void *ctx, uint16_t *nodes, uint32_t max)
+{
+   return CAN_Port_Nodes(ctx, nodes, max);
+}
+
+static void CAN_Select(void *ctx, uint16_t node)
+{
+   CAN_Port_Select(ctx, node);
+}
+
+static void CAN_Broadcast(void *ctx, const uint8_t *stream, uint32_t len, const uint16_t *nodes, uint8_t *done, uint32_t count)
+{
+   CAN_Port_Broadcast(ctx, stream, len, nodes, done, count);
+}
+
+static uint32_t RS485_Write(void *ctx, const uint8_t *buf, uint32_t len)
+{
+   return RS485_Port_Write(ctx, (uint8_t *)buf, len);
+}
+
+static uint32_t RS485_Read(void *ctx, uint8_t *buf, uint32_t len)
+{
+   return RS485_Port_Read(ctx, buf, len);
+}
+
+static void RS485_Timeout(void *ctx, uint32_t ms)
+{
+   RS485_Port_Timeout(ctx, ms);
+}
+
+static void RS485_Close(void *ctx)
+{
+   RS485_Port_Close(ctx);
+}
+
+static uint32_t RS485_Nodes(void *ctx, uint16_t *nodes, uint32_t max)
+{
+   return RS485_Port_Nodes(ctx, nodes, max);
+}
+
+static void RS485_Select(void *ctx, uint16_t node)
+{
+   RS485_Port_Select(ctx, node);
+}
+
+// nodes take stream without replying, each is asked afterwards
+static void RS485_Broadcast(void *ctx, const uint8_t *stream, uint32_t len, const uint16_t *nodes, uint8_t *done, uint32_t count)
+{
+   // broadcast address reaches every node on the bus, dropped nodes are just not asked for status any more
+   (void)nodes;
+
+   RS485_Port_Broadcast(ctx, (uint8_t *)stream, len);
+   memset(done, 1, count);
+}
+
+int stm32bl_port_transport(stm32bl_transport_t *transport, const char *port, uint32_t baud)
+{
+   char name[256];
+
+   if (transport == NULL || port == NULL || strlen(port) >= sizeof(name))
+   {
+      return STM32BL_ERR_ARGUMENT;
+   }
+
+   // port apis take a writable name
+   strcpy(name, port);
+   memset(transport, 0, sizeof(*transport));
+
+   // baud is sck frequency for spi
+   if (strncmp(name, "spi:", 4) == 0 || strncmp(name, "spiloop:", 8) == 0)
+   {
+      transport->ctx = SPI_Port_Config(name, baud);
+      transport->write = SPI_Write;
+      transport->read = SPI_Read;
+      transport->timeout = SPI_Timeout;
+      transport->close = SPI_Close;
+   }
+   // bus bitrate is set on can interface
+   else if (strncmp(name, "can:", 4) == 0)
+   {
+      transport->ctx = CAN_Port_Config(name);
+      transport->write = CAN_Write;
+      transport->read = CAN_Read;
+      transport->timeout = CAN_Timeout;
+      transport->close = CAN_Close;
+      transport->nodes = CAN_Nodes;
+      transport->select = CAN_Select;
+      transport->broadcast = CAN_Broadcast;
+   }
+   // serial port with node addresses
+   else if (strncmp(name, "rs485:", 6) == 0)
+   {
+      transport->ctx = RS485_Port_Config(name, baud);
+      transport->write = RS485_Write;
+      transport->read = RS485_Read;
+      transport->timeout = RS485_Timeout;
+      transport->close = RS485_Close;
+      transport->nodes = RS485_Nodes;
+      transport->select = RS485_Select;
+      transport->broadcast = RS485_Broadcast;
+      transport->broadcast_silent = 1;
+      transport->baud = baud;
+   }
+   else
+   {
+      SERIAL_HANDLE *handle = malloc(sizeof(SERIAL_HANDLE));
+
+      if (handle == NULL)
+      {
+         return STM32BL_ERR_MEMORY;
+      }
+
+      *handle = Serial_Port_Config((uint8_t *)name, baud);
+
+#ifdef _WIN32
+      if (*handle == INVALID_HANDLE_VALUE)
+#else
+      if (*handle == -1)
+#endif
+      {
+         free(handle);
+         handle = NULL;
+      }
+
+      transport->ctx = handle;
+      transport->write = Serial_Write;
+      transport->write_chunks = Serial_Write_Chunks;
+      transport->read = Serial_Read;
+      transport->timeout = Serial_Timeout;
+      transport->close = Serial_Close;
+      transport->baud = baud;
+#ifdef __linux__
+      transport->fd = Serial_Fd;
+#endif
+   }
+
+   return (transport->ctx == NULL) ? STM32BL_ERR_PORT : STM32BL_OK;
+}
+
+static uint32_t Port_Write(stm32bl_session_t *s, const uint8_t *buf, uint32_t len)
+{
+   return s->transport.write(s->transport.ctx, buf, len);
+}
+
+// chunks of one or more frames in one write, gathered into one buffer for transports that take only that
+static uint32_t Port_Write_Chunks(stm32bl_session_t *s, const stm32bl_chunk_t *chunks, uint32_t count)
+{
+   uint32_t len = 0;
+
+   if (s->transport.write_chunks)
+   {
+      return s->transport.write_chunks(s->transport.ctx, chunks, count);
+   }
+
+   for (uint32_t i = 0; i < count && len + chunks[i].len <= sizeof(s->stream); i++)
+   {
+      memcpy(&s->stream[len], chunks[i].data, chunks[i].len);
+      len += chunks[i].len;
+   }
+
+   return Port_Write(s, s->stream, len);
+}
+
+static uint32_t Port_Read(stm32bl_session_t *s, uint8_t *buf, uint32_t len)
+{
+   return s->transport.read(s->transport.ctx, buf, len);
+}
+
+static void Port_Timeout(stm32bl_session_t *s, uint32_t timeout)
+{
+   s->transport.timeout(s->transport.ctx, timeout);
+}
+
+static void stm32_log(stm32bl_session_t *s, const char *format, ...)
+{
+   char line[256];
+   va_list args;
+
+   if (s->log == NULL)
+   {
+      return;
+   }
+
+   va_start(args, format);
+   vsnprintf(line, sizeof(line), format, args);
+   va_end(args);
+
+   s->log(s->user, line);
+}
+
+// bytes done of operation, 1 once callback asks to stop
+static uint8_t stm32_progress(stm32bl_session_t *s, const char *operation, uint32_t done, uint32_t total)
+{
+   return s->progress && s->progress(s->user, operation, done, total) != 0;
+}
+
+/*Maxim APPLICATION NOTE 27 */
+static const uint8_t CRC8_Table[] =
+    {
+        0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83, 0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41,
+        0x9D, 0xC3, 0x21, 0x7F, 0xFC, 0xA2, 0x40, 0x1E, 0x5F, 0x01, 0xE3, 0xBD, 0x3E, 0x60, 0x82, 0xDC,
+        0x23, 0x7D, 0x9F, 0xC1, 0x42, 0x1C, 0xFE, 0xA0, 0xE1, 0xBF, 0x5D, 0x03, 0x80, 0xDE, 0x3C, 0x62,
+        0xBE, 0xE0, 0x02, 0x5C, 0xDF, 0x81, 0x63, 0x3D, 0x7C, 0x22, 0xC0, 0x9E, 0x1D, 0x43, 0xA1, 0xFF,
+        0x46, 0x18, 0xFA, 0xA4, 0x27, 0x79, 0x9B, 0xC5, 0x84, 0xDA, 0x38, 0x66, 0xE5, 0xBB, 0x59, 0x07,
+        0xDB, 0x85, 0x67, 0x39, 0xBA, 0xE4, 0x06, 0x58, 0x19, 0x47, 0xA5, 0xFB, 0x78, 0x26, 0xC4, 0x9A,
+        0x65, 0x3B, 0xD9, 0x87, 0x04, 0x5A, 0xB8, 0xE6, 0xA7, 0xF9, 0x1B, 0x45, 0xC6, 0x98, 0x7A, 0x24,
+        0xF8, 0xA6, 0x44, 0x1A, 0x99, 0xC7, 0x25, 0x7B, 0x3A, 0x64, 0x86, 0xD8, 0x5B, 0x05, 0xE7, 0xB9,
+        0x8C, 0xD2, 0x30, 0x6E, 0xED, 0xB3, 0x51, 0x0F, 0x4E, 0x10, 0xF2, 0xAC, 0x2F, 0x71, 0x93, 0xCD,
+        0x11, 0x4F, 0xAD, 0xF3, 0x70, 0x2E, 0xCC, 0x92, 0xD3, 0x8D, 0x6F, 0x31, 0xB2, 0xEC, 0x0E, 0x50,
+        0xAF, 0xF1, 0x13, 0x4D, 0xCE, 0x90, 0x72, 0x2C, 0x6D, 0x33, 0xD1, 0x8F, 0x0C, 0x52, 0xB0, 0xEE,
+        0x32, 0x6C, 0x8E, 0xD0, 0x53, 0x0D, 0xEF, 0xB1, 0xF0, 0xAE, 0x4C, 0x12, 0x91, 0xCF, 0x2D, 0x73,
+        0xCA, 0x94, 0x76, 0x28, 0xAB, 0xF5, 0x17, 0x49, 0x08, 0x56, 0xB4, 0xEA, 0x69, 0x37, 0xD5, 0x8B,
+        0x57, 0x09, 0xEB, 0xB5, 0x36, 0x68, 0x8A, 0xD4, 0x95, 0xCB, 0x29, 0x77, 0xF4, 0xAA, 0x48, 0x16,
+        0xE9, 0xB7, 0x55, 0x0B, 0x88, 0xD6, 0x34, 0x6A, 0x2B, 0x75, 0x97, 0xC9, 0x4A, 0x14, 0xF6, 0xA8,
+        0x74, 0x2A, 0xC8, 0x96, 0x15, 0x4B, 0xA9, 0xF7, 0xB6, 0xE8, 0x0A, 0x54, 0xD7, 0x89, 0x6B, 0x35};
+
+// crc8 carried on from crc of data ahead
+static uint8_t CRC8_Next(uint8_t crc, const uint8_t *data, uint32_t len)
+{
+   for (uint32_t i = 0; i < len; i++)
+   {
+      crc = CRC8_Table[crc ^ data[i]];
+   }
+
+   return crc;
+}
+
+static uint8_t CRC8(const uint8_t *data, uint32_t len)
+{
+   return CRC8_Next(0, data, len);
+}
+
+// same crc32 as stm32 crc unit fed with flash words
+static uint32_t CRC32(const uint8_t *data, uint32_t len)
+{
+   uint32_t crc = 0xFFFFFFFF;
+
+   for (uint32_t i = 0; i < len; i += 4)
+   {
+      uint8_t word[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+      memcpy(word, &data[i], (len - i < 4) ? (len - i) : 4);
+
+      crc ^= word[3] << 24 | word[2] << 16 | word[1] << 8 | word[0];
+
+      for (uint32_t bit = 0; bit < 32; bit++)
+      {
+         crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+      }
+   }
+
+   return crc;
+}
+
+// lz4 length above 15 continues in bytes of 255
+static uint32_t LZ4_Put_Len(uint8_t *dst, uint32_t len)
+{
+   uint32_t count = 0;
+
+   for (len -= 15; len >= 255; len -= 255)
+   {
+      dst[count++] = 255;
+   }
+   dst[count++] = len;
+
+   return count;
+}
+
+static uint32_t LZ4_Put_Sequence(uint8_t *dst, const uint8_t *literals, uint32_t literal_len, uint32_t offset, uint32_t match_len)
+{
+   uint32_t count = 0;
+   uint8_t *token = &dst[count++];
+
+   *token = ((literal_len < 15) ? literal_len : 15) << 4;
+   if (literal_len >= 15)
+   {
+      count += LZ4_Put_Len(&dst[count], literal_len);
+   }
+
+   memcpy(&dst[count], literals, literal_len);
+   count += literal_len;
+
+   // last sequence has literals only
+   if (match_len)
+   {
+      dst[count++] = offset & 0xFF;
+      dst[count++] = offset >> 8;
+
+      *token |= (match_len - 4 < 15) ? (match_len - 4) : 15;
+      if (match_len - 4 >= 15)
+      {
+         count += LZ4_Put_Len(&dst[count], match_len - 4);
+      }
+   }
+
+   return count;
+}
+
+// greedy lz4 block compression, dst holds len + len / 255 + 16 bytes
+static uint32_t LZ4_Compress(const uint8_t *src, uint32_t len, uint8_t *dst)
+{
+   uint32_t table[4096] = {0}; // position + 1 of last 4-byte sequence with same hash
+   uint32_t in = 0;
+   uint32_t anchor = 0;
+   uint32_t count = 0;
+
+   // lz4 ends with at least 5 literals, last match starts 12 bytes before end
+   while (len >= 13 && in < len - 12)
+   {
+      uint32_t sequence;
+      memcpy(&sequence, &src[in], 4);
+
+      uint32_t hash = (sequence * 2654435761U) >> 20;
+      uint32_t ref = table[hash];
+      table[hash] = in + 1;
+
+      if (ref && in - (ref - 1) <= 0xFFFF && memcmp(&src[ref - 1], &src[in], 4) == 0)
+      {
+         uint32_t match_len = 4;
+
+         while (in + match_len < len - 5 && src[ref - 1 + match_len] == src[in + match_len])
+         {
+            match_len++;
+         }
+
+         count += LZ4_Put_Sequence(&dst[count], &src[anchor], in - anchor, in - (ref - 1), match_len);
+         in += match_len;
+         anchor = in;
+      }
+      else
+      {
+         in++;
+      }
+   }
+
+   count += LZ4_Put_Sequence(&dst[count], &src[anchor], len - anchor, 0, 0);
+
+   return count;
+}
+
+// sync char and no of chars in bl_packet ahead of it, returns header len
+static uint32_t stm32_frame_header(stm32bl_session_t *s, uint8_t *header, uint32_t len)
+{
+   header[0] = SYNC_CHAR;
+
+   // 2 bytes in v2
+   if (s->frame_version == FRAME_V2)
+   {
+      header[1] = (len >> 8 & 0xFF);
+      header[2] = (len & 0xFF);
+      return 3;
+   }
+
+   header[1] = len;
+   return 2;
+}
+
+static void stm32_send_packet(stm32bl_session_t *s, uint8_t *bl_packet, uint32_t len)
+{
+   uint8_t header[3];
+
+   // sync char, frame len and bl_packet in one write
+   stm32bl_chunk_t chunks[2] = {{header, stm32_frame_header(s, header, len)}, {bl_packet, len}};
+
+   Port_Write_Chunks(s, chunks, 2);
+}
+
+// cmd, len, seq, flags, address and v2 len ahead of payload, returns no of bytes
+static uint32_t stm32_frame_fields(stm32bl_session_t *s, uint8_t *bl_packet, uint8_t cmd, uint8_t seq, uint8_t flags, uint32_t address, uint32_t len)
+{
+   uint32_t bl_packet_index = 0;
+
+   // assemble cmd
+   bl_packet[bl_packet_index++] = cmd;
+
+   // no of char to write or read, moved after address in v2
+   bl_packet[bl_packet_index++] = (s->frame_version == FRAME_V2) ? 0x00 : len;
+
+   // seq and flags, 0x00 padding for stm32 word alignment if not used
+   bl_packet[bl_packet_index++] = seq;
+   bl_packet[bl_packet_index++] = flags;
+
+   // assemble address
+   bl_packet[bl_packet_index++] = (address >> 24 & 0xFF);
+   bl_packet[bl_packet_index++] = (address >> 16 & 0xFF);
+   bl_packet[bl_packet_index++] = (address >> 8 & 0xFF);
+   bl_packet[bl_packet_index++] = (address & 0xFF);
+
+   if (s->frame_version == FRAME_V2)
+   {
+      bl_packet[bl_packet_index++] = (len >> 24 & 0xFF);
+      bl_packet[bl_packet_index++] = (len >> 16 & 0xFF);
+      bl_packet[bl_packet_index++] = (len >> 8 & 0xFF);
+      bl_packet[bl_packet_index++] = (len & 0xFF);
+   }
+
+   return bl_packet_index;
+}
+
+static uint32_t stm32_assemble_frame(stm32bl_session_t *s, uint8_t *bl_packet, uint8_t cmd, uint8_t seq, uint8_t flags,
+                                     uint32_t address, uint32_t len, const uint8_t *payload, uint32_t payload_len)
+{
+   uint32_t bl_packet_index = stm32_frame_fields(s, bl_packet, cmd, seq, flags, address, len);
+
+   // assemble payload
+   if (payload_len)
+   {
+      memcpy(&bl_packet[bl_packet_index], payload, payload_len);
+      bl_packet_index += payload_len;
+   }
+
+   // calculate crc
+   uint8_t crc = CRC8(bl_packet, bl_packet_index);
+
+   // assemble crc
+   bl_packet[bl_packet_index++] = crc;
+
+   return bl_packet_index;
+}
+
+// frame with payload left where it is, chunks point into frame and payload
+// with WRITE_FLAG_END image_end follows payload
+static void stm32_frame_end(stm32bl_session_t *s, stm32_frame_t *frame, uint8_t cmd, uint8_t seq, uint8_t flags,
+                            uint32_t address, uint32_t len, const uint8_t *payload, uint32_t payload_len, uint32_t image_end)
+{
+   uint8_t fields[12];
+   uint32_t fields_len = stm32_frame_fields(s, fields, cmd, seq, flags, address, len);
+   uint32_t tail_len = (flags & WRITE_FLAG_END) ? 4 : 0;
+   uint32_t header_len = stm32_frame_header(s, frame->head, fields_len + payload_len + tail_len + 1);
+
+   memcpy(&frame->head[header_len], fields, fields_len);
+
+   frame->tail[0] = (image_end >> 24 & 0xFF);
+   frame->tail[1] = (image_end >> 16 & 0xFF);
+   frame->tail[2] = (image_end >> 8 & 0xFF);
+   frame->tail[3] = (image_end & 0xFF);
+   frame->tail[tail_len] = CRC8_Next(CRC8_Next(CRC8(fields, fields_len), payload, payload_len), frame->tail, tail_len);
+
+   frame->chunk[0] = (stm32bl_chunk_t){frame->head, header_len + fields_len};
+   frame->chunk[1] = (stm32bl_chunk_t){payload, payload_len};
+   frame->chunk[2] = (stm32bl_chunk_t){frame->tail, tail_len + 1};
+}
+
+static void stm32_frame(stm32bl_session_t *s, stm32_frame_t *frame, uint8_t cmd, uint8_t seq, uint8_t flags,
+                        uint32_t address, uint32_t len, const uint8_t *payload, uint32_t payload_len)
+{
+   stm32_frame_end(s, frame, cmd, seq, flags, address, len, payload, payload_len, 0);
+}
+
+// up to WINDOW_SIZE frames in one write
+static void stm32_send_frames(stm32bl_session_t *s, stm32_frame_t *frames, uint32_t count)
+{
+   stm32bl_chunk_t chunks[3 * WINDOW_SIZE];
+   uint32_t chunk_count = 0;
+
+   for (uint32_t i = 0; i < count && i < WINDOW_SIZE; i++)
+   {
+      for (uint32_t k = 0; k < 3; k++)
+      {
+         if (frames[i].chunk[k].len)
+         {
+            chunks[chunk_count++] = frames[i].chunk[k];
+         }
+      }
+   }
+
+   Port_Write_Chunks(s, chunks, chunk_count);
+}
+
+// frame gathered into one buffer after sync char and frame len, returns no of bytes
+static uint32_t stm32_frame_stream(const stm32_frame_t *frame, uint8_t *stream)
+{
+   uint32_t len = 0;
+
+   for (uint32_t k = 0; k < 3; k++)
+   {
+      if (frame->chunk[k].len)
+      {
+         memcpy(&stream[len], frame->chunk[k].data, frame->chunk[k].len);
+         len += frame->chunk[k].len;
+      }
+   }
+
+   return len;
+}
+
+// whole file mapped read only, frames are sent straight out of it
+// returns NULL if it can not be read or is empty
+static const uint8_t *stm32_map_file(const char *input_file, uint32_t *size)
+{
+   uint8_t *data = NULL;
+
+#ifdef __linux__
+   struct stat st;
+   int fd = open(input_file, O_RDONLY);
+
+   if (fd == -1)
+   {
+      return NULL;
+   }
+
+   if (fstat(fd, &st) == 0 && st.st_size > 0)
+   {
+      data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+      if (data == MAP_FAILED)
+      {
+         data = NULL;
+      }
+      else
+      {
+         madvise(data, st.st_size, MADV_SEQUENTIAL);
+         *size = st.st_size;
+      }
+   }
+
+   close(fd);
+#else
+   FILE *fp = fopen(input_file, "rb");
+
+   if (fp == NULL)
+   {
+      return NULL;
+   }
+
+   fseek(fp, 0L, SEEK_END);
+   *size = ftell(fp);
+   rewind(fp);
+
+   data = (*size > 0) ? malloc(*size) : NULL;
+
+   if (data && fread(data, 1, *size, fp) != *size)
+   {
+      free(data);
+      data = NULL;
+   }
+
+   fclose(fp);
+#endif
+
+   return data;
+}
+
+static void stm32_unmap_file(const uint8_t *data, uint32_t size)
+{
+#ifdef __linux__
+   munmap((void *)data, size);
+#else
+   free((void *)data);
+#endif
+}
+
+static void stm32_send_cmd(stm32bl_session_t *s, uint8_t cmd)
+{
+   uint8_t bl_packet[2];
+
+   bl_packet[0] = cmd;
+   bl_packet[1] = CRC8(bl_packet, 1);
+
+   stm32_send_packet(s, bl_packet, 2);
+}
+
+static uint32_t stm32_read_bytes(stm32bl_session_t *s, uint8_t *buf, uint32_t len)
+{
+   uint32_t count = 0;
+
+   while (count < len)
+   {
+      uint32_t rx_count = Port_Read(s, buf + count, len - count);
+
+      if (rx_count == 0 || rx_count > len - count)
+      {
+         break;
+      }
+
+      count += rx_count;
+   }
+
+   return count;
+}
+
+static uint8_t stm32_read_ack(stm32bl_session_t *s)
+{
+   uint8_t rx_char = 0;
+   stm32_read_bytes(s, &rx_char, 1);
+
+   return (rx_char == CMD_ACK);
+}
+
+static uint8_t stm32_read_write_ack(stm32bl_session_t *s, uint32_t *error_address)
+{
+   uint8_t response[6] = {0};
+   stm32_read_bytes(s, response, 1);
+
+   // deferred write error, [ERROR + 4-byte address + crc]
+   if (response[0] == CMD_ERROR)
+   {
+      if (stm32_read_bytes(s, &response[1], 5) == 5 && CRC8(&response[1], 4) == response[5])
+      {
+         *error_address = response[1] << 24 | response[2] << 16 | response[3] << 8 | response[4];
+      }
+   }
+
+   return response[0];
+}
+
+static uint32_t stm32_get_u32(const uint8_t *buf)
+{
+   return buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+static void stm32_put_u32(uint8_t *buf, uint32_t value)
+{
+   buf[0] = (value >> 24 & 0xFF);
+   buf[1] = (value >> 16 & 0xFF);
+   buf[2] = (value >> 8 & 0xFF);
+   buf[3] = (value & 0xFF);
+}
+
+// CMD_CONNECT used for auto baud detection on stm32, returns 1 once acked
+static uint8_t stm32_connect(stm32bl_session_t *s)
+{
+   uint8_t temp = CMD_CONNECT;
+   uint8_t retry = 10;
+
+   while (retry--)
+   {
+      Port_Write(s, &temp, 1);
+
+      if (stm32_read_ack(s))
+      {
+         return 1;
+      }
+
+      uint64_t delay = Serial_Port_Millis();
+      while (Serial_Port_Millis() - delay < 100)
+         ;
+   }
+
+   return 0;
+}
+
+static void stm32_write_flags(stm32bl_session_t *s)
+{
+   s->write_flags = 0x00;
+
+   if (s->capabilities & CAP_DEFER_WRITE)
+   {
+      s->write_flags |= WRITE_FLAG_DEFER;
+   }
+
+   if (s->capabilities & CAP_LAZY_ERASE)
+   {
+      s->write_flags |= WRITE_FLAG_ERASE;
+   }
+}
+
+// device layout and capabilities from CMD_GET_INFO reply, configures transfers from them
+// returns 0 and leaves defaults if region or baud list runs past reply or app area is empty
+static uint8_t stm32_parse_info(stm32bl_session_t *s, const uint8_t *info, uint32_t info_len)
+{
+   char line[256];
+   uint32_t line_len = 0;
+
+   // version, ids, layout, payload, window and caps, then region count
+   uint32_t need = 1 + 4 + 12 + 21 + 1;
+
+   if (info_len < need)
+   {
+      return 0;
+   }
+
+   // regions of 4-byte size + 2-byte count, then baud count
+   need += info[need - 1] * 6 + 1;
+
+   if (info_len < need)
+   {
+      return 0;
+   }
+
+   // 4-byte bauds
+   need += info[need - 1] * 4;
+
+   if (info_len < need || stm32_get_u32(&info[1 + 4 + 12 + 8]) <= stm32_get_u32(&info[1 + 4 + 12 + 4]))
+   {
+      return 0;
+   }
+
+   stm32bl_info_t *device = &s->info;
+   uint32_t index = 1; // skip info version
+
+   device->device_id = stm32_get_u32(&info[index]);
+   index += 4;
+
+   for (uint32_t i = 0; i < 3; i++)
+   {
+      device->unique_id[i] = stm32_get_u32(&info[index + i * 4]);
+   }
+   index += 12;
+
+   stm32_log(s, "device id 0X%03x rev 0X%04x", device->device_id & 0xFFF, device->device_id >> 16);
+   stm32_log(s, "unique id %08X%08X%08X", device->unique_id[0], device->unique_id[1], device->unique_id[2]);
+
+   device->flash_total = stm32_get_u32(&info[index]);
+   device->app_start = stm32_get_u32(&info[index + 4]);
+   device->app_end = stm32_get_u32(&info[index + 8]);
+   uint32_t payload = stm32_get_u32(&info[index + 12]);
+   uint32_t device_window = info[index + 16];
+   s->capabilities = stm32_get_u32(&info[index + 17]);
+   index += 21;
+
+   stm32_log(s, "flash %ukB, app 0X%08x-0X%08x, max payload %u, window %u, capabilities 0X%04x",
+             device->flash_total / 1024, device->app_start, device->app_end, payload, device_window, s->capabilities);
+
+   uint32_t region_count = info[index++];
+
+   device->region_count = (region_count < STM32BL_MAX_REGIONS) ? region_count : STM32BL_MAX_REGIONS;
+
+   for (uint32_t i = 0; i < region_count; i++)
+   {
+      if (i < STM32BL_MAX_REGIONS)
+      {
+         device->unit_size[i] = stm32_get_u32(&info[index]);
+         device->unit_count[i] = info[index + 4] << 8 | info[index + 5];
+      }
+
+      line_len += snprintf(&line[line_len], sizeof(line) - line_len, "%u x %ukB ",
+                           info[index + 4] << 8 | info[index + 5], stm32_get_u32(&info[index]) / 1024);
+      index += 6;
+
+      if (line_len >= sizeof(line))
+      {
+         line_len = sizeof(line) - 1;
+      }
+   }
+   stm32_log(s, "%spages or sectors", line);
+
+   uint32_t baud_count = info[index++];
+   uint8_t baud_ok = 0;
+
+   device->baud_count = (baud_count < STM32BL_MAX_BAUDS) ? baud_count : STM32BL_MAX_BAUDS;
+   line_len = snprintf(line, sizeof(line), "baud rates");
+
+   for (uint32_t i = 0; i < baud_count; i++)
+   {
+      uint32_t baud = stm32_get_u32(&info[index]);
+
+      if (i < STM32BL_MAX_BAUDS)
+      {
+         device->baud[i] = baud;
+      }
+
+      baud_ok |= (baud == s->transport.baud);
+      line_len += snprintf(&line[line_len], sizeof(line) - line_len, " %u", baud);
+      index += 4;
+
+      if (line_len >= sizeof(line))
+      {
+         line_len = sizeof(line) - 1;
+      }
+   }
+   stm32_log(s, "%s", line);
+
+   // uart baud list, spi sck and can bitrate are not reported
+   if (!baud_ok && s->transport.baud)
+   {
+      stm32_log(s, "baud %u not reported by device", s->transport.baud);
+   }
+
+   // configure transfers from device layout and capabilities
+   s->user_app_address = device->app_start;
+   s->flash_size = device->app_end - device->app_start;
+   s->window_size = (device_window < WINDOW_SIZE) ? device_window : WINDOW_SIZE;
+   stm32_write_flags(s);
+
+   return 1;
+}
+
+static uint8_t stm32_get_info(stm32bl_session_t *s)
+{
+   uint8_t response[3] = {0};
+   uint8_t info[INFO_SIZE];
+
+   stm32_send_cmd(s, CMD_GET_INFO);
+
+   // [ACK + 2-byte info len + info + crc], old bootloader ignores cmd
+   if (stm32_read_bytes(s, response, 3) != 3 || response[0] != CMD_ACK)
+   {
+      stm32_log(s, "device info not supported, using defaults");
+      return 0;
+   }
+
+   uint32_t info_len = response[1] << 8 | response[2];
+
+   if (info_len + 1 > sizeof(info) || stm32_read_bytes(s, info, info_len + 1) != info_len + 1 ||
+       CRC8(info, info_len) != info[info_len])
+   {
+      stm32_log(s, "device info crc mismatch, using defaults");
+      return 0;
+   }
+
+   if (!stm32_parse_info(s, info, info_len))
+   {
+      stm32_log(s, "device info malformed, using defaults");
+      return 0;
+   }
+
+   return 1;
+}
+
+// [ACK + version + 2-byte max payload + crc], old bootloader ignores cmd
+static void stm32_frame_format_reply(stm32bl_session_t *s, uint8_t version, const uint8_t *response, uint32_t count)
+{
+   if (count == 5 && response[0] == CMD_ACK && response[1] == version && CRC8(&response[1], 3) == response[4])
+   {
+      uint32_t payload = response[2] << 8 | response[3];
+
+      s->frame_version = version;
+      s->max_payload = (payload < MAX_PAYLOAD) ? payload : MAX_PAYLOAD;
+   }
+
+   stm32_log(s, "frame format v%u, %u bytes per frame", s->frame_version, s->max_payload);
+}
+
+static void stm32_frame_format_request(stm32bl_session_t *s, uint8_t version)
+{
+   uint8_t bl_packet[3];
+
+   bl_packet[0] = CMD_FRAME_FORMAT;
+   bl_packet[1] = version;
+   bl_packet[2] = CRC8(bl_packet, 2);
+
+   stm32_send_packet(s, bl_packet, 3);
+}
+
+static void stm32_frame_format(stm32bl_session_t *s, uint8_t version)
+{
+   uint8_t response[5];
+
+   stm32_frame_format_request(s, version);
+
+   stm32_frame_format_reply(s, version, response, stm32_read_bytes(s, response, 5));
+}
+
+// response to CMD_ERASE_RANGE, 0 if bootloader does not answer
+static uint8_t stm32_erase_span(stm32bl_session_t *s, uint32_t address, uint32_t len)
+{
+   uint8_t bl_packet[32];
+   uint8_t erase_len[4];
+   uint8_t rx_char = 0;
+
+   stm32_put_u32(erase_len, len);
+
+   Port_Timeout(s, 10000);
+
+   uint32_t bl_packet_index = stm32_assemble_frame(s, bl_packet, CMD_ERASE_RANGE, 0x00, 0x00, address, 4, erase_len, 4);
+
+   stm32_send_packet(s, bl_packet, bl_packet_index);
+
+   stm32_read_bytes(s, &rx_char, 1);
+
+   Port_Timeout(s, 100);
+
+   return rx_char;
+}
+
+static uint8_t stm32_page_hash(stm32bl_session_t *s, uint32_t address, uint32_t len, uint32_t *hashes, uint32_t *count)
+{
+   uint8_t bl_packet[32];
+   uint8_t hash_len[4];
+   uint8_t response[3 + MAX_UNITS * 4 + 1] = {0};
+
+   stm32_put_u32(hash_len, len);
+
+   uint32_t bl_packet_index = stm32_assemble_frame(s, bl_packet, CMD_PAGE_HASH, 0x00, 0x00, address, 4, hash_len, 4);
+
+   // crc unit hashes whole flash in a few ms
+   Port_Timeout(s, 1000);
+
+   stm32_send_packet(s, bl_packet, bl_packet_index);
+
+   // [ACK + 2-byte count + count * 4-byte crc32 + crc]
+   uint8_t status = 0;
+
+   if (stm32_read_bytes(s, response, 3) == 3 && response[0] == CMD_ACK)
+   {
+      *count = response[1] << 8 | response[2];
+
+      if (*count <= MAX_UNITS && stm32_read_bytes(s, &response[3], *count * 4 + 1) == *count * 4 + 1 &&
+          CRC8(&response[1], 2 + *count * 4) == response[3 + *count * 4])
+      {
+         for (uint32_t i = 0; i < *count; i++)
+         {
+            hashes[i] = stm32_get_u32(&response[3 + i * 4]);
+         }
+
+         status = 1;
+      }
+   }
+
+   Port_Timeout(s, 100);
+
+   return status;
+}
+
+static void stm32_checksum_request(stm32bl_session_t *s, uint32_t address, uint32_t len)
+{
+   uint8_t bl_packet[32];
+   uint8_t crc_len[4];
+
+   stm32_put_u32(crc_len, len);
+
+   uint32_t bl_packet_index = stm32_assemble_frame(s, bl_packet, CMD_CHECKSUM, 0x00, 0x00, address, 4, crc_len, 4);
+
+   stm32_send_packet(s, bl_packet, bl_packet_index);
+}
+
+// [ACK + 4-byte crc32 + crc]
+static uint8_t stm32_checksum_reply(const uint8_t *response, uint32_t count, uint32_t *crc)
+{
+   if (count != 6 || response[0] != CMD_ACK || CRC8(&response[1], 4) != response[5])
+   {
+      return 0;
+   }
+
+   *crc = stm32_get_u32(&response[1]);
+
+   return 1;
+}
+
+static uint8_t stm32_checksum(stm32bl_session_t *s, uint32_t address, uint32_t len, uint32_t *crc)
+{
+   uint8_t response[6] = {0};
+
+   // crc unit takes a few ms per 100kB
+   Port_Timeout(s, 1000);
+
+   stm32_checksum_request(s, address, len);
+
+   uint32_t count = stm32_read_bytes(s, response, 6);
+
+   Port_Timeout(s, 100);
+
+   return stm32_checksum_reply(response, count, crc);
+}
+
+// image end for frame at offset into image, sent on first frame of a lazily erased write so
+// bootloader erases ahead up to it, 0 if not sent
+static uint32_t stm32_image_end(stm32bl_session_t *s, uint8_t flags, uint32_t offset, uint32_t end)
+{
+   return (offset == 0 && (flags & WRITE_FLAG_ERASE) && (s->capabilities & CAP_IMAGE_END)) ? end : 0;
+}
+
+// write frame for block, lz4 compressed into lz4_block if bootloader takes it and it comes out smaller
+// image_end goes with it unless 0, adds bytes put in frame to sent_bytes
+static void stm32_write_frame(stm32bl_session_t *s, stm32_frame_t *frame, uint8_t *lz4_block, uint8_t flags, uint32_t address,
+                              const uint8_t *block, uint32_t len, uint32_t image_end, uint32_t *sent_bytes)
+{
+   uint32_t lz4_len = 0;
+
+   if (image_end)
+   {
+      flags |= WRITE_FLAG_END;
+   }
+
+   if (s->capabilities & CAP_COMPRESSED)
+   {
+      // 4-byte no of bytes to write + lz4 block
+      stm32_put_u32(lz4_block, len);
+      lz4_len = 4 + LZ4_Compress(block, len, &lz4_block[4]);
+   }
+
+   // payload straight from image, acked before it is programmed and erased on first write if supported
+   if (lz4_len && lz4_len < len)
+   {
+      *sent_bytes += lz4_len;
+      stm32_frame_end(s, frame, CMD_WRITE_COMPRESSED, 0x00, flags, address, lz4_len, lz4_block, lz4_len, image_end);
+      return;
+   }
+
+   *sent_bytes += len;
+   stm32_frame_end(s, frame, CMD_WRITE, 0x00, flags, address, len, block, len, image_end);
+}
+
+// writes data in frames from address, progress runs from done to done + len of total
+static int stm32_write_data(stm32bl_session_t *s, uint32_t address, const uint8_t *data, uint32_t len, uint8_t flags,
+                            uint32_t done, uint32_t total)
+{
+   stm32_frame_t frame;
+   uint8_t lz4_block[LZ4_BLOCK_SIZE];
+
+   uint32_t stm32_app_address = address;
+   uint32_t remaining_bytes = len;
+   uint32_t write_block_size = s->max_payload;
+   uint32_t sent_bytes = 0;
+   uint8_t response = CMD_ACK;
+   int status = STM32BL_OK;
+
+   // ack can wait for a sector erase
+   Port_Timeout(s, 10000);
+
+   while (remaining_bytes > 0)
+   {
+      if (remaining_bytes < write_block_size)
+      {
+         write_block_size = remaining_bytes;
+      }
+
+      uint32_t image_end = stm32_image_end(s, flags, len - remaining_bytes, address + len);
+
+      stm32_write_frame(s, &frame, lz4_block, flags, stm32_app_address, &data[len - remaining_bytes], write_block_size, image_end, &sent_bytes);
+
+      stm32_send_frames(s, &frame, 1);
+
+      // deferred write error carries address of failed frame
+      s->error_address = stm32_app_address;
+      response = stm32_read_write_ack(s, &s->error_address);
+
+      if (response != CMD_ACK)
+      {
+         status = STM32BL_ERR_WRITE;
+         break;
+      }
+
+      remaining_bytes -= write_block_size;
+      stm32_app_address += write_block_size;
+
+      if (stm32_progress(s, "write", done + len - remaining_bytes, total))
+      {
+         status = STM32BL_ERR_CANCELLED;
+         break;
+      }
+   }
+
+   if (status == STM32BL_OK && (flags & WRITE_FLAG_DEFER))
+   {
+      // frame with no payload collects status of last frame
+      stm32_frame(s, &frame, CMD_WRITE, 0x00, flags, stm32_app_address, 0, NULL, 0);
+
+      stm32_send_frames(s, &frame, 1);
+
+      s->error_address = stm32_app_address;
+
+      if (stm32_read_write_ack(s, &s->error_address) != CMD_ACK)
+      {
+         status = STM32BL_ERR_WRITE;
+      }
+   }
+
+   Port_Timeout(s, 100);
+
+   if (s->capabilities & CAP_COMPRESSED)
+   {
+      stm32_log(s, "sent %u of %u bytes compressed", sent_bytes, len - remaining_bytes);
+   }
+
+   return status;
+}
+
+// erases and writes only pages or sectors whose crc32 differs from image
+static int stm32_write_diff(stm32bl_session_t *s, const uint8_t *data, uint32_t len)
+{
+   uint32_t count = 0;
+
+   if (stm32_page_hash(s, s->user_app_address, len, s->hashes, &count) == 0)
+   {
+      stm32_log(s, "page hash error");
+      return STM32BL_ERR_NACK;
+   }
+
+   // unit image is padded with erased value up to unit end
+   uint8_t *unit_image = malloc(s->flash_size);
+
+   if (unit_image == NULL)
+   {
+      return STM32BL_ERR_MEMORY;
+   }
+
+   uint32_t unit_address = s->info.app_end - s->info.flash_total;
+   uint32_t unit = 0;
+   uint32_t changed = 0;
+   int status = STM32BL_OK;
+
+   for (uint32_t r = 0; r < s->info.region_count && status == STM32BL_OK; r++)
+   {
+      for (uint32_t i = 0; i < s->info.unit_count[r] && status == STM32BL_OK; i++)
+      {
+         uint32_t unit_size = s->info.unit_size[r];
+         uint32_t unit_end = unit_address + unit_size;
+
+         if (unit_end > s->user_app_address && unit_address < s->user_app_address + len && unit < count)
+         {
+            uint32_t offset = unit_address - s->user_app_address;
+            uint32_t data_len = (len - offset < unit_size) ? (len - offset) : unit_size;
+
+            memset(unit_image, 0xFF, unit_size);
+            memcpy(unit_image, &data[offset], data_len);
+
+            if (CRC32(unit_image, unit_size) != s->hashes[unit])
+            {
+               stm32_log(s, "rewriting 0X%08x, %u bytes", unit_address, data_len);
+               changed++;
+
+               // erase changed unit only, lazy erase would erase ahead into unchanged ones
+               if (stm32_erase_span(s, unit_address, unit_size) != CMD_ACK)
+               {
+                  s->error_address = unit_address;
+                  status = STM32BL_ERR_ERASE;
+               }
+               else
+               {
+                  status = stm32_write_data(s, unit_address, &data[offset], data_len, s->write_flags & ~WRITE_FLAG_ERASE, offset, len);
+               }
+            }
+            else if (stm32_progress(s, "write", offset + data_len, len))
+            {
+               status = STM32BL_ERR_CANCELLED;
+            }
+
+            unit++;
+         }
+
+         unit_address = unit_end;
+      }
+   }
+
+   free(unit_image);
+
+   if (status == STM32BL_OK)
+   {
+      stm32_log(s, "%u of %u pages or sectors changed", changed, count);
+   }
+
+   return status;
+}
+
+stm32bl_session_t *stm32bl_session_new(const stm32bl_transport_t *transport)
+{
+   if (transport == NULL || transport->write == NULL || transport->read == NULL || transport->timeout == NULL)
+   {
+      return NULL;
+   }
+
+   stm32bl_session_t *s = calloc(1, sizeof(stm32bl_session_t));
+
+   if (s == NULL)
+   {
+      return NULL;
+   }
+
+   s->transport = *transport;
+   s->frame_version = FRAME_V1;
+   s->max_payload = V1_PAYLOAD;
+   s->user_app_address = USER_APP_ADDRESS;
+   s->flash_size = FLASH_SIZE;
+   s->window_size = WINDOW_SIZE;
+   s->info.app_start = USER_APP_ADDRESS;
+   s->info.app_end = USER_APP_ADDRESS + FLASH_SIZE;
+
+   return s;
+}
+
+stm32bl_session_t *stm32bl_session_open(const char *port, uint32_t baud)
+{
+   stm32bl_transport_t transport;
+
+   if (stm32bl_port_transport(&transport, port, baud) != STM32BL_OK)
+   {
+      return NULL;
+   }
+
+   stm32bl_session_t *s = stm32bl_session_new(&transport);
+
+   if (s == NULL && transport.close)
+   {
+      transport.close(transport.ctx);
+   }
+
+   return s;
+}
+
+void stm32bl_session_close(stm32bl_session_t *s)
+{
+   if (s == NULL)
+   {
+      return;
+   }
+
+   if (s->transport.close)
+   {
+      s->transport.close(s->transport.ctx);
+   }
+
+   free(s);
+}
+
+void stm32bl_set_callbacks(stm32bl_session_t *s, stm32bl_progress_fn progress, stm32bl_log_fn log, void *user)
+{
+   s->progress = progress;
+   s->log = log;
+   s->user = user;
+}
+
+const char *stm32bl_strerror(int status)
+{
+   if (status < 0 || status >= (int)(sizeof(stm32bl_errors) / sizeof(stm32bl_errors[0])))
+   {
+      return "unknown error";
+   }
+
+   return stm32bl_errors[status];
+}
+
+uint32_t stm32bl_error_address(stm32bl_session_t *s)
+{
+   return s->error_address;
+}
+
+int stm32bl_connect(stm32bl_session_t *s)
+{
+   if (!stm32_connect(s))
+   {
+      return STM32BL_ERR_CONNECT;
+   }
+
+   // flash layout and capabilities, then large frames if bootloader supports them
+   if (stm32_get_info(s) && (s->capabilities & CAP_FRAME_V2))
+   {
+      stm32_frame_format(s, FRAME_V2);
+   }
+
+   return STM32BL_OK;
+}
+
+int stm32bl_info(stm32bl_session_t *s, stm32bl_info_t *info)
+{
+   *info = s->info;
+
+   // as used by session, defaults for old bootloader
+   info->app_start = s->user_app_address;
+   info->app_end = s->user_app_address + s->flash_size;
+   info->max_payload = s->max_payload;
+   info->window_size = s->window_size;
+   info->capabilities = s->capabilities;
+   info->frame_version = s->frame_version;
+
+   return STM32BL_OK;
+}
+
+int stm32bl_write(stm32bl_session_t *s, const uint8_t *data, uint32_t len)
+{
+   if (data == NULL || len == 0)
+   {
+      return STM32BL_ERR_ARGUMENT;
+   }
+
+   if (len > s->flash_size)
+   {
+      return STM32BL_ERR_SIZE;
+   }
+
+   if ((s->capabilities & CAP_PAGE_HASH) && (s->capabilities & CAP_ERASE_RANGE))
+   {
+      // skip pages or sectors already holding image
+      return stm32_write_diff(s, data, len);
+   }
+
+   return stm32_write_data(s, s->user_app_address, data, len, s->write_flags, 0, len);
+}
+
+int stm32bl_write_file(stm32bl_session_t *s, const char *path)
+{
+   uint32_t f_file_size = 0;
+   const uint8_t *f_data = stm32_map_file(path, &f_file_size);
+
+   if (f_data == NULL)
+   {
+      return STM32BL_ERR_FILE;
+   }
+
+   int status = stm32bl_write(s, f_data, f_file_size);
+
+   stm32_unmap_file(f_data, f_file_size);
+
+   return status;
+}
+
+// end of page or sector holding address, from device layout
+static uint32_t stm32_unit_end(stm32bl_session_t *s, uint32_t address)
+{
+   uint32_t unit_end = s->info.app_end - s->info.flash_total;
+
+   for (uint32_t r = 0; r < s->info.region_count; r++)
+   {
+      for (uint32_t i = 0; i < s->info.unit_count[r]; i++)
+      {
+         unit_end += s->info.unit_size[r];
+
+         if (address < unit_end)
+         {
+            return unit_end;
+         }
+      }
+   }
+
+   return unit_end;
+}
+
+// whole image stays in memory, frames are resent from first unacked one
+static int stm32_write_window(stm32bl_session_t *s, const uint8_t *data, uint32_t len)
+{
+   stm32_frame_t frames[WINDOW_SIZE];
+
+   if (len > s->flash_size)
+   {
+      return STM32BL_ERR_SIZE;
+   }
+
+   const uint32_t write_block_size = s->max_payload;
+   uint32_t total_frames = (len + write_block_size - 1) / write_block_size;
+   uint32_t base_frame = 0; // first unacked frame
+   uint32_t next_frame = 0; // next frame to send
+   uint32_t hold_frame = 0; // frames from here wait till all before are acked
+   uint8_t flags = s->write_flags & WRITE_FLAG_ERASE;
+   uint8_t start_seq = s->window_seq++;
+   uint8_t retry = 0;
+   int status = STM32BL_OK;
+
+   // ack can wait for a sector erase
+   Port_Timeout(s, 10000);
+
+   while (base_frame < total_frames)
+   {
+      uint32_t frame_count = 0;
+
+      // refill window, frames go out together in one write
+      while (next_frame < total_frames && next_frame - base_frame < s->window_size &&
+             (next_frame < hold_frame || base_frame >= hold_frame))
+      {
+         uint32_t offset = next_frame * write_block_size;
+         uint32_t stm32_app_address = s->user_app_address + offset;
+         uint32_t block_size = write_block_size;
+
+         if (len - offset < block_size)
+         {
+            block_size = len - offset;
+         }
+
+         // seq and flags, first frame starts a new transfer
+         stm32_frame(s, &frames[frame_count++], CMD_WRITE_WINDOW, ((start_seq + next_frame) & 0xFF),
+                     flags | ((next_frame == 0) ? WINDOW_FLAG_START : 0x00),
+                     stm32_app_address, block_size, data + offset, block_size);
+
+         next_frame++;
+
+         // device receives nothing else while it erases a page or sector this frame starts
+         if (flags && (offset == 0 || stm32_unit_end(s, stm32_app_address - 1) < stm32_app_address + block_size))
+         {
+            hold_frame = next_frame;
+            break;
+         }
+      }
+
+      if (frame_count)
+      {
+         stm32_send_frames(s, frames, frame_count);
+      }
+
+      // cumulative ack, [ACK/NACK + next expected seq]
+      uint8_t response[2];
+      uint8_t acked = 0;
+      uint8_t resend = 1;
+
+      if (stm32_read_bytes(s, response, 2) == 2 && (response[0] == CMD_ACK || response[0] == CMD_NACK))
+      {
+         acked = (uint8_t)(response[1] - start_seq - base_frame);
+
+         if (acked > next_frame - base_frame)
+         {
+            acked = 0;
+         }
+
+         base_frame += acked;
+
+         // ack of a resent frame that was already programmed moves nothing
+         resend = (response[0] == CMD_NACK);
+      }
+
+      if (acked)
+      {
+         retry = 0;
+
+         uint32_t done = base_frame * write_block_size;
+
+         if (stm32_progress(s, "write", (done < len) ? done : len, len))
+         {
+            status = STM32BL_ERR_CANCELLED;
+            break;
+         }
+      }
+
+      if (resend)
+      {
+         // no response or nack, go back to first unacked frame
+         next_frame = base_frame;
+
+         if (++retry > WINDOW_RETRY)
+         {
+            s->error_address = s->user_app_address + base_frame * write_block_size;
+            status = STM32BL_ERR_WRITE;
+            break;
+         }
+      }
+   }
+
+   Port_Timeout(s, 100);
+
+   return status;
+}
+
+int stm32bl_write_window_file(stm32bl_session_t *s, const char *path)
+{
+   uint32_t f_file_size = 0;
+   const uint8_t *f_data = stm32_map_file(path, &f_file_size);
+
+   if (f_data == NULL)
+   {
+      return STM32BL_ERR_FILE;
+   }
+
+   int status = stm32_write_window(s, f_data, f_file_size);
+
+   stm32_unmap_file(f_data, f_file_size);
+
+   return status;
+}
+
+int stm32bl_verify(stm32bl_session_t *s, const uint8_t *data, uint32_t len)
+{
+   if (data == NULL || len == 0)
+   {
+      return STM32BL_ERR_ARGUMENT;
+   }
+
+   if (s->capabilities & CAP_CHECKSUM)
+   {
+      // one crc32 instead of sending image again
+      uint32_t file_crc = CRC32(data, len);
+      uint32_t stm32_crc = 0;
+
+      if (stm32_checksum(s, s->user_app_address, len, &stm32_crc) == 0)
+      {
+         return STM32BL_ERR_NACK;
+      }
+
+      if (stm32_crc != file_crc)
+      {
+         stm32_log(s, "crc32 0X%08x expected 0X%08x", stm32_crc, file_crc);
+         s->error_address = s->user_app_address;
+         return STM32BL_ERR_VERIFY;
+      }
+
+      stm32_log(s, "crc32 0X%08x", stm32_crc);
+      return STM32BL_OK;
+   }
+
+   stm32_frame_t frame;
+   uint32_t stm32_app_address = s->user_app_address;
+   uint32_t remaining_bytes = len;
+   uint32_t write_block_size = s->max_payload;
+
+   while (remaining_bytes > 0)
+   {
+      if (remaining_bytes < write_block_size)
+      {
+         write_block_size = remaining_bytes;
+      }
+
+      // payload straight from image
+      stm32_frame(s, &frame, CMD_VERIFY, 0x00, 0x00, stm32_app_address, write_block_size, &data[len - remaining_bytes], write_block_size);
+
+      stm32_send_frames(s, &frame, 1);
+
+      if (!stm32_read_ack(s))
+      {
+         s->error_address = stm32_app_address;
+         return STM32BL_ERR_VERIFY;
+      }
+
+      remaining_bytes -= write_block_size;
+      stm32_app_address += write_block_size;
+
+      if (stm32_progress(s, "verify", len - remaining_bytes, len))
+      {
+         return STM32BL_ERR_CANCELLED;
+      }
+   }
+
+   return STM32BL_OK;
+}
+
+int stm32bl_verify_file(stm32bl_session_t *s, const char *path)
+{
+   uint32_t f_file_size = 0;
+   const uint8_t *f_data = stm32_map_file(path, &f_file_size);
+
+   if (f_data == NULL)
+   {
+      return STM32BL_ERR_FILE;
+   }
+
+   int status = stm32bl_verify(s, f_data, f_file_size);
+
+   stm32_unmap_file(f_data, f_file_size);
+
+   return status;
+}
+
+int stm32bl_read(stm32bl_session_t *s, uint32_t address, uint8_t *data, uint32_t len)
+{
+   uint8_t bl_packet[16];
+   uint32_t stm32_app_address = address;
+   uint32_t remaining_bytes = len;
+
+   while (remaining_bytes > 0)
+   {
+      uint32_t read_block_size = s->max_payload;
+      uint8_t *rx_buffer = &data[len - remaining_bytes];
+      uint8_t crc_recvd = 0;
+
+      if (remaining_bytes < read_block_size)
+      {
+         read_block_size = remaining_bytes;
+      }
+
+      // no of char to receive from stm32
+      uint32_t bl_packet_index = stm32_assemble_frame(s, bl_packet, CMD_READ, 0x00, 0x00, stm32_app_address, read_block_size, NULL, 0);
+
+      stm32_send_packet(s, bl_packet, bl_packet_index);
+
+      s->error_address = stm32_app_address;
+
+      if (!stm32_read_ack(s))
+      {
+         return STM32BL_ERR_READ;
+      }
+
+      stm32_read_bytes(s, rx_buffer, read_block_size);
+      stm32_read_bytes(s, &crc_recvd, 1);
+
+      if (crc_recvd != CRC8(rx_buffer, read_block_size))
+      {
+         return STM32BL_ERR_CRC;
+      }
+
+      remaining_bytes -= read_block_size;
+      stm32_app_address += read_block_size;
+
+      if (stm32_progress(s, "read", len - remaining_bytes, len))
+      {
+         return STM32BL_ERR_CANCELLED;
+      }
+   }
+
+   return STM32BL_OK;
+}
+
+int stm32bl_read_file(stm32bl_session_t *s, const char *path)
+{
+   uint8_t *data = malloc(s->flash_size);
+
+   if (data == NULL)
+   {
+      return STM32BL_ERR_MEMORY;
+   }
+
+   int status = stm32bl_read(s, s->user_app_address, data, s->flash_size);
+
+   if (status == STM32BL_OK)
+   {
+      FILE *fp = fopen(path, "wb");
+
+      if (fp == NULL || fwrite(data, 1, s->flash_size, fp) != s->flash_size)
+      {
+         status = STM32BL_ERR_FILE;
+      }
+
+      if (fp)
+      {
+         fclose(fp);
+      }
+   }
+
+   free(data);
+
+   return status;
+}
+
+int stm32bl_erase(stm32bl_session_t *s, uint32_t len)
+{
+   if (len)
+   {
+      uint8_t rx_char = stm32_erase_span(s, s->user_app_address, len);
+
+      if (rx_char == CMD_ACK)
+      {
+         return STM32BL_OK;
+      }
+
+      if (rx_char != 0)
+      {
+         s->error_address = s->user_app_address;
+         return STM32BL_ERR_ERASE;
+      }
+
+      // old bootloader ignores cmd
+      stm32_log(s, "range erase not supported, erasing whole flash");
+   }
+
+   Port_Timeout(s, 10000);
+
+   stm32_send_cmd(s, CMD_ERASE);
+
+   uint8_t acked = stm32_read_ack(s);
+
+   Port_Timeout(s, 100);
+
+   return acked ? STM32BL_OK : STM32BL_ERR_ERASE;
+}
+
+int stm32bl_checksum(stm32bl_session_t *s, uint32_t address, uint32_t len, uint32_t *crc)
+{
+   return stm32_checksum(s, address, len, crc) ? STM32BL_OK : STM32BL_ERR_NACK;
+}
+
+int stm32bl_reset(stm32bl_session_t *s)
+{
+   stm32_send_cmd(s, CMD_RESET);
+
+   return stm32_read_ack(s) ? STM32BL_OK : STM32BL_ERR_NACK;
+}
+
+int stm32bl_jump(stm32bl_session_t *s)
+{
+   stm32_send_cmd(s, CMD_JUMP);
+
+   return stm32_read_ack(s) ? STM32BL_OK : STM32BL_ERR_NACK;
+}
+
+uint32_t stm32bl_nodes(stm32bl_session_t *s, uint16_t *nodes, uint32_t max)
+{
+   if (s->transport.nodes)
+   {
+      return s->transport.nodes(s->transport.ctx, nodes, max);
+   }
+
+   // point to point transport is one node
+   if (max)
+   {
+      nodes[0] = 0;
+   }
+
+   return 1;
+}
+
+void stm32bl_select(stm32bl_session_t *s, uint16_t node)
+{
+   if (s->transport.select)
+   {
+      s->transport.select(s->transport.ctx, node);
+   }
+}
+
+int stm32bl_node_ok(stm32bl_session_t *s, uint32_t i)
+{
+   return i < s->node_count && s->alive[i];
+}
+
+int stm32bl_connect_nodes(stm32bl_session_t *s)
+{
+   uint32_t common_capabilities = 0xFFFFFFFF;
+   uint32_t common_payload = MAX_PAYLOAD;
+   uint32_t live_count = 0;
+
+   s->node_count = stm32bl_nodes(s, s->nodes, MAX_NODES);
+
+   if (s->node_count > MAX_NODES)
+   {
+      s->node_count = MAX_NODES;
+   }
+
+   memset(s->alive, 0, sizeof(s->alive));
+
+   stm32_log(s, "%u nodes found", s->node_count);
+
+   // nodes sharing an image run same bootloader, frames are sized for all of them
+   for (uint32_t i = 0; i < s->node_count; i++)
+   {
+      stm32bl_select(s, s->nodes[i]);
+      stm32_log(s, "node %04X", s->nodes[i]);
+
+      if (!stm32_connect(s))
+      {
+         stm32_log(s, "node %04X connection failed", s->nodes[i]);
+         continue;
+      }
+
+      s->alive[i] = 1;
+      common_capabilities &= stm32_get_info(s) ? s->capabilities : 0;
+   }
+
+   for (uint32_t i = 0; i < s->node_count; i++)
+   {
+      if (!s->alive[i] || !(common_capabilities & CAP_FRAME_V2))
+      {
+         continue;
+      }
+
+      // each node starts out on v1 frames
+      stm32bl_select(s, s->nodes[i]);
+      s->frame_version = FRAME_V1;
+      s->max_payload = V1_PAYLOAD;
+      stm32_frame_format(s, FRAME_V2);
+
+      if (s->frame_version != FRAME_V2)
+      {
+         stm32_log(s, "node %04X frame format failed", s->nodes[i]);
+         s->alive[i] = 0;
+      }
+
+      common_payload = (s->max_payload < common_payload) ? s->max_payload : common_payload;
+   }
+
+   if (common_capabilities & CAP_FRAME_V2)
+   {
+      s->frame_version = FRAME_V2;
+      s->max_payload = common_payload;
+   }
+
+   s->capabilities = common_capabilities;
+   stm32_write_flags(s);
+
+   for (uint32_t i = 0; i < s->node_count; i++)
+   {
+      live_count += s->alive[i];
+   }
+
+   return (live_count && live_count == s->node_count) ? STM32BL_OK : STM32BL_ERR_NODES;
+}
+
+// sends frame once to every live node and reads reply of each, a node that misses it or does not ack is dropped
+// nodes that stay silent on a broadcast frame are each asked for status of it with an empty deferred frame
+// returns no of nodes left
+static uint32_t stm32_broadcast_frame(stm32bl_session_t *s, const stm32_frame_t *frame, uint32_t address)
+{
+   uint8_t stream[FRAME_BUFFER_SIZE + 3];
+   uint16_t live[MAX_NODES] = {0};
+   uint8_t done[MAX_NODES] = {0};
+   uint32_t live_index[MAX_NODES];
+   uint32_t live_count = 0;
+   uint32_t acked = 0;
+
+   // whole frame goes out as one chunk, nodes hand it to bootloader once it is complete
+   uint32_t len = stm32_frame_stream(frame, stream);
+
+   for (uint32_t i = 0; i < s->node_count; i++)
+   {
+      if (s->alive[i])
+      {
+         live_index[live_count] = i;
+         live[live_count++] = s->nodes[i];
+      }
+   }
+
+   s->transport.broadcast(s->transport.ctx, stream, len, live, done, live_count);
+
+   for (uint32_t k = 0; k < live_count; k++)
+   {
+      uint32_t error_address = address;
+
+      if (!done[k])
+      {
+         stm32_log(s, "node %04X missed frame at 0X%0x", live[k], address);
+         s->alive[live_index[k]] = 0;
+         continue;
+      }
+
+      // every can node acks on its own id
+      stm32bl_select(s, live[k]);
+
+      if (s->transport.broadcast_silent)
+      {
+         // answered once broadcast frame is programmed, with its error if it failed, old bootloader just acks
+         stm32_frame_t status_frame;
+
+         stm32_frame(s, &status_frame, CMD_WRITE, 0x00, WRITE_FLAG_DEFER, address, 0, NULL, 0);
+         stm32_send_frames(s, &status_frame, 1);
+      }
+
+      uint8_t response = stm32_read_write_ack(s, &error_address);
+
+      if (response != CMD_ACK)
+      {
+         stm32_log(s, "node %04X flash write error at 0X%0x", live[k], error_address);
+         s->alive[live_index[k]] = 0;
+         continue;
+      }
+
+      acked++;
+   }
+
+   return acked;
+}
+
+int stm32bl_broadcast_write_file(stm32bl_session_t *s, const char *path)
+{
+   if (s->transport.broadcast == NULL)
+   {
+      return STM32BL_ERR_UNSUPPORTED;
+   }
+
+   uint32_t f_file_size = 0;
+   const uint8_t *f_data = stm32_map_file(path, &f_file_size);
+
+   if (f_data == NULL)
+   {
+      return STM32BL_ERR_FILE;
+   }
+
+   if (f_file_size > s->flash_size)
+   {
+      stm32_unmap_file(f_data, f_file_size);
+      return STM32BL_ERR_SIZE;
+   }
+
+   stm32_frame_t frame;
+   uint8_t lz4_block[LZ4_BLOCK_SIZE];
+   uint32_t remaining_bytes = f_file_size;
+   uint32_t stm32_app_address = s->user_app_address;
+   uint32_t write_block_size = s->max_payload;
+   uint32_t sent_bytes = 0;
+   uint32_t node_count = 0;
+   uint32_t live_count = 0;
+   int status = STM32BL_OK;
+
+   for (uint32_t i = 0; i < s->node_count; i++)
+   {
+      node_count += s->alive[i];
+   }
+
+   live_count = node_count;
+
+   // ack can wait for a sector erase
+   Port_Timeout(s, 10000);
+
+   if (live_count && !(s->write_flags & WRITE_FLAG_ERASE))
+   {
+      // erase footprint of file on every node first
+      uint8_t erase_len[4];
+
+      stm32_put_u32(erase_len, f_file_size);
+      stm32_frame(s, &frame, CMD_ERASE_RANGE, 0x00, 0x00, s->user_app_address, 4, erase_len, 4);
+
+      live_count = stm32_broadcast_frame(s, &frame, s->user_app_address);
+   }
+
+   while (live_count && remaining_bytes > 0)
+   {
+      if (remaining_bytes < write_block_size)
+      {
+         write_block_size = remaining_bytes;
+      }
+
+      uint32_t image_end = stm32_image_end(s, s->write_flags, f_file_size - remaining_bytes, s->user_app_address + f_file_size);
+
+      stm32_write_frame(s, &frame, lz4_block, s->write_flags, stm32_app_address, &f_data[f_file_size - remaining_bytes], write_block_size, image_end, &sent_bytes);
+
+      live_count = stm32_broadcast_frame(s, &frame, stm32_app_address);
+
+      remaining_bytes -= write_block_size;
+      stm32_app_address += write_block_size;
+
+      if (stm32_progress(s, "write", f_file_size - remaining_bytes, f_file_size))
+      {
+         status = STM32BL_ERR_CANCELLED;
+         break;
+      }
+   }
+
+   if (status == STM32BL_OK && live_count && (s->write_flags & WRITE_FLAG_DEFER))
+   {
+      // frame with no payload collects status of last frame
+      stm32_frame(s, &frame, CMD_WRITE, 0x00, s->write_flags, stm32_app_address, 0, NULL, 0);
+
+      live_count = stm32_broadcast_frame(s, &frame, stm32_app_address);
+   }
+
+   Port_Timeout(s, 100);
+
+   if (status == STM32BL_OK && live_count && (s->capabilities & CAP_CHECKSUM))
+   {
+      uint32_t file_crc = CRC32(f_data, f_file_size);
+
+      // one crc32 from each node
+      for (uint32_t i = 0; i < s->node_count; i++)
+      {
+         uint32_t stm32_crc = 0;
+
+         if (!s->alive[i])
+         {
+            continue;
+         }
+
+         stm32bl_select(s, s->nodes[i]);
+
+         if (stm32_checksum(s, s->user_app_address, f_file_size, &stm32_crc) == 0 || stm32_crc != file_crc)
+         {
+            stm32_log(s, "node %04X verify error, crc32 0X%08x expected 0X%08x", s->nodes[i], stm32_crc, file_crc);
+            s->alive[i] = 0;
+            live_count--;
+         }
+      }
+   }
+
+   if (status == STM32BL_OK && live_count && (s->capabilities & CAP_COMPRESSED))
+   {
+      stm32_log(s, "sent %u of %u bytes compressed", sent_bytes, f_file_size);
+   }
+
+   stm32_unmap_file(f_data, f_file_size);
+
+   if (status == STM32BL_OK && (live_count == 0 || live_count != node_count))
+   {
+      status = STM32BL_ERR_NODES;
+   }
+
+   return status;
+}
+
+// request sent, reply of need chars due within timeout
+static void stm32_job_expect(stm32bl_session_t *s, uint8_t state, uint32_t need, uint32_t timeout)
+{
+   s->job.state = state;
+   s->job.need = need;
+   s->job.count = 0;
+   s->job.deadline = Serial_Port_Millis() + timeout;
+}
+
+static void stm32_job_done(stm32bl_session_t *s, int status)
+{
+   s->job.state = JOB_DONE;
+   s->job.status = status;
+
+   if (status == STM32BL_OK && s->job.write && (s->capabilities & CAP_COMPRESSED))
+   {
+      stm32_log(s, "sent %u of %u bytes compressed", s->job.sent_bytes, s->job.len);
+   }
+}
+
+static void stm32_job_connect(stm32bl_session_t *s)
+{
+   uint8_t temp = CMD_CONNECT;
+
+   Port_Write(s, &temp, 1);
+
+   stm32_job_expect(s, JOB_CONNECT, 1, 100);
+}
+
+static void stm32_job_checksum(stm32bl_session_t *s)
+{
+   if (!(s->capabilities & CAP_CHECKSUM))
+   {
+      // image is written, or can not be checked without sending it again
+      stm32_job_done(s, s->job.write ? STM32BL_OK : STM32BL_ERR_UNSUPPORTED);
+      return;
+   }
+
+   // crc unit takes a few ms per 100kB
+   stm32_checksum_request(s, s->user_app_address, s->job.len);
+
+   stm32_job_expect(s, JOB_CHECKSUM, 6, 1000);
+}
+
+// next frame of image, frame with no payload collects status of last deferred one
+static void stm32_job_frame(stm32bl_session_t *s)
+{
+   stm32_frame_t frame;
+   uint8_t lz4_block[LZ4_BLOCK_SIZE];
+   uint32_t address = s->user_app_address + s->job.offset;
+
+   if (s->job.offset < s->job.len)
+   {
+      s->job.block = (s->job.len - s->job.offset < s->max_payload) ? s->job.len - s->job.offset : s->max_payload;
+
+      uint32_t image_end = stm32_image_end(s, s->write_flags, s->job.offset, s->user_app_address + s->job.len);
+
+      stm32_write_frame(s, &frame, lz4_block, s->write_flags, address, &s->job.data[s->job.offset], s->job.block, image_end, &s->job.sent_bytes);
+   }
+   else if (s->job.block && (s->write_flags & WRITE_FLAG_DEFER))
+   {
+      s->job.block = 0;
+
+      stm32_frame(s, &frame, CMD_WRITE, 0x00, s->write_flags, address, 0, NULL, 0);
+   }
+   else
+   {
+      stm32_job_checksum(s);
+      return;
+   }
+
+   stm32_send_frames(s, &frame, 1);
+
+   // ack can wait for a sector erase
+   stm32_job_expect(s, JOB_WRITE, 1, 10000);
+}
+
+// connected and configured, image goes out or is checked
+static void stm32_job_begin(stm32bl_session_t *s)
+{
+   if (!s->job.write)
+   {
+      stm32_job_checksum(s);
+      return;
+   }
+
+   if (s->job.len > s->flash_size)
+   {
+      stm32_job_done(s, STM32BL_ERR_SIZE);
+      return;
+   }
+
+   stm32_job_frame(s);
+}
+
+// whole reply of current step is in
+static void stm32_job_reply(stm32bl_session_t *s)
+{
+   stm32_job_t *job = &s->job;
+   uint32_t crc = 0;
+
+   switch (job->state)
+   {
+   case JOB_CONNECT:
+      if (job->reply[0] != CMD_ACK)
+      {
+         // stray char, wait for ack till deadline
+         job->count = 0;
+         break;
+      }
+
+      stm32_send_cmd(s, CMD_GET_INFO);
+      stm32_job_expect(s, JOB_INFO_HEAD, 3, 1000);
+      break;
+
+   case JOB_INFO_HEAD:
+   {
+      // [ACK + 2-byte info len + info + crc]
+      uint32_t info_len = job->reply[1] << 8 | job->reply[2];
+
+      if (job->reply[0] != CMD_ACK || info_len + 1 > INFO_SIZE)
+      {
+         stm32_log(s, "device info not supported, using defaults");
+         stm32_job_begin(s);
+         break;
+      }
+
+      stm32_job_expect(s, JOB_INFO, info_len + 1, 1000);
+      break;
+   }
+
+   case JOB_INFO:
+      if (CRC8(job->reply, job->need - 1) != job->reply[job->need - 1])
+      {
+         stm32_log(s, "device info crc mismatch, using defaults");
+         stm32_job_begin(s);
+         break;
+      }
+
+      if (!stm32_parse_info(s, job->reply, job->need - 1))
+      {
+         stm32_log(s, "device info malformed, using defaults");
+         stm32_job_begin(s);
+         break;
+      }
+
+      if (!(s->capabilities & CAP_FRAME_V2))
+      {
+         stm32_job_begin(s);
+         break;
+      }
+
+      stm32_frame_format_request(s, FRAME_V2);
+      stm32_job_expect(s, JOB_FORMAT, 5, 1000);
+      break;
+
+   case JOB_FORMAT:
+      stm32_frame_format_reply(s, FRAME_V2, job->reply, job->count);
+      stm32_job_begin(s);
+      break;
+
+   case JOB_WRITE:
+      s->error_address = s->user_app_address + job->offset;
+
+      if (job->reply[0] == CMD_ERROR)
+      {
+         // deferred write error, [ERROR + 4-byte address + crc]
+         stm32_job_expect(s, JOB_WRITE_ERROR, 5, 1000);
+         break;
+      }
+
+      if (job->reply[0] != CMD_ACK)
+      {
+         stm32_job_done(s, STM32BL_ERR_WRITE);
+         break;
+      }
+
+      job->offset += job->block;
+
+      if (job->block && stm32_progress(s, "write", job->offset, job->len))
+      {
+         stm32_job_done(s, STM32BL_ERR_CANCELLED);
+         break;
+      }
+
+      stm32_job_frame(s);
+      break;
+
+   case JOB_WRITE_ERROR:
+      if (CRC8(job->reply, 4) == job->reply[4])
+      {
+         s->error_address = stm32_get_u32(job->reply);
+      }
+
+      stm32_job_done(s, STM32BL_ERR_WRITE);
+      break;
+
+   case JOB_CHECKSUM:
+      if (!stm32_checksum_reply(job->reply, job->count, &crc))
+      {
+         stm32_job_done(s, STM32BL_ERR_NACK);
+      }
+      else if (crc != CRC32(job->data, job->len))
+      {
+         stm32_log(s, "crc32 0X%08x expected 0X%08x", crc, CRC32(job->data, job->len));
+         s->error_address = s->user_app_address;
+         stm32_job_done(s, STM32BL_ERR_VERIFY);
+      }
+      else
+      {
+         stm32_log(s, "crc32 0X%08x", crc);
+         stm32_job_done(s, STM32BL_OK);
+      }
+      break;
+   }
+}
+
+// reply of current step did not come in time
+static void stm32_job_timeout(stm32bl_session_t *s)
+{
+   stm32_job_t *job = &s->job;
+
+   switch (job->state)
+   {
+   case JOB_CONNECT:
+      if (++job->retry < 10)
+      {
+         stm32_job_connect(s);
+      }
+      else
+      {
+         stm32_job_done(s, STM32BL_ERR_CONNECT);
+      }
+      break;
+
+   // old bootloader ignores cmd
+   case JOB_INFO_HEAD:
+      stm32_log(s, "device info not supported, using defaults");
+      stm32_job_begin(s);
+      break;
+
+   case JOB_INFO:
+      stm32_log(s, "device info crc mismatch, using defaults");
+      stm32_job_begin(s);
+      break;
+
+   case JOB_FORMAT:
+      stm32_frame_format_reply(s, FRAME_V2, job->reply, job->count);
+      stm32_job_begin(s);
+      break;
+
+   case JOB_WRITE:
+      s->error_address = s->user_app_address + job->offset;
+      stm32_job_done(s, STM32BL_ERR_WRITE);
+      break;
+
+   case JOB_WRITE_ERROR:
+      stm32_job_done(s, STM32BL_ERR_WRITE);
+      break;
+
+   case JOB_CHECKSUM:
+      stm32_job_done(s, STM32BL_ERR_NACK);
+      break;
+   }
+}
+
+static int stm32_job_start(stm32bl_session_t *s, const uint8_t *data, uint32_t len, uint8_t write)
+{
+   if (data == NULL || len == 0)
+   {
+      return STM32BL_ERR_ARGUMENT;
+   }
+
+   memset(&s->job, 0, sizeof(s->job));
+   s->job.data = data;
+   s->job.len = len;
+   s->job.write = write;
+   s->job.status = STM32BL_PENDING;
+
+   // reads take what is there, waiting is left to caller
+   Port_Timeout(s, 0);
+
+   stm32_job_connect(s);
+
+   return STM32BL_PENDING;
+}
+
+int stm32bl_write_start(stm32bl_session_t *s, const uint8_t *data, uint32_t len)
+{
+   return stm32_job_start(s, data, len, 1);
+}
+
+int stm32bl_verify_start(stm32bl_session_t *s, const uint8_t *data, uint32_t len)
+{
+   return stm32_job_start(s, data, len, 0);
+}
+
+int stm32bl_fd(stm32bl_session_t *s)
+{
+   return s->transport.fd ? s->transport.fd(s->transport.ctx) : -1;
+}
+
+int stm32bl_step(stm32bl_session_t *s)
+{
+   stm32_job_t *job = &s->job;
+
+   if (job->state == JOB_IDLE)
+   {
+      return STM32BL_ERR_ARGUMENT;
+   }
+
+   // one read can hold replies of several steps
+   while (job->state != JOB_DONE)
+   {
+      job->count += Port_Read(s, &job->reply[job->count], job->need - job->count);
+
+      if (job->count < job->need)
+      {
+         break;
+      }
+
+      stm32_job_reply(s);
+   }
+
+   if (job->state != JOB_DONE && Serial_Port_Millis() >= job->deadline)
+   {
+      stm32_job_timeout(s);
+   }
+
+   if (job->state == JOB_DONE)
+   {
+      Port_Timeout(s, 100);
+   }
+
+   return job->status;
+}
+
+uint32_t stm32bl_step_timeout(stm32bl_session_t *s)
+{
+   uint64_t now = Serial_Port_Millis();
+
+   if (s->job.state == JOB_IDLE || s->job.state == JOB_DONE)
+   {
+      return 0;
+   }
+
+   return (s->job.deadline > now) ? (uint32_t)(s->job.deadline - now) : 0;
+}
@@ -0,0 +1,183 @@
+#ifndef __STM32BL_H
+#define __STM32BL_H
+
+#include <stdint.h>
+
+// libstm32bl, host side of the bootloader protocol
+// one session per device, sessions share nothing so several devices can be driven from one process
+// session talks through an injected transport, or one opened from a port string like the cli takes
+// progress and text output go to callbacks, every operation returns a STM32BL_ status
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#define STM32BL_API __declspec(dllexport)
+#else
+#define STM32BL_API __attribute__((visibility("default")))
+#endif
+
+typedef struct stm32bl_session stm32bl_session_t;
+
+typedef enum
+{
+   STM32BL_OK = 0,
+   STM32BL_ERR_PORT,        // port can not be opened or went away
+   STM32BL_ERR_CONNECT,     // no ack to CMD_CONNECT
+   STM32BL_ERR_FILE,        // file can not be read or created
+   STM32BL_ERR_SIZE,        // image larger than flash
+   STM32BL_ERR_NACK,        // cmd not acked
+   STM32BL_ERR_WRITE,       // flash write failed, see stm32bl_error_address
+   STM32BL_ERR_ERASE,       // flash erase failed
+   STM32BL_ERR_READ,        // flash read failed, see stm32bl_error_address
+   STM32BL_ERR_VERIFY,      // flash differs from image, see stm32bl_error_address
+   STM32BL_ERR_CRC,         // reply crc mismatch
+   STM32BL_ERR_UNSUPPORTED, // bootloader or transport lacks cmd
+   STM32BL_ERR_MEMORY,      // out of memory
+   STM32BL_ERR_CANCELLED,   // progress callback asked to stop
+   STM32BL_ERR_NODES,       // not every node made it, see stm32bl_node_ok
+   STM32BL_ERR_ARGUMENT,    // bad argument
+   STM32BL_PENDING          // started operation still running, see stm32bl_step
+} stm32bl_status_t;
+
+// piece of a frame, pieces are written together without copying them into one buffer
+typedef struct
+{
+   const uint8_t *data;
+   uint32_t len;
+} stm32bl_chunk_t;
+
+// byte stream to one bootloader, or to nodes on a multi-drop bus
+// read waits up to the timeout set for all len chars, returns no of chars read
+// write_chunks, close and the bus members may be NULL
+typedef struct
+{
+   void *ctx;
+   uint32_t (*write)(void *ctx, const uint8_t *buf, uint32_t len);
+   uint32_t (*write_chunks)(void *ctx, const stm32bl_chunk_t *chunks, uint32_t count);
+   uint32_t (*read)(void *ctx, uint8_t *buf, uint32_t len);
+   void (*timeout)(void *ctx, uint32_t ms);
+   void (*close)(void *ctx);
+
+   // nodes on bus, up to max of them copied, returns no of nodes
+   uint32_t (*nodes)(void *ctx, uint16_t *nodes, uint32_t max);
+   // node written to and read from
+   void (*select)(void *ctx, uint16_t node);
+   // stream sent once to nodes, done[i] set once nodes[i] holds all of it
+   void (*broadcast)(void *ctx, const uint8_t *stream, uint32_t len, const uint16_t *nodes, uint8_t *done, uint32_t count);
+   // nodes stay silent on broadcast frames, each is asked for status with an empty deferred write
+   uint8_t broadcast_silent;
+
+   // uart baud checked against baud list of device, 0 where device does not report it
+   uint32_t baud;
+
+   // descriptor that turns readable as reply chars arrive, for event loops, may be NULL
+   int (*fd)(void *ctx);
+} stm32bl_transport_t;
+
+// called from inside long operations with bytes done so far, must return quickly
+// nonzero return stops operation with STM32BL_ERR_CANCELLED
+typedef int (*stm32bl_progress_fn)(void *user, const char *operation, uint32_t done, uint32_t total);
+
+// line of text about what session does, device info, rewritten pages, speeds
+typedef void (*stm32bl_log_fn)(void *user, const char *line);
+
+#define STM32BL_MAX_REGIONS 4
+#define STM32BL_MAX_BAUDS 8
+
+// device as reported by CMD_GET_INFO, defaults for old bootloader
+typedef struct
+{
+   uint32_t device_id;
+   uint32_t unique_id[3];
+   uint32_t flash_total;
+   uint32_t app_start;
+   uint32_t app_end;
+   uint32_t max_payload;  // negotiated for this session
+   uint32_t window_size;
+   uint32_t capabilities;
+   uint32_t frame_version;
+   uint32_t region_count;
+   uint32_t unit_size[STM32BL_MAX_REGIONS];
+   uint32_t unit_count[STM32BL_MAX_REGIONS];
+   uint32_t baud_count;
+   uint32_t baud[STM32BL_MAX_BAUDS];
+} stm32bl_info_t;
+
+// transport for "spi:", "spiloop:", "can:", "rs485:" or serial port, transport is filled in
+STM32BL_API int stm32bl_port_transport(stm32bl_transport_t *transport, const char *port, uint32_t baud);
+
+// session on transport, transport is copied and closed with session, NULL if out of memory
+STM32BL_API stm32bl_session_t *stm32bl_session_new(const stm32bl_transport_t *transport);
+
+// session on port string, NULL if port can not be opened
+STM32BL_API stm32bl_session_t *stm32bl_session_open(const char *port, uint32_t baud);
+
+STM32BL_API void stm32bl_session_close(stm32bl_session_t *s);
+
+STM32BL_API void stm32bl_set_callbacks(stm32bl_session_t *s, stm32bl_progress_fn progress, stm32bl_log_fn log, void *user);
+
+STM32BL_API const char *stm32bl_strerror(int status);
+
+// address of last failed write, read or verify
+STM32BL_API uint32_t stm32bl_error_address(stm32bl_session_t *s);
+
+// CMD_CONNECT, then device info and largest frames both sides take
+STM32BL_API int stm32bl_connect(stm32bl_session_t *s);
+STM32BL_API int stm32bl_info(stm32bl_session_t *s, stm32bl_info_t *info);
+
+STM32BL_API int stm32bl_write_file(stm32bl_session_t *s, const char *path);
+STM32BL_API int stm32bl_write_window_file(stm32bl_session_t *s, const char *path);
+STM32BL_API int stm32bl_verify_file(stm32bl_session_t *s, const char *path);
+
+// image in memory, written from app start
+STM32BL_API int stm32bl_write(stm32bl_session_t *s, const uint8_t *data, uint32_t len);
+STM32BL_API int stm32bl_verify(stm32bl_session_t *s, const uint8_t *data, uint32_t len);
+
+// len bytes of flash from address, or whole app region into file
+STM32BL_API int stm32bl_read(stm32bl_session_t *s, uint32_t address, uint8_t *data, uint32_t len);
+STM32BL_API int stm32bl_read_file(stm32bl_session_t *s, const char *path);
+
+// whole flash, or pages or sectors under len bytes from app start, whole flash on old bootloader
+STM32BL_API int stm32bl_erase(stm32bl_session_t *s, uint32_t len);
+STM32BL_API int stm32bl_checksum(stm32bl_session_t *s, uint32_t address, uint32_t len, uint32_t *crc);
+STM32BL_API int stm32bl_reset(stm32bl_session_t *s);
+STM32BL_API int stm32bl_jump(stm32bl_session_t *s);
+
+// nodes on bus, up to max of them copied, returns no of nodes, 1 on point to point transports
+STM32BL_API uint32_t stm32bl_nodes(stm32bl_session_t *s, uint16_t *nodes, uint32_t max);
+STM32BL_API void stm32bl_select(stm32bl_session_t *s, uint16_t node);
+
+// connects every node, frames are sized for all of them, STM32BL_ERR_NODES unless all connect
+STM32BL_API int stm32bl_connect_nodes(stm32bl_session_t *s);
+
+// image sent once for all connected nodes, STM32BL_ERR_NODES unless all are written
+STM32BL_API int stm32bl_broadcast_write_file(stm32bl_session_t *s, const char *path);
+
+// after stm32bl_connect_nodes, node i of stm32bl_nodes still fine
+STM32BL_API int stm32bl_node_ok(stm32bl_session_t *s, uint32_t i);
+
+// non-blocking write of image in memory, so one thread can drive many sessions
+// connects, reads device info and writes, image is checked by crc32 where bootloader supports it
+// image must stay in memory until operation is done
+STM32BL_API int stm32bl_write_start(stm32bl_session_t *s, const uint8_t *data, uint32_t len);
+
+// non-blocking crc32 check of image in memory after connect, STM32BL_ERR_UNSUPPORTED without CMD_CHECKSUM
+STM32BL_API int stm32bl_verify_start(stm32bl_session_t *s, const uint8_t *data, uint32_t len);
+
+// descriptor to wait on for replies, -1 if transport has none
+STM32BL_API int stm32bl_fd(stm32bl_session_t *s);
+
+// called once stm32bl_fd is readable or stm32bl_step_timeout has passed, never waits itself
+// returns STM32BL_PENDING while operation runs, then its status
+STM32BL_API int stm32bl_step(stm32bl_session_t *s);
+
+// ms until stm32bl_step must be called even if no reply came
+STM32BL_API uint32_t stm32bl_step_timeout(stm32bl_session_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
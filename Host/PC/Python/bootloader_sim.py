@@ -0,0 +1,510 @@
+import os
+import select
+import signal
+import sys
+import time
+import tty
+
+from stm32_bootloader import (CRC8, CRC32, CMD_WRITE, CMD_READ, CMD_ERASE, CMD_RESET, CMD_JUMP, CMD_VERIFY,
+                              CMD_WRITE_WINDOW, CMD_FRAME_FORMAT, CMD_ERASE_RANGE, CMD_GET_INFO, CMD_CHECKSUM,
+                              CMD_PAGE_HASH, CMD_WRITE_COMPRESSED, CMD_ACK, CMD_NACK, CMD_ERROR, CMD_CONNECT,
+                              SYNC_CHAR, FRAME_V1, FRAME_V2, WINDOW_FLAG_START, WRITE_FLAG_DEFER, WRITE_FLAG_ERASE,
+                              WRITE_FLAG_END, CAP_WINDOW, CAP_FRAME_V2, CAP_DEFER_WRITE, CAP_ERASE_RANGE,
+                              CAP_LAZY_ERASE, CAP_CHECKSUM, CAP_PAGE_HASH, CAP_COMPRESSED, CAP_IMAGE_END)
+
+"""
+simulated bootloader on a pseudo terminal, for trying host tools and their serial port code without a board
+answers frames the way MCU/Bootloader/bootloader.c does on stm32f407vg, flash is kept in memory
+replies can be cut into pieces with a gap between them and held back, so host reads have to gather
+them across several reads and wait out their deadlines
+with -f, app area of flash is loaded from file at start and saved to it on reset, jump and exit,
+so what host wrote can be compared with image it sent, e.g. cmp -n <image size> <image> <flash file>
+
+usage: bootloader_sim.py <pty link> [chars per piece] [gap ms] [delay ms] [-f flash file] [-v]
+pty link is made a symlink to the pty, host opens it as serial port at any baud
+"""
+
+CMD_GETVER = 0x56
+
+# stm32f407vg, must match flash geometry table of bootloader
+FLASH_BASE = 0x08000000
+FLASH_REGIONS = [(16 * 1024, 4), (64 * 1024, 1), (128 * 1024, 7)]
+FLASH_TOTAL = 1024 * 1024
+BL_RESERVED = 2 * 16 * 1024
+APP_START = FLASH_BASE + BL_RESERVED
+APP_END = FLASH_BASE + FLASH_TOTAL
+PROGRAM_WIDTH = 4
+
+BL_VERSION = bytes([0, 1, 31])
+BL_MAX_PAYLOAD = 4 * 1024
+BL_FRAME_SIZE = BL_MAX_PAYLOAD + 20
+BL_WINDOW_SIZE = 4
+BL_INFO_VERSION = 1
+BL_CAPABILITIES = (CAP_WINDOW | CAP_FRAME_V2 | CAP_DEFER_WRITE | CAP_ERASE_RANGE | CAP_LAZY_ERASE |
+                   CAP_CHECKSUM | CAP_PAGE_HASH | CAP_COMPRESSED | CAP_IMAGE_END)
+
+# cmds whose header len counts payload that must have arrived
+PAYLOAD_CMDS = (CMD_WRITE, CMD_WRITE_COMPRESSED, CMD_WRITE_WINDOW, CMD_VERIFY, CMD_ERASE_RANGE, CMD_CHECKSUM,
+                CMD_PAGE_HASH)
+
+
+def LZ4_Decompress(src, dst_len):
+    # lz4 block, None if it is malformed or does not decompress to dst_len bytes
+    dst = bytearray()
+    pos = 0
+
+    def length(value):
+        nonlocal pos
+        if(value == 15):
+            while True:
+                if(pos >= len(src)):
+                    return None
+                extra = src[pos]
+                pos += 1
+                value += extra
+                if(extra != 255):
+                    break
+        return value
+
+    while(pos < len(src)):
+        token = src[pos]
+        pos += 1
+
+        literal_len = length(token >> 4)
+        if(literal_len is None or literal_len > len(src) - pos or len(dst) + literal_len > dst_len):
+            return None
+        dst += src[pos:pos + literal_len]
+        pos += literal_len
+
+        # last sequence has literals only
+        if(pos == len(src)):
+            break
+
+        if(pos + 2 > len(src)):
+            return None
+        offset = src[pos] | src[pos + 1] << 8
+        pos += 2
+
+        match_len = length(token & 0x0F)
+        if(match_len is None or offset == 0 or offset > len(dst) or len(dst) + match_len + 4 > dst_len):
+            return None
+
+        # byte by byte, match may overlap its own output
+        for i in range(match_len + 4):
+            dst.append(dst[-offset])
+
+    return bytes(dst) if len(dst) == dst_len else None
+
+
+class Bootloader:
+    def __init__(self, fd, piece, gap, delay, flash_file, verbose):
+        self.fd = fd
+        self.piece = piece
+        self.gap = gap
+        self.delay = delay
+        self.flash_file = flash_file
+        self.verbose = verbose
+        self.rx = bytearray()
+        self.flash = bytearray(b'\xff' * FLASH_TOTAL)
+        self.load()
+
+        self.units = []
+        address = FLASH_BASE
+        for size, count in FLASH_REGIONS:
+            for i in range(count):
+                self.units.append((address, size))
+                address += size
+
+        self.connected = False
+        self.new_session()
+
+    def log(self, text):
+        if(self.verbose):
+            print(text)
+
+    def load(self):
+        # app area only, file starts at APP_START
+        if(self.flash_file and os.path.exists(self.flash_file)):
+            with open(self.flash_file, "rb") as f:
+                data = f.read(APP_END - APP_START)
+            self.flash[BL_RESERVED:BL_RESERVED + len(data)] = data
+            print("flash loaded from %s, %d bytes" % (self.flash_file, len(data)))
+
+    def save(self):
+        if(self.flash_file):
+            with open(self.flash_file, "wb") as f:
+                f.write(self.flash[BL_RESERVED:])
+            self.log("flash saved to {}".format(self.flash_file))
+
+    def new_session(self):
+        # state bootloader drops on CMD_CONNECT
+        self.frame_version = FRAME_V1
+        self.erased = set()
+        self.image_end = 0
+        self.write_error = False
+        self.write_error_address = 0
+        self.window_expected_seq = 0
+        self.window_error = False
+        self.window_start = None
+
+    def get(self, count, timeout):
+        # count chars within timeout ms, None leaves chars received so far for next call
+        deadline = time.monotonic() + timeout / 1000
+
+        while(len(self.rx) < count):
+            remaining = deadline - time.monotonic()
+            if(remaining <= 0):
+                return None
+
+            readable, _, _ = select.select([self.fd], [], [], remaining)
+            if(readable):
+                self.rx += os.read(self.fd, 65536)
+
+        data = bytes(self.rx[:count])
+        del self.rx[:count]
+        return data
+
+    def send(self, data):
+        # pieces with a gap make host read reply in parts
+        if(self.delay):
+            time.sleep(self.delay / 1000)
+
+        piece = self.piece or len(data)
+        for i in range(0, len(data), piece):
+            if(i and self.gap):
+                time.sleep(self.gap / 1000)
+            os.write(self.fd, data[i:i + piece])
+
+    def send_char(self, char):
+        self.send(bytes([char]))
+
+    def unit(self, address):
+        for i, (start, size) in enumerate(self.units):
+            if(start <= address < start + size):
+                return i
+        return len(self.units)
+
+    def is_user_flash(self, address, length):
+        return APP_START <= address <= APP_END and length <= APP_END - address
+
+    def erase_unit(self, unit):
+        start, size = self.units[unit]
+        self.flash[start - FLASH_BASE:start - FLASH_BASE + size] = b'\xff' * size
+        self.erased.add(unit)
+        self.log("erase {} at 0X{:08x}".format(unit, start))
+
+    def erase_range(self, address, length):
+        if(length == 0 or not self.is_user_flash(address, length)):
+            return False
+        for unit in range(self.unit(address), self.unit(address + length - 1) + 1):
+            self.erase_unit(unit)
+        return True
+
+    def lazy_erase(self, address, length):
+        if(length == 0):
+            return True
+        if(not self.is_user_flash(address, length)):
+            return False
+        for unit in range(self.unit(address), self.unit(address + length - 1) + 1):
+            if(unit not in self.erased):
+                self.erase_unit(unit)
+        return True
+
+    def erase_ahead(self, address, length):
+        # unit after the one just written, if it holds part of image
+        unit = self.unit(address + length - 1) + 1
+        if(unit < len(self.units) and self.units[unit][0] < min(APP_END, self.image_end) and unit not in self.erased):
+            self.erase_unit(unit)
+
+    def program(self, address, data):
+        # tail not multiple of program width is padded with erased value, bits only go from 1 to 0
+        data = bytes(data) + b'\xff' * (-len(data) % PROGRAM_WIDTH)
+        if(not self.is_user_flash(address, len(data)) or address % PROGRAM_WIDTH):
+            return False
+
+        offset = address - FLASH_BASE
+        for i, byte in enumerate(data):
+            if(self.flash[offset + i] & byte != byte):
+                return False
+        self.flash[offset:offset + len(data)] = data
+        return True
+
+    def read_flash(self, address, length):
+        return bytes(self.flash[address - FLASH_BASE:address - FLASH_BASE + length])
+
+    def parse_header(self, frame):
+        address = int.from_bytes(frame[4:8], 'big')
+        if(self.frame_version == FRAME_V2):
+            return address, int.from_bytes(frame[8:12], 'big'), frame[12:-1]
+        return address, frame[1], frame[8:-1]
+
+    def write(self, address, data, flags):
+        status = True
+
+        if(flags & WRITE_FLAG_DEFER):
+            if(self.write_error):
+                # previous frame failed, drop this one and let host know
+                error = self.write_error_address.to_bytes(4, 'big')
+                self.send(bytes([CMD_ERROR]) + error + bytes([CRC8(error, 4)]))
+                self.write_error = False
+                return
+            self.send_char(CMD_ACK)
+
+        if(flags & WRITE_FLAG_ERASE):
+            status = self.lazy_erase(address, len(data))
+
+        status = status and self.program(address, data)
+        self.log("write 0X{:08x} {} bytes flags 0X{:02x} {}".format(address, len(data), flags,
+                                                                     "ok" if status else "failed"))
+
+        if(flags & WRITE_FLAG_DEFER):
+            if(not status):
+                self.write_error = True
+                self.write_error_address = address
+        else:
+            self.send_char(CMD_ACK if status else CMD_NACK)
+
+        if((flags & WRITE_FLAG_ERASE) and status and data):
+            self.erase_ahead(address, len(data))
+
+    def write_compressed(self, address, payload, flags):
+        if(4 <= len(payload) <= BL_MAX_PAYLOAD):
+            raw_len = int.from_bytes(payload[0:4], 'big')
+            data = LZ4_Decompress(payload[4:], raw_len) if raw_len <= BL_MAX_PAYLOAD else None
+            if(data is not None):
+                self.write(address, data, flags)
+                return
+        self.send_char(CMD_NACK)
+
+    def write_window(self, frame):
+        seq, flags = frame[2], frame[3]
+        address, length, payload = self.parse_header(frame)
+
+        # start frame with seq and address of running transfer is a resend, its ack was lost
+        if((flags & WINDOW_FLAG_START) and self.window_start != (seq, address)):
+            self.window_start = (seq, address)
+            self.window_expected_seq = seq
+            self.window_error = False
+
+        offset = (seq - self.window_expected_seq) & 0xFF
+
+        if(offset == 0):
+            status = length <= len(payload)
+            if(status and (flags & WRITE_FLAG_ERASE)):
+                status = self.lazy_erase(address, length)
+            status = status and self.program(address, payload[:length])
+            self.log("window 0X{:08x} {} bytes seq {} {}".format(address, length, seq, "ok" if status else "failed"))
+
+            if(status):
+                self.window_expected_seq = (self.window_expected_seq + 1) & 0xFF
+
+            # on failure frames behind this one are dropped till host resends it
+            self.window_error = not status
+            self.window_ack(status)
+        elif(offset >= 128):
+            # already programmed, ack again in case ack was lost
+            self.window_ack(True)
+        elif(not self.window_error):
+            # frame in between is lost or corrupted
+            self.window_error = True
+            self.window_ack(False)
+
+    def window_ack(self, status):
+        self.send(bytes([CMD_ACK if status else CMD_NACK, self.window_expected_seq]))
+
+    def span(self, payload, length):
+        # no of bytes of span cmds, sent as 4-byte payload
+        return int.from_bytes(payload[0:4], 'big') if length == 4 else None
+
+    def info(self):
+        info = bytearray([BL_INFO_VERSION])
+        info += (0x1007 << 16 | 0x413).to_bytes(4, 'big')
+        info += bytes.fromhex("112233445566778899AABBCC")
+        for value in (FLASH_TOTAL, APP_START, APP_END, BL_MAX_PAYLOAD):
+            info += value.to_bytes(4, 'big')
+        info.append(BL_WINDOW_SIZE)
+        info += BL_CAPABILITIES.to_bytes(4, 'big')
+        info.append(len(FLASH_REGIONS))
+        for size, count in FLASH_REGIONS:
+            info += size.to_bytes(4, 'big') + count.to_bytes(2, 'big')
+
+        # pty takes any baud
+        info.append(1)
+        info += (115200).to_bytes(4, 'big')
+
+        return bytes([CMD_ACK]) + len(info).to_bytes(2, 'big') + info + bytes([CRC8(info, len(info))])
+
+    def frame(self, frame):
+        cmd = frame[0]
+        address, length, payload = self.parse_header(frame)
+
+        # image end follows payload
+        end = 4 if cmd in (CMD_WRITE, CMD_WRITE_COMPRESSED) and (frame[3] & WRITE_FLAG_END) else 0
+
+        if(cmd in PAYLOAD_CMDS and cmd != CMD_WRITE_WINDOW and length + end > len(payload)):
+            # header claims more payload than arrived
+            self.send_char(CMD_NACK)
+            return
+
+        if(end):
+            self.image_end = int.from_bytes(payload[length:length + 4], 'big')
+
+        payload = payload[:length]
+
+        if(cmd != CMD_WRITE_WINDOW):
+            # window transfer ends with first other cmd
+            self.window_start = None
+
+        if(cmd == CMD_WRITE):
+            self.write(address, payload, frame[3])
+
+        elif(cmd == CMD_WRITE_COMPRESSED):
+            self.write_compressed(address, payload, frame[3])
+
+        elif(cmd == CMD_WRITE_WINDOW):
+            self.write_window(frame)
+
+        elif(cmd == CMD_READ):
+            if(self.is_user_flash(address, length) and length < BL_FRAME_SIZE):
+                data = self.read_flash(address, length)
+                self.send_char(CMD_ACK)
+                self.send(data + bytes([CRC8(data, len(data))]))
+            else:
+                self.send_char(CMD_NACK)
+
+        elif(cmd == CMD_VERIFY):
+            ok = self.is_user_flash(address, length) and self.read_flash(address, length) == payload
+            self.send_char(CMD_ACK if ok else CMD_NACK)
+
+        elif(cmd == CMD_ERASE):
+            self.send_char(CMD_ACK if self.erase_range(APP_START, APP_END - APP_START) else CMD_NACK)
+
+        elif(cmd == CMD_ERASE_RANGE):
+            erase_len = self.span(payload, length)
+            ok = erase_len is not None and self.erase_range(address, erase_len)
+            self.send_char(CMD_ACK if ok else CMD_NACK)
+
+        elif(cmd == CMD_CHECKSUM):
+            crc_len = self.span(payload, length)
+            if(crc_len is not None and self.is_user_flash(address, crc_len) and address % 4 == 0):
+                crc = CRC32(self.read_flash(address, crc_len)).to_bytes(4, 'big')
+                self.send(bytes([CMD_ACK]) + crc + bytes([CRC8(crc, 4)]))
+            else:
+                self.send_char(CMD_NACK)
+
+        elif(cmd == CMD_PAGE_HASH):
+            span_len = self.span(payload, length)
+            if(span_len and self.is_user_flash(address, span_len)):
+                first, last = self.unit(address), self.unit(address + span_len - 1)
+                hashes = bytearray((last - first + 1).to_bytes(2, 'big'))
+                for start, size in self.units[first:last + 1]:
+                    hashes += CRC32(self.read_flash(start, size)).to_bytes(4, 'big')
+                self.send(bytes([CMD_ACK]) + hashes + bytes([CRC8(hashes, len(hashes))]))
+            else:
+                self.send_char(CMD_NACK)
+
+        elif(cmd == CMD_GETVER):
+            self.send(bytes([CMD_ACK]) + BL_VERSION + bytes([CRC8(BL_VERSION, 3)]))
+
+        elif(cmd == CMD_GET_INFO):
+            self.send(self.info())
+
+        elif(cmd == CMD_FRAME_FORMAT):
+            version = frame[1]
+            if(version in (FRAME_V1, FRAME_V2)):
+                # reply goes out in old format, new format applies from next frame
+                reply = bytes([version]) + BL_MAX_PAYLOAD.to_bytes(2, 'big')
+                self.send(bytes([CMD_ACK]) + reply + bytes([CRC8(reply, 3)]))
+                self.frame_version = version
+            else:
+                self.send_char(CMD_NACK)
+
+        elif(cmd in (CMD_RESET, CMD_JUMP)):
+            # device comes back in bootloader, host has to connect again
+            self.send_char(CMD_ACK)
+            self.log("reset" if cmd == CMD_RESET else "jump to application")
+            self.connected = False
+            self.save()
+
+    def run(self):
+        while True:
+            sync_char = self.get(1, 10)
+
+            if(sync_char is None):
+                continue
+
+            if(sync_char[0] == CMD_CONNECT):
+                # new host, start over with v1 frames
+                if(not self.connected):
+                    self.log("connected")
+                self.connected = True
+                self.new_session()
+                self.send_char(CMD_ACK)
+                continue
+
+            # nothing but connect cmd is taken before session starts
+            if(not self.connected or sync_char[0] != SYNC_CHAR):
+                continue
+
+            frame_len = self.get(2 if self.frame_version == FRAME_V2 else 1, 100)
+            if(frame_len is None):
+                continue
+
+            frame_len = int.from_bytes(frame_len, 'big')
+            if(frame_len <= 1 or frame_len > BL_FRAME_SIZE):
+                continue
+
+            frame = self.get(frame_len, 5000)
+            if(frame is None or CRC8(frame, frame_len - 1) != frame[-1]):
+                continue
+
+            self.frame(frame)
+
+
+def main():
+    args = [arg for arg in sys.argv if arg != "-v"]
+
+    flash_file = None
+    if "-f" in args:
+        i = args.index("-f")
+        if i + 1 >= len(args):
+            print("please enter flash file after -f")
+            return
+        flash_file = args[i + 1]
+        del args[i:i + 2]
+
+    if len(args) < 2:
+        print("please enter pty link and optional chars per reply piece, ms gap between pieces and ms reply delay")
+        return
+
+    link = args[1]
+    piece = int(args[2]) if len(args) > 2 else 0
+    gap = int(args[3]) if len(args) > 3 else 0
+    delay = int(args[4]) if len(args) > 4 else 0
+
+    master, slave = os.openpty()
+    tty.setraw(slave)
+
+    # slave stays open here so master does not see a hang up between host runs
+    if os.path.lexists(link):
+        os.unlink(link)
+    os.symlink(os.ttyname(slave), link)
+
+    print("bootloader on %s -> %s" % (link, os.ttyname(slave)))
+
+    # kill saves flash too
+    signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit(0))
+
+    bootloader = Bootloader(master, piece, gap, delay, flash_file, "-v" in sys.argv)
+
+    try:
+        bootloader.run()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        bootloader.save()
+        os.unlink(link)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,166 @@
+import random
+import select
+import socket
+import struct
+import sys
+
+import serial
+
+"""
+simulated bootloader can node for trying host can backend without can hardware
+bridges one node id on a socketcan interface to a bootloader on a serial port and does what
+bootloader can transport does: node stream, broadcast frame assembly, missing segment status and discovery
+one process per node, broadcast segments can be dropped at random to exercise resends
+
+usage: can_node_sim.py <interface> <hex node id> <serial port> <baud> [segment drop rate]
+vcan setup: ip link add dev vcan0 type vcan && ip link set up vcan0
+"""
+
+# id layout, must match bootloader can transport
+CAN_ID_BASE = 0x1B000000
+CAN_ID_BASE_MASK = 0x1FF00000
+CAN_ID_TYPE_MASK = 0x000F0000
+CAN_ID_LOW_MASK = 0x0000FFFF
+CAN_ID_HOST_DATA = 0x00000000  # host to node stream, low bits node id
+CAN_ID_NODE_DATA = 0x00010000  # node to host stream, low bits node id
+CAN_ID_BCAST_DATA = 0x00020000  # host to all, low bits segment no
+CAN_ID_BCAST_CTRL = 0x00030000  # host to all, low bits 0
+CAN_ID_NODE_STATUS = 0x00040000  # node to host, low bits node id
+
+# broadcast control, first data byte
+CAN_CTRL_START = 0x01  # [START + tag + 2-byte len]
+CAN_CTRL_STATUS = 0x02  # [STATUS + tag], reply [STATUS + tag + 2-byte missing + 2-byte first + 2-byte window mask]
+CAN_CTRL_DISCOVER = 0x03  # [DISCOVER], reply [DISCOVER + joined]
+
+CAN_NO_FRAME = 0xFFFF
+CAN_SEGMENT_SIZE = 8
+CAN_STATUS_WINDOW = 16  # segments per status frame, bit i of mask set if segment first + i is missing
+CAN_STATUS_FRAMES = 8  # status frames per request at most
+CAN_MAX_FRAME = 8192  # bootloader can rx buffer
+
+CAN_FRAME_FMT = "=IB3x8s"
+
+
+class Node:
+    def __init__(self, can, node_id, port, drop):
+        self.can = can
+        self.node_id = node_id
+        self.port = port
+        self.drop = drop
+        self.joined = False
+        self.tag = 0
+        self.frame = bytearray()
+        self.have = []
+        self.missing = 0
+
+    def send(self, type_, data):
+        can_id = CAN_ID_BASE | type_ | self.node_id | socket.CAN_EFF_FLAG
+        self.can.send(struct.pack(CAN_FRAME_FMT, can_id, len(data), bytes(data).ljust(8, b'\0')))
+
+    def status(self, tag):
+        missing, have = CAN_NO_FRAME, []
+
+        if self.frame and tag == self.tag:
+            missing, have = self.missing, self.have
+
+        # one frame per window starting at a hole, host has them all once their holes add up to missing
+        first, frames = 0, 0
+        while True:
+            while first < len(have) and have[first]:
+                first += 1
+
+            if frames and first >= len(have):
+                break
+
+            window = have[first:first + CAN_STATUS_WINDOW]
+            mask = sum(1 << i for i, received in enumerate(window) if not received)
+            self.send(CAN_ID_NODE_STATUS, struct.pack(">BBHHH", CAN_CTRL_STATUS, tag, missing, first, mask))
+
+            first += CAN_STATUS_WINDOW
+            frames += 1
+
+            if missing == CAN_NO_FRAME or frames == CAN_STATUS_FRAMES:
+                break
+
+    def rx_frame(self, can_id, data):
+        type_ = can_id & CAN_ID_TYPE_MASK
+        low = can_id & CAN_ID_LOW_MASK
+
+        if type_ == CAN_ID_HOST_DATA and low == self.node_id:
+            self.joined = True
+            self.port.write(data)
+
+        elif type_ == CAN_ID_BCAST_DATA:
+            offset = low * CAN_SEGMENT_SIZE
+
+            if not self.joined or not self.missing or offset >= len(self.frame) or self.have[low]:
+                return
+
+            # lost in a full rx fifo
+            if random.random() < self.drop:
+                return
+
+            data = data[:len(self.frame) - offset]
+            self.frame[offset:offset + len(data)] = data
+            self.have[low] = True
+            self.missing -= 1
+
+            # complete frame is read by bootloader as if it came unicast
+            if not self.missing:
+                self.port.write(self.frame)
+
+        elif type_ == CAN_ID_BCAST_CTRL and low == 0 and data:
+            if data[0] == CAN_CTRL_START and len(data) >= 4 and self.joined:
+                length = data[2] << 8 | data[3]
+
+                # start repeated for a frame already started keeps segments received so far
+                if (self.frame and data[1] == self.tag) or length == 0 or length > CAN_MAX_FRAME:
+                    return
+
+                self.tag = data[1]
+                self.frame = bytearray(length)
+                self.have = [False] * ((length + CAN_SEGMENT_SIZE - 1) // CAN_SEGMENT_SIZE)
+                self.missing = len(self.have)
+
+            elif data[0] == CAN_CTRL_STATUS and len(data) >= 2 and self.joined:
+                self.status(data[1])
+
+            elif data[0] == CAN_CTRL_DISCOVER:
+                self.send(CAN_ID_NODE_STATUS, bytes([CAN_CTRL_DISCOVER, self.joined]))
+
+    def run(self):
+        while True:
+            readable, _, _ = select.select([self.can, self.port], [], [])
+
+            if self.can in readable:
+                can_id, dlc, data = struct.unpack(CAN_FRAME_FMT, self.can.recv(16))
+
+                if (can_id & socket.CAN_EFF_FLAG) and (can_id & CAN_ID_BASE_MASK) == CAN_ID_BASE:
+                    self.rx_frame(can_id & socket.CAN_EFF_MASK, data[:min(dlc, 8)])
+
+            if self.port in readable:
+                data = self.port.read(self.port.in_waiting or 1)
+
+                for i in range(0, len(data), CAN_SEGMENT_SIZE):
+                    self.send(CAN_ID_NODE_DATA, data[i:i + CAN_SEGMENT_SIZE])
+
+
+def main():
+    if len(sys.argv) < 5:
+        print("please enter interface, hex node id, serial port, baud and optional segment drop rate")
+        return
+
+    can = socket.socket(socket.AF_CAN, socket.SOCK_RAW, socket.CAN_RAW)
+    can.bind((sys.argv[1],))
+
+    port = serial.Serial(sys.argv[3], int(sys.argv[4]), timeout=0)
+    drop = float(sys.argv[5]) if len(sys.argv) > 5 else 0.0
+
+    node_id = int(sys.argv[2], 16) & CAN_ID_LOW_MASK
+    print("node %04X on %s, bootloader on %s" % (node_id, sys.argv[1], sys.argv[3]))
+
+    Node(can, node_id, port, drop).run()
+
+
+if __name__ == "__main__":
+    main()
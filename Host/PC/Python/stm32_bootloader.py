@@ -3,7 +3,10 @@ import os
 import sys
 import time
 
+import stm32bl
 
+
+# defaults for bootloader without CMD_GET_INFO
 USER_APP_ADDRESS = 0x08008000  # 0x08004000->8K, 0x08004000 -> 16k, 0x08008000->32k
 FLASH_SIZE = 496000 + 512000  # uncomment for 407VG
 Serial_Port = ""
@@ -15,6 +18,23 @@ CMD_WRITE, CMD_VERIFY Frame
 [1-byte cmd + 1-byte no of bytes to write + 0x00 + 0x00 + 4-byte addes +  payload + 1-byte CRC]
 */
 
+/*
+CMD_WRITE Frame with WRITE_FLAG_DEFER in flags byte, frame is acked before it is programmed
+response [ACK] or [ERROR + 4-byte address of failed frame + 1-byte CRC] for a previous frame
+frame with no payload at the end collects status of last frame, old bootloader just acks it
+with WRITE_FLAG_ERASE each page or sector is erased on first write into it, no separate erase needed
+with WRITE_FLAG_END on first frame 4-byte image end goes between payload and crc, not counted in len,
+first write into a page or sector then starts erase of next one if it is below image end
+*/
+
+/*
+CMD_WRITE_WINDOW Frame
+[SYNC_CHAR + frame len] frame len = 9 + payload len
+[1-byte cmd + 1-byte no of bytes to write + 1-byte seq + 1-byte flags + 4-byte addes +  payload + 1-byte CRC]
+response [ACK or NACK + 1-byte next expected seq] for each frame as it is programmed, next frame goes out on each ack
+with WRITE_FLAG_ERASE nothing follows a frame that starts a page or sector till it is acked
+*/
+
 /*
 CMD_READ Frame
 [SYNC_CHAR + frame len] frame len = 9
@@ -26,6 +46,59 @@ CMD_ERASE, CMD_RESET, CMD_JUMP Frame
 [SYNC_CHAR + frame len] frame len = 2
 [1-byte cmd + 1-byte CRC]
 */
+
+/*
+CMD_ERASE_RANGE Frame, no of bytes to erase sent as 4-byte payload
+[SYNC_CHAR + frame len] frame len = 13
+[1-byte cmd + 0x04 + 0x00 + 0x00 + 4-byte addes + 4-byte no of bytes to erase + 1-byte CRC]
+response [ACK] or [NACK], no response from old bootloader
+*/
+
+/*
+CMD_GET_INFO Frame, sent right after connect
+[SYNC_CHAR + frame len] frame len = 2
+[1-byte cmd + 1-byte CRC]
+response [ACK + 2-byte info len + info + 1-byte CRC of info], no response from old bootloader
+info
+[1-byte info version + 4-byte device id + 12-byte unique id + 4-byte flash size + 4-byte app start +
+ 4-byte app end + 4-byte max payload + 1-byte window size + 4-byte capabilities +
+ 1-byte region count + region count * (4-byte page or sector size + 2-byte count) +
+ 1-byte baud count + baud count * 4-byte baud rate]
+*/
+
+/*
+CMD_CHECKSUM Frame, no of bytes sent as 4-byte payload
+[SYNC_CHAR + frame len] frame len = 13
+[1-byte cmd + 0x04 + 0x00 + 0x00 + 4-byte addes + 4-byte no of bytes + 1-byte CRC]
+response [ACK + 4-byte CRC32 + 1-byte CRC of CRC32] or [NACK]
+CRC32 of stm32 crc unit, poly 0x04C11DB7, init 0xFFFFFFFF, little endian words, tail padded with 0xFF
+*/
+
+/*
+CMD_PAGE_HASH Frame, same as CMD_CHECKSUM
+response [ACK + 2-byte count + count * 4-byte CRC32 + 1-byte CRC of count and CRC32s] or [NACK]
+one CRC32 for every whole page or sector overlapping the span
+*/
+
+/*
+CMD_WRITE_COMPRESSED Frame, payload is 4-byte no of bytes to write + lz4 block decompressing to them
+[SYNC_CHAR + frame len] frame len = 13 + lz4 block len
+[1-byte cmd + 1-byte payload len + 0x00 + 1-byte flags + 4-byte addes + 4-byte no of bytes + lz4 block + 1-byte CRC]
+flags and response as CMD_WRITE, sent only when block is smaller than data
+*/
+
+/*
+CMD_FRAME_FORMAT Frame, sent after CMD_GET_INFO
+[SYNC_CHAR + frame len] frame len = 3
+[1-byte cmd + 1-byte frame version + 1-byte CRC]
+response [ACK + 1-byte frame version + 2-byte max payload + 1-byte CRC], no response from old bootloader
+*/
+
+/*
+v2 Frame, 2-byte frame len and 4-byte no of bytes appended to header
+[SYNC_CHAR + 2-byte frame len] frame len = 13 + payload len
+[1-byte cmd + 0x00 + 1-byte seq + 1-byte flags + 4-byte addes + 4-byte no of bytes + payload + 1-byte CRC]
+*/
 """
 
 CMD_WRITE = 0x50
@@ -34,6 +107,13 @@ CMD_ERASE = 0x52
 CMD_RESET = 0x53
 CMD_JUMP = 0x54
 CMD_VERIFY = 0x55
+CMD_WRITE_WINDOW = 0x57
+CMD_FRAME_FORMAT = 0x58
+CMD_ERASE_RANGE = 0x59
+CMD_GET_INFO = 0x5A
+CMD_CHECKSUM = 0x5B
+CMD_PAGE_HASH = 0x5C
+CMD_WRITE_COMPRESSED = 0x5D
 
 CMD_ACK = 0x90
 CMD_NACK = 0x91
@@ -45,6 +125,48 @@ CMD_CONNECT = 0x7F
 
 SYNC_CHAR = ord('$')
 
+FRAME_V1 = 1
+FRAME_V2 = 2
+
+# v1 payload, 1-byte frame len
+V1_PAYLOAD = 240
+# largest payload accepted from bootloader in v2
+MAX_PAYLOAD = 4 * 1024
+
+# negotiated with CMD_FRAME_FORMAT after connect
+Frame_Version = FRAME_V1
+Max_Payload = V1_PAYLOAD
+
+WINDOW_FLAG_START = 0x01
+WRITE_FLAG_DEFER = 0x02
+WRITE_FLAG_ERASE = 0x04
+WRITE_FLAG_END = 0x10
+
+# frames in flight for write_window, must not exceed BL_WINDOW_SIZE on mcu
+WINDOW_SIZE = 4
+WINDOW_RETRY = 5
+
+# CMD_GET_INFO capabilities
+CAP_WINDOW = 0x0001
+CAP_FRAME_V2 = 0x0002
+CAP_DEFER_WRITE = 0x0004
+CAP_ERASE_RANGE = 0x0008
+CAP_LAZY_ERASE = 0x0010
+CAP_AUTO_BAUD = 0x0020
+CAP_CHECKSUM = 0x0040
+CAP_PAGE_HASH = 0x0080
+CAP_COMPRESSED = 0x0100
+CAP_IMAGE_END = 0x0400
+
+# configured from CMD_GET_INFO after connect
+Window_Size = WINDOW_SIZE
+Capabilities = 0
+Write_Flags = 0x00
+
+# pages or sectors from flash base as (size, count), reported by CMD_GET_INFO
+Flash_Base = 0
+Flash_Regions = []
+
 # Maxim APPLICATION NOTE 27
 
 CRC8_Table = [
@@ -76,18 +198,208 @@ def CRC8(data, count):
     return crc
 
 
+# msb first table for poly 0x04C11DB7 of stm32 crc unit
+CRC32_Table = []
+for i in range(256):
+    crc = i << 24
+    for bit in range(8):
+        crc = ((crc << 1) ^ 0x04C11DB7 if crc & 0x80000000 else crc << 1) & 0xFFFFFFFF
+    CRC32_Table.append(crc)
+
+
+def CRC32(data):
+    # same crc32 as stm32 crc unit fed with little endian flash words, tail padded with 0xFF
+    data = bytes(data) + bytes([0xFF] * (-len(data) % 4))
+    crc = 0xFFFFFFFF
+    for i in range(0, len(data), 4):
+        for byte in reversed(data[i:i + 4]):
+            crc = ((crc << 8) & 0xFFFFFFFF) ^ CRC32_Table[(crc >> 24) ^ byte]
+    return crc
+
+
+def LZ4_Len(length):
+    # lz4 length above 15 continues in bytes of 255
+    length -= 15
+    return bytes([255] * (length // 255) + [length % 255])
+
+
+def LZ4_Sequence(literals, offset=0, match_len=0):
+    token = min(len(literals), 15) << 4
+    sequence = bytearray()
+    if(len(literals) >= 15):
+        sequence += LZ4_Len(len(literals))
+    sequence += literals
+
+    # last sequence has literals only
+    if(match_len):
+        token |= min(match_len - 4, 15)
+        sequence += offset.to_bytes(2, 'little')
+        if(match_len - 4 >= 15):
+            sequence += LZ4_Len(match_len - 4)
+
+    return bytes([token]) + sequence
+
+
+def LZ4_Compress(data):
+    # greedy lz4 block compression
+    table = {}
+    block = bytearray()
+    pos = 0
+    anchor = 0
+
+    # lz4 ends with at least 5 literals, last match starts 12 bytes before end
+    while(pos < len(data) - 12):
+        sequence = data[pos:pos + 4]
+        ref = table.get(sequence)
+        table[sequence] = pos
+
+        if(ref is not None and pos - ref <= 0xFFFF):
+            match_len = 4
+            while(pos + match_len < len(data) - 5 and data[ref + match_len] == data[pos + match_len]):
+                match_len += 1
+
+            block += LZ4_Sequence(data[anchor:pos], pos - ref, match_len)
+            pos += match_len
+            anchor = pos
+        else:
+            pos += 1
+
+    block += LZ4_Sequence(data[anchor:])
+    return bytes(block)
+
+
 def int_to_bytes(data):
     return bytes([data])
 
 
+def stm32_send_packet(bl_packet):
+
+    # no of chars in bl_packet, 2 bytes in v2
+    if(Frame_Version == FRAME_V2):
+        packet_len = int_to_bytes(len(bl_packet) >> 8 & 0xFF) + int_to_bytes(len(bl_packet) & 0xFF)
+    else:
+        packet_len = int_to_bytes(len(bl_packet))
+
+    Serial_Port.write(int_to_bytes(SYNC_CHAR) + packet_len + bl_packet)
+
+
+def stm32_assemble_frame(cmd, address, length, payload=bytes(), seq=0x00, flags=0x00):
+
+    bl_packet = bytes()
+
+    # assemble cmd
+    bl_packet += int_to_bytes(cmd)
+
+    # no of char to write or read, moved after address in v2
+    bl_packet += int_to_bytes(0x00 if Frame_Version == FRAME_V2 else length)
+
+    # seq and flags, 0x00 padding for stm32 word alignment if not used
+    bl_packet += int_to_bytes(seq)
+    bl_packet += int_to_bytes(flags)
+
+    # assemble address
+    bl_packet += address.to_bytes(4, 'big')
+
+    if(Frame_Version == FRAME_V2):
+        bl_packet += length.to_bytes(4, 'big')
+
+    # assemble payload
+    bl_packet += payload
+
+    # assemble crc
+    bl_packet += int_to_bytes(CRC8(bl_packet, len(bl_packet)))
+
+    return bl_packet
+
+
 def stm32_bl_send_cmd(cmd):
 
     crc = CRC8([cmd], 1)
-    Serial_Port.write(int_to_bytes(SYNC_CHAR))
-    Serial_Port.write(int_to_bytes(2))
+    stm32_send_packet(int_to_bytes(cmd) + int_to_bytes(crc))
+
+
+def stm32_get_info():
+    global USER_APP_ADDRESS
+    global FLASH_SIZE
+    global Window_Size
+    global Capabilities
+    global Write_Flags
+    global Flash_Base
+    global Flash_Regions
+
+    stm32_bl_send_cmd(CMD_GET_INFO)
+
+    # [ACK + 2-byte info len + info + crc], old bootloader ignores cmd
+    response = Serial_Port.read(3)
+    if(len(response) != 3 or response[0] != CMD_ACK):
+        print("device info not supported, using defaults")
+        return False
 
-    Serial_Port.write(int_to_bytes(cmd))
-    Serial_Port.write(int_to_bytes(crc))
+    info_len = response[1] << 8 | response[2]
+    info = Serial_Port.read(info_len + 1)
+    if(len(info) != info_len + 1 or CRC8(info, info_len) != info[info_len]):
+        print("device info crc mismatch, using defaults")
+        return False
+
+    def u32(index): return int.from_bytes(info[index:index + 4], 'big')
+
+    device_id = u32(1)
+    print("device id {} rev {}".format(hex(device_id & 0xFFF), hex(device_id >> 16)))
+    print("unique id {:08X}{:08X}{:08X}".format(u32(5), u32(9), u32(13)))
+
+    flash_total = u32(17)
+    app_start = u32(21)
+    app_end = u32(25)
+    payload = u32(29)
+    device_window = info[33]
+    Capabilities = u32(34)
+    print("flash {}kB, app {}-{}, max payload {}, window {}, capabilities {}".format(
+        flash_total // 1024, hex(app_start), hex(app_end), payload, device_window, hex(Capabilities)))
+
+    index = 38
+    Flash_Base = app_end - flash_total
+    Flash_Regions = []
+    for i in range(info[index]):
+        Flash_Regions.append((u32(index + 1), info[index + 5] << 8 | info[index + 6]))
+        index += 6
+    index += 1
+    print(" ".join("{} x {}kB".format(count, size // 1024) for (size, count) in Flash_Regions) + " pages or sectors")
+
+    bauds = [u32(index + 1 + 4 * i) for i in range(info[index])]
+    print("baud rates " + " ".join(str(baud) for baud in bauds))
+    if(Serial_Port.baudrate not in bauds):
+        print("baud {} not reported by device".format(Serial_Port.baudrate))
+
+    # configure transfers from device layout and capabilities
+    USER_APP_ADDRESS = app_start
+    FLASH_SIZE = app_end - app_start
+    Window_Size = min(device_window, WINDOW_SIZE)
+    Write_Flags = 0x00
+
+    if(Capabilities & CAP_DEFER_WRITE):
+        Write_Flags |= WRITE_FLAG_DEFER
+
+    if(Capabilities & CAP_LAZY_ERASE):
+        Write_Flags |= WRITE_FLAG_ERASE
+
+    return True
+
+
+def stm32_frame_format(version):
+    global Frame_Version
+    global Max_Payload
+
+    bl_packet = int_to_bytes(CMD_FRAME_FORMAT) + int_to_bytes(version)
+    stm32_send_packet(bl_packet + int_to_bytes(CRC8(bl_packet, 2)))
+
+    # [ACK + version + 2-byte max payload + crc], old bootloader ignores cmd
+    response = Serial_Port.read(5)
+    if(len(response) == 5 and response[0] == CMD_ACK and response[1] == version and
+       CRC8(response[1:4], 3) == response[4]):
+        Frame_Version = version
+        Max_Payload = min(response[2] << 8 | response[3], MAX_PAYLOAD)
+
+    print("frame format v{}, {} bytes per frame".format(Frame_Version, Max_Payload))
 
 
 def stm32_send_ack():
@@ -108,6 +420,21 @@ def stm32_read_ack():
         return (ord(rx_char) == CMD_ACK)
 
 
+def stm32_read_write_ack():
+    rx_char = Serial_Port.read(1)
+    if(rx_char == b''):
+        return (None, None)
+
+    # deferred write error, [ERROR + 4-byte address + crc]
+    error_address = None
+    if(ord(rx_char) == CMD_ERROR):
+        response = Serial_Port.read(5)
+        if(len(response) == 5 and CRC8(response, 4) == response[4]):
+            error_address = int.from_bytes(response[0:4], 'big')
+
+    return (ord(rx_char), error_address)
+
+
 def stm32_erase():
 
     Serial_Port.timeout = 10
@@ -128,15 +455,56 @@ def stm32_erase():
     Serial_Port.timeout = 1
 
 
+def stm32_erase_span(address, length):
+    # response to CMD_ERASE_RANGE, None if bootloader does not answer
+
+    Serial_Port.timeout = 10
+
+    stm32_send_packet(stm32_assemble_frame(CMD_ERASE_RANGE, address, 4, length.to_bytes(4, 'big')))
+
+    rx_char = Serial_Port.read(1)
+
+    Serial_Port.timeout = 1
+
+    return None if rx_char == b'' else ord(rx_char)
+
+
+def stm32_erase_range(bin_file):
+
+    try:
+        f_file_size = os.path.getsize(bin_file)
+    except(OSError):
+        print("can not open " + bin_file)
+        return
+
+    print("erasing {} bytes from {}".format(f_file_size, hex(USER_APP_ADDRESS)))
+
+    response = stm32_erase_span(USER_APP_ADDRESS, f_file_size)
+
+    if(response is None):
+        # old bootloader ignores cmd
+        print("range erase not supported, erasing whole flash")
+        stm32_erase()
+    elif(response == CMD_ACK):
+        print("flash erase success")
+    else:
+        print("flash erase error")
+
+
 def stm32_get_help():
     print("""
        supported commands
-       write  -> write application to mcu.
-       erase  -> erase mcu flash.
+       write  -> write application to mcu, erases flash on the fly.
+       erase  -> erase mcu flash, only footprint of input file if given.
        reset  -> reset mcu.
        jump   -> jump to user application.
        read   -> read flash from mcu.
        verify -> verify mcu content.
+       write_window -> write application with pipelined frames.
+       info   -> print device info.
+       checksum -> print crc32 of flash, only footprint of input file if given.
+       cmds joined by ',' run in one connection, like erase,write,verify,jump
+       each may name its own file, like "write app.bin,verify app.bin"
        """)
 
 
@@ -159,7 +527,7 @@ def stm32_jump():
 def stm32_read_flash():
 
     start = millis()
-    read_block_size = 240
+    read_block_size = Max_Payload
     remaining_bytes = FLASH_SIZE
     stm32_app_address = USER_APP_ADDRESS
     rcvd_file = bytes()
@@ -169,49 +537,20 @@ def stm32_read_flash():
         if(remaining_bytes < read_block_size):
             read_block_size = remaining_bytes
 
-        bl_packet = bytes()
         rcvd_packet = bytes()
 
-        # assemble cmd
-        bl_packet += int_to_bytes(CMD_READ)
-
         # no of char to receive from stm32
-        bl_packet += int_to_bytes(read_block_size)
-
-        # 2 bytes padding for stm32 word alignment
-        bl_packet += int_to_bytes(0x00)
-        bl_packet += int_to_bytes(0x00)
-
-        # assemble address
-        bl_packet += int_to_bytes(stm32_app_address >> 24 & 0xFF)
-        bl_packet += int_to_bytes(stm32_app_address >> 16 & 0xFF)
-        bl_packet += int_to_bytes(stm32_app_address >> 8 & 0xFF)
-        bl_packet += int_to_bytes(stm32_app_address >> 0 & 0xFF)
-
-        # calculate crc
-        crc = CRC8(bl_packet, 8)
-
-        # assemble crc
-        bl_packet += int_to_bytes(crc)
-
-        # send sync char
-        Serial_Port.write(int_to_bytes(SYNC_CHAR))
-
-        # send no of chars in bl_packet
-        Serial_Port.write(int_to_bytes(9))  # total bytes in bl_packet
-
-        # send bl_packet
-        Serial_Port.write(bl_packet)
+        stm32_send_packet(stm32_assemble_frame(CMD_READ, stm32_app_address, read_block_size))
 
         if(stm32_read_ack()):
 
             rcvd_packet = Serial_Port.read(read_block_size)
 
-            crc_recvd = ord(Serial_Port.read(1))
+            crc_recvd = Serial_Port.read(1)
 
-            crc_calc = CRC8(rcvd_packet, read_block_size)
+            crc_calc = CRC8(rcvd_packet, len(rcvd_packet))
 
-            if(crc_recvd == crc_calc):
+            if(len(rcvd_packet) == read_block_size and crc_recvd == int_to_bytes(crc_calc)):
 
                 rcvd_file += rcvd_packet
                 #print("read write success at " + hex(stm32_app_address))
@@ -246,99 +585,324 @@ def stm32_read_flash():
             print("read speed = {}kB/S".format(int(file_size/elapsed_time)))
 
 
+def stm32_write_data(address, data, flags):
+    # writes data in frames from address, True once every frame is programmed
+
+    stm32_app_address = address
+    remaining_bytes = len(data)
+    write_block_size = Max_Payload
+    sent_bytes = 0
+    response = CMD_ACK
+
+    # ack can wait for a sector erase
+    Serial_Port.timeout = 10
+
+    while(remaining_bytes > 0):
+
+        if(remaining_bytes < write_block_size):
+            write_block_size = remaining_bytes
+
+        offset = len(data) - remaining_bytes
+        payload = data[offset:offset + write_block_size]
+        lz4_block = bytes()
+        end = bytes()
+
+        if(offset == 0 and (flags & WRITE_FLAG_ERASE) and (Capabilities & CAP_IMAGE_END)):
+            # image end after payload, bootloader erases ahead up to it
+            end = (address + len(data)).to_bytes(4, 'big')
+
+        if(Capabilities & CAP_COMPRESSED):
+            # 4-byte no of bytes to write + lz4 block
+            lz4_block = write_block_size.to_bytes(4, 'big') + LZ4_Compress(payload)
+
+        # assemble frame with payload from file, acked before it is programmed and erased on first write if supported
+        if(lz4_block and len(lz4_block) < write_block_size):
+            stm32_send_packet(stm32_assemble_frame(CMD_WRITE_COMPRESSED, stm32_app_address, len(lz4_block), lz4_block + end,
+                                                   flags=flags | (WRITE_FLAG_END if end else 0x00)))
+            sent_bytes += len(lz4_block)
+        else:
+            stm32_send_packet(stm32_assemble_frame(CMD_WRITE, stm32_app_address, write_block_size, payload + end,
+                                                   flags=flags | (WRITE_FLAG_END if end else 0x00)))
+            sent_bytes += write_block_size
+
+        (response, error_address) = stm32_read_write_ack()
+
+        if(response == CMD_ACK):
+            #print("flash write success at " + hex(stm32_app_address))
+            pass
+        elif(response == CMD_ERROR and error_address is not None):
+            print("\nflash write error at " + hex(error_address))
+            break
+        else:
+            print("\nflash write error at " + hex(stm32_app_address))
+            break
+
+        remaining_bytes -= write_block_size
+        stm32_app_address += write_block_size
+        print("\rremaining bytes:{}".format(remaining_bytes), end='')
+
+    if(remaining_bytes == 0 and (flags & WRITE_FLAG_DEFER)):
+        # frame with no payload collects status of last frame
+        stm32_send_packet(stm32_assemble_frame(CMD_WRITE, stm32_app_address, 0, flags=flags))
+
+        (response, error_address) = stm32_read_write_ack()
+
+        if(response != CMD_ACK):
+            print("\nflash write error at " + hex(error_address if error_address is not None else stm32_app_address))
+
+    Serial_Port.timeout = 1
+
+    if(Capabilities & CAP_COMPRESSED):
+        print("\nsent {} of {} bytes compressed".format(sent_bytes, len(data)))
+
+    return (remaining_bytes == 0 and response == CMD_ACK)
+
+
+def stm32_page_hash(address, length):
+
+    # crc unit hashes whole flash in a few ms
+    Serial_Port.timeout = 1
+
+    stm32_send_packet(stm32_assemble_frame(CMD_PAGE_HASH, address, 4, length.to_bytes(4, 'big')))
+
+    # [ACK + 2-byte count + count * 4-byte crc32 + crc]
+    response = Serial_Port.read(3)
+    if(len(response) != 3 or response[0] != CMD_ACK):
+        return None
+
+    count = response[1] << 8 | response[2]
+    response += Serial_Port.read(count * 4 + 1)
+    if(len(response) != 3 + count * 4 + 1 or CRC8(response[1:], 2 + count * 4) != response[-1]):
+        return None
+
+    return [int.from_bytes(response[3 + i * 4:7 + i * 4], 'big') for i in range(count)]
+
+
+def stm32_write_diff(data):
+    # erases and writes only pages or sectors whose crc32 differs from image
+
+    hashes = stm32_page_hash(USER_APP_ADDRESS, len(data))
+    if(hashes is None):
+        print("page hash error")
+        return False
+
+    unit_address = Flash_Base
+    unit = 0
+    changed = 0
+
+    for (unit_size, unit_count) in Flash_Regions:
+        for i in range(unit_count):
+            unit_end = unit_address + unit_size
+
+            if(unit_end > USER_APP_ADDRESS and unit_address < USER_APP_ADDRESS + len(data) and unit < len(hashes)):
+                offset = unit_address - USER_APP_ADDRESS
+                unit_data = data[offset:offset + unit_size]
+
+                # unit image is padded with erased value up to unit end
+                if(CRC32(unit_data + bytes([0xFF] * (unit_size - len(unit_data)))) != hashes[unit]):
+                    print("\nrewriting {}, {} bytes".format(hex(unit_address), len(unit_data)))
+                    changed += 1
+
+                    # erase changed unit only, lazy erase would erase ahead into unchanged ones
+                    if(stm32_erase_span(unit_address, unit_size) != CMD_ACK):
+                        print("flash erase error at " + hex(unit_address))
+                        return False
+
+                    if(not stm32_write_data(unit_address, unit_data, Write_Flags & ~WRITE_FLAG_ERASE)):
+                        return False
+
+                unit += 1
+
+            unit_address = unit_end
+
+    print("\n{} of {} pages or sectors changed".format(changed, len(hashes)))
+    return True
+
+
 def stm32_write(bin_file):
 
     start = millis()
 
-    remaining_bytes = 0
-    f_file_exist = False
-    f_file_size = 0
-    write_block_size = 240
-    stm32_app_address = USER_APP_ADDRESS
+    print("opening file...")
+
+    try:
+        with open(bin_file, "rb") as bin_file_data:
+            data = bin_file_data.read()
+    except(OSError):
+        print("can not open " + bin_file)
+        return
+
+    print("file size " + str(len(data)))
+
+    if(len(data) > FLASH_SIZE):
+        print("file larger than flash")
+        return
+
+    if((Capabilities & CAP_PAGE_HASH) and (Capabilities & CAP_ERASE_RANGE)):
+        # skip pages or sectors already holding image
+        status = stm32_write_diff(data)
+    else:
+        status = stm32_write_data(USER_APP_ADDRESS, data, Write_Flags)
+
+    if(status):
+        print("\nflash write successfull, jolly good!!!!")
+        elapsed_time = max(millis() - start, 1)
+        print("elapsed time = {}ms".format(int(elapsed_time)))
+        print("write speed = {}kB/S".format(int(len(data)/elapsed_time)))
+
+
+def stm32_unit_end(address):
+    # end of page or sector holding address, from device layout
+    unit_end = Flash_Base
+    for (unit_size, unit_count) in Flash_Regions:
+        for i in range(unit_count):
+            unit_end += unit_size
+            if(address < unit_end):
+                return unit_end
+    return unit_end
+
+
+def stm32_write_window(bin_file):
+
+    start = millis()
+
+    write_block_size = Max_Payload
 
     print("opening file...")
 
     try:
-        remaining_bytes = os.path.getsize(bin_file)
-        f_file_size = remaining_bytes
-        bin_file_data = open(bin_file, "rb")
-        print("file size " + str(remaining_bytes))
-        f_file_exist = True
+        with open(bin_file, "rb") as bin_file_data:
+            f_data = bin_file_data.read()
+        print("file size " + str(len(f_data)))
     except(OSError):
         print("can not open " + bin_file)
+        return
 
-    while(remaining_bytes > 0):
+    # ack can wait for a sector erase
+    Serial_Port.timeout = 10
 
-        if(remaining_bytes < write_block_size):
-            write_block_size = remaining_bytes
+    total_frames = (len(f_data) + write_block_size - 1) // write_block_size
+    base_frame = 0  # first unacked frame
+    next_frame = 0  # next frame to send
+    hold_frame = 0  # frames from here wait till all before are acked
+    flags = Write_Flags & WRITE_FLAG_ERASE
+    retry = 0
 
-        bl_packet = bytes()
+    while(base_frame < total_frames):
 
-        # assemble cmd
-        bl_packet += int_to_bytes(CMD_WRITE)
+        # refill window
+        while(next_frame < total_frames and next_frame - base_frame < Window_Size and
+              (next_frame < hold_frame or base_frame >= hold_frame)):
 
-        # no of char to flash to stm32
-        bl_packet += int_to_bytes(write_block_size)
+            offset = next_frame * write_block_size
+            stm32_app_address = USER_APP_ADDRESS + offset
+            payload = f_data[offset:offset + write_block_size]
 
-        # 2 bytes padding for stm32 word alignment
-        bl_packet += int_to_bytes(0x00)
-        bl_packet += int_to_bytes(0x00)
+            # seq and flags, first frame starts a new transfer
+            frame_flags = flags | (WINDOW_FLAG_START if next_frame == 0 else 0x00)
+            stm32_send_packet(stm32_assemble_frame(CMD_WRITE_WINDOW, stm32_app_address, len(payload),
+                                                   payload, next_frame & 0xFF, frame_flags))
 
-        # assemble address
-        bl_packet += int_to_bytes(stm32_app_address >> 24 & 0xFF)
-        bl_packet += int_to_bytes(stm32_app_address >> 16 & 0xFF)
-        bl_packet += int_to_bytes(stm32_app_address >> 8 & 0xFF)
-        bl_packet += int_to_bytes(stm32_app_address >> 0 & 0xFF)
+            next_frame += 1
 
-        # assemble payload
-        for x in range(write_block_size):
-            bl_packet += bin_file_data.read(1)
+            # device receives nothing else while it erases a page or sector this frame starts
+            if(flags and (offset == 0 or stm32_unit_end(stm32_app_address - 1) < stm32_app_address + len(payload))):
+                hold_frame = next_frame
+                break
 
-        # calculate crc
-        crc = CRC8(bl_packet, (write_block_size + 8))
+        # cumulative ack for each programmed frame, [ACK/NACK + next expected seq]
+        response = Serial_Port.read(2)
+        acked = 0
+        resend = True
 
-        # assemble crc
-        bl_packet += int_to_bytes(crc)
+        if(len(response) == 2 and response[0] in (CMD_ACK, CMD_NACK)):
+            acked = (response[1] - base_frame) & 0xFF
 
-        # send sync char
-        Serial_Port.write(int_to_bytes(SYNC_CHAR))
+            if(acked > next_frame - base_frame):
+                acked = 0
 
-        # send no of char in bl_packet
-        Serial_Port.write(int_to_bytes(write_block_size + 9))
+            base_frame += acked
 
-        # send bl_packet
-        Serial_Port.write(bl_packet)
+            # ack of a resent frame that was already programmed moves nothing
+            resend = (response[0] == CMD_NACK)
 
-        if(stm32_read_ack()):
-            #print("flash write success at " + hex(stm32_app_address))
-            pass
-        else:
-            print("flash write error at " + hex(stm32_app_address))
-            break
+        if(acked):
+            retry = 0
+            print("\rremaining bytes:{}".format(max(len(f_data) - base_frame * write_block_size, 0)), end='')
 
-        remaining_bytes -= write_block_size
-        stm32_app_address += write_block_size
-        print("\rremaining bytes:{}".format(remaining_bytes), end='')
+        if(resend):
+            # no response or nack, go back to first unacked frame
+            next_frame = base_frame
 
-        if(remaining_bytes == 0):
-            print("\nflash write successfull, jolly good!!!!")
-            elapsed_time = millis() - start
-            print("elapsed time = {}ms".format(int(elapsed_time)))
-            print("write speed = {}kB/S".format(int(f_file_size/elapsed_time)))
+            retry += 1
+            if(retry > WINDOW_RETRY):
+                Serial_Port.timeout = 1
+                print("flash write error at " + hex(USER_APP_ADDRESS + base_frame * write_block_size))
+                return
+
+    Serial_Port.timeout = 1
+
+    print("\nflash write successfull, jolly good!!!!")
+    elapsed_time = millis() - start
+    print("elapsed time = {}ms".format(int(elapsed_time)))
+    print("write speed = {}kB/S".format(int(len(f_data)/max(elapsed_time, 1))))
+
+
+def stm32_checksum(address, length):
+
+    # crc unit takes a few ms per 100kB
+    Serial_Port.timeout = 1
+
+    stm32_send_packet(stm32_assemble_frame(CMD_CHECKSUM, address, 4, length.to_bytes(4, 'big')))
+
+    # [ACK + 4-byte crc32 + crc]
+    response = Serial_Port.read(6)
+    if(len(response) == 6 and response[0] == CMD_ACK and CRC8(response[1:5], 4) == response[5]):
+        return int.from_bytes(response[1:5], 'big')
+
+    return None
 
-    if(f_file_exist):
-        bin_file_data.close()
-        print("closing file")
+
+def stm32_verify_checksum(bin_file):
+
+    start = millis()
+
+    print("opening file...")
+
+    try:
+        with open(bin_file, "rb") as bin_file_data:
+            data = bin_file_data.read()
+    except(OSError):
+        print("can not open " + bin_file)
+        return
+
+    print("file size " + str(len(data)))
+
+    file_crc = CRC32(data)
+    stm32_crc = stm32_checksum(USER_APP_ADDRESS, len(data))
+
+    if(stm32_crc is None):
+        print("checksum error")
+    elif(stm32_crc != file_crc):
+        print("verify error, crc32 {} expected {}".format(hex(stm32_crc), hex(file_crc)))
+    else:
+        print("verify successfull, crc32 {}, jolly good!!!!".format(hex(stm32_crc)))
+        print("elapsed time = {}ms".format(int(millis() - start)))
 
 
 def stm32_verify(bin_file):
 
+    if(Capabilities & CAP_CHECKSUM):
+        # one crc32 instead of sending image again
+        stm32_verify_checksum(bin_file)
+        return
+
     start = millis()
 
     remaining_bytes = 0
     f_file_exist = False
     f_file_size = 0
-    write_block_size = 240
+    write_block_size = Max_Payload
     stm32_app_address = USER_APP_ADDRESS
 
     print("opening file...")
@@ -357,42 +921,9 @@ def stm32_verify(bin_file):
         if(remaining_bytes < write_block_size):
             write_block_size = remaining_bytes
 
-        bl_packet = bytes()
-
-        # assemble cmd
-        bl_packet += int_to_bytes(CMD_VERIFY)
-
-        # no of char to flash to stm32
-        bl_packet += int_to_bytes(write_block_size)
-
-        # 2 bytes padding for stm32 word alignment
-        bl_packet += int_to_bytes(0x00)
-        bl_packet += int_to_bytes(0x00)
-
-        # assemble address
-        bl_packet += int_to_bytes(stm32_app_address >> 24 & 0xFF)
-        bl_packet += int_to_bytes(stm32_app_address >> 16 & 0xFF)
-        bl_packet += int_to_bytes(stm32_app_address >> 8 & 0xFF)
-        bl_packet += int_to_bytes(stm32_app_address >> 0 & 0xFF)
-
-        # assemble payload
-        for x in range(write_block_size):
-            bl_packet += bin_file_data.read(1)
-
-        # calculate crc
-        crc = CRC8(bl_packet, (write_block_size + 8))
-
-        # assemble crc
-        bl_packet += int_to_bytes(crc)
-
-        # send sync char
-        Serial_Port.write(int_to_bytes(SYNC_CHAR))
-
-        # send no of char in bl_packet
-        Serial_Port.write(int_to_bytes(write_block_size + 9))
-
-        # send bl_packet
-        Serial_Port.write(bl_packet)
+        # assemble frame with payload from file
+        payload = bin_file_data.read(write_block_size)
+        stm32_send_packet(stm32_assemble_frame(CMD_VERIFY, stm32_app_address, write_block_size, payload))
 
         if(stm32_read_ack()):
             #print("verify write success at " + hex(stm32_app_address))
@@ -416,6 +947,109 @@ def stm32_verify(bin_file):
         print("closing file")
 
 
+def stm32_lib_progress(operation, done, total):
+    print("\r{} remaining bytes:{}".format(operation, total - done), end='')
+    if(done == total):
+        print("")
+
+
+def stm32_lib_run(session, cmd, bin_file):
+    # one node, or node selected by caller, False if cmd can not run
+    start = millis()
+
+    if(cmd in ("write", "write_window", "verify") and bin_file is None):
+        print("please enter input file")
+        return False
+    elif(cmd == "write"):
+        session.write_file(bin_file)
+        print("flash write successfull, jolly good!!!!")
+    elif(cmd == "write_window"):
+        session.write_window_file(bin_file)
+        print("flash write successfull, jolly good!!!!")
+    elif(cmd == "verify"):
+        session.verify_file(bin_file)
+        print("verify successfull, jolly good!!!!")
+    elif(cmd == "erase"):
+        session.erase(os.path.getsize(bin_file) if bin_file else 0)
+        print("flash erase success")
+    elif(cmd == "read"):
+        session.read_file("read_file.bin")
+        print("flash read successfull, jolly good!!!!")
+    elif(cmd == "reset"):
+        session.reset()
+        print("mcu reset")
+    elif(cmd == "jump"):
+        session.jump()
+        print("entering user application")
+    elif(cmd == "checksum"):
+        info = session.info()
+        length = os.path.getsize(bin_file) if bin_file else info.app_end - info.app_start
+        print("crc32 {} of {} bytes from {}".format(hex(session.checksum(info.app_start, length)), length, hex(info.app_start)))
+    elif(cmd == "help"):
+        stm32_get_help()
+    elif(cmd != "info"):
+        print("invalid cmd")
+        return False
+
+    print("elapsed time = {}ms".format(millis() - start))
+    return True
+
+
+def stm32_lib_main(port, baud, cmd, bin_file):
+    # same cmds through libstm32bl, which also drives spi:, can: and rs485: ports
+    try:
+        with stm32bl.Session(port, baud, log=print, progress=stm32_lib_progress) as session:
+            print("Port open success")
+
+            # every node on can bus or several on rs485 bus, write is broadcast once for all of them
+            if((port.startswith("can:") and port.endswith(":*")) or (port.startswith("rs485:") and len(session.nodes()) > 1)):
+                nodes = session.nodes()
+
+                try:
+                    session.connect_nodes()
+                except stm32bl.Error as error:
+                    print(error)
+
+                if(cmd == "write" and bin_file):
+                    try:
+                        session.broadcast_write_file(bin_file)
+                    except stm32bl.Error as error:
+                        print(error)
+
+                    for i, node in enumerate(nodes):
+                        print("node {:04X} {}".format(node, "written" if session.node_ok(i) else "failed"))
+                    return
+
+                for i, node in enumerate(nodes):
+                    if(session.node_ok(i)):
+                        session.select(node)
+                        print("node {:04X}".format(node))
+                        try:
+                            stm32_lib_run(session, cmd, bin_file)
+                        except stm32bl.Error as error:
+                            print(error)
+                return
+
+            session.connect()
+            print("connected to stm32 device")
+
+            # each cmd of a list runs on this connection, first failing one stops the rest
+            for step in cmd.split(","):
+                name, _, step_file = step.strip().partition(" ")
+
+                try:
+                    ok = stm32_lib_run(session, name, step_file or bin_file)
+                except stm32bl.Error as error:
+                    print(error)
+                    ok = False
+
+                if(not ok):
+                    print("{} failed, skipping remaining cmds".format(name))
+                    break
+    except stm32bl.Error as error:
+        print("stm32 device {}".format(error))
+
+
 def main():
 
     ser_open = False
@@ -429,6 +1063,12 @@ def main():
         baud = int(sys.argv[2])
         cmd = sys.argv[3]
 
+        # library when it is built, pure python otherwise
+        if(stm32bl.load() is not None):
+            print("using libstm32bl")
+            stm32_lib_main(port, baud, cmd, sys.argv[4] if len(sys.argv) >= 5 else None)
+            return
+
         try:
             Serial_Port = serial.Serial(port, baud, timeout=1)
             ser_open = True
@@ -457,6 +1097,11 @@ def main():
             print("stm32 device connection failed")
         else:
             print("connected to stm32 device")
+
+            # flash layout and capabilities, then large frames if bootloader supports them
+            if(stm32_get_info() and (Capabilities & CAP_FRAME_V2)):
+                stm32_frame_format(FRAME_V2)
+
             if(cmd == "write"):
                 if len(sys.argv) >= 5:
                     bin_file = sys.argv[4]
@@ -464,12 +1109,26 @@ def main():
                     # stm32_jump()
                 else:
                     print("please enter input file")
+            elif(cmd == "write_window"):
+                if len(sys.argv) >= 5:
+                    bin_file = sys.argv[4]
+                    stm32_write_window(bin_file)
+                else:
+                    print("please enter input file")
             elif(cmd == "erase"):
-                stm32_erase()
+                if len(sys.argv) >= 5:
+                    # erase only footprint of input file
+                    bin_file = sys.argv[4]
+                    stm32_erase_range(bin_file)
+                else:
+                    stm32_erase()
             elif(cmd == "reset"):
                 stm32_reset()
             elif(cmd == "jump"):
                 stm32_jump()
+            elif(cmd == "info"):
+                # already printed after connect
+                pass
             elif(cmd == "help"):
                 stm32_get_help()
             elif(cmd == "read"):
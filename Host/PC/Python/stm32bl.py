@@ -0,0 +1,242 @@
+import ctypes
+import os
+import sys
+
+
+# ctypes binding of libstm32bl, see stm32bl.h
+# library is taken from STM32BL_LIB, from next to this file or from ../C, None if it is not there
+
+OK = 0
+ERR_PORT = 1
+ERR_CONNECT = 2
+ERR_FILE = 3
+ERR_SIZE = 4
+ERR_NACK = 5
+ERR_WRITE = 6
+ERR_ERASE = 7
+ERR_READ = 8
+ERR_VERIFY = 9
+ERR_CRC = 10
+ERR_UNSUPPORTED = 11
+ERR_MEMORY = 12
+ERR_CANCELLED = 13
+ERR_NODES = 14
+ERR_ARGUMENT = 15
+PENDING = 16
+
+MAX_REGIONS = 4
+MAX_BAUDS = 8
+MAX_NODES = 256
+
+# progress(operation, done, total) returns True to stop, log(line)
+PROGRESS_FN = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint32, ctypes.c_uint32)
+LOG_FN = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_char_p)
+
+
+class Info(ctypes.Structure):
+    _fields_ = [("device_id", ctypes.c_uint32),
+                ("unique_id", ctypes.c_uint32 * 3),
+                ("flash_total", ctypes.c_uint32),
+                ("app_start", ctypes.c_uint32),
+                ("app_end", ctypes.c_uint32),
+                ("max_payload", ctypes.c_uint32),
+                ("window_size", ctypes.c_uint32),
+                ("capabilities", ctypes.c_uint32),
+                ("frame_version", ctypes.c_uint32),
+                ("region_count", ctypes.c_uint32),
+                ("unit_size", ctypes.c_uint32 * MAX_REGIONS),
+                ("unit_count", ctypes.c_uint32 * MAX_REGIONS),
+                ("baud_count", ctypes.c_uint32),
+                ("baud", ctypes.c_uint32 * MAX_BAUDS)]
+
+
+Lib = None
+
+
+def load():
+    global Lib
+
+    if(Lib is not None):
+        return Lib
+
+    name = "stm32bl.dll" if sys.platform == "win32" else "libstm32bl.so"
+    here = os.path.dirname(os.path.abspath(__file__))
+    paths = [os.environ.get("STM32BL_LIB"), os.path.join(here, name), os.path.join(here, "..", "C", name)]
+
+    for path in paths:
+        if(path and os.path.exists(path)):
+            try:
+                Lib = ctypes.CDLL(path)
+                break
+            except(OSError):
+                pass
+
+    if(Lib is None):
+        return None
+
+    p, u32, u16p, u8p = ctypes.c_void_p, ctypes.c_uint32, ctypes.POINTER(ctypes.c_uint16), ctypes.POINTER(ctypes.c_uint8)
+
+    Lib.stm32bl_session_open.restype = p
+    Lib.stm32bl_session_open.argtypes = [ctypes.c_char_p, u32]
+    Lib.stm32bl_session_close.argtypes = [p]
+    Lib.stm32bl_set_callbacks.argtypes = [p, PROGRESS_FN, LOG_FN, p]
+    Lib.stm32bl_strerror.restype = ctypes.c_char_p
+    Lib.stm32bl_strerror.argtypes = [ctypes.c_int]
+    Lib.stm32bl_error_address.restype = u32
+    Lib.stm32bl_error_address.argtypes = [p]
+    Lib.stm32bl_info.argtypes = [p, ctypes.POINTER(Info)]
+    Lib.stm32bl_write.argtypes = [p, u8p, u32]
+    Lib.stm32bl_verify.argtypes = [p, u8p, u32]
+    Lib.stm32bl_read.argtypes = [p, u32, u8p, u32]
+    Lib.stm32bl_erase.argtypes = [p, u32]
+    Lib.stm32bl_checksum.argtypes = [p, u32, u32, ctypes.POINTER(u32)]
+    Lib.stm32bl_nodes.restype = u32
+    Lib.stm32bl_nodes.argtypes = [p, u16p, u32]
+    Lib.stm32bl_select.argtypes = [p, ctypes.c_uint16]
+    Lib.stm32bl_node_ok.argtypes = [p, u32]
+    Lib.stm32bl_write_start.argtypes = [p, u8p, u32]
+    Lib.stm32bl_verify_start.argtypes = [p, u8p, u32]
+    Lib.stm32bl_step_timeout.restype = u32
+
+    for fn in ["connect", "reset", "jump", "connect_nodes", "fd", "step", "step_timeout"]:
+        getattr(Lib, "stm32bl_" + fn).argtypes = [p]
+
+    for fn in ["write_file", "write_window_file", "verify_file", "read_file", "broadcast_write_file"]:
+        getattr(Lib, "stm32bl_" + fn).argtypes = [p, ctypes.c_char_p]
+
+    return Lib
+
+
+class Error(Exception):
+
+    # address where device reported write, erase, read or verify error
+    def __init__(self, status, address=0):
+        self.status = status
+        self.address = address
+        text = Lib.stm32bl_strerror(status).decode()
+        if(status in (ERR_WRITE, ERR_ERASE, ERR_READ, ERR_VERIFY, ERR_CRC)):
+            text += " at 0X{:x}".format(address)
+        super().__init__(text)
+
+
+class Session:
+
+    # session on port string as the c tool takes it, log and progress are optional callables
+    def __init__(self, port, baud, log=None, progress=None):
+        if(load() is None):
+            raise OSError("libstm32bl not found")
+
+        self.handle = Lib.stm32bl_session_open(port.encode(), baud)
+
+        if(not self.handle):
+            raise Error(ERR_PORT)
+
+        # kept referenced for as long as library may call them
+        self.log_fn = LOG_FN(lambda user, line: log(line.decode()) if log else None)
+        self.progress_fn = PROGRESS_FN(lambda user, operation, done, total:
+                                       1 if progress and progress(operation.decode(), done, total) else 0)
+        Lib.stm32bl_set_callbacks(self.handle, self.progress_fn, self.log_fn, None)
+
+    def close(self):
+        if(self.handle):
+            Lib.stm32bl_session_close(self.handle)
+            self.handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def check(self, status):
+        if(status != OK):
+            raise Error(status, Lib.stm32bl_error_address(self.handle))
+
+    def connect(self):
+        self.check(Lib.stm32bl_connect(self.handle))
+
+    def info(self):
+        info = Info()
+        self.check(Lib.stm32bl_info(self.handle, ctypes.byref(info)))
+        return info
+
+    def write_file(self, path):
+        self.check(Lib.stm32bl_write_file(self.handle, path.encode()))
+
+    def write_window_file(self, path):
+        self.check(Lib.stm32bl_write_window_file(self.handle, path.encode()))
+
+    def verify_file(self, path):
+        self.check(Lib.stm32bl_verify_file(self.handle, path.encode()))
+
+    def write(self, data):
+        buf = (ctypes.c_uint8 * len(data)).from_buffer_copy(data)
+        self.check(Lib.stm32bl_write(self.handle, buf, len(data)))
+
+    def verify(self, data):
+        buf = (ctypes.c_uint8 * len(data)).from_buffer_copy(data)
+        self.check(Lib.stm32bl_verify(self.handle, buf, len(data)))
+
+    def read(self, address, length):
+        buf = (ctypes.c_uint8 * length)()
+        self.check(Lib.stm32bl_read(self.handle, address, buf, length))
+        return bytes(buf)
+
+    def read_file(self, path):
+        self.check(Lib.stm32bl_read_file(self.handle, path.encode()))
+
+    # whole flash, or pages or sectors under length bytes from app start
+    def erase(self, length=0):
+        self.check(Lib.stm32bl_erase(self.handle, length))
+
+    def checksum(self, address, length):
+        crc = ctypes.c_uint32()
+        self.check(Lib.stm32bl_checksum(self.handle, address, length, ctypes.byref(crc)))
+        return crc.value
+
+    def reset(self):
+        self.check(Lib.stm32bl_reset(self.handle))
+
+    def jump(self):
+        self.check(Lib.stm32bl_jump(self.handle))
+
+    def nodes(self):
+        nodes = (ctypes.c_uint16 * MAX_NODES)()
+        count = Lib.stm32bl_nodes(self.handle, nodes, MAX_NODES)
+        return list(nodes[:min(count, MAX_NODES)])
+
+    def select(self, node):
+        Lib.stm32bl_select(self.handle, node)
+
+    # raise Error with ERR_NODES unless every node made it, node_ok tells which did
+    def connect_nodes(self):
+        self.check(Lib.stm32bl_connect_nodes(self.handle))
+
+    def broadcast_write_file(self, path):
+        self.check(Lib.stm32bl_broadcast_write_file(self.handle, path.encode()))
+
+    def node_ok(self, i):
+        return Lib.stm32bl_node_ok(self.handle, i) != 0
+
+    # non-blocking write or crc32 check, image is kept here until it is done
+    # step once fd is readable or step_timeout ms have passed, True once done
+    def write_start(self, data):
+        self.job_data = (ctypes.c_uint8 * len(data)).from_buffer_copy(data)
+        Lib.stm32bl_write_start(self.handle, self.job_data, len(data))
+
+    def verify_start(self, data):
+        self.job_data = (ctypes.c_uint8 * len(data)).from_buffer_copy(data)
+        Lib.stm32bl_verify_start(self.handle, self.job_data, len(data))
+
+    def fd(self):
+        return Lib.stm32bl_fd(self.handle)
+
+    def step(self):
+        status = Lib.stm32bl_step(self.handle)
+        if(status == PENDING):
+            return False
+        self.check(status)
+        return True
+
+    def step_timeout(self):
+        return Lib.stm32bl_step_timeout(self.handle)
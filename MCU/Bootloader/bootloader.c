@@ -2,7 +2,7 @@
  * @file bootloader.c
  * @brief Implements bootloader control commands
  * @author xyz
- * @version 0.1.7
+ * @version 0.1.31
  */
 
 /**
@@ -18,6 +18,61 @@
  *   2. usb cdc interface
  ******V0.1.7***
  *   1.using magic number to decide to bootloader
+ ******V0.1.8***
+ *   1. windowed write cmd with sequence numbers and cumulative ack
+ ******V0.1.9***
+ *   1. v2 frame format with 16-bit frame len and page sized payload
+ ******V0.1.10***
+ *   1. deferred write, ack before programming and report errors on next frame
+ *   2. uart rx in background from isr
+ ******V0.1.11***
+ *   1. erase range cmd, erases only pages or sectors covering given span
+ ******V0.1.12***
+ *   1. lazy erase on first write, next page or sector erased while next frame is received
+ ******V0.1.13***
+ *   1. flash geometry table per target
+ *   2. get info cmd, device id, flash layout, frame size, baud rates and capabilities
+ ******V0.1.14***
+ *   1. checksum cmd, crc32 of a flash span from hardware crc unit
+ ******V0.1.15***
+ *   1. page hash cmd, crc32 of every page or sector in a span for differential reflash
+ ******V0.1.16***
+ *   1. compressed write cmd, lz4 block per frame decompressed into tx buffer
+ ******V0.1.17***
+ *   1. uart rx into circular dma buffer with idle line wakeup, tx over dma
+ ******V0.1.18***
+ *   1. cdc rx in lock free ring, out endpoint naks while ring is full
+ ******V0.1.19***
+ *   1. cdc tx queue coalescing replies into full packets
+ ******V0.1.20***
+ *   1. cdc rx waits sleep until usb isr, timeouts kept to the us
+ ******V0.1.21***
+ *   1. connect arbiter woken by transport isr, first connect cmd wins the session
+ ******V0.1.22***
+ *   1. transports behind a descriptor with buffer send, receive, poll and capabilities
+ *   2. payload reported to host is capped so a whole frame fits transport receive buffer
+ ******V0.1.23***
+ *   1. spi slave transport over dma with ready line
+ ******V0.1.24***
+ *   1. bxcan transport with node ids, broadcast frames with per node missing segment report
+ ******V0.1.25***
+ *   1. rs485 addressed mode on uart, driver enable around replies, broadcast frames without reply
+ *   2. node address handed over by application next to magic number
+ ******V0.1.26***
+ *   1. frames whose header len exceeds payload that arrived are nacked
+ ******V0.1.27***
+ *   1. page or sector erase started from ram function so transport is polled while it runs
+ ******V0.1.28***
+ *   1. erase ahead only with more frames flag from host, nothing past image is erased
+ ******V0.1.29***
+ *   1. cdc receive timeout copies no more chars than asked for
+ ******V0.1.30***
+ *   1. write window frames are programmed and acked as they arrive, frame pool is gone
+ *   2. resent start frame of running window transfer does not restart it
+ *   3. write window honours BL_WRITE_FLAG_ERASE
+ ******V0.1.31***
+ *   1. lazy erase starts next page or sector on first write into current one, up to image end sent with BL_WRITE_FLAG_END
+ *   2. erase ahead no longer holds off interrupts on dma transports, main loop finishes it
  * */
 
 /** stdandard includes */
@@ -43,13 +98,26 @@
 
 #define BL_VERSION_MAJOR (0)
 #define BL_VERSION_MINOR (1)
-#define BL_VERSION_BUILD (7)
+#define BL_VERSION_BUILD (31)
 
-#define BL_RX_BUFFER_SIZE (1024)
-#define BL_TX_BUFFER_SIZE (1024)
+/* run of equally sized pages or sectors */
+struct BL_Flash_Region_t
+{
+    uint32_t Unit_Size;  // bytes per page or sector
+    uint32_t Unit_Count; // no of pages or sectors in run
+};
 
-static uint8_t BL_RX_Buffer[BL_RX_BUFFER_SIZE];
-static uint8_t BL_TX_Buffer[BL_TX_BUFFER_SIZE];
+/* flash geometry, all erase, write, read and verify bounds are derived from it
+   program width is 4, flash is programmed with FLASH_TYPEPROGRAM_WORD */
+struct BL_Flash_Geometry_t
+{
+    uint32_t Base;          // address of page or sector 0
+    uint32_t Size;          // total flash
+    uint32_t Reserved;      // bytes used by bootloader, on page or sector boundary
+    uint32_t Program_Width; // bytes per program operation
+    uint32_t Region_Count;
+    struct BL_Flash_Region_t Regions[3];
+};
 
 #ifdef STM32F103xE
 #include "stm32f1xx_hal.h"
@@ -60,14 +128,14 @@ static uint8_t BL_TX_Buffer[BL_TX_BUFFER_SIZE];
  *  pages to erase 8 to 255, except pages 0 to 7 (bootloader).
  *  Erase type- pages.
  *  Programaing voltage- 2.7v to 3.3v.
- *  Flash writing width - double word.
+ *  Flash writing width - word, programmed as two half words.
  */
-#define BL_PAGE_SIZE (2 * 1024) // 2KB
-#define BL_TOTAL_PAGES 255      // 255*2KB
-#define BL_USED_PAGES 8         // 8*2KB
+#define BL_FLASH_UNITS 256 // pages
 
-#define USER_FLASH_START_ADDRESS (0x08000000 + BL_USED_PAGES * BL_PAGE_SIZE)
-#define USER_FLASH_END_ADDRESS (0x08000000 + 512 * 1024)
+static const struct BL_Flash_Geometry_t BL_Flash =
+    {0x08000000, 512 * 1024, 8 * 2 * 1024, 4, 1, {{2 * 1024, 256}}};
+
+#define BL_MAX_PAYLOAD (2 * 1024) // v2 frame payload, one page
 #endif
 
 #ifdef STM32F103xB
@@ -76,17 +144,17 @@ static uint8_t BL_TX_Buffer[BL_TX_BUFFER_SIZE];
  *  STM32F103C8 -- 64KB total flash.
  *  Bootloader resides in pages 0,1--7 1KB*8 Flash.
  *  Total pages in 103C* are 64.
- *  pages to erase 8 to 64, except pages 0 to 7 (bootloader).
+ *  pages to erase 8 to 63, except pages 0 to 7 (bootloader).
  *  Erase type- pages.
  *  Programaing voltage- 2.7v to 3.3v.
- *  Flash writing width - double word.
+ *  Flash writing width - word, programmed as two half words.
  */
-#define BL_PAGE_SIZE (1 * 1024) // 1KB
-#define BL_TOTAL_PAGES 64       // 64*1KB
-#define BL_USED_PAGES 8         // 8*1KB
+#define BL_FLASH_UNITS 64 // pages
+
+static const struct BL_Flash_Geometry_t BL_Flash =
+    {0x08000000, 64 * 1024, 8 * 1 * 1024, 4, 1, {{1 * 1024, 64}}};
 
-#define USER_FLASH_START_ADDRESS (0x08000000 + BL_USED_PAGES * BL_PAGE_SIZE)
-#define USER_FLASH_END_ADDRESS (0x08000000 + 64 * 1024)
+#define BL_MAX_PAYLOAD (1 * 1024) // v2 frame payload, one page
 #endif
 
 #ifdef STM32F401xE
@@ -94,45 +162,108 @@ static uint8_t BL_TX_Buffer[BL_TX_BUFFER_SIZE];
 /**
  *  STM32F401RE -- 512KB total flash.
  *  Bootloader resides in sector 0 -- 16KB Flash.
- *  Total sectors in 401RE are 8.
+ *  Total sectors in 401RE are 8, 16KB+16KB+16KB+16KB+64KB+128KB+128KB+128KB.
  *  Sectors to erase 7, except sector 0 (bootloader).
  *  Erase type- sector by sector.
  *  Programaing voltage- 2.7v to 3.3v.
- *  Flash writing width - byte by byte for 2.7v to 3.3v.
+ *  Flash writing width - word for 2.7v to 3.3v.
  */
-#define BL_SECTOR_SIZE (16 * 1024) //16KB
-#define BL_TOTAL_SECTORS 8         // 16KB+16KB+16KB+16KB+64KB+128KB+128KB+128KB
-#define BL_USED_SECTORS 1          // 16KB
+#define BL_FLASH_UNITS 8 // sectors
 
-#define USER_FLASH_START_ADDRESS (0x08000000 + BL_USED_SECTORS * BL_SECTOR_SIZE)
-#define USER_FLASH_END_ADDRESS (0x08000000 + 512 * 1024)
+static const struct BL_Flash_Geometry_t BL_Flash =
+    {0x08000000, 512 * 1024, 16 * 1024, 4, 3, {{16 * 1024, 4}, {64 * 1024, 1}, {128 * 1024, 3}}};
+
+#define BL_MAX_PAYLOAD (4 * 1024) // v2 frame payload, quarter of smallest sector
 #endif
 
 #ifdef STM32F407xx
 #include "stm32f4xx_hal.h"
 /**
  *  STM32F407xx -- 1024K total flash.
- *  Bootloader resides in sector 0 -- 16KB Flash.
- *  Total sectors in 407VG are 12.
- *  Sectors to erase 11, except sector 0 (bootloader).
+ *  Bootloader resides in sector 0,1 -- 32KB Flash.
+ *  Total sectors in 407VG are 12, 16KB+16KB+16KB+16KB+64KB+128KB*7.
+ *  Sectors to erase 10, except sector 0,1 (bootloader).
  *  Erase type- sector by sector.
  *  Programaing voltage- 2.7v to 3.3v.
- *  Flash writing width - byte by byte for 2.7v to 3.3v.
+ *  Flash writing width - word for 2.7v to 3.3v.
  */
-#define BL_SECTOR_SIZE (16 * 1024) //16KB
-#define BL_TOTAL_SECTORS 12        // 16KB+16KB+16KB+16KB+64KB+128KB+128KB+128KB...128KB
-#define BL_USED_SECTORS 2          // 16KB*2
+#define BL_FLASH_UNITS 12 // sectors
 
-#define USER_FLASH_START_ADDRESS (0x08000000 + BL_USED_SECTORS * BL_SECTOR_SIZE)
-#define USER_FLASH_END_ADDRESS (0x08000000 + 1024 * 1024) // 32KB used by bootloader remaining
+static const struct BL_Flash_Geometry_t BL_Flash =
+    {0x08000000, 1024 * 1024, 2 * 16 * 1024, 4, 3, {{16 * 1024, 4}, {64 * 1024, 1}, {128 * 1024, 7}}};
+
+#define BL_MAX_PAYLOAD (4 * 1024) // v2 frame payload, quarter of smallest sector
 #endif
 
+#define USER_FLASH_START_ADDRESS (BL_Flash.Base + BL_Flash.Reserved)
+#define USER_FLASH_END_ADDRESS (BL_Flash.Base + BL_Flash.Size)
+
+/* longest erase or program waited for, well above a 128 KB sector erase */
+#define BL_FLASH_TIMEOUT 50000U
+
+/* largest v2 frame, 12-byte header + payload + 4-byte image end + 1-byte crc, rounded to word */
+#define BL_FRAME_SIZE (BL_MAX_PAYLOAD + 20)
+
+#define BL_RX_BUFFER_SIZE BL_FRAME_SIZE
+#define BL_TX_BUFFER_SIZE BL_FRAME_SIZE
+
+static uint8_t BL_RX_Buffer[BL_RX_BUFFER_SIZE];
+static uint8_t BL_TX_Buffer[BL_TX_BUFFER_SIZE];
+
+/* number of CMD_WRITE_WINDOW frames host keeps in flight */
+#define BL_WINDOW_SIZE (4)
+
 /*
 CMD_WRITE, CMD_VERIFY Frame
 [SYNC_CHAR + frame len] frame len = 9 + payload len
 [1-byte cmd + 1-byte no of bytes to write + 0x00 + 0x00 + 4-byte address +  payload + 1-byte CRC]
 */
 
+/*
+CMD_WRITE Frame with BL_WRITE_FLAG_DEFER set in flags byte (padding byte 3)
+frame is acked as soon as it is received and crc is valid, then programmed while next frame is received
+a programming failure is reported on next deferred frame, which is discarded
+response [ACK] or [ERROR + 4-byte address of failed frame + 1-byte CRC]
+host sends a deferred frame with no payload at the end to collect status of last frame
+*/
+
+/*
+CMD_WRITE Frame with BL_WRITE_FLAG_ERASE set in flags byte
+each page or sector is erased on first write into it in this session, no separate CMD_ERASE needed
+first write into a page or sector also starts erase of next one if it holds part of image,
+main loop polls it while next frames are received
+erase state is cleared on CMD_CONNECT, combines with BL_WRITE_FLAG_DEFER
+*/
+
+/*
+CMD_WRITE, CMD_WRITE_COMPRESSED Frame with BL_WRITE_FLAG_END set in flags byte
+[... + payload + 4-byte image end address + 1-byte CRC], header len counts payload only
+host sets it on first frame of an image written with BL_WRITE_FLAG_ERASE,
+nothing at or past image end is erased ahead
+*/
+
+/*
+CMD_WRITE_COMPRESSED Frame, payload is 4-byte no of bytes to write + lz4 block decompressing to them
+[SYNC_CHAR + frame len] frame len = 13 + lz4 block len
+[1-byte cmd + 1-byte payload len + 0x00 + 1-byte flags + 4-byte address + 4-byte no of bytes + lz4 block + 1-byte CRC]
+at most BL_MAX_PAYLOAD bytes per frame, each block is independent, flags and response as CMD_WRITE
+malformed block is NACKed
+*/
+
+/*
+CMD_WRITE_WINDOW Frame
+[SYNC_CHAR + frame len] frame len = 9 + payload len
+[1-byte cmd + 1-byte no of bytes to write + 1-byte seq + 1-byte flags + 4-byte address +  payload + 1-byte CRC]
+host keeps up to BL_WINDOW_SIZE frames in flight, first frame of a transfer has BL_WINDOW_FLAG_START set.
+each in order frame is programmed as it arrives and acked cumulatively, host sends next frame on each ack
+start frame with seq and address of running transfer is a resend and does not restart it, host starts each
+transfer at a new seq, frames already programmed are acked again
+first frame after a gap is NACKed once, frames after it are dropped till the missing one arrives
+with BL_WRITE_FLAG_ERASE pages or sectors are erased on first write like CMD_WRITE, host holds back frames
+behind one that starts a page or sector till it is acked, rx buffer only holds one frame while flash erases
+response [ACK or NACK + 1-byte next expected seq], host resends from next expected seq on NACK
+*/
+
 /*
 CMD_READ Frame
 [SYNC_CHAR + frame len] frame len = 9
@@ -140,11 +271,63 @@ CMD_READ Frame
 */
 
 /*
-CMD_ERASE, CMD_RESET, CMD_JUMP, CMD_GETVER Frame
+CMD_FRAME_FORMAT Frame, sent in current frame format
+[SYNC_CHAR + frame len] frame len = 3
+[1-byte cmd + 1-byte frame version + 1-byte CRC]
+response [ACK + 1-byte frame version + 2-byte max payload + 1-byte CRC] or [NACK]
+format stays in effect until next CMD_CONNECT, old hosts never send it and keep v1 frames
+*/
+
+/*
+v2 Frame, same header as v1 with 4-byte len appended, payload stays word aligned
+[SYNC_CHAR + 2-byte frame len] frame len = 13 + payload len
+[1-byte cmd + 0x00 + 1-byte seq + 1-byte flags + 4-byte address + 4-byte no of bytes + payload + 1-byte CRC]
+CMD_ERASE, CMD_RESET, CMD_JUMP, CMD_GETVER in v2
+[SYNC_CHAR + 2-byte frame len] frame len = 2
+[1-byte cmd + 1-byte CRC]
+*/
+
+/*
+CMD_ERASE_RANGE Frame, no of bytes to erase sent as 4-byte payload so v1 frames can carry it
+[SYNC_CHAR + frame len] frame len = 13
+[1-byte cmd + 0x04 + 0x00 + 0x00 + 4-byte address + 4-byte no of bytes to erase + 1-byte CRC]
+v2 frame len = 17, 4-byte no of bytes in header is 4
+erases every page or sector overlapping [address, address + no of bytes), response [ACK] or [NACK]
+*/
+
+/*
+CMD_CHECKSUM Frame, no of bytes sent as 4-byte payload like CMD_ERASE_RANGE
+[SYNC_CHAR + frame len] frame len = 13
+[1-byte cmd + 0x04 + 0x00 + 0x00 + 4-byte address + 4-byte no of bytes + 1-byte CRC]
+response [ACK + 4-byte CRC32 + 1-byte CRC of CRC32] or [NACK]
+CRC32 from hardware crc unit, poly 0x04C11DB7, init 0xFFFFFFFF, no reflection, no final xor,
+fed with little endian words read from flash, tail word padded with 0xFF
+*/
+
+/*
+CMD_PAGE_HASH Frame, same as CMD_CHECKSUM
+[SYNC_CHAR + frame len] frame len = 13
+[1-byte cmd + 0x04 + 0x00 + 0x00 + 4-byte address + 4-byte no of bytes + 1-byte CRC]
+response [ACK + 2-byte count + count * 4-byte CRC32 + 1-byte CRC of count and CRC32s] or [NACK]
+one CRC32 as in CMD_CHECKSUM for every whole page or sector overlapping the span, in address order
+*/
+
+/*
+CMD_ERASE, CMD_RESET, CMD_JUMP, CMD_GETVER, CMD_GET_INFO Frame
 [SYNC_CHAR + frame len] frame len = 2
 [1-byte cmd + 1-byte CRC]
 */
 
+/*
+CMD_GET_INFO response, all fields big endian
+[ACK + 2-byte info len + info + 1-byte CRC of info]
+info
+[1-byte info version + 4-byte device id (rev id << 16 | dev id) + 12-byte unique id +
+ 4-byte flash size + 4-byte app start + 4-byte app end + 4-byte max payload + 1-byte window size +
+ 4-byte capabilities + 1-byte region count + region count * (4-byte page or sector size + 2-byte count) +
+ 1-byte baud count + baud count * 4-byte baud rate, first one in use]
+*/
+
 #define BL_CMD_WRITE 0x50
 #define BL_CMD_READ 0x51
 #define BL_CMD_ERASE 0x52
@@ -152,6 +335,13 @@ CMD_ERASE, CMD_RESET, CMD_JUMP, CMD_GETVER Frame
 #define BL_CMD_JUMP 0x54
 #define BL_CMD_VERIFY 0x55
 #define BL_CMD_GETVER 0x56
+#define BL_CMD_WRITE_WINDOW 0x57
+#define BL_CMD_FRAME_FORMAT 0x58
+#define BL_CMD_ERASE_RANGE 0x59
+#define BL_CMD_GET_INFO 0x5A
+#define BL_CMD_CHECKSUM 0x5B
+#define BL_CMD_PAGE_HASH 0x5C
+#define BL_CMD_WRITE_COMPRESSED 0x5D
 
 #define BL_CMD_ACK 0x90
 #define BL_CMD_NACK 0x91
@@ -159,6 +349,33 @@ CMD_ERASE, CMD_RESET, CMD_JUMP, CMD_GETVER Frame
 
 #define BL_SYNC_CHAR '$'
 
+/* frame versions */
+#define BL_FRAME_V1 1
+#define BL_FRAME_V2 2
+
+/* CMD_WRITE_WINDOW flags */
+#define BL_WINDOW_FLAG_START 0x01
+
+/* CMD_WRITE flags */
+#define BL_WRITE_FLAG_DEFER 0x02
+#define BL_WRITE_FLAG_ERASE 0x04
+#define BL_WRITE_FLAG_END 0x10
+
+/* CMD_GET_INFO capabilities */
+#define BL_CAP_WINDOW 0x0001      // CMD_WRITE_WINDOW
+#define BL_CAP_FRAME_V2 0x0002    // CMD_FRAME_FORMAT v2
+#define BL_CAP_DEFER_WRITE 0x0004 // BL_WRITE_FLAG_DEFER
+#define BL_CAP_ERASE_RANGE 0x0008 // CMD_ERASE_RANGE
+#define BL_CAP_LAZY_ERASE 0x0010  // BL_WRITE_FLAG_ERASE
+#define BL_CAP_AUTO_BAUD 0x0020   // uart baud detected on connect
+#define BL_CAP_CHECKSUM 0x0040    // CMD_CHECKSUM
+#define BL_CAP_PAGE_HASH 0x0080   // CMD_PAGE_HASH
+#define BL_CAP_COMPRESSED 0x0100  // CMD_WRITE_COMPRESSED
+#define BL_CAP_ADDRESSED 0x0200   // uart on rs485 bus, frames to broadcast address get no reply
+#define BL_CAP_IMAGE_END 0x0400   // BL_WRITE_FLAG_END
+
+#define BL_INFO_VERSION 1
+
 /* used for auto baud detection ST AN4908*/
 #define BL_CMD_CONNECT 0x7F
 
@@ -206,6 +423,40 @@ uint8_t BL_CRC8_Table[] =
         0xE9, 0xB7, 0x55, 0x0B, 0x88, 0xD6, 0x34, 0x6A, 0x2B, 0x75, 0x97, 0xC9, 0x4A, 0x14, 0xF6, 0xA8,
         0x74, 0x2A, 0xC8, 0x96, 0x15, 0x4B, 0xA9, 0xF7, 0xB6, 0xE8, 0x0A, 0x54, 0xD7, 0x89, 0x6B, 0x35};
 
+/* frame format negotiated with CMD_FRAME_FORMAT */
+static uint8_t BL_Frame_Version = BL_FRAME_V1;
+
+/* seq of next in order frame */
+static uint8_t BL_Window_Expected_Seq;
+
+/* set once a gap is NACKed, frames after it are dropped till the missing one arrives */
+static uint8_t BL_Window_Error;
+
+/* set while a CMD_WRITE_WINDOW transfer runs, any other cmd ends it */
+static uint8_t BL_Window_Active;
+
+/* seq and address of start frame of running transfer, tells a resent start frame from a new transfer */
+static uint8_t BL_Window_Start_Seq;
+static uint32_t BL_Window_Start_Address;
+
+/* set if a deferred CMD_WRITE frame failed to program */
+static uint8_t BL_Write_Error;
+
+/* address of deferred frame that failed */
+static uint32_t BL_Write_Error_Address;
+
+/* pages or sectors erased in this session, one bit each */
+static uint8_t BL_Erased_Map[(BL_FLASH_UNITS + 7) / 8];
+
+/* set while an erase started by ST_Erase_Start() is not finished */
+static uint8_t BL_Erase_Pending;
+
+/* page or sector being erased */
+static uint32_t BL_Erase_Pending_Unit;
+
+/* end of image from last BL_WRITE_FLAG_END frame, 0 if none */
+static uint32_t BL_Image_End;
+
 /**
  * @}
  */
@@ -217,23 +468,71 @@ uint8_t BL_CRC8_Table[] =
  */
 
 static uint8_t ST_Erase_Flash(void);
-static uint8_t BL_CRC8(uint8_t *data, uint8_t len);
-static void BL_Write_Callback(uint32_t address, const uint8_t *data, uint32_t len);
-static void BL_Verify_Callback(uint32_t address, const uint8_t *data, uint8_t len);
+static uint8_t ST_Erase_Range(uint32_t address, uint32_t len);
+static uint8_t ST_Is_User_Flash(uint32_t address, uint32_t len);
+static uint32_t ST_Get_Unit(uint32_t address);
+static uint32_t ST_Get_Unit_Address(uint32_t unit);
+static uint8_t ST_Erase_Unit(uint32_t unit);
+static void ST_Erase_Start(uint32_t unit);
+static uint8_t ST_Erase_Finish(void);
+static void ST_Erase_Poll(void);
+static uint8_t ST_Lazy_Erase(uint32_t address, uint32_t len);
+static void ST_Erase_Ahead(uint32_t address, uint32_t len);
+static void ST_Flash_Erase_Start(uint32_t unit, uint32_t address);
+static uint8_t ST_Write_Flash(uint32_t address, const uint8_t *data, uint32_t len);
+static uint32_t ST_CRC32(uint32_t address, uint32_t len);
+static uint8_t BL_CRC8(uint8_t *data, uint32_t len);
+static uint8_t *BL_Parse_Header(uint8_t *frame, uint32_t *address, uint32_t *len);
+static uint8_t BL_Payload_Fits(const uint8_t *frame, uint32_t frame_len, uint32_t len);
+static void BL_Write_Callback(uint32_t address, const uint8_t *data, uint32_t len, uint8_t flags);
+static void BL_Write_Error_Report(void);
+static void BL_Write_Compressed_Callback(uint32_t address, const uint8_t *data, uint32_t len, uint8_t flags);
+static uint32_t BL_LZ4_Decompress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len);
+static void BL_Verify_Callback(uint32_t address, const uint8_t *data, uint32_t len);
 static void BL_Read_Callback(uint32_t address, uint32_t len);
 static void BL_Erase_Callback(void);
+static void BL_Erase_Range_Callback(uint32_t address, const uint8_t *data, uint32_t len);
+static void BL_Checksum_Callback(uint32_t address, const uint8_t *data, uint32_t len);
+static void BL_Page_Hash_Callback(uint32_t address, const uint8_t *data, uint32_t len);
 static void BL_Jump_Callback(void);
 static void BL_Jump(void);
 static void BL_Get_Version_Callback(void);
+static void BL_Get_Info_Callback(void);
+static uint32_t BL_Put_U32(uint8_t *buffer, uint32_t value);
+static void BL_Write_Window_Callback(const uint8_t *frame, uint32_t frame_len);
+static void BL_Frame_Format_Callback(uint8_t version);
+static void BL_Window_Ack(uint8_t status);
+static uint32_t BL_Get_Max_Payload(void);
+static void BL_Send_Char(uint8_t data);
+static int BL_Get_Char(uint32_t timeout);
+static void BL_Connect_Arbiter(void);
 static void BL_Loop(void);
 
-static void (*BL_COMM_Deinit)(void);
+/** every enabled transport, first one to present connect cmd wins the session */
+static const struct BL_COMM_Transport_t *const BL_Transports[] = {
+    &BL_UART_Transport,
+#if (USE_USB_CDC == 1)
+    &BL_CDC_Transport,
+#endif
+#if (USE_SPI == 1)
+    &BL_SPI_Transport,
+#endif
+#if (USE_CAN == 1)
+    &BL_CAN_Transport,
+#endif
+};
 
-static void (*BL_Send_Char)(char data);
-static void (*BL_Send_Chars)(char *data, uint32_t count);
+/** transport of current session, NULL until connected */
+static const struct BL_COMM_Transport_t *BL_Transport;
 
-static int (*BL_Get_Char)(uint32_t timeout);
-static uint32_t (*BL_Get_Chars)(char *buffer, uint32_t count, uint32_t timeout);
+/* copy of session transport poll in ram, descriptor in flash cannot be read while flash is busy */
+static void (*BL_COMM_Poll)(void);
+
+/** set by transport isr when chars arrive, arbiter sleeps while it is clear */
+static volatile uint8_t BL_RX_Event;
+
+/** node address application wrote next to magic number before reset, 0 if none */
+static uint8_t BL_Handover_Address;
 
 /**
  * @}
@@ -251,11 +550,11 @@ static uint32_t (*BL_Get_Chars)(char *buffer, uint32_t count, uint32_t timeout);
  * @param len number of bytes in input buffer
  * @retval return calculated crc
  */
-static uint8_t BL_CRC8(uint8_t *data, uint8_t len)
+static uint8_t BL_CRC8(uint8_t *data, uint32_t len)
 {
     uint8_t crc = 0;
 
-    for (uint8_t i = 0; i < len; i++)
+    for (uint32_t i = 0; i < len; i++)
     {
         crc = BL_CRC8_Table[crc ^ data[i]];
     }
@@ -263,27 +562,167 @@ static uint8_t BL_CRC8(uint8_t *data, uint8_t len)
     return crc;
 }
 
+/**
+ * @brief decode address and no of bytes from frame header
+ * @note header layout depends on negotiated frame version
+ * @param frame received frame without sync char and frame len
+ * @param address decoded address
+ * @param len decoded no of bytes to write, read or verify
+ * @retval pointer to payload
+ */
+static uint8_t *BL_Parse_Header(uint8_t *frame, uint32_t *address, uint32_t *len)
+{
+    *address = frame[4] << 24 | frame[5] << 16 |
+               frame[6] << 8 | frame[7] << 0;
+
+    if (BL_Frame_Version == BL_FRAME_V2)
+    {
+        *len = frame[8] << 24 | frame[9] << 16 |
+               frame[10] << 8 | frame[11] << 0;
+
+        return (frame + 12);
+    }
+
+    *len = frame[1];
+
+    return (frame + 8);
+}
+
+/**
+ * @brief check that payload of frame holds no of bytes given in its header
+ * @note cmds without payload always fit, CMD_READ len is no of bytes to send back
+ * @param frame received frame without sync char and frame len
+ * @param frame_len number of bytes in frame
+ * @param len no of bytes decoded by BL_Parse_Header()
+ * @retval 1 if len bytes of payload arrived before crc
+ */
+static uint8_t BL_Payload_Fits(const uint8_t *frame, uint32_t frame_len, uint32_t len)
+{
+    uint32_t header_len = (BL_Frame_Version == BL_FRAME_V2) ? 12 : 8;
+
+    switch (frame[0])
+    {
+    case BL_CMD_WRITE:
+    case BL_CMD_WRITE_COMPRESSED:
+        /* image end follows payload */
+        if (frame[3] & BL_WRITE_FLAG_END)
+        {
+            header_len += 4;
+        }
+        /* fall through */
+    case BL_CMD_WRITE_WINDOW:
+    case BL_CMD_VERIFY:
+    case BL_CMD_ERASE_RANGE:
+    case BL_CMD_CHECKSUM:
+    case BL_CMD_PAGE_HASH:
+        return (frame_len > header_len && len <= frame_len - header_len - 1);
+
+    default:
+        return 1;
+    }
+}
+
 /**
  * @brief erase stm32 flash
- * @note erase mode depends upon mcu family
+ * @note all pages or sectors after bootloader
  */
 static uint8_t ST_Erase_Flash(void)
+{
+    return ST_Erase_Range(USER_FLASH_START_ADDRESS, USER_FLASH_END_ADDRESS - USER_FLASH_START_ADDRESS);
+}
+
+/**
+ * @brief check that span lies in user flash
+ * @param address start of span
+ * @param len no of bytes in span
+ * @retval 1 if span is between bootloader and end of flash
+ */
+static uint8_t ST_Is_User_Flash(uint32_t address, uint32_t len)
+{
+    return (address >= USER_FLASH_START_ADDRESS && address <= USER_FLASH_END_ADDRESS &&
+            len <= USER_FLASH_END_ADDRESS - address);
+}
+
+/**
+ * @brief get page or sector containing given flash address
+ * @param address flash address
+ * @retval page number on f1, sector number on f4
+ */
+static uint32_t ST_Get_Unit(uint32_t address)
+{
+    uint32_t offset = address - BL_Flash.Base;
+    uint32_t unit = 0;
+
+    for (uint32_t i = 0; i < BL_Flash.Region_Count; i++)
+    {
+        uint32_t region_size = BL_Flash.Regions[i].Unit_Size * BL_Flash.Regions[i].Unit_Count;
+
+        if (offset < region_size)
+        {
+            return unit + offset / BL_Flash.Regions[i].Unit_Size;
+        }
+
+        offset -= region_size;
+        unit += BL_Flash.Regions[i].Unit_Count;
+    }
+
+    return unit;
+}
+
+/**
+ * @brief get start address of page or sector
+ * @param unit page number on f1, sector number on f4
+ * @retval start address
+ */
+static uint32_t ST_Get_Unit_Address(uint32_t unit)
+{
+    uint32_t address = BL_Flash.Base;
+
+    for (uint32_t i = 0; i < BL_Flash.Region_Count && unit; i++)
+    {
+        uint32_t count = (unit < BL_Flash.Regions[i].Unit_Count) ? unit : BL_Flash.Regions[i].Unit_Count;
+
+        address += count * BL_Flash.Regions[i].Unit_Size;
+        unit -= count;
+    }
+
+    return address;
+}
+
+/**
+ * @brief erase pages or sectors overlapping given span
+ * @param address start of span
+ * @param len no of bytes in span
+ * @retval 1 if span is in user flash and erased
+ */
+static uint8_t ST_Erase_Range(uint32_t address, uint32_t len)
 {
     uint8_t status = 0;
     uint32_t error = 0;
 
+    if (len == 0 || !ST_Is_User_Flash(address, len))
+    {
+        return 0;
+    }
+
     FLASH_EraseInitTypeDef flash_erase_handle;
 
 #if defined(STM32F103xE) || defined(STM32F103xB)
+    uint32_t first_page = ST_Get_Unit(address);
+    uint32_t last_page = ST_Get_Unit(address + len - 1);
+
     flash_erase_handle.TypeErase = FLASH_TYPEERASE_PAGES;
     flash_erase_handle.Banks = FLASH_BANK_1;
-    flash_erase_handle.NbPages = (BL_TOTAL_PAGES - BL_USED_PAGES);
-    flash_erase_handle.PageAddress = USER_FLASH_START_ADDRESS;
+    flash_erase_handle.NbPages = last_page - first_page + 1;
+    flash_erase_handle.PageAddress = ST_Get_Unit_Address(first_page);
 #elif defined(STM32F407xx) || defined(STM32F401xE)
+    uint32_t first_sector = ST_Get_Unit(address);
+    uint32_t last_sector = ST_Get_Unit(address + len - 1);
+
     flash_erase_handle.TypeErase = FLASH_TYPEERASE_SECTORS;
     flash_erase_handle.Banks = FLASH_BANK_1;
-    flash_erase_handle.Sector = BL_USED_SECTORS;
-    flash_erase_handle.NbSectors = (BL_TOTAL_SECTORS - BL_USED_SECTORS);
+    flash_erase_handle.Sector = first_sector;
+    flash_erase_handle.NbSectors = last_sector - first_sector + 1;
     flash_erase_handle.VoltageRange = FLASH_VOLTAGE_RANGE_3;
 #endif
 
@@ -291,43 +730,211 @@ static uint8_t ST_Erase_Flash(void)
 
     if (HAL_FLASHEx_Erase(&flash_erase_handle, &error) == HAL_OK)
     {
+        for (uint32_t unit = ST_Get_Unit(address); unit <= ST_Get_Unit(address + len - 1); unit++)
+        {
+            BL_Erased_Map[unit / 8] |= (1 << (unit % 8));
+        }
+        status = 1;
+    }
+
+    HAL_FLASH_Lock();
+
+    return status;
+}
+
+/**
+ * @brief start erase of one page or sector
+ * @note runs from ram, code fetch from flash stalls while flash is busy
+ *       erase is started here and not by hal, first fetch from flash after start would stall till erase is done
+ *       transports with a poll function are drained here with interrupts held off till erase is done,
+ *       otherwise it returns at once and dma keeps receiving, interrupts stay enabled
+ * @param unit sector number on f4
+ * @param address page address on f1
+ */
+__RAM_FUNC __attribute__((noinline)) static void ST_Flash_Erase_Start(uint32_t unit, uint32_t address)
+{
+    if (BL_COMM_Poll)
+    {
+        __disable_irq();
+    }
+
+#if defined(STM32F103xE) || defined(STM32F103xB)
+    (void)unit;
+    SET_BIT(FLASH->CR, FLASH_CR_PER);
+    WRITE_REG(FLASH->AR, address);
+    SET_BIT(FLASH->CR, FLASH_CR_STRT);
+#elif defined(STM32F407xx) || defined(STM32F401xE)
+    (void)address;
+    MODIFY_REG(FLASH->CR, FLASH_CR_PSIZE | FLASH_CR_SNB, FLASH_PSIZE_WORD | FLASH_CR_SER | (unit << FLASH_CR_SNB_Pos));
+    SET_BIT(FLASH->CR, FLASH_CR_STRT);
+#endif
+
+    if (BL_COMM_Poll)
+    {
+        while (FLASH->SR & FLASH_SR_BSY)
+        {
+            BL_COMM_Poll();
+        }
+
+        __enable_irq();
+    }
+}
+
+/**
+ * @brief erase one page or sector and wait for it
+ * @param unit page number on f1, sector number on f4
+ * @retval 1 if erased
+ */
+static uint8_t ST_Erase_Unit(uint32_t unit)
+{
+    ST_Erase_Start(unit);
+
+    return ST_Erase_Finish();
+}
+
+/**
+ * @brief start erase of one page or sector, finished by ST_Erase_Finish()
+ * @param unit page number on f1, sector number on f4
+ */
+static void ST_Erase_Start(uint32_t unit)
+{
+    HAL_FLASH_Unlock();
+
+    BL_Erase_Pending = 1;
+    BL_Erase_Pending_Unit = unit;
+
+    ST_Flash_Erase_Start(unit, ST_Get_Unit_Address(unit));
+}
+
+/**
+ * @brief wait for pending erase, mark its page or sector erased and lock flash
+ * @retval 1 if no erase is pending or it succeeded
+ */
+static uint8_t ST_Erase_Finish(void)
+{
+    uint8_t status = 0;
+
+    if (!BL_Erase_Pending)
+    {
+        return 1;
+    }
+
+    /* waits for busy flag, then checks error flags */
+    if (FLASH_WaitForLastOperation(BL_FLASH_TIMEOUT) == HAL_OK)
+    {
+        BL_Erased_Map[BL_Erase_Pending_Unit / 8] |= (1 << (BL_Erase_Pending_Unit % 8));
         status = 1;
     }
 
+#if defined(STM32F103xE) || defined(STM32F103xB)
+    CLEAR_BIT(FLASH->CR, FLASH_CR_PER);
+#elif defined(STM32F407xx) || defined(STM32F401xE)
+    CLEAR_BIT(FLASH->CR, (FLASH_CR_SER | FLASH_CR_SNB));
+    FLASH_FlushCaches();
+#endif
+
     HAL_FLASH_Lock();
 
+    BL_Erase_Pending = 0;
+
     return status;
 }
 
+/**
+ * @brief finish pending erase once busy flag is clear, called from main loop while idle
+ */
+static void ST_Erase_Poll(void)
+{
+    if (BL_Erase_Pending && !(FLASH->SR & FLASH_SR_BSY))
+    {
+        ST_Erase_Finish();
+    }
+}
+
+/**
+ * @brief erase pages or sectors of given span not yet erased in this session
+ * @param address start of span
+ * @param len no of bytes in span
+ * @retval 1 if whole span is erased
+ */
+static uint8_t ST_Lazy_Erase(uint32_t address, uint32_t len)
+{
+    if (len == 0)
+    {
+        return 1;
+    }
+
+    if (!ST_Is_User_Flash(address, len))
+    {
+        return 0;
+    }
+
+    for (uint32_t unit = ST_Get_Unit(address); unit <= ST_Get_Unit(address + len - 1); unit++)
+    {
+        if (!(BL_Erased_Map[unit / 8] & (1 << (unit % 8))) && !ST_Erase_Unit(unit))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief start erase of page or sector after the one just written if it holds part of image
+ * @note only first write into a page or sector finds next one not erased,
+ *       it erases while rest of current one is received, failure is caught by ST_Lazy_Erase()
+ * @param address start of written span
+ * @param len no of bytes in span
+ */
+static void ST_Erase_Ahead(uint32_t address, uint32_t len)
+{
+    uint32_t unit = ST_Get_Unit(address + len - 1) + 1;
+    uint32_t unit_address = ST_Get_Unit_Address(unit);
+
+    if (BL_Erase_Pending || unit >= BL_FLASH_UNITS ||
+        unit_address >= USER_FLASH_END_ADDRESS || unit_address >= BL_Image_End)
+    {
+        return;
+    }
+
+    if (!(BL_Erased_Map[unit / 8] & (1 << (unit % 8))))
+    {
+        ST_Erase_Start(unit);
+    }
+}
+
 /**
  * @brief write data in given flash address
  * @param address address where flash is to be written
  * @param data input data buffer
  * @param len amount of data to be written
+ * @retval 1 if data is written and read back correctly
  */
-static void BL_Write_Callback(uint32_t address, const uint8_t *data, uint32_t len)
+static uint8_t ST_Write_Flash(uint32_t address, const uint8_t *data, uint32_t len)
 {
-    uint32_t *sram_ptr = (uint32_t *)data;
     uint8_t status = 1;
-    len /= 4;
 
-    if (address >= USER_FLASH_START_ADDRESS && address <= USER_FLASH_END_ADDRESS - len)
+    if (ST_Is_User_Flash(address, len) && (address % BL_Flash.Program_Width) == 0)
     {
         /* Unlock the Flash to enable the flash control register access */
         HAL_FLASH_Unlock();
 
-        for (uint32_t i = 0; i < len; i++)
+        for (uint32_t i = 0; i < len; i += BL_Flash.Program_Width)
         {
-            if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address, *sram_ptr) == HAL_OK)
+            /* tail of a frame not multiple of program width is padded with erased value */
+            uint32_t word = 0xFFFFFFFF;
+            memcpy(&word, data + i, (len - i < BL_Flash.Program_Width) ? (len - i) : BL_Flash.Program_Width);
+
+            if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, address + i, word) == HAL_OK)
             {
                 /* Check the written value */
-                if (*(uint32_t *)address != *sram_ptr++)
+                if (*(uint32_t *)(address + i) != word)
                 {
                     /* Flash content doesn't match SRAM content */
                     status = 0;
                     break;
                 }
-                address += 4;
             }
             else
             {
@@ -346,54 +953,321 @@ static void BL_Write_Callback(uint32_t address, const uint8_t *data, uint32_t le
         status = 0;
     }
 
-    if (status)
+    return status;
+}
+
+/**
+ * @brief crc32 of flash span from hardware crc unit
+ * @param address start of span, word aligned
+ * @param len no of bytes, tail word is padded with 0xFF
+ * @retval crc32
+ */
+static uint32_t ST_CRC32(uint32_t address, uint32_t len)
+{
+    const uint32_t *word = (const uint32_t *)address;
+    uint32_t tail = 0xFFFFFFFF;
+
+    __HAL_RCC_CRC_CLK_ENABLE();
+
+    /* init value 0xFFFFFFFF */
+    CRC->CR = CRC_CR_RESET;
+
+    for (uint32_t i = 0; i < len / 4; i++)
     {
-        BL_Send_Char(BL_CMD_ACK);
+        CRC->DR = word[i];
     }
-    else
+
+    if (len % 4)
     {
-        BL_Send_Char(BL_CMD_NACK);
+        memcpy(&tail, &word[len / 4], len % 4);
+        CRC->DR = tail;
     }
+
+    return CRC->DR;
 }
 
 /**
- * @brief verify data at given flash address
- * @param address address where flash is to be verified
+ * @brief write data in given flash address and ack if success
+ * @note with BL_WRITE_FLAG_DEFER frame is acked before programming,
+ *       uart or cdc isr keeps receiving next frame meanwhile
+ *       with BL_WRITE_FLAG_ERASE pages or sectors are erased on first write,
+ *       and next one is started up to image end from BL_WRITE_FLAG_END
+ * @param address address where flash is to be written
  * @param data input data buffer
  * @param len amount of data to be written
+ * @param flags frame flags
  */
-static void BL_Verify_Callback(uint32_t address, const uint8_t *data, uint8_t len)
+static void BL_Write_Callback(uint32_t address, const uint8_t *data, uint32_t len, uint8_t flags)
 {
-    uint8_t ok_flag = 1;
-    len /= 4;
+    uint8_t status = 1;
 
-    if (address >= USER_FLASH_START_ADDRESS && address <= USER_FLASH_END_ADDRESS - len)
+    if (flags & BL_WRITE_FLAG_DEFER)
     {
-
-        for (uint8_t i = 0; i < len; i++)
+        if (BL_Write_Error)
         {
-            if (*(uint32_t *)address != *(uint32_t *)data)
-            {
-                ok_flag = 0;
-                break;
-            }
-
-            address += 4;
-            data += 4;
+            /* previous frame failed, drop this one and let host know */
+            BL_Write_Error_Report();
+            return;
         }
+
+        BL_Send_Char(BL_CMD_ACK);
     }
-    else
+
+    if (flags & BL_WRITE_FLAG_ERASE)
     {
-        ok_flag = 0;
+        status = ST_Lazy_Erase(address, len);
     }
 
-    if (ok_flag)
+    if (status)
     {
-        BL_Send_Char(BL_CMD_ACK);
+        status = ST_Write_Flash(address, data, len);
     }
-    else
+
+    if (flags & BL_WRITE_FLAG_DEFER)
     {
-        BL_Send_Char(BL_CMD_NACK);
+        if (!status)
+        {
+            BL_Write_Error = 1;
+            BL_Write_Error_Address = address;
+        }
+    }
+    else
+    {
+        BL_Send_Char(status ? BL_CMD_ACK : BL_CMD_NACK);
+    }
+
+    if ((flags & BL_WRITE_FLAG_ERASE) && status && len)
+    {
+        /* host is sending next frame by now */
+        ST_Erase_Ahead(address, len);
+    }
+}
+
+/**
+ * @brief send address of failed deferred frame and clear error
+ */
+static void BL_Write_Error_Report(void)
+{
+    uint8_t response[6];
+
+    response[0] = BL_CMD_ERROR;
+    BL_Put_U32(&response[1], BL_Write_Error_Address);
+    response[5] = BL_CRC8(&response[1], 4);
+
+    BL_Transport->Send(response, sizeof(response));
+
+    BL_Write_Error = 0;
+}
+
+/**
+ * @brief decompress lz4 block and write it like CMD_WRITE
+ * @note block is decompressed into BL_TX_Buffer, no reply is pending from it during a write
+ * @param address address where flash is to be written
+ * @param data payload with 4-byte no of bytes to write and lz4 block
+ * @param len no of bytes in payload
+ * @param flags BL_WRITE_FLAG_DEFER, BL_WRITE_FLAG_ERASE and BL_WRITE_FLAG_END
+ */
+static void BL_Write_Compressed_Callback(uint32_t address, const uint8_t *data, uint32_t len, uint8_t flags)
+{
+    if (len >= 4 && len <= BL_MAX_PAYLOAD)
+    {
+        uint32_t raw_len = data[0] << 24 | data[1] << 16 |
+                           data[2] << 8 | data[3] << 0;
+
+        if (raw_len <= BL_MAX_PAYLOAD &&
+            BL_LZ4_Decompress(data + 4, len - 4, BL_TX_Buffer, raw_len) == raw_len)
+        {
+            BL_Write_Callback(address, BL_TX_Buffer, raw_len, flags);
+            return;
+        }
+    }
+
+    BL_Send_Char(BL_CMD_NACK);
+}
+
+/**
+ * @brief decompress lz4 block, sequences of literals and back references
+ * @param src lz4 block
+ * @param src_len no of bytes in block
+ * @param dst output buffer
+ * @param dst_len size of output buffer
+ * @retval no of bytes decompressed, 0 if block is malformed or does not fit
+ */
+static uint32_t BL_LZ4_Decompress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len)
+{
+    uint32_t in = 0;
+    uint32_t out = 0;
+
+    while (in < src_len)
+    {
+        uint8_t token = src[in++];
+        uint32_t literal_len = token >> 4;
+        uint32_t match_len = (token & 0x0F) + 4;
+        uint8_t extra;
+
+        /* 15 is followed by bytes added to it until one is not 255 */
+        if (literal_len == 15)
+        {
+            do
+            {
+                if (in >= src_len)
+                {
+                    return 0;
+                }
+                extra = src[in++];
+                literal_len += extra;
+            } while (extra == 255);
+        }
+
+        if (literal_len > src_len - in || literal_len > dst_len - out)
+        {
+            return 0;
+        }
+
+        memcpy(&dst[out], &src[in], literal_len);
+        in += literal_len;
+        out += literal_len;
+
+        /* last sequence has literals only */
+        if (in == src_len)
+        {
+            break;
+        }
+
+        if (src_len - in < 2)
+        {
+            return 0;
+        }
+
+        uint32_t offset = src[in] | src[in + 1] << 8;
+        in += 2;
+
+        if (match_len == 19)
+        {
+            do
+            {
+                if (in >= src_len)
+                {
+                    return 0;
+                }
+                extra = src[in++];
+                match_len += extra;
+            } while (extra == 255);
+        }
+
+        if (offset == 0 || offset > out || match_len > dst_len - out)
+        {
+            return 0;
+        }
+
+        /* byte by byte, match may overlap its own output */
+        for (uint32_t i = 0; i < match_len; i++, out++)
+        {
+            dst[out] = dst[out - offset];
+        }
+    }
+
+    return out;
+}
+
+/**
+ * @brief program a CMD_WRITE_WINDOW frame in order and ack it cumulatively
+ * @param frame received frame without sync char and frame len
+ * @param frame_len number of bytes in frame
+ */
+static void BL_Write_Window_Callback(const uint8_t *frame, uint32_t frame_len)
+{
+    uint8_t seq = frame[2];
+    uint8_t flags = frame[3];
+
+    uint32_t address;
+    uint32_t len;
+    uint8_t *payload = BL_Parse_Header((uint8_t *)frame, &address, &len);
+
+    /* start frame is resent if its ack was lost, programming it again would fail on written flash */
+    if ((flags & BL_WINDOW_FLAG_START) &&
+        !(BL_Window_Active && seq == BL_Window_Start_Seq && address == BL_Window_Start_Address))
+    {
+        /* new transfer */
+        BL_Window_Active = 1;
+        BL_Window_Start_Seq = seq;
+        BL_Window_Start_Address = address;
+        BL_Window_Expected_Seq = seq;
+        BL_Window_Error = 0;
+    }
+
+    /* position of this frame relative to next in order frame */
+    uint8_t offset = seq - BL_Window_Expected_Seq;
+
+    if (offset == 0)
+    {
+        uint8_t status = BL_Payload_Fits(frame, frame_len, len);
+
+        if (status && (flags & BL_WRITE_FLAG_ERASE))
+        {
+            status = ST_Lazy_Erase(address, len);
+        }
+
+        if (status)
+        {
+            status = ST_Write_Flash(address, payload, len);
+        }
+
+        if (status)
+        {
+            BL_Window_Expected_Seq++;
+        }
+
+        /* on failure frames in flight behind this one are dropped till host resends it */
+        BL_Window_Error = !status;
+        BL_Window_Ack(status);
+    }
+    else if (offset >= 128)
+    {
+        /* already programmed, ack again in case ack was lost */
+        BL_Window_Ack(1);
+    }
+    else if (!BL_Window_Error)
+    {
+        /* frame in between is lost or corrupted, host goes back to next expected seq */
+        BL_Window_Error = 1;
+        BL_Window_Ack(0);
+    }
+}
+
+/**
+ * @brief send cumulative ack for CMD_WRITE_WINDOW
+ * @param status 1 for ACK, 0 for NACK
+ */
+static void BL_Window_Ack(uint8_t status)
+{
+    uint8_t response[2] = {status ? BL_CMD_ACK : BL_CMD_NACK, BL_Window_Expected_Seq};
+
+    BL_Transport->Send(response, sizeof(response));
+}
+
+/**
+ * @brief verify data at given flash address
+ * @param address address where flash is to be verified
+ * @param data input data buffer
+ * @param len amount of data to be written
+ */
+static void BL_Verify_Callback(uint32_t address, const uint8_t *data, uint32_t len)
+{
+    uint8_t ok_flag = 0;
+
+    if (ST_Is_User_Flash(address, len) && memcmp((const void *)address, data, len) == 0)
+    {
+        ok_flag = 1;
+    }
+
+    if (ok_flag)
+    {
+        BL_Send_Char(BL_CMD_ACK);
+    }
+    else
+    {
+        BL_Send_Char(BL_CMD_NACK);
     }
 }
 
@@ -407,18 +1281,18 @@ static void BL_Read_Callback(uint32_t address, uint32_t len)
     uint8_t crc;
     uint8_t *add_ptr = (uint8_t *)address;
 
-    if (address >= USER_FLASH_START_ADDRESS && address <= USER_FLASH_END_ADDRESS - len)
+    if (ST_Is_User_Flash(address, len) && len < BL_TX_BUFFER_SIZE)
     {
         BL_Send_Char(BL_CMD_ACK);
 
-        for (uint8_t i = 0; i < len; i++)
+        for (uint32_t i = 0; i < len; i++)
         {
             BL_TX_Buffer[i] = add_ptr[i];
         }
         crc = BL_CRC8(BL_TX_Buffer, len);
         BL_TX_Buffer[len] = crc;
 
-        BL_Send_Chars((char *)BL_TX_Buffer, len + 1);
+        BL_Transport->Send(BL_TX_Buffer, len + 1);
     }
     else
     {
@@ -441,6 +1315,93 @@ static void BL_Erase_Callback(void)
     }
 }
 
+/**
+ * @brief erase pages or sectors covering given span and ack if success
+ * @param address start of span
+ * @param data payload with 4-byte no of bytes to erase
+ * @param len no of bytes in payload
+ */
+static void BL_Erase_Range_Callback(uint32_t address, const uint8_t *data, uint32_t len)
+{
+    uint32_t erase_len = data[0] << 24 | data[1] << 16 |
+                         data[2] << 8 | data[3] << 0;
+
+    if (len == 4 && ST_Erase_Range(address, erase_len))
+    {
+        BL_Send_Char(BL_CMD_ACK);
+    }
+    else
+    {
+        BL_Send_Char(BL_CMD_NACK);
+    }
+}
+
+/**
+ * @brief send crc32 of given flash span
+ * @param address start of span
+ * @param data payload with 4-byte no of bytes to checksum
+ * @param len no of bytes in payload
+ */
+static void BL_Checksum_Callback(uint32_t address, const uint8_t *data, uint32_t len)
+{
+    uint32_t crc_len = data[0] << 24 | data[1] << 16 |
+                       data[2] << 8 | data[3] << 0;
+
+    if (len == 4 && ST_Is_User_Flash(address, crc_len) && (address % 4) == 0)
+    {
+        BL_Put_U32(&BL_TX_Buffer[1], ST_CRC32(address, crc_len));
+        BL_TX_Buffer[0] = BL_CMD_ACK;
+        BL_TX_Buffer[5] = BL_CRC8(&BL_TX_Buffer[1], 4);
+
+        BL_Transport->Send(BL_TX_Buffer, 6);
+    }
+    else
+    {
+        BL_Send_Char(BL_CMD_NACK);
+    }
+}
+
+/**
+ * @brief send crc32 of every page or sector overlapping given span
+ * @param address start of span
+ * @param data payload with 4-byte no of bytes in span
+ * @param len no of bytes in payload
+ */
+static void BL_Page_Hash_Callback(uint32_t address, const uint8_t *data, uint32_t len)
+{
+    uint32_t span_len = data[0] << 24 | data[1] << 16 |
+                        data[2] << 8 | data[3] << 0;
+
+    if (len == 4 && span_len > 0 && ST_Is_User_Flash(address, span_len))
+    {
+        uint32_t first = ST_Get_Unit(address);
+        uint32_t count = ST_Get_Unit(address + span_len - 1) - first + 1;
+
+        /* ack, count, hashes and crc must fit in one reply */
+        if (3 + count * 4 + 1 <= BL_TX_BUFFER_SIZE)
+        {
+            BL_TX_Buffer[0] = BL_CMD_ACK;
+            BL_TX_Buffer[1] = (count >> 8) & 0xFF;
+            BL_TX_Buffer[2] = count & 0xFF;
+
+            for (uint32_t i = 0; i < count; i++)
+            {
+                uint32_t unit_address = ST_Get_Unit_Address(first + i);
+                uint32_t unit_size = ST_Get_Unit_Address(first + i + 1) - unit_address;
+
+                BL_Put_U32(&BL_TX_Buffer[3 + i * 4], ST_CRC32(unit_address, unit_size));
+            }
+
+            BL_TX_Buffer[3 + count * 4] = BL_CRC8(&BL_TX_Buffer[1], 2 + count * 4);
+
+            BL_Transport->Send(BL_TX_Buffer, 3 + count * 4 + 1);
+            return;
+        }
+    }
+
+    BL_Send_Char(BL_CMD_NACK);
+}
+
 /**
  * @brief reset stm32 device
  */
@@ -448,6 +1409,10 @@ static void BL_Reset_Callback(void)
 {
     // reset mcu
     BL_Send_Char(BL_CMD_ACK);
+
+    /** ack is out before reset */
+    BL_Transport->Deinit();
+
     HAL_NVIC_SystemReset();
 }
 
@@ -456,16 +1421,16 @@ static void BL_Reset_Callback(void)
  */
 static void BL_Jump_Callback(void)
 {
-    if (BL_Send_Char)
+    if (BL_Transport)
     {
         BL_Send_Char(BL_CMD_ACK);
+
+        /** deinit uart or cdc, ack is out before peripherals reset */
+        BL_Transport->Deinit();
     }
 
     HAL_DeInit();
 
-    /** deinit uart or cdc */
-    BL_COMM_Deinit();
-
     BL_Jump();
 }
 
@@ -474,16 +1439,132 @@ static void BL_Jump_Callback(void)
  */
 static void BL_Get_Version_Callback(void)
 {
-    uint8_t crc;
+    uint8_t response[5];
 
-    BL_Send_Char(BL_CMD_ACK);
+    response[0] = BL_CMD_ACK;
+    memcpy(&response[1], BL_Version, 3);
+    response[4] = BL_CRC8(BL_Version, 3);
+
+    BL_Transport->Send(response, sizeof(response));
+}
+
+/**
+ * @brief put 32 bit value in buffer, big endian
+ * @param buffer output buffer
+ * @param value value to put
+ * @retval no of bytes put
+ */
+static uint32_t BL_Put_U32(uint8_t *buffer, uint32_t value)
+{
+    buffer[0] = (value >> 24) & 0xFF;
+    buffer[1] = (value >> 16) & 0xFF;
+    buffer[2] = (value >> 8) & 0xFF;
+    buffer[3] = value & 0xFF;
+
+    return 4;
+}
+
+/**
+ * @brief send device info, flash layout and capabilities
+ */
+static void BL_Get_Info_Callback(void)
+{
+    uint8_t *info = &BL_TX_Buffer[3];
+    uint32_t info_len = 0;
+    uint32_t capabilities = BL_CAP_WINDOW | BL_CAP_FRAME_V2 | BL_CAP_DEFER_WRITE |
+                            BL_CAP_ERASE_RANGE | BL_CAP_LAZY_ERASE | BL_CAP_CHECKSUM |
+                            BL_CAP_PAGE_HASH | BL_CAP_COMPRESSED | BL_CAP_IMAGE_END;
+
+#if (BL_AUTO_BAUD == 1)
+    capabilities |= BL_CAP_AUTO_BAUD;
+#endif
+
+#if (BL_RS485 == 1)
+    capabilities |= BL_CAP_ADDRESSED;
+#endif
+
+    info[info_len++] = BL_INFO_VERSION;
+
+    info_len += BL_Put_U32(&info[info_len], HAL_GetREVID() << 16 | HAL_GetDEVID());
+    info_len += BL_Put_U32(&info[info_len], HAL_GetUIDw0());
+    info_len += BL_Put_U32(&info[info_len], HAL_GetUIDw1());
+    info_len += BL_Put_U32(&info[info_len], HAL_GetUIDw2());
+
+    info_len += BL_Put_U32(&info[info_len], BL_Flash.Size);
+    info_len += BL_Put_U32(&info[info_len], USER_FLASH_START_ADDRESS);
+    info_len += BL_Put_U32(&info[info_len], USER_FLASH_END_ADDRESS);
+    info_len += BL_Put_U32(&info[info_len], BL_Get_Max_Payload());
+    info[info_len++] = BL_WINDOW_SIZE;
+    info_len += BL_Put_U32(&info[info_len], capabilities);
+
+    info[info_len++] = BL_Flash.Region_Count;
+
+    for (uint32_t i = 0; i < BL_Flash.Region_Count; i++)
+    {
+        info_len += BL_Put_U32(&info[info_len], BL_Flash.Regions[i].Unit_Size);
+        info[info_len++] = (BL_Flash.Regions[i].Unit_Count >> 8) & 0xFF;
+        info[info_len++] = BL_Flash.Regions[i].Unit_Count & 0xFF;
+    }
+
+    /* baud in use first, usb cdc ignores baud */
+    uint32_t baud = BL_UART_Get_Baud();
+    uint8_t *baud_count = &info[info_len++];
+
+    *baud_count = 1;
+    info_len += BL_Put_U32(&info[info_len], baud);
+
+#if (BL_AUTO_BAUD == 1)
+    /* standard rates offered when baud is auto detected */
+    static const uint32_t baud_rates[] = {9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600,
+#if (BL_UART_DMA == 1)
+                                          /* no per byte cpu work with dma */
+                                          1000000, 2000000
+#endif
+    };
+
+    for (uint32_t i = 0; i < sizeof(baud_rates) / sizeof(baud_rates[0]); i++)
+    {
+        if (baud_rates[i] != baud)
+        {
+            info_len += BL_Put_U32(&info[info_len], baud_rates[i]);
+            (*baud_count)++;
+        }
+    }
+#endif
+
+    BL_TX_Buffer[0] = BL_CMD_ACK;
+    BL_TX_Buffer[1] = (info_len >> 8) & 0xFF;
+    BL_TX_Buffer[2] = info_len & 0xFF;
+    info[info_len] = BL_CRC8(info, info_len);
+
+    BL_Transport->Send(BL_TX_Buffer, info_len + 4);
+}
+
+/**
+ * @brief switch frame format for rest of session
+ * @param version requested frame version
+ */
+static void BL_Frame_Format_Callback(uint8_t version)
+{
+    uint8_t response[5];
+    uint32_t payload = BL_Get_Max_Payload();
 
-    crc = BL_CRC8(BL_Version, 3);
+    if (version != BL_FRAME_V1 && version != BL_FRAME_V2)
+    {
+        BL_Send_Char(BL_CMD_NACK);
+        return;
+    }
+
+    response[0] = BL_CMD_ACK;
+    response[1] = version;
+    response[2] = (payload >> 8) & 0xFF;
+    response[3] = payload & 0xFF;
+    response[4] = BL_CRC8(&response[1], 3);
+
+    /* response goes out in old format, new format applies from next frame */
+    BL_Transport->Send(response, sizeof(response));
 
-    BL_Send_Char(BL_Version[0]);
-    BL_Send_Char(BL_Version[1]);
-    BL_Send_Char(BL_Version[2]);
-    BL_Send_Char(crc);
+    BL_Frame_Version = version;
 }
 
 /**
@@ -516,104 +1597,208 @@ static void BL_Jump(void)
 }
 
 /**
- * @brief bootloader main process loop
+ * @brief called from transport isr when chars arrive
  */
+void BL_COMM_RX_Event(void)
+{
+    BL_RX_Event = 1;
+}
 
-static void BL_Loop(void)
+/**
+ * @brief node address handed over by application
+ * @note second byte of magic word, only valid along with magic number
+ */
+uint8_t BL_COMM_Handover_Address(void)
 {
-    /** try auto baud if enabled */
-    BL_UART_Init();
+    return BL_Handover_Address;
+}
 
-#if (USE_USB_CDC == 1)
-    BL_CDC_Init();
-#endif
+/**
+ * @brief largest payload whose frame fits receive side of session transport
+ * @note halved from BL_MAX_PAYLOAD so it stays page aligned
+ */
+static uint32_t BL_Get_Max_Payload(void)
+{
+    uint32_t payload = BL_MAX_PAYLOAD;
 
+    while (payload + (BL_FRAME_SIZE - BL_MAX_PAYLOAD) > BL_Transport->Max_Frame_Size)
+    {
+        payload /= 2;
+    }
+
+    return payload;
+}
+
+/**
+ * @brief send single char on session transport
+ * @param data char to be sent
+ */
+static void BL_Send_Char(uint8_t data)
+{
+    BL_Transport->Send(&data, 1);
+}
+
+/**
+ * @brief get single char from session transport
+ * @param timeout in ms
+ * @retval char or -1 on timeout
+ */
+static int BL_Get_Char(uint32_t timeout)
+{
+    uint8_t ch;
+
+    if (BL_Transport->Receive(&ch, 1, timeout) == 1)
+    {
+        return ch;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief sleep until a transport receives chars, then drain each one looking for connect cmd
+ * @note other chars are dropped, first transport with connect cmd is selected and acked
+ */
+static void BL_Connect_Arbiter(void)
+{
     while (1)
     {
-        int uart_char = BL_UART_Get_Char(100);
-        if (uart_char == BL_CMD_CONNECT)
-        {
-            /* send ack for connect cmd*/
-            BL_UART_Send_Char(BL_CMD_ACK);
+        /* clear before draining, chars arriving meanwhile keep arbiter awake */
+        BL_RX_Event = 0;
 
-            /** if any activity is detected on uart choose uart interface */
-            BL_COMM_Deinit = BL_UART_Deinit;
+        for (uint32_t i = 0; i < sizeof(BL_Transports) / sizeof(BL_Transports[0]); i++)
+        {
+            uint8_t ch;
 
-            BL_Send_Char = BL_UART_Send_Char;
-            BL_Send_Chars = BL_UART_Send_Chars;
+            while (BL_Transports[i]->Receive(&ch, 1, 0) == 1)
+            {
+                if (ch == BL_CMD_CONNECT)
+                {
+                    BL_Transport = BL_Transports[i];
+                    BL_COMM_Poll = BL_Transport->Poll;
 
-            BL_Get_Char = BL_UART_Get_Char;
-            BL_Get_Chars = BL_UART_Get_Chars;
-            break;
+                    /* send ack for connect cmd*/
+                    BL_Send_Char(BL_CMD_ACK);
+                    return;
+                }
+            }
         }
-#if (USE_USB_CDC == 1)
-        int cdc_char = BL_CDC_Get_Char(100);
-        if (cdc_char == BL_CMD_CONNECT)
+
+        /* wfi still wakes on an isr pending since the check */
+        __disable_irq();
+
+        if (!BL_RX_Event)
         {
-            /* send ack for connect cmd*/
-            BL_CDC_Send_Char(BL_CMD_ACK);
+            __WFI();
+        }
 
-            /** choose usb cdc */
-            BL_COMM_Deinit = BL_CDC_Deinit;
+        __enable_irq();
+    }
+}
 
-            BL_Send_Char = BL_CDC_Send_Char;
-            BL_Send_Chars = BL_CDC_Send_Chars;
+/**
+ * @brief bootloader main process loop
+ */
 
-            BL_Get_Char = BL_CDC_Get_Char;
-            BL_Get_Chars = BL_CDC_Get_Chars;
-            break;
-        }
-#endif
+static void BL_Loop(void)
+{
+    /** uart tries auto baud if enabled */
+    for (uint32_t i = 0; i < sizeof(BL_Transports) / sizeof(BL_Transports[0]); i++)
+    {
+        BL_Transports[i]->Init();
     }
 
+    BL_Connect_Arbiter();
+
     while (1)
     {
         /* wait for sync char*/
         int sync_char = BL_Get_Char(10);
 
-        if (sync_char != -1)
+        if (sync_char == -1)
+        {
+            ST_Erase_Poll();
+        }
+        else
         {
             /* if BL_CMD_CONNECT received again send ack*/
             /* can be used to test connection*/
             if (sync_char == BL_CMD_CONNECT)
             {
+                /* new host, start over with v1 frames */
+                BL_Frame_Version = BL_FRAME_V1;
+                BL_Write_Error = 0;
+                BL_Window_Active = 0;
+                ST_Erase_Finish();
+                memset(BL_Erased_Map, 0, sizeof(BL_Erased_Map));
+                BL_Image_End = 0;
                 BL_Send_Char(BL_CMD_ACK);
             }
 
             if (sync_char == BL_SYNC_CHAR)
             {
-                /* wait for packet_len char*/
+                /* wait for packet_len, 1 char in v1 and 2 chars in v2*/
                 int packet_len = BL_Get_Char(100);
 
-                if (packet_len != -1)
+                if (packet_len != -1 && BL_Frame_Version == BL_FRAME_V2)
+                {
+                    int packet_len_lo = BL_Get_Char(100);
+                    packet_len = (packet_len_lo == -1) ? -1 : (packet_len << 8 | packet_len_lo);
+                }
+
+                if (packet_len > 1 && packet_len <= BL_RX_BUFFER_SIZE)
                 {
-                    if (BL_Get_Chars((char *)BL_RX_Buffer, packet_len, 5000) == packet_len)
+                    if (BL_Transport->Receive(BL_RX_Buffer, packet_len, 5000) == packet_len)
                     {
                         uint8_t cmd = BL_RX_Buffer[0];
 
                         /* only applicable to CMD_WRITE, CMD_READ, CMD_VERIFY cmds,  dont care for other cmd*/
-                        /* no of bytes to read or write*/
-                        uint32_t len = BL_RX_Buffer[1];
-                        uint32_t address = BL_RX_Buffer[4] << 24 | BL_RX_Buffer[5] << 16 |
-                                           BL_RX_Buffer[6] << 8 | BL_RX_Buffer[7] << 0;
+                        /* address and no of bytes to read or write*/
+                        uint32_t address;
+                        uint32_t len;
+                        uint8_t *payload = BL_Parse_Header(BL_RX_Buffer, &address, &len);
 
-                        /* dont care*/
-                        /* padding for stm32 word alignment*/
+                        /* seq and flags, only applicable to CMD_WRITE_WINDOW and CMD_WRITE, dont care for other cmd*/
+                        /* also padding for stm32 word alignment*/
                         (void)BL_RX_Buffer[2];
-                        (void)BL_RX_Buffer[3];
+                        uint8_t flags = BL_RX_Buffer[3];
 
-                        /* last byte is crc*/
                         uint8_t crc_recvd = BL_RX_Buffer[packet_len - 1];
 
                         /* calculate crc */
                         uint8_t crc_calc = BL_CRC8(BL_RX_Buffer, (packet_len - 1));
 
-                        if (crc_calc == crc_recvd)
+                        if (crc_calc == crc_recvd && cmd != BL_CMD_WRITE_WINDOW && !BL_Payload_Fits(BL_RX_Buffer, packet_len, len))
                         {
+                            /* header claims more payload than arrived */
+                            BL_Send_Char(BL_CMD_NACK);
+                        }
+                        else if (crc_calc == crc_recvd)
+                        {
+                            /* every cmd may touch flash, erase started ahead is done first */
+                            ST_Erase_Finish();
+
+                            if ((cmd == BL_CMD_WRITE || cmd == BL_CMD_WRITE_COMPRESSED) && (flags & BL_WRITE_FLAG_END))
+                            {
+                                /* image end follows payload */
+                                BL_Image_End = payload[len] << 24 | payload[len + 1] << 16 |
+                                               payload[len + 2] << 8 | payload[len + 3] << 0;
+                            }
+
+                            if (cmd != BL_CMD_WRITE_WINDOW)
+                            {
+                                /* window transfer ends with first other cmd */
+                                BL_Window_Active = 0;
+                            }
+
                             switch (cmd)
                             {
                             case BL_CMD_WRITE:
-                                BL_Write_Callback(address, (BL_RX_Buffer + 8), len);
+                                BL_Write_Callback(address, payload, len, flags);
+                                break;
+
+                            case BL_CMD_WRITE_COMPRESSED:
+                                BL_Write_Compressed_Callback(address, payload, len, flags);
                                 break;
 
                             case BL_CMD_READ:
@@ -633,13 +1818,37 @@ static void BL_Loop(void)
                                 break;
 
                             case BL_CMD_VERIFY:
-                                BL_Verify_Callback(address, (BL_RX_Buffer + 8), len);
+                                BL_Verify_Callback(address, payload, len);
                                 break;
 
                             case BL_CMD_GETVER:
                                 BL_Get_Version_Callback();
                                 break;
 
+                            case BL_CMD_WRITE_WINDOW:
+                                BL_Write_Window_Callback(BL_RX_Buffer, packet_len);
+                                break;
+
+                            case BL_CMD_FRAME_FORMAT:
+                                BL_Frame_Format_Callback(BL_RX_Buffer[1]);
+                                break;
+
+                            case BL_CMD_GET_INFO:
+                                BL_Get_Info_Callback();
+                                break;
+
+                            case BL_CMD_ERASE_RANGE:
+                                BL_Erase_Range_Callback(address, payload, len);
+                                break;
+
+                            case BL_CMD_CHECKSUM:
+                                BL_Checksum_Callback(address, payload, len);
+                                break;
+
+                            case BL_CMD_PAGE_HASH:
+                                BL_Page_Hash_Callback(address, payload, len);
+                                break;
+
                             default:
                                 break;
                             }
@@ -657,6 +1866,7 @@ static void BL_Loop(void)
 void BL_Main(void)
 {
     HAL_Delay(1);
+    uint32_t magic_word;
     uint8_t magic_number;
 
     /** enable backup register access */
@@ -665,19 +1875,27 @@ void BL_Main(void)
 
 #if defined(STM32F103xE) || defined(STM32F103xB)
     __HAL_RCC_BKP_CLK_ENABLE();
-    magic_number = BKP->DR1 & 0x0000FFFF;
+    magic_word = BKP->DR1 & 0x0000FFFF;
     BKP->DR1 = 0x00;
 #elif defined(STM32F407xx)
     __HAL_RCC_BKPSRAM_CLK_ENABLE();
-    magic_number = *(__IO uint8_t *)0x40024000;
-    *(__IO uint8_t *)0x40024000 = 0x00;
+    magic_word = *(__IO uint16_t *)0x40024000;
+    *(__IO uint16_t *)0x40024000 = 0x00;
 #elif defined(STM32F401xE)
     __HAL_RCC_RTC_CONFIG(RCC_RTCCLKSOURCE_LSI);
     __HAL_RCC_RTC_ENABLE();
-    magic_number = RTC->BKP0R;
+    magic_word = RTC->BKP0R;
     RTC->BKP0R = 0x00;
 #endif
 
+    /** application may put node address in byte after magic number */
+    magic_number = magic_word & 0xFF;
+
+    if (magic_number == 0xA5)
+    {
+        BL_Handover_Address = (magic_word >> 8) & 0xFF;
+    }
+
     /** if pin is low enter bootloader, magic number is set or debug flag is enabled */
     if (HAL_GPIO_ReadPin(Boot_GPIO_Port, Boot_Pin) == GPIO_PIN_RESET || magic_number == 0xA5 || BL_DEBUG)
     {
@@ -5,22 +5,69 @@
 
 #ifdef STM32F103xB
 #define USE_USB_CDC 1
+#define BL_CDC_RX_BUFFER_SIZE 2048 // power of 2, holds one full frame
+#define BL_CDC_TX_BUFFER_SIZE 512 // power of 2, larger replies block until in endpoint drains
 #define BL_AUTO_BAUD 1
+#define BL_UART_RX_BUFFER_SIZE 2048 // power of 2, holds one full frame
+#define BL_UART_DMA 1 // 0 for rx isr and polled tx
+#define BL_UART_TX_BUFFER_SIZE 256 // dma tx chunk
+#define BL_RS485 0 // 1 for addressed multi-drop bus with driver enable pin, needs BL_AUTO_BAUD 0
+#define USE_SPI 0 // no ram left for spi buffers
+#define USE_CAN 0 // shares packet memory with usb, needs USE_USB_CDC 0
+#define BL_CAN_RX_BUFFER_SIZE 2048 // power of 2, holds one full frame, broadcast frame buffer is as large
 #endif
 
 #ifdef STM32F103xE
 #define USE_USB_CDC 1
+#define BL_CDC_RX_BUFFER_SIZE 4096 // power of 2, holds one full frame
+#define BL_CDC_TX_BUFFER_SIZE 1024 // power of 2, larger replies block until in endpoint drains
 #define BL_AUTO_BAUD 1
+#define BL_UART_RX_BUFFER_SIZE 4096 // power of 2, holds one full frame
+#define BL_UART_DMA 1 // 0 for rx isr and polled tx
+#define BL_UART_TX_BUFFER_SIZE 256 // dma tx chunk
+#define BL_RS485 0 // 1 for addressed multi-drop bus with driver enable pin, needs BL_AUTO_BAUD 0
+#define USE_SPI 1
+#define BL_SPI_RX_BUFFER_SIZE 4096 // power of 2, holds one full frame
+#define BL_SPI_TX_BUFFER_SIZE 4096 // holds largest reply
+#define USE_CAN 0 // shares packet memory with usb, needs USE_USB_CDC 0
+#define BL_CAN_RX_BUFFER_SIZE 4096 // power of 2, holds one full frame, broadcast frame buffer is as large
 #endif
 
 #ifdef STM32F401xE
 #define USE_USB_CDC 0
 #define BL_AUTO_BAUD 1
+#define BL_UART_RX_BUFFER_SIZE 8192 // power of 2, holds one full frame
+#define BL_UART_DMA 1 // 0 for rx isr and polled tx
+#define BL_UART_TX_BUFFER_SIZE 256 // dma tx chunk
+#define BL_RS485 0 // 1 for addressed multi-drop bus with driver enable pin, needs BL_AUTO_BAUD 0
+#define USE_SPI 1
+#define BL_SPI_RX_BUFFER_SIZE 8192 // power of 2, holds one full frame
+#define BL_SPI_TX_BUFFER_SIZE 8192 // holds largest reply
+#define USE_CAN 0 // no can controller
 #endif
 
 #ifdef STM32F407xx
 #define USE_USB_CDC 1
+#define BL_CDC_RX_BUFFER_SIZE 8192 // power of 2, holds one full frame
+#define BL_CDC_TX_BUFFER_SIZE 2048 // power of 2, larger replies block until in endpoint drains
 #define BL_AUTO_BAUD 0
+#define BL_UART_RX_BUFFER_SIZE 8192 // power of 2, holds one full frame
+#define BL_UART_DMA 1 // 0 for rx isr and polled tx
+#define BL_UART_TX_BUFFER_SIZE 256 // dma tx chunk
+#define BL_RS485 0 // 1 for addressed multi-drop bus with driver enable pin, needs BL_AUTO_BAUD 0
+#define USE_SPI 1
+#define BL_SPI_RX_BUFFER_SIZE 8192 // power of 2, holds one full frame
+#define BL_SPI_TX_BUFFER_SIZE 8192 // holds largest reply
+#define USE_CAN 1
+#define BL_CAN_RX_BUFFER_SIZE 8192 // power of 2, holds one full frame, broadcast frame buffer is as large
+#endif
+
+#if (BL_RS485 == 1) && (BL_AUTO_BAUD == 1)
+#error "auto baud would lock onto traffic to other nodes on rs485 bus"
+#endif
+
+#if (USE_CAN == 1) && (USE_USB_CDC == 1) && (defined(STM32F103xE) || defined(STM32F103xB))
+#error "can and usb share packet memory on f103"
 #endif
 
 void BL_Main(void);
@@ -0,0 +1,569 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "bootloader.h"
+
+#if (USE_CAN == 1)
+#include "comm_interface.h"
+#include "main.h"
+
+/**
+ * bxcan node, bootloader byte stream cut into 8 byte data frames with 29-bit ids
+ *
+ * id is BL_CAN_ID_BASE | type << 16 | node id, host talks to one node at a time on that node's id
+ * and the node answers on its own, every node on the bus has its own id
+ *
+ * broadcast: host sends a whole bootloader frame once to every node it has a unicast session with,
+ * BL_CAN_CTRL_START announces tag and length, each 8 byte segment carries its segment no in the id so a
+ * lost segment only leaves a hole until host sends it again, BL_CAN_CTRL_STATUS has every node report
+ * its holes on its status id, a complete frame is read by bootloader as if it came unicast
+ * and each node acks it on its own id
+ *
+ * all filters feed fifo 1, fifo 0 irq is shared with usb on f103
+ */
+
+#define BL_CAN CAN1 // CAN1 on PB8 rx, PB9 tx
+#define BL_CAN_GPIO_Port GPIOB
+#define BL_CAN_RX_Pin GPIO_PIN_8
+#define BL_CAN_TX_Pin GPIO_PIN_9
+
+#define BL_CAN_IRQn CAN1_RX1_IRQn
+#define BL_CAN_IRQHandler CAN1_RX1_IRQHandler
+
+#define BL_CAN_CLK_ENABLE __HAL_RCC_CAN1_CLK_ENABLE
+#define BL_CAN_FORCE_RESET __HAL_RCC_CAN1_FORCE_RESET
+#define BL_CAN_RELEASE_RESET __HAL_RCC_CAN1_RELEASE_RESET
+#define BL_CAN_GPIO_CLK_ENABLE __HAL_RCC_GPIOB_CLK_ENABLE
+
+#ifndef BL_CAN_BITRATE
+#define BL_CAN_BITRATE 1000000
+#endif
+
+#ifndef BL_CAN_NODE_ID
+#define BL_CAN_NODE_ID 0 // 0 folds unique id into node id, set per node to pin it
+#endif
+
+/** id layout, must match host */
+#define BL_CAN_ID_BASE 0x1B000000U
+#define BL_CAN_ID_BASE_MASK 0x1FF00000U
+#define BL_CAN_ID_TYPE_MASK 0x000F0000U
+#define BL_CAN_ID_LOW_MASK 0x0000FFFFU
+#define BL_CAN_ID_HOST_DATA 0x00000000U   // host to node stream, low bits node id
+#define BL_CAN_ID_NODE_DATA 0x00010000U   // node to host stream, low bits node id
+#define BL_CAN_ID_BCAST_DATA 0x00020000U  // host to all, low bits segment no
+#define BL_CAN_ID_BCAST_CTRL 0x00030000U  // host to all, low bits 0
+#define BL_CAN_ID_NODE_STATUS 0x00040000U // node to host, low bits node id
+
+/** broadcast control, first data byte */
+#define BL_CAN_CTRL_START 0x01    // [START + tag + 2-byte frame len]
+#define BL_CAN_CTRL_STATUS 0x02   // [STATUS + tag], reply [STATUS + tag + 2-byte missing + 2-byte first + 2-byte window mask]
+#define BL_CAN_CTRL_DISCOVER 0x03 // [DISCOVER], reply [DISCOVER + joined]
+
+#define BL_CAN_NO_FRAME 0xFFFF // missing count when frame start for tag was not seen
+#define BL_CAN_SEGMENT_SIZE 8
+#define BL_CAN_STATUS_WINDOW 16 // segments per status frame, bit i of mask set if segment first + i is missing
+#define BL_CAN_STATUS_FRAMES 8  // status frames per request at most, rest is reported on next request
+
+#define BL_CAN_PENDING_STATUS 0x01
+#define BL_CAN_PENDING_DISCOVER 0x02
+
+#define BL_CAN_TX_TIMEOUT 100 // ms for a free mailbox, host gone or bus off after that
+
+/** unicast stream, free running indices, written by isr or by poll while flash is busy */
+static uint8_t BL_CAN_RX_Buffer[BL_CAN_RX_BUFFER_SIZE];
+static volatile uint32_t BL_CAN_RX_Write_Index;
+static uint32_t BL_CAN_RX_Read_Index;
+
+/** broadcast frame assembled by segment no, read by bootloader once no segment is missing */
+static uint8_t BL_CAN_Bcast_Buffer[BL_CAN_RX_BUFFER_SIZE];
+static uint8_t BL_CAN_Bcast_Map[BL_CAN_RX_BUFFER_SIZE / BL_CAN_SEGMENT_SIZE / 8];
+static volatile uint32_t BL_CAN_Bcast_Len;
+static volatile uint32_t BL_CAN_Bcast_Missing;
+static volatile uint32_t BL_CAN_Bcast_Read_Index;
+static volatile uint8_t BL_CAN_Bcast_Tag;
+
+/** set by first unicast data, node takes broadcasts only while host has a session with it */
+static volatile uint8_t BL_CAN_Joined;
+
+/** control requests answered from thread, mailboxes are not touched from isr */
+static volatile uint8_t BL_CAN_Pending;
+static volatile uint8_t BL_CAN_Status_Tag;
+
+static uint16_t BL_CAN_Node_ID;
+
+/**
+ * @brief store one received frame, unicast into stream, broadcast into frame by segment no
+ * @note runs from ram, called by poll while flash is busy
+ */
+__RAM_FUNC static void BL_CAN_RX_Frame(uint32_t id, const uint8_t *data, uint32_t dlc)
+{
+    uint32_t type = id & BL_CAN_ID_TYPE_MASK;
+    uint32_t low = id & BL_CAN_ID_LOW_MASK;
+
+    if (type == BL_CAN_ID_HOST_DATA)
+    {
+        /* filter passes own node id only */
+        BL_CAN_Joined = 1;
+
+        for (uint32_t i = 0; i < dlc; i++)
+        {
+            /* drop byte if ring is full, frame crc will catch it */
+            if (BL_CAN_RX_Write_Index - BL_CAN_RX_Read_Index < BL_CAN_RX_BUFFER_SIZE)
+            {
+                BL_CAN_RX_Buffer[BL_CAN_RX_Write_Index & (BL_CAN_RX_BUFFER_SIZE - 1)] = data[i];
+                BL_CAN_RX_Write_Index++;
+            }
+        }
+    }
+    else if (type == BL_CAN_ID_BCAST_DATA)
+    {
+        uint32_t offset = low * BL_CAN_SEGMENT_SIZE;
+        uint8_t bit = 1U << (low & 7);
+
+        /* segment of a frame we are not assembling, or one we already have */
+        if (!BL_CAN_Joined || !BL_CAN_Bcast_Missing || offset >= BL_CAN_Bcast_Len || (BL_CAN_Bcast_Map[low >> 3] & bit))
+        {
+            return;
+        }
+
+        for (uint32_t i = 0; i < dlc && offset + i < BL_CAN_Bcast_Len; i++)
+        {
+            BL_CAN_Bcast_Buffer[offset + i] = data[i];
+        }
+
+        BL_CAN_Bcast_Map[low >> 3] |= bit;
+        BL_CAN_Bcast_Missing--;
+    }
+    else if (type == BL_CAN_ID_BCAST_CTRL && dlc)
+    {
+        if (data[0] == BL_CAN_CTRL_START && dlc >= 4 && BL_CAN_Joined)
+        {
+            uint32_t len = data[2] << 8 | data[3];
+
+            /* start repeated for a frame already started keeps segments received so far */
+            if ((BL_CAN_Bcast_Len && data[1] == BL_CAN_Bcast_Tag) || len == 0 || len > BL_CAN_RX_BUFFER_SIZE)
+            {
+                return;
+            }
+
+            uint32_t segments = (len + BL_CAN_SEGMENT_SIZE - 1) / BL_CAN_SEGMENT_SIZE;
+
+            for (uint32_t i = 0; i < (segments + 7) / 8; i++)
+            {
+                BL_CAN_Bcast_Map[i] = 0;
+            }
+
+            BL_CAN_Bcast_Tag = data[1];
+            BL_CAN_Bcast_Read_Index = 0;
+            BL_CAN_Bcast_Missing = segments;
+            BL_CAN_Bcast_Len = len;
+        }
+        else if (data[0] == BL_CAN_CTRL_STATUS && dlc >= 2 && BL_CAN_Joined)
+        {
+            BL_CAN_Status_Tag = data[1];
+            BL_CAN_Pending |= BL_CAN_PENDING_STATUS;
+        }
+        else if (data[0] == BL_CAN_CTRL_DISCOVER)
+        {
+            BL_CAN_Pending |= BL_CAN_PENDING_DISCOVER;
+        }
+    }
+}
+
+/**
+ * @brief empty fifo 1, three frames deep
+ * @note runs from ram with interrupts off while flash is busy
+ */
+__RAM_FUNC static void BL_CAN_Poll(void)
+{
+    while (BL_CAN->RF1R & CAN_RF1R_FMP1)
+    {
+        uint32_t data[2];
+
+        /* stid and exid make up the 29-bit id */
+        uint32_t id = BL_CAN->sFIFOMailBox[1].RIR >> CAN_RI1R_EXID_Pos;
+        uint32_t dlc = BL_CAN->sFIFOMailBox[1].RDTR & CAN_RDT1R_DLC;
+
+        data[0] = BL_CAN->sFIFOMailBox[1].RDLR;
+        data[1] = BL_CAN->sFIFOMailBox[1].RDHR;
+
+        BL_CAN->RF1R = CAN_RF1R_RFOM1;
+
+        BL_CAN_RX_Frame(id, (const uint8_t *)data, (dlc > 8) ? 8 : dlc);
+    }
+}
+
+/**
+ * @brief queue one frame in first free mailbox, mailboxes go out in request order
+ * @retval 1 if queued
+ */
+static uint8_t BL_CAN_TX_Frame(uint32_t id, const uint8_t *data, uint32_t dlc)
+{
+    uint32_t tick_start = HAL_GetTick();
+    uint32_t word[2] = {0};
+
+    while ((BL_CAN->TSR & CAN_TSR_TME) == 0)
+    {
+        if (HAL_GetTick() - tick_start >= BL_CAN_TX_TIMEOUT)
+        {
+            return 0;
+        }
+    }
+
+    uint32_t mailbox = (BL_CAN->TSR & CAN_TSR_CODE) >> CAN_TSR_CODE_Pos;
+
+    memcpy(word, data, dlc);
+
+    BL_CAN->sTxMailBox[mailbox].TDTR = dlc;
+    BL_CAN->sTxMailBox[mailbox].TDLR = word[0];
+    BL_CAN->sTxMailBox[mailbox].TDHR = word[1];
+    BL_CAN->sTxMailBox[mailbox].TIR = (id << CAN_TI0R_EXID_Pos) | CAN_TI0R_IDE | CAN_TI0R_TXRQ;
+
+    return 1;
+}
+
+/**
+ * @brief 1 if segment of broadcast frame is in
+ */
+static uint8_t BL_CAN_Segment_Received(uint32_t segment)
+{
+    return (BL_CAN_Bcast_Map[segment >> 3] >> (segment & 7)) & 1;
+}
+
+/**
+ * @brief answer status and discover requests taken by isr
+ */
+static void BL_CAN_Service(void)
+{
+    uint8_t reply[8];
+    uint8_t pending;
+
+    __disable_irq();
+    pending = BL_CAN_Pending;
+    BL_CAN_Pending = 0;
+    __enable_irq();
+
+    if (pending & BL_CAN_PENDING_DISCOVER)
+    {
+        reply[0] = BL_CAN_CTRL_DISCOVER;
+        reply[1] = BL_CAN_Joined;
+        BL_CAN_TX_Frame(BL_CAN_ID_BASE | BL_CAN_ID_NODE_STATUS | BL_CAN_Node_ID, reply, 2);
+    }
+
+    if (pending & BL_CAN_PENDING_STATUS)
+    {
+        uint32_t missing = BL_CAN_NO_FRAME;
+        uint32_t segments = 0;
+        uint32_t first = 0;
+        uint32_t frames = 0;
+
+        if (BL_CAN_Bcast_Len && BL_CAN_Bcast_Tag == BL_CAN_Status_Tag)
+        {
+            missing = BL_CAN_Bcast_Missing;
+            segments = (BL_CAN_Bcast_Len + BL_CAN_SEGMENT_SIZE - 1) / BL_CAN_SEGMENT_SIZE;
+        }
+
+        /* one frame per window starting at a hole, host has them all once their holes add up to missing */
+        while (1)
+        {
+            uint32_t mask = 0;
+
+            while (first < segments && BL_CAN_Segment_Received(first))
+            {
+                first++;
+            }
+
+            if (frames && first >= segments)
+            {
+                break;
+            }
+
+            for (uint32_t i = 0; i < BL_CAN_STATUS_WINDOW && first + i < segments; i++)
+            {
+                if (!BL_CAN_Segment_Received(first + i))
+                {
+                    mask |= 1U << i;
+                }
+            }
+
+            reply[0] = BL_CAN_CTRL_STATUS;
+            reply[1] = BL_CAN_Status_Tag;
+            reply[2] = missing >> 8;
+            reply[3] = missing;
+            reply[4] = first >> 8;
+            reply[5] = first;
+            reply[6] = mask >> 8;
+            reply[7] = mask;
+            BL_CAN_TX_Frame(BL_CAN_ID_BASE | BL_CAN_ID_NODE_STATUS | BL_CAN_Node_ID, reply, 8);
+
+            first += BL_CAN_STATUS_WINDOW;
+
+            if (missing == BL_CAN_NO_FRAME || ++frames == BL_CAN_STATUS_FRAMES)
+            {
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * @brief no of chars bootloader can read, rest of a complete broadcast frame plus unicast stream
+ */
+static uint32_t BL_CAN_RX_Count(void)
+{
+    uint32_t count = BL_CAN_RX_Write_Index - BL_CAN_RX_Read_Index;
+
+    if (BL_CAN_Bcast_Len && !BL_CAN_Bcast_Missing)
+    {
+        count += BL_CAN_Bcast_Len - BL_CAN_Bcast_Read_Index;
+    }
+
+    return count;
+}
+
+/**
+ * @brief  send string buffer as node data frames
+ * @param data input buffer
+ * @param number of chars to send
+ **/
+static void BL_CAN_Send_Chars(const uint8_t *data, uint32_t count)
+{
+    while (count)
+    {
+        uint32_t chunk = (count < BL_CAN_SEGMENT_SIZE) ? count : BL_CAN_SEGMENT_SIZE;
+
+        /* give up on rest once mailboxes stay full, frame crc catches anything cut */
+        if (!BL_CAN_TX_Frame(BL_CAN_ID_BASE | BL_CAN_ID_NODE_DATA | BL_CAN_Node_ID, data, chunk))
+        {
+            break;
+        }
+
+        data += chunk;
+        count -= chunk;
+    }
+}
+
+/**
+ * @brief get chars, complete broadcast frame is read before unicast stream
+ * @param timeout
+ * @retval number chars received
+ */
+static uint32_t BL_CAN_Get_Chars(uint8_t *buffer, uint32_t count, uint32_t timeout)
+{
+    uint32_t tick_start = HAL_GetTick();
+
+    while (1)
+    {
+        BL_CAN_Service();
+
+        __disable_irq();
+
+        if (BL_CAN_RX_Count() >= count)
+        {
+            __enable_irq();
+            break;
+        }
+
+        if (HAL_GetTick() - tick_start >= timeout)
+        {
+            __enable_irq();
+            return 0;
+        }
+
+        /* woken by can rx isr or systick, a request taken meanwhile is answered on next pass */
+        if (!BL_CAN_Pending)
+        {
+            __WFI();
+        }
+
+        __enable_irq();
+    }
+
+    uint32_t index = 0;
+
+    if (BL_CAN_Bcast_Len && !BL_CAN_Bcast_Missing)
+    {
+        uint32_t first = BL_CAN_Bcast_Len - BL_CAN_Bcast_Read_Index;
+
+        if (first > count)
+        {
+            first = count;
+        }
+
+        memcpy(buffer, &BL_CAN_Bcast_Buffer[BL_CAN_Bcast_Read_Index], first);
+        BL_CAN_Bcast_Read_Index += first;
+        index = first;
+    }
+
+    for (; index < count; index++)
+    {
+        buffer[index] = BL_CAN_RX_Buffer[BL_CAN_RX_Read_Index & (BL_CAN_RX_BUFFER_SIZE - 1)];
+        BL_CAN_RX_Read_Index++;
+    }
+
+    return count;
+}
+
+/**
+ * @brief accept ids matching id under mask into fifo 1, data frames with extended id only
+ */
+static void BL_CAN_Filter(uint32_t bank, uint32_t id, uint32_t mask)
+{
+    uint32_t bit = 1U << bank;
+
+    CLEAR_BIT(BL_CAN->FM1R, bit);
+    SET_BIT(BL_CAN->FS1R, bit);
+    SET_BIT(BL_CAN->FFA1R, bit);
+
+    BL_CAN->sFilterRegister[bank].FR1 = (id << CAN_RI1R_EXID_Pos) | CAN_RI1R_IDE;
+    BL_CAN->sFilterRegister[bank].FR2 = (mask << CAN_RI1R_EXID_Pos) | CAN_RI1R_IDE | CAN_RI1R_RTR;
+
+    SET_BIT(BL_CAN->FA1R, bit);
+}
+
+/**
+ * @brief bit timing for BL_CAN_BITRATE, sample point near 87.5%
+ * @retval 1 if apb1 clock divides into 8 to 18 time quanta per bit
+ */
+static uint8_t BL_CAN_Bit_Timing(void)
+{
+    uint32_t pclk = HAL_RCC_GetPCLK1Freq();
+
+    for (uint32_t tq = 18; tq >= 8; tq--)
+    {
+        if (pclk % (BL_CAN_BITRATE * tq) == 0)
+        {
+            uint32_t prescaler = pclk / (BL_CAN_BITRATE * tq);
+            uint32_t bs2 = (tq + 4) / 8;
+            uint32_t bs1 = tq - 1 - bs2;
+
+            BL_CAN->BTR = (bs2 - 1) << CAN_BTR_TS2_Pos | (bs1 - 1) << CAN_BTR_TS1_Pos | (prescaler - 1);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static uint8_t BL_CAN_Init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStruct = {0};
+    uint32_t tick_start;
+
+    BL_CAN_CLK_ENABLE();
+    BL_CAN_GPIO_CLK_ENABLE();
+
+#if defined(STM32F103xE) || defined(STM32F103xB)
+    GPIO_InitStruct.Pin = BL_CAN_TX_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+    HAL_GPIO_Init(BL_CAN_GPIO_Port, &GPIO_InitStruct);
+
+    GPIO_InitStruct.Pin = BL_CAN_RX_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+    GPIO_InitStruct.Pull = GPIO_PULLUP;
+    HAL_GPIO_Init(BL_CAN_GPIO_Port, &GPIO_InitStruct);
+
+    /* can on PB8 PB9 */
+    __HAL_RCC_AFIO_CLK_ENABLE();
+    __HAL_AFIO_REMAP_CAN1_2();
+#else
+    GPIO_InitStruct.Pin = BL_CAN_RX_Pin | BL_CAN_TX_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    GPIO_InitStruct.Pull = GPIO_PULLUP;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+    GPIO_InitStruct.Alternate = GPIO_AF9_CAN1;
+    HAL_GPIO_Init(BL_CAN_GPIO_Port, &GPIO_InitStruct);
+#endif
+
+    BL_CAN_FORCE_RESET();
+    BL_CAN_RELEASE_RESET();
+
+    /* leave sleep, enter init */
+    BL_CAN->MCR = CAN_MCR_INRQ;
+    tick_start = HAL_GetTick();
+
+    while ((BL_CAN->MSR & CAN_MSR_INAK) == 0)
+    {
+        if (HAL_GetTick() - tick_start >= 10)
+        {
+            return 0;
+        }
+    }
+
+    /* recover from bus off by itself, mailboxes leave in request order */
+    BL_CAN->MCR = CAN_MCR_INRQ | CAN_MCR_ABOM | CAN_MCR_TXFP;
+
+    if (!BL_CAN_Bit_Timing())
+    {
+        return 0;
+    }
+
+#if (BL_CAN_NODE_ID == 0)
+    uint32_t uid = HAL_GetUIDw0() ^ HAL_GetUIDw1() ^ HAL_GetUIDw2();
+
+    BL_CAN_Node_ID = (uid ^ (uid >> 16)) & BL_CAN_ID_LOW_MASK;
+#else
+    BL_CAN_Node_ID = BL_CAN_NODE_ID;
+#endif
+
+    BL_CAN_RX_Write_Index = 0;
+    BL_CAN_RX_Read_Index = 0;
+    BL_CAN_Bcast_Len = 0;
+    BL_CAN_Bcast_Missing = 0;
+    BL_CAN_Joined = 0;
+    BL_CAN_Pending = 0;
+
+    SET_BIT(BL_CAN->FMR, CAN_FMR_FINIT);
+    BL_CAN_Filter(0, BL_CAN_ID_BASE | BL_CAN_ID_HOST_DATA | BL_CAN_Node_ID, BL_CAN_ID_BASE_MASK | BL_CAN_ID_TYPE_MASK | BL_CAN_ID_LOW_MASK);
+    BL_CAN_Filter(1, BL_CAN_ID_BASE | BL_CAN_ID_BCAST_DATA, BL_CAN_ID_BASE_MASK | BL_CAN_ID_TYPE_MASK);
+    BL_CAN_Filter(2, BL_CAN_ID_BASE | BL_CAN_ID_BCAST_CTRL, BL_CAN_ID_BASE_MASK | BL_CAN_ID_TYPE_MASK | BL_CAN_ID_LOW_MASK);
+    CLEAR_BIT(BL_CAN->FMR, CAN_FMR_FINIT);
+
+    BL_CAN->IER = CAN_IER_FMPIE1;
+
+    /* joins bus after 11 recessive bits, receiving starts then */
+    CLEAR_BIT(BL_CAN->MCR, CAN_MCR_INRQ);
+
+    HAL_NVIC_SetPriority(BL_CAN_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(BL_CAN_IRQn);
+
+    return 1;
+}
+
+static void BL_CAN_Deinit(void)
+{
+    uint32_t tick_start = HAL_GetTick();
+
+    /* let last ack out */
+    while ((BL_CAN->TSR & CAN_TSR_TME) != CAN_TSR_TME && HAL_GetTick() - tick_start < BL_CAN_TX_TIMEOUT)
+        ;
+
+    HAL_NVIC_DisableIRQ(BL_CAN_IRQn);
+
+    BL_CAN_FORCE_RESET();
+    BL_CAN_RELEASE_RESET();
+    HAL_GPIO_DeInit(BL_CAN_GPIO_Port, BL_CAN_RX_Pin | BL_CAN_TX_Pin);
+}
+
+/**
+ * @brief This function handles can fifo 1 message pending interrupt.
+ */
+void BL_CAN_IRQHandler(void)
+{
+    BL_CAN_Poll();
+    BL_COMM_RX_Event();
+}
+
+const struct BL_COMM_Transport_t BL_CAN_Transport = {
+    .Init = BL_CAN_Init,
+    .Deinit = BL_CAN_Deinit,
+    .Send = BL_CAN_Send_Chars,
+    .Receive = BL_CAN_Get_Chars,
+    /* fifo is three frames deep, emptied into ram while flash is busy */
+    .Poll = BL_CAN_Poll,
+    .Max_Frame_Size = BL_CAN_RX_BUFFER_SIZE,
+    /* controller receives into fifo while mailboxes send */
+    .Caps = BL_COMM_CAP_FULL_DUPLEX,
+};
+#endif
@@ -1,19 +1,48 @@
 #include <stdint.h>
 
-uint8_t BL_UART_Init();
-void BL_UART_Deinit();
+/** transport capability flags */
+#define BL_COMM_CAP_DMA 0x01         // data moved by dma or usb core, cpu sleeps while waiting
+#define BL_COMM_CAP_FULL_DUPLEX 0x02 // receives while a send is in flight
 
-void BL_UART_Send_Char(char data);
-void BL_UART_Send_Chars(char *data, uint32_t count);
+/**
+ * transport backend, protocol core only talks to the session transport through this
+ */
+struct BL_COMM_Transport_t
+{
+    /** init hardware and start receiving, returns 1 on success */
+    uint8_t (*Init)(void);
 
-int BL_UART_Get_Char(uint32_t timeout);
-uint32_t BL_UART_Get_Chars(char *buffer, uint32_t count, uint32_t timeout);
+    /** flush pending sends and release hardware */
+    void (*Deinit)(void);
 
-uint8_t BL_CDC_Init();
-void BL_CDC_Deinit();
+    /** send or queue buffer, caller may reuse it on return */
+    void (*Send)(const uint8_t *data, uint32_t count);
 
-void BL_CDC_Send_Char(char data);
-void BL_CDC_Send_Chars(char *data, uint32_t count);
+    /** receive count chars within timeout ms, returns fewer on timeout, 0 timeout does not block */
+    uint32_t (*Receive)(uint8_t *buffer, uint32_t count, uint32_t timeout);
 
-int BL_CDC_Get_Char(uint32_t timeout);
-uint32_t BL_CDC_Get_Chars(char *buffer, uint32_t count, uint32_t timeout);
+    /** runs from ram with interrupts off while flash is busy, NULL if not needed */
+    void (*Poll)(void);
+
+    /** largest frame receive side holds at once */
+    uint32_t Max_Frame_Size;
+
+    /** BL_COMM_CAP_ flags */
+    uint32_t Caps;
+};
+
+extern const struct BL_COMM_Transport_t BL_UART_Transport;
+extern const struct BL_COMM_Transport_t BL_CDC_Transport;
+extern const struct BL_COMM_Transport_t BL_SPI_Transport;
+extern const struct BL_COMM_Transport_t BL_CAN_Transport;
+
+uint32_t BL_UART_Get_Baud(void);
+
+uint32_t BL_CDC_Peek(const uint8_t **span);
+void BL_CDC_Consume(uint32_t count);
+
+/** node address application handed over with magic number, 0 if none */
+uint8_t BL_COMM_Handover_Address(void);
+
+/** called by transport isr when chars arrive, wakes connect arbiter */
+void BL_COMM_RX_Event(void);
@@ -0,0 +1,337 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "bootloader.h"
+
+#if (USE_SPI == 1)
+#include "comm_interface.h"
+#include "main.h"
+
+/**
+ * spi slave, master clocks every byte in both directions
+ *
+ * ready line is driven high while bootloader waits for input and any reply is loaded for the master to clock out,
+ * it drops on nss rising edge at end of each master transaction and stays low until bootloader is waiting again
+ *
+ * master sequence: wait ready, clock frame out, wait ready, clock reply in with 0xFF filler,
+ * filler lands in rx ring and is skipped by bootloader while it waits for next sync char
+ */
+
+#define BL_SPI SPI2 // SPI2 on PB12 nss, PB13 sck, PB14 miso, PB15 mosi
+#define BL_SPI_GPIO_Port GPIOB
+#define BL_SPI_NSS_Pin GPIO_PIN_12
+#define BL_SPI_SCK_Pin GPIO_PIN_13
+#define BL_SPI_MISO_Pin GPIO_PIN_14
+#define BL_SPI_MOSI_Pin GPIO_PIN_15
+#define BL_SPI_Ready_GPIO_Port GPIOB
+#define BL_SPI_Ready_Pin GPIO_PIN_11 // push pull output to master, high when ready
+
+#define BL_SPI_NSS_EXTI_Line (1U << 12)
+#define BL_SPI_NSS_IRQn EXTI15_10_IRQn
+#define BL_SPI_NSS_IRQHandler EXTI15_10_IRQHandler
+
+#define BL_SPI_CLK_ENABLE __HAL_RCC_SPI2_CLK_ENABLE
+#define BL_SPI_FORCE_RESET __HAL_RCC_SPI2_FORCE_RESET
+#define BL_SPI_RELEASE_RESET __HAL_RCC_SPI2_RELEASE_RESET
+#define BL_SPI_GPIO_CLK_ENABLE __HAL_RCC_GPIOB_CLK_ENABLE
+
+#if defined(STM32F103xE) || defined(STM32F103xB)
+#define BL_SPI_DMA_RX_Stream DMA1_Channel4 // DMA1_Channel4 for spi2 rx
+#define BL_SPI_DMA_TX_Stream DMA1_Channel5 // DMA1_Channel5 for spi2 tx
+#else
+#define BL_SPI_DMA_RX_Stream DMA1_Stream3 // DMA1_Stream3 for spi2 rx
+#define BL_SPI_DMA_TX_Stream DMA1_Stream4 // DMA1_Stream4 for spi2 tx
+#define BL_SPI_DMA_Channel DMA_CHANNEL_0  // DMA_CHANNEL_0 for spi2
+#endif
+#define BL_SPI_DMA_CLK_ENABLE __HAL_RCC_DMA1_CLK_ENABLE
+
+static DMA_HandleTypeDef BL_SPI_DMA_RX;
+static DMA_HandleTypeDef BL_SPI_DMA_TX;
+
+/** circular rx buffer written by dma, write index is taken from dma counter */
+static uint8_t BL_SPI_RX_Buffer[BL_SPI_RX_BUFFER_SIZE];
+static uint32_t BL_SPI_RX_Read_Index;
+
+/** reply is collected here and handed to dma once bootloader waits for input */
+static uint8_t BL_SPI_TX_Buffer[BL_SPI_TX_BUFFER_SIZE];
+static uint32_t BL_SPI_TX_Count;
+static uint8_t BL_SPI_TX_Loaded;
+
+/**
+ * @brief slave mode 0, 8 bit, hardware nss, both directions over dma
+ */
+static void BL_SPI_Config(void)
+{
+    BL_SPI->CR1 = 0;
+    BL_SPI->CR2 = SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+    BL_SPI->CR1 = SPI_CR1_SPE;
+}
+
+/**
+ * @brief no of received chars not read yet
+ */
+static uint32_t BL_SPI_RX_Count(void)
+{
+    uint32_t write_index = BL_SPI_RX_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(&BL_SPI_DMA_RX);
+
+    return (write_index - BL_SPI_RX_Read_Index) & (BL_SPI_RX_BUFFER_SIZE - 1);
+}
+
+/**
+ * @brief drop previous reply, master did not clock all of it
+ */
+static void BL_SPI_TX_Flush(void)
+{
+    HAL_DMA_Abort(&BL_SPI_DMA_TX);
+
+    /* data register has no flush, a stale char would lead next reply, rx dma keeps running */
+    if ((BL_SPI->SR & SPI_SR_TXE) == 0)
+    {
+        BL_SPI_FORCE_RESET();
+        BL_SPI_RELEASE_RESET();
+        BL_SPI_Config();
+    }
+}
+
+/**
+ * @brief hand collected reply to dma, master clocks it out after ready goes high
+ */
+static void BL_SPI_TX_Load(void)
+{
+    if (BL_SPI_TX_Count && !BL_SPI_TX_Loaded)
+    {
+        HAL_DMA_Start(&BL_SPI_DMA_TX, (uint32_t)BL_SPI_TX_Buffer, (uint32_t)&BL_SPI->DR, BL_SPI_TX_Count);
+        BL_SPI_TX_Loaded = 1;
+    }
+}
+
+/**
+ * @brief  collect string buffer into reply
+ * @note nothing moves until master clocks, reply is loaded when bootloader waits for input
+ * @param data input buffer
+ * @param number of chars to send
+ **/
+static void BL_SPI_Send_Chars(const uint8_t *data, uint32_t count)
+{
+    /* first send after a loaded reply starts a new one */
+    if (BL_SPI_TX_Loaded)
+    {
+        if (__HAL_DMA_GET_COUNTER(&BL_SPI_DMA_TX))
+        {
+            BL_SPI_TX_Flush();
+        }
+        else
+        {
+            HAL_DMA_PollForTransfer(&BL_SPI_DMA_TX, HAL_DMA_FULL_TRANSFER, 0);
+        }
+
+        BL_SPI_TX_Count = 0;
+        BL_SPI_TX_Loaded = 0;
+    }
+
+    /* replies fit, tx buffer holds a whole frame, frame crc catches anything cut */
+    if (count > BL_SPI_TX_BUFFER_SIZE - BL_SPI_TX_Count)
+    {
+        count = BL_SPI_TX_BUFFER_SIZE - BL_SPI_TX_Count;
+    }
+
+    memcpy(&BL_SPI_TX_Buffer[BL_SPI_TX_Count], data, count);
+    BL_SPI_TX_Count += count;
+}
+
+/**
+ * @brief get chars, raises ready line while waiting
+ * @param timeout
+ * @retval number chars received
+ */
+static uint32_t BL_SPI_Get_Chars(uint8_t *buffer, uint32_t count, uint32_t timeout)
+{
+    uint32_t tick_start = HAL_GetTick();
+
+    BL_SPI_TX_Load();
+
+    while (1)
+    {
+        /* nss edge cannot drop ready between the check and raising it */
+        __disable_irq();
+
+        if (BL_SPI_RX_Count() >= count)
+        {
+            __enable_irq();
+            break;
+        }
+
+        HAL_GPIO_WritePin(BL_SPI_Ready_GPIO_Port, BL_SPI_Ready_Pin, GPIO_PIN_SET);
+
+        if (HAL_GetTick() - tick_start >= timeout)
+        {
+            __enable_irq();
+            return 0;
+        }
+
+        /* woken by nss edge or systick */
+        __WFI();
+        __enable_irq();
+    }
+
+    /* copy in up to two spans around end of circular buffer */
+    uint32_t first = BL_SPI_RX_BUFFER_SIZE - BL_SPI_RX_Read_Index;
+
+    if (first > count)
+    {
+        first = count;
+    }
+
+    memcpy(buffer, &BL_SPI_RX_Buffer[BL_SPI_RX_Read_Index], first);
+    memcpy(buffer + first, BL_SPI_RX_Buffer, count - first);
+
+    BL_SPI_RX_Read_Index = (BL_SPI_RX_Read_Index + count) & (BL_SPI_RX_BUFFER_SIZE - 1);
+
+    return count;
+}
+
+/**
+ * @brief dma streams for spi, circular rx and normal tx
+ */
+static void BL_SPI_DMA_Init(void)
+{
+    BL_SPI_DMA_CLK_ENABLE();
+
+    BL_SPI_DMA_RX.Instance = BL_SPI_DMA_RX_Stream;
+    BL_SPI_DMA_RX.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    BL_SPI_DMA_RX.Init.PeriphInc = DMA_PINC_DISABLE;
+    BL_SPI_DMA_RX.Init.MemInc = DMA_MINC_ENABLE;
+    BL_SPI_DMA_RX.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    BL_SPI_DMA_RX.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    BL_SPI_DMA_RX.Init.Mode = DMA_CIRCULAR;
+    BL_SPI_DMA_RX.Init.Priority = DMA_PRIORITY_VERY_HIGH;
+#if !defined(STM32F103xE) && !defined(STM32F103xB)
+    BL_SPI_DMA_RX.Init.Channel = BL_SPI_DMA_Channel;
+    BL_SPI_DMA_RX.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+#endif
+
+    BL_SPI_DMA_TX.Instance = BL_SPI_DMA_TX_Stream;
+    BL_SPI_DMA_TX.Init = BL_SPI_DMA_RX.Init;
+    BL_SPI_DMA_TX.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    BL_SPI_DMA_TX.Init.Mode = DMA_NORMAL;
+    BL_SPI_DMA_TX.Init.Priority = DMA_PRIORITY_HIGH;
+
+    if (HAL_DMA_Init(&BL_SPI_DMA_RX) != HAL_OK || HAL_DMA_Init(&BL_SPI_DMA_TX) != HAL_OK)
+    {
+        Error_Handler();
+    }
+}
+
+static uint8_t BL_SPI_Init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+    BL_SPI_CLK_ENABLE();
+    BL_SPI_GPIO_CLK_ENABLE();
+
+    /* busy until bootloader first waits for input */
+    HAL_GPIO_WritePin(BL_SPI_Ready_GPIO_Port, BL_SPI_Ready_Pin, GPIO_PIN_RESET);
+    GPIO_InitStruct.Pin = BL_SPI_Ready_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+    GPIO_InitStruct.Pull = GPIO_NOPULL;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+    HAL_GPIO_Init(BL_SPI_Ready_GPIO_Port, &GPIO_InitStruct);
+
+#if defined(STM32F103xE) || defined(STM32F103xB)
+    GPIO_InitStruct.Pin = BL_SPI_MISO_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+    HAL_GPIO_Init(BL_SPI_GPIO_Port, &GPIO_InitStruct);
+
+    GPIO_InitStruct.Pin = BL_SPI_NSS_Pin | BL_SPI_SCK_Pin | BL_SPI_MOSI_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+    HAL_GPIO_Init(BL_SPI_GPIO_Port, &GPIO_InitStruct);
+
+    /* nss edge on port b */
+    __HAL_RCC_AFIO_CLK_ENABLE();
+    MODIFY_REG(AFIO->EXTICR[3], AFIO_EXTICR4_EXTI12, AFIO_EXTICR4_EXTI12_PB);
+#else
+    GPIO_InitStruct.Pin = BL_SPI_NSS_Pin | BL_SPI_SCK_Pin | BL_SPI_MISO_Pin | BL_SPI_MOSI_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+    GPIO_InitStruct.Alternate = GPIO_AF5_SPI2;
+    HAL_GPIO_Init(BL_SPI_GPIO_Port, &GPIO_InitStruct);
+
+    /* nss edge on port b */
+    __HAL_RCC_SYSCFG_CLK_ENABLE();
+    MODIFY_REG(SYSCFG->EXTICR[3], SYSCFG_EXTICR4_EXTI12, SYSCFG_EXTICR4_EXTI12_PB);
+#endif
+
+    /* exti input stays connected while pin is in alternate function mode */
+    SET_BIT(EXTI->RTSR, BL_SPI_NSS_EXTI_Line);
+    SET_BIT(EXTI->IMR, BL_SPI_NSS_EXTI_Line);
+
+    BL_SPI_DMA_Init();
+    BL_SPI_Config();
+
+    /* rx runs in background from here, tx is started per reply */
+    BL_SPI_RX_Read_Index = 0;
+    BL_SPI_TX_Count = 0;
+    BL_SPI_TX_Loaded = 0;
+    HAL_DMA_Start(&BL_SPI_DMA_RX, (uint32_t)&BL_SPI->DR, (uint32_t)BL_SPI_RX_Buffer, BL_SPI_RX_BUFFER_SIZE);
+
+    HAL_NVIC_SetPriority(BL_SPI_NSS_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(BL_SPI_NSS_IRQn);
+
+    return 1;
+}
+
+static void BL_SPI_Deinit(void)
+{
+    uint32_t tick_start = HAL_GetTick();
+
+    /* let master clock last ack out */
+    BL_SPI_TX_Load();
+    HAL_GPIO_WritePin(BL_SPI_Ready_GPIO_Port, BL_SPI_Ready_Pin, GPIO_PIN_SET);
+
+    while (BL_SPI_TX_Loaded && __HAL_DMA_GET_COUNTER(&BL_SPI_DMA_TX) && HAL_GetTick() - tick_start < 100)
+        ;
+
+    HAL_NVIC_DisableIRQ(BL_SPI_NSS_IRQn);
+    CLEAR_BIT(EXTI->IMR, BL_SPI_NSS_EXTI_Line);
+    CLEAR_BIT(EXTI->RTSR, BL_SPI_NSS_EXTI_Line);
+
+    HAL_GPIO_WritePin(BL_SPI_Ready_GPIO_Port, BL_SPI_Ready_Pin, GPIO_PIN_RESET);
+
+    BL_SPI->CR1 = 0;
+    BL_SPI->CR2 = 0;
+    HAL_DMA_Abort(&BL_SPI_DMA_RX);
+    HAL_DMA_Abort(&BL_SPI_DMA_TX);
+    HAL_DMA_DeInit(&BL_SPI_DMA_RX);
+    HAL_DMA_DeInit(&BL_SPI_DMA_TX);
+
+    BL_SPI_FORCE_RESET();
+    BL_SPI_RELEASE_RESET();
+    HAL_GPIO_DeInit(BL_SPI_GPIO_Port, BL_SPI_NSS_Pin | BL_SPI_SCK_Pin | BL_SPI_MISO_Pin | BL_SPI_MOSI_Pin);
+}
+
+/**
+ * @brief This function handles nss rising edge, end of a master transaction.
+ * @note data is already in rx buffer, bootloader raises ready again once it waits for more
+ */
+void BL_SPI_NSS_IRQHandler(void)
+{
+    EXTI->PR = BL_SPI_NSS_EXTI_Line;
+
+    HAL_GPIO_WritePin(BL_SPI_Ready_GPIO_Port, BL_SPI_Ready_Pin, GPIO_PIN_RESET);
+
+    BL_COMM_RX_Event();
+}
+
+const struct BL_COMM_Transport_t BL_SPI_Transport = {
+    .Init = BL_SPI_Init,
+    .Deinit = BL_SPI_Deinit,
+    .Send = BL_SPI_Send_Chars,
+    .Receive = BL_SPI_Get_Chars,
+    /* dma keeps receiving while flash is busy, master waits on ready anyway */
+    .Poll = NULL,
+    .Max_Frame_Size = BL_SPI_RX_BUFFER_SIZE,
+    /* slave only sends while master clocks */
+    .Caps = BL_COMM_CAP_DMA,
+};
+#endif
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <string.h>
 
 #include "bootloader.h"
 #include "comm_interface.h"
@@ -7,66 +8,399 @@
 /** default baud */
 #define BL_BAUD 115200
 
+#if (BL_RS485 == 1)
+/**
+ * addressed multi-drop bus, every node shares the line with the host
+ *
+ * host wraps its stream in envelopes [SYNC + 1-byte address + 2-byte len + 1-byte check + len chars],
+ * check is ~(address ^ len hi ^ len lo), a node reads chars of envelopes to its own address or to
+ * BL_RS485_BROADCAST and skips the rest, so only the addressed node ever drives the line
+ *
+ * frames read from a broadcast envelope get no reply, host collects status of every node
+ * one by one afterwards, replies go out unwrapped with driver enable held until tc
+ */
+#define BL_RS485_DE_GPIO_Port GPIOA // driver enable on usart2 rts pin, receiver enable tied to it
+#define BL_RS485_DE_Pin GPIO_PIN_1
+#define BL_RS485_DE_GPIO_CLK_ENABLE __HAL_RCC_GPIOA_CLK_ENABLE
+
+#ifndef BL_RS485_ADDRESS
+#define BL_RS485_ADDRESS 0 // 0 takes address application hands over, else folds unique id, set per node to pin it
+#endif
+
+#define BL_RS485_SYNC_CHAR '#'
+#define BL_RS485_BROADCAST 0xFF
+#define BL_RS485_HEADER_SIZE 5
+
+/** address of this node, 1 to 254 */
+static uint8_t BL_RS485_Address;
+
+/** envelope header collected so far, kept across receive timeouts */
+static uint8_t BL_RS485_Header[BL_RS485_HEADER_SIZE];
+static uint32_t BL_RS485_Header_Len;
+
+/** chars left in current envelope and whether this node reads them */
+static uint32_t BL_RS485_Span;
+static uint8_t BL_RS485_Listen;
+static uint8_t BL_RS485_Envelope_Address;
+
+/** set while chars handed to bootloader last came from a broadcast envelope, replies are dropped */
+static uint8_t BL_RS485_Broadcast;
+
+#define BL_UART_DUPLEX 0 // line is shared, no reply while host sends
+#else
+#define BL_UART_DUPLEX BL_COMM_CAP_FULL_DUPLEX
+#endif
+
 UART_HandleTypeDef *BL_UART = &huart2; // huart2 or huart6
 
+#define BL_UART_IRQn USART2_IRQn             // USART2_IRQn or USART6_IRQn
+#define BL_UART_IRQHandler USART2_IRQHandler // USART2_IRQHandler or USART6_IRQHandler
+
+#if (BL_UART_DMA == 1)
+#if defined(STM32F103xE) || defined(STM32F103xB)
+#define BL_UART_DMA_RX_Stream DMA1_Channel6 // DMA1_Channel6 for usart2 rx
+#define BL_UART_DMA_TX_Stream DMA1_Channel7 // DMA1_Channel7 for usart2 tx
+#else
+#define BL_UART_DMA_RX_Stream DMA1_Stream5 // DMA1_Stream5 or DMA2_Stream1 for usart6 rx
+#define BL_UART_DMA_TX_Stream DMA1_Stream6 // DMA1_Stream6 or DMA2_Stream6 for usart6 tx
+#define BL_UART_DMA_Channel DMA_CHANNEL_4  // DMA_CHANNEL_4 or DMA_CHANNEL_5 for usart6
+#endif
+#define BL_UART_DMA_CLK_ENABLE __HAL_RCC_DMA1_CLK_ENABLE // __HAL_RCC_DMA2_CLK_ENABLE for usart6
+
+static DMA_HandleTypeDef BL_UART_DMA_RX;
+static DMA_HandleTypeDef BL_UART_DMA_TX;
+
+/** circular rx buffer written by dma, write index is taken from dma counter, overrun is caught by frame crc */
+static uint8_t BL_UART_RX_Buffer[BL_UART_RX_BUFFER_SIZE];
+static uint32_t BL_UART_RX_Read_Index;
+
+/** tx data is copied here so callers can reuse their buffers while dma sends */
+static uint8_t BL_UART_TX_Buffer[BL_UART_TX_BUFFER_SIZE];
+static uint8_t BL_UART_TX_Busy;
+
+static void BL_UART_DMA_Init(void);
+#else
+/** rx ring filled from uart isr, holds next frame while flash is being programmed or erased */
+static uint8_t BL_UART_RX_Buffer[BL_UART_RX_BUFFER_SIZE];
+static volatile uint32_t BL_UART_RX_Write_Index;
+static volatile uint32_t BL_UART_RX_Read_Index;
+#endif
+
 static volatile uint8_t BL_UART_RX_INT_Count;
 static volatile uint32_t Tick_Value;
 
+#if (BL_UART_DMA == 1)
+/**
+ * @brief wait for dma to finish previous tx
+ */
+static void BL_UART_TX_Wait(void)
+{
+    if (BL_UART_TX_Busy)
+    {
+        HAL_DMA_PollForTransfer(&BL_UART_DMA_TX, HAL_DMA_FULL_TRANSFER, 100);
+        BL_UART_TX_Busy = 0;
+    }
+}
+
+/**
+ * @brief  send string buffer
+ * @note returns once data is handed to dma, only waits for a previous transfer
+ * @param data input buffer
+ * @param number of chars to send
+ **/
+static void BL_UART_Send_Chars(const uint8_t *data, uint32_t count)
+{
+    while (count)
+    {
+        uint32_t chunk = (count < BL_UART_TX_BUFFER_SIZE) ? count : BL_UART_TX_BUFFER_SIZE;
+
+        BL_UART_TX_Wait();
+
+        memcpy(BL_UART_TX_Buffer, data, chunk);
+
+        /* tc is set again only once this chunk has left, deinit and rs485 driver enable wait on it */
+        __HAL_UART_CLEAR_FLAG(BL_UART, UART_FLAG_TC);
+        HAL_DMA_Start(&BL_UART_DMA_TX, (uint32_t)BL_UART_TX_Buffer, (uint32_t)&BL_UART->Instance->DR, chunk);
+        BL_UART_TX_Busy = 1;
+
+        data += chunk;
+        count -= chunk;
+    }
+}
+
+/**
+ * @brief no of received chars not read yet
+ */
+static uint32_t BL_UART_RX_Count(void)
+{
+    uint32_t write_index = BL_UART_RX_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(&BL_UART_DMA_RX);
+
+    return (write_index - BL_UART_RX_Read_Index) & (BL_UART_RX_BUFFER_SIZE - 1);
+}
+
 /**
- * @brief send character
- * @param data char to be sent
+ * @brief take received chars out of rx buffer
+ * @param buffer destination, NULL drops them
+ * @param count no of chars, no more than BL_UART_RX_Count()
  */
-void BL_UART_Send_Char(char data)
+static void BL_UART_RX_Copy(uint8_t *buffer, uint32_t count)
 {
-    BL_UART->Instance->DR = data;
+    if (buffer)
+    {
+        /* copy in up to two spans around end of circular buffer */
+        uint32_t first = BL_UART_RX_BUFFER_SIZE - BL_UART_RX_Read_Index;
+
+        if (first > count)
+        {
+            first = count;
+        }
+
+        memcpy(buffer, &BL_UART_RX_Buffer[BL_UART_RX_Read_Index], first);
+        memcpy(buffer + first, BL_UART_RX_Buffer, count - first);
+    }
+
+    BL_UART_RX_Read_Index = (BL_UART_RX_Read_Index + count) & (BL_UART_RX_BUFFER_SIZE - 1);
+}
+
+/**
+ * @brief wait for dma to finish previous tx and last char to leave shift register
+ */
+static void BL_UART_TX_Drain(void)
+{
+    BL_UART_TX_Wait();
+
     while (__HAL_UART_GET_FLAG(BL_UART, UART_FLAG_TC) == 0)
         ;
 }
-
+#else
 /**
  * @brief  send string buffer
  * @param data input buffer
  * @param number of chars to send
  **/
-void BL_UART_Send_Chars(char *data, uint32_t count)
+static void BL_UART_Send_Chars(const uint8_t *data, uint32_t count)
 {
     while (count--)
     {
-        BL_UART_Send_Char(*data);
-        data++;
+        BL_UART->Instance->DR = *data++;
+        while (__HAL_UART_GET_FLAG(BL_UART, UART_FLAG_TC) == 0)
+            ;
     }
 }
 
 /**
- * @brief get character
- * @param timeout
+ * @brief no of received chars not read yet
+ */
+static uint32_t BL_UART_RX_Count(void)
+{
+    return BL_UART_RX_Write_Index - BL_UART_RX_Read_Index;
+}
+
+/**
+ * @brief take received chars out of rx ring
+ * @param buffer destination, NULL drops them
+ * @param count no of chars, no more than BL_UART_RX_Count()
+ */
+static void BL_UART_RX_Copy(uint8_t *buffer, uint32_t count)
+{
+    for (uint32_t i = 0; buffer && i < count; i++)
+    {
+        buffer[i] = BL_UART_RX_Buffer[(BL_UART_RX_Read_Index + i) & (BL_UART_RX_BUFFER_SIZE - 1)];
+    }
+
+    BL_UART_RX_Read_Index += count;
+}
+
+/**
+ * @brief every char is sent by the time send returns
  */
-int BL_UART_Get_Char(uint32_t timeout)
+static void BL_UART_TX_Drain(void)
 {
-    uint8_t ch;
+}
+#endif
 
-    if (HAL_UART_Receive(BL_UART, &ch, 1, timeout) == HAL_OK)
+/**
+ * @brief wait until count chars are received
+ * @param count no of chars
+ * @param tick_start tick timeout runs from
+ * @param timeout in ms, 0 only checks
+ * @retval 1 once they are in, 0 on timeout
+ */
+static uint8_t BL_UART_RX_Wait(uint32_t count, uint32_t tick_start, uint32_t timeout)
+{
+    while (BL_UART_RX_Count() < count)
     {
-        return ch;
+        if (HAL_GetTick() - tick_start >= timeout)
+        {
+            return 0;
+        }
+
+#if (BL_UART_DMA == 1)
+        /* sleep until dma has the whole span, woken by idle line or systick */
+        __WFI();
+#endif
     }
 
-    return -1;
+    return 1;
 }
 
+#if (BL_RS485 == 0)
 /**
  * @brief get character
+ * @note nothing is taken on timeout
  * @param timeout
  * @retval number chars received
  */
-uint32_t BL_UART_Get_Chars(char *buffer, uint32_t count, uint32_t timeout)
+static uint32_t BL_UART_Get_Chars(uint8_t *buffer, uint32_t count, uint32_t timeout)
 {
-    if (HAL_UART_Receive(BL_UART, (uint8_t*)buffer, count, timeout) == HAL_OK)
+    if (!BL_UART_RX_Wait(count, HAL_GetTick(), timeout))
     {
-        return count;
+        return 0;
     }
 
-    return 0;
+    BL_UART_RX_Copy(buffer, count);
+
+    return count;
 }
+#else
+/**
+ * @brief get chars from envelopes to this node or to broadcast address, others are skipped
+ * @param timeout
+ * @retval number chars received, fewer on timeout
+ */
+static uint32_t BL_RS485_Get_Chars(uint8_t *buffer, uint32_t count, uint32_t timeout)
+{
+    uint32_t tick_start = HAL_GetTick();
+    uint32_t received = 0;
+
+    while (received < count)
+    {
+        if (BL_RS485_Span == 0)
+        {
+            /* header char by char, hunting for sync char */
+            if (!BL_UART_RX_Wait(1, tick_start, timeout))
+            {
+                break;
+            }
+
+            BL_UART_RX_Copy(&BL_RS485_Header[BL_RS485_Header_Len], 1);
+
+            if (BL_RS485_Header[0] != BL_RS485_SYNC_CHAR || ++BL_RS485_Header_Len < BL_RS485_HEADER_SIZE)
+            {
+                continue;
+            }
+
+            BL_RS485_Header_Len = 0;
+
+            uint8_t address = BL_RS485_Header[1];
+            uint8_t check = ~(address ^ BL_RS485_Header[2] ^ BL_RS485_Header[3]);
+
+            /* corrupt header is dropped, hunt goes on from next char */
+            if (check == BL_RS485_Header[4])
+            {
+                BL_RS485_Span = BL_RS485_Header[2] << 8 | BL_RS485_Header[3];
+                BL_RS485_Listen = (address == BL_RS485_Address || address == BL_RS485_BROADCAST);
+                BL_RS485_Envelope_Address = address;
+            }
+
+            continue;
+        }
+
+        if (!BL_RS485_Listen)
+        {
+            /* envelope to another node, drop whatever of it is in */
+            if (!BL_UART_RX_Wait(1, tick_start, timeout))
+            {
+                break;
+            }
+
+            uint32_t skip = BL_UART_RX_Count();
+
+            skip = (skip < BL_RS485_Span) ? skip : BL_RS485_Span;
+            BL_UART_RX_Copy(NULL, skip);
+            BL_RS485_Span -= skip;
+
+            continue;
+        }
+
+        uint32_t chunk = count - received;
+
+        chunk = (chunk < BL_RS485_Span) ? chunk : BL_RS485_Span;
+
+        if (!BL_UART_RX_Wait(chunk, tick_start, timeout))
+        {
+            break;
+        }
+
+        BL_UART_RX_Copy(buffer + received, chunk);
+        BL_RS485_Span -= chunk;
+        received += chunk;
+
+        BL_RS485_Broadcast = (BL_RS485_Envelope_Address == BL_RS485_BROADCAST);
+    }
+
+    return received;
+}
+
+/**
+ * @brief send reply with driver enable held until last char has left
+ * @note reply to a broadcast frame is dropped, every listener would drive the line at once
+ * @param data input buffer
+ * @param number of chars to send
+ */
+static void BL_RS485_Send_Chars(const uint8_t *data, uint32_t count)
+{
+    if (BL_RS485_Broadcast)
+    {
+        return;
+    }
+
+    HAL_GPIO_WritePin(BL_RS485_DE_GPIO_Port, BL_RS485_DE_Pin, GPIO_PIN_SET);
+
+    BL_UART_Send_Chars(data, count);
+    BL_UART_TX_Drain();
+
+    HAL_GPIO_WritePin(BL_RS485_DE_GPIO_Port, BL_RS485_DE_Pin, GPIO_PIN_RESET);
+}
+
+/**
+ * @brief driver enable pin and node address
+ */
+static void BL_RS485_Init(void)
+{
+    GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+    BL_RS485_DE_GPIO_CLK_ENABLE();
+
+    /* receive until a reply is sent */
+    HAL_GPIO_WritePin(BL_RS485_DE_GPIO_Port, BL_RS485_DE_Pin, GPIO_PIN_RESET);
+
+    GPIO_InitStruct.Pin = BL_RS485_DE_Pin;
+    GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+    GPIO_InitStruct.Pull = GPIO_NOPULL;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+    HAL_GPIO_Init(BL_RS485_DE_GPIO_Port, &GPIO_InitStruct);
+
+#if (BL_RS485_ADDRESS == 0)
+    BL_RS485_Address = BL_COMM_Handover_Address();
+
+    if (BL_RS485_Address == 0 || BL_RS485_Address == BL_RS485_BROADCAST)
+    {
+        uint32_t uid = HAL_GetUIDw0() ^ HAL_GetUIDw1() ^ HAL_GetUIDw2();
+
+        uid ^= uid >> 16;
+        BL_RS485_Address = 1 + ((uid ^ (uid >> 8)) & 0xFF) % 254;
+    }
+#else
+    BL_RS485_Address = BL_RS485_ADDRESS;
+#endif
+
+    BL_RS485_Header_Len = 0;
+    BL_RS485_Span = 0;
+    BL_RS485_Listen = 0;
+    BL_RS485_Broadcast = 0;
+}
+#endif
 
 #if (BL_AUTO_BAUD == 1)
 static void BL_UART_RX_INT_Reset(void)
@@ -93,13 +427,17 @@ static void BL_UART_RX_INT_Init(void)
 }
 #endif
 
-uint8_t BL_UART_Init()
+static uint8_t BL_UART_Init(void)
 {
     uint32_t baud = BL_BAUD;
     uint8_t xreturn = 0;
 
     MX_USART2_UART_Init(); //  MX_USART2_UART_Init(), MX_USART6_UART_Init(); for 407
 
+#if (BL_RS485 == 1)
+    BL_RS485_Init();
+#endif
+
 #if (BL_AUTO_BAUD == 1)
     /* auto baud detection ST AN4908 */
 
@@ -141,14 +479,144 @@ uint8_t BL_UART_Init()
         Error_Handler();
     }
 
+#if (BL_UART_DMA == 1)
+    BL_UART_DMA_Init();
+
+    /* dma receives in background, idle line interrupt only wakes reader at end of a frame */
+    BL_UART_RX_Read_Index = 0;
+    BL_UART_TX_Busy = 0;
+    HAL_DMA_Start(&BL_UART_DMA_RX, (uint32_t)&BL_UART->Instance->DR, (uint32_t)BL_UART_RX_Buffer, BL_UART_RX_BUFFER_SIZE);
+    SET_BIT(BL_UART->Instance->CR3, USART_CR3_DMAR | USART_CR3_DMAT);
+    __HAL_UART_ENABLE_IT(BL_UART, UART_IT_IDLE);
+    __HAL_UART_ENABLE_IT(BL_UART, UART_IT_ERR);
+#else
+    /* receive in background, bytes keep arriving while flash is programmed */
+    BL_UART_RX_Read_Index = BL_UART_RX_Write_Index;
+    __HAL_UART_ENABLE_IT(BL_UART, UART_IT_RXNE);
+#endif
+    HAL_NVIC_SetPriority(BL_UART_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(BL_UART_IRQn);
+
     return xreturn;
 }
 
-void BL_UART_Deinit()
+/**
+ * @brief get baud rate in use, auto detected or default
+ * @retval baud rate
+ */
+uint32_t BL_UART_Get_Baud(void)
+{
+    return BL_UART->Init.BaudRate;
+}
+
+static void BL_UART_Deinit(void)
 {
+    HAL_NVIC_DisableIRQ(BL_UART_IRQn);
+#if (BL_UART_DMA == 1)
+    /* let last ack leave before uart is reset */
+    BL_UART_TX_Drain();
+
+    __HAL_UART_DISABLE_IT(BL_UART, UART_IT_IDLE);
+    __HAL_UART_DISABLE_IT(BL_UART, UART_IT_ERR);
+    CLEAR_BIT(BL_UART->Instance->CR3, USART_CR3_DMAR | USART_CR3_DMAT);
+    HAL_DMA_Abort(&BL_UART_DMA_RX);
+    HAL_DMA_DeInit(&BL_UART_DMA_RX);
+    HAL_DMA_DeInit(&BL_UART_DMA_TX);
+#else
+    __HAL_UART_DISABLE_IT(BL_UART, UART_IT_RXNE);
+#endif
     HAL_UART_DeInit(BL_UART);
+
+#if (BL_RS485 == 1)
+    HAL_GPIO_DeInit(BL_RS485_DE_GPIO_Port, BL_RS485_DE_Pin);
+#endif
 }
 
+#if (BL_UART_DMA == 1)
+/**
+ * @brief dma streams for uart, circular rx and normal tx
+ */
+static void BL_UART_DMA_Init(void)
+{
+    BL_UART_DMA_CLK_ENABLE();
+
+    BL_UART_DMA_RX.Instance = BL_UART_DMA_RX_Stream;
+    BL_UART_DMA_RX.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    BL_UART_DMA_RX.Init.PeriphInc = DMA_PINC_DISABLE;
+    BL_UART_DMA_RX.Init.MemInc = DMA_MINC_ENABLE;
+    BL_UART_DMA_RX.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    BL_UART_DMA_RX.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    BL_UART_DMA_RX.Init.Mode = DMA_CIRCULAR;
+    BL_UART_DMA_RX.Init.Priority = DMA_PRIORITY_HIGH;
+#if !defined(STM32F103xE) && !defined(STM32F103xB)
+    BL_UART_DMA_RX.Init.Channel = BL_UART_DMA_Channel;
+    BL_UART_DMA_RX.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+#endif
+
+    BL_UART_DMA_TX.Instance = BL_UART_DMA_TX_Stream;
+    BL_UART_DMA_TX.Init = BL_UART_DMA_RX.Init;
+    BL_UART_DMA_TX.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    BL_UART_DMA_TX.Init.Mode = DMA_NORMAL;
+    BL_UART_DMA_TX.Init.Priority = DMA_PRIORITY_MEDIUM;
+
+    if (HAL_DMA_Init(&BL_UART_DMA_RX) != HAL_OK || HAL_DMA_Init(&BL_UART_DMA_TX) != HAL_OK)
+    {
+        Error_Handler();
+    }
+
+    __HAL_LINKDMA(BL_UART, hdmarx, BL_UART_DMA_RX);
+    __HAL_LINKDMA(BL_UART, hdmatx, BL_UART_DMA_TX);
+}
+
+/**
+ * @brief This function handles uart idle line and error interrupt.
+ * @note waking from wfi is all that is needed, data is already in rx buffer
+ */
+void BL_UART_IRQHandler(void)
+{
+    uint32_t status = BL_UART->Instance->SR;
+
+    if (status & (USART_SR_IDLE | USART_SR_ORE | USART_SR_NE | USART_SR_FE))
+    {
+        /* reading SR then DR clears idle and error flags */
+        (void)BL_UART->Instance->DR;
+    }
+
+    BL_COMM_RX_Event();
+}
+#else
+/**
+ * @brief move received char to rx ring
+ * @note runs from ram, also called with interrupts off while flash is busy
+ */
+__RAM_FUNC static void BL_UART_Poll(void)
+{
+    uint32_t status = BL_UART->Instance->SR;
+
+    if (status & (USART_SR_RXNE | USART_SR_ORE))
+    {
+        /* reading DR clears RXNE and ORE */
+        uint8_t data = BL_UART->Instance->DR;
+
+        /* drop byte if ring is full, frame crc will catch it */
+        if (BL_UART_RX_Write_Index - BL_UART_RX_Read_Index < BL_UART_RX_BUFFER_SIZE)
+        {
+            BL_UART_RX_Buffer[BL_UART_RX_Write_Index & (BL_UART_RX_BUFFER_SIZE - 1)] = data;
+            BL_UART_RX_Write_Index++;
+        }
+    }
+}
+
+/**
+ * @brief This function handles uart rx interrupt.
+ */
+void BL_UART_IRQHandler(void)
+{
+    BL_UART_Poll();
+    BL_COMM_RX_Event();
+}
+#endif
+
 #if (BL_AUTO_BAUD == 1)
 /**
  * @brief This function handles uart rx pin interrupt.
@@ -175,3 +643,26 @@ void EXTI3_IRQHandler(void)
     /* USER CODE END EXTI3_IRQn 1 */
 }
 #endif
+
+const struct BL_COMM_Transport_t BL_UART_Transport = {
+    .Init = BL_UART_Init,
+    .Deinit = BL_UART_Deinit,
+#if (BL_RS485 == 1)
+    /* only the addressed node drives the line */
+    .Send = BL_RS485_Send_Chars,
+    .Receive = BL_RS485_Get_Chars,
+#else
+    .Send = BL_UART_Send_Chars,
+    .Receive = BL_UART_Get_Chars,
+#endif
+#if (BL_UART_DMA == 1)
+    /* dma keeps receiving while flash is busy */
+    .Poll = NULL,
+    .Max_Frame_Size = BL_UART_RX_BUFFER_SIZE,
+    .Caps = BL_COMM_CAP_DMA | BL_UART_DUPLEX,
+#else
+    .Poll = BL_UART_Poll,
+    .Max_Frame_Size = BL_UART_RX_BUFFER_SIZE,
+    .Caps = BL_UART_DUPLEX,
+#endif
+};
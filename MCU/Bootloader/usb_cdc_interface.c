@@ -3,6 +3,7 @@
 #if (USE_USB_CDC == 1)
 /** standaed includes */
 #include <stdint.h>
+#include <string.h>
 
 /** bootloader includes */
 #include "comm_interface.h"
@@ -10,136 +11,378 @@
 /** st includes */
 #include "usbd_cdc_if.h"
 
+/**
+ * single producer single consumer ring, rx producer is usb isr and consumer is bootloader loop,
+ * tx the other way round, indices run freely and are masked on access, each one is written by one side only
+ */
 struct Ring_Buffer_t
 {
     uint8_t *Storage;
-    uint8_t Full_Flag;
-    uint16_t Write_Index;
-    uint16_t Read_Index;
-    uint16_t Size;
+    volatile uint32_t Write_Index;
+    volatile uint32_t Read_Index;
+    volatile uint32_t Dropped;
+    uint32_t Size;
 };
 
-uint8_t CDC_RX_Buffer[1024];
-struct Ring_Buffer_t CDC_RB = {CDC_RX_Buffer, 0, 0, 0, sizeof(CDC_RX_Buffer)};
+static uint8_t CDC_RX_Buffer[BL_CDC_RX_BUFFER_SIZE];
+static struct Ring_Buffer_t CDC_RB = {CDC_RX_Buffer, 0, 0, 0, sizeof(CDC_RX_Buffer)};
+
+static uint8_t CDC_TX_Buffer[BL_CDC_TX_BUFFER_SIZE];
+static struct Ring_Buffer_t CDC_TX_RB = {CDC_TX_Buffer, 0, 0, 0, sizeof(CDC_TX_Buffer)};
+
+/** chars handed to in endpoint, they stay in ring until transfer completes */
+static volatile uint32_t CDC_TX_In_Flight;
+
+/** set when bootloader turns around to receive, a short packet may then go out */
+static volatile uint8_t CDC_TX_Flush;
+
+/** ms without progress before tx gives up, host stopped reading */
+#define CDC_TX_TIMEOUT 100
+
+/**
+ * out endpoint is left unarmed while ring has less than one packet of space,
+ * host controller then sees naks and retries the packet until consumer re-arms it
+ */
+static volatile uint8_t CDC_RX_Parked;
+
+extern USBD_HandleTypeDef hUsbDeviceFS;
+
+static uint32_t RB_Get_Count(struct Ring_Buffer_t *rb)
+{
+    return rb->Write_Index - rb->Read_Index;
+}
+
+/**
+ * @brief free running time in us, hal tick extended with systick counter
+ */
+static uint32_t CDC_Get_Micros(void)
+{
+    uint32_t tick;
+    uint32_t val;
+
+    /* read again if systick wrapped in between */
+    do
+    {
+        tick = HAL_GetTick();
+        val = SysTick->VAL;
+    } while (tick != HAL_GetTick());
+
+    uint32_t load = SysTick->LOAD + 1;
+
+    return tick * 1000 + (load - 1 - val) * 1000 / load;
+}
 
-static uint16_t RB_Get_Count()
+/**
+ * @brief start next in transfer when endpoint is idle, runs in usb isr or with irqs masked
+ */
+static void CDC_TX_Service(void)
 {
-    if (CDC_RB.Full_Flag)
+    USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *)hUsbDeviceFS.pClassData;
+
+    /* not configured yet, or previous transfer and its zlp still on the bus */
+    if (hcdc == NULL || hcdc->TxState != 0)
     {
-        return CDC_RB.Size;
+        return;
     }
-    if (CDC_RB.Write_Index >= CDC_RB.Read_Index)
+
+    CDC_TX_RB.Read_Index += CDC_TX_In_Flight;
+    CDC_TX_In_Flight = 0;
+
+    uint32_t count = RB_Get_Count(&CDC_TX_RB);
+
+    if (count == 0)
     {
-        return CDC_RB.Write_Index - CDC_RB.Read_Index;
+        CDC_TX_Flush = 0;
+        return;
     }
 
-    return CDC_RB.Size - (CDC_RB.Read_Index - CDC_RB.Write_Index);
+    /* coalesce small sends until a full packet is queued or the reply is complete */
+    if (count < CDC_DATA_FS_MAX_PACKET_SIZE && !CDC_TX_Flush)
+    {
+        return;
+    }
+
+    uint32_t read_offset = CDC_TX_RB.Read_Index & (CDC_TX_RB.Size - 1);
+
+    if (count > CDC_TX_RB.Size - read_offset)
+    {
+        count = CDC_TX_RB.Size - read_offset;
+    }
+
+    /* chars are in storage before endpoint reads them */
+    __DMB();
+
+    /* class terminates a transfer that is a multiple of packet size with a zlp */
+    if (CDC_Transmit_FS(&CDC_TX_RB.Storage[read_offset], count) == USBD_OK)
+    {
+        CDC_TX_In_Flight = count;
+    }
 }
 
 /**
- * @brief send character
- * @param data char to be sent
+ * @brief service tx from bootloader loop, also completes transfers on cores without tx complete callback
  */
-void BL_CDC_Send_Char(char data)
+static void CDC_TX_Kick(void)
 {
-    CDC_Transmit_FS((uint8_t *)&data, 1);
+    __disable_irq();
+    CDC_TX_Service();
+    __enable_irq();
 }
 
 /**
- * @brief  send string buffer
+ * @brief let queued chars go out without waiting for a full packet
+ */
+static void CDC_TX_Flush_Queue(void)
+{
+    CDC_TX_Flush = 1;
+    CDC_TX_Kick();
+}
+
+/**
+ * @brief  queue string buffer, goes out in full packets or once bootloader waits for input
  * @param data input buffer
  * @param number of chars to send
  **/
-void BL_CDC_Send_Chars(char *data, uint32_t count)
+static void BL_CDC_Send_Chars(const uint8_t *data, uint32_t count)
 {
-    CDC_Transmit_FS((uint8_t *)data, count);
+    uint32_t tick = HAL_GetTick();
+
+    while (count)
+    {
+        uint32_t space = CDC_TX_RB.Size - RB_Get_Count(&CDC_TX_RB);
+
+        if (space == 0)
+        {
+            /* ring full, wait for in endpoint to drain it */
+            CDC_TX_Flush_Queue();
+
+            if (HAL_GetTick() - tick > CDC_TX_TIMEOUT)
+            {
+                return;
+            }
+
+            continue;
+        }
+
+        if (space > count)
+        {
+            space = count;
+        }
+
+        uint32_t write_offset = CDC_TX_RB.Write_Index & (CDC_TX_RB.Size - 1);
+        uint32_t first = CDC_TX_RB.Size - write_offset;
+
+        if (first > space)
+        {
+            first = space;
+        }
+
+        memcpy(&CDC_TX_RB.Storage[write_offset], data, first);
+        memcpy(CDC_TX_RB.Storage, data + first, space - first);
+
+        /* chars are in storage before isr sees new write index */
+        __DMB();
+
+        CDC_TX_RB.Write_Index += space;
+
+        data += space;
+        count -= space;
+        tick = HAL_GetTick();
+    }
+
+    CDC_TX_Kick();
 }
 
 /**
- * @brief get character
- * @param timeout
+ * @brief get contiguous span of received chars, read in place then release with BL_CDC_Consume()
+ * @param span set to first unread char
+ * @retval no of chars in span, up to end of ring storage
  */
-int BL_CDC_Get_Char(uint32_t timeout)
+uint32_t BL_CDC_Peek(const uint8_t **span)
 {
-    uint8_t ch;
+    uint32_t count = RB_Get_Count(&CDC_RB);
+    uint32_t read_offset = CDC_RB.Read_Index & (CDC_RB.Size - 1);
+
+    /* chars are in storage before write index is seen */
+    __DMB();
 
-    while (--timeout && CDC_RB.Write_Index == CDC_RB.Read_Index && !CDC_RB.Full_Flag)
+    if (count > CDC_RB.Size - read_offset)
     {
-        HAL_Delay(1);
+        count = CDC_RB.Size - read_offset;
     }
 
-    if (timeout)
+    *span = &CDC_RB.Storage[read_offset];
+
+    return count;
+}
+
+/**
+ * @brief release chars read in place
+ * @param count no of chars, at most what BL_CDC_Peek() returned
+ */
+void BL_CDC_Consume(uint32_t count)
+{
+    /* reads finish before isr may overwrite them */
+    __DMB();
+
+    CDC_RB.Read_Index += count;
+
+    /* isr cannot run while parked, no out packet completes on unarmed endpoint */
+    if (CDC_RX_Parked && CDC_RB.Size - RB_Get_Count(&CDC_RB) >= CDC_DATA_FS_MAX_PACKET_SIZE)
     {
-        ch = CDC_RB.Storage[CDC_RB.Read_Index++];
-        if (CDC_RB.Read_Index == CDC_RB.Size)
-        {
-            CDC_RB.Read_Index = 0;
-        }
-        CDC_RB.Full_Flag = 0;
-        return ch;
-    }
+        CDC_RX_Parked = 0;
 
-    return -1;
+        /* endpoint register is shared with in direction, keep usb isr out of it */
+        __disable_irq();
+        USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+        __enable_irq();
+    }
 }
 
 /**
  * @brief get character
- * @param timeout
+ * @param timeout in ms, kept to the us
  * @reval number chaers received
  */
-uint32_t BL_CDC_Get_Chars(char *buffer, uint32_t count, uint32_t timeout)
+static uint32_t BL_CDC_Get_Chars(uint8_t *buffer, uint32_t count, uint32_t timeout)
 {
-    uint32_t temp;
+    uint32_t us_start = CDC_Get_Micros();
+    uint32_t us_timeout = timeout * 1000;
 
-    while (--timeout && RB_Get_Count() < count)
-    {
-        HAL_Delay(1);
-    }
+    /* reply is complete once bootloader waits for input */
+    CDC_TX_Flush_Queue();
 
-    if (!timeout)
+    /* sleep until receive isr has the whole span */
+    while (RB_Get_Count(&CDC_RB) < count)
     {
-        count = RB_Get_Count();
+        uint32_t us_elapsed = CDC_Get_Micros() - us_start;
+
+        if (us_elapsed >= us_timeout)
+        {
+            /* isr may have added a packet since the check, never copy more than asked for */
+            uint32_t available = RB_Get_Count(&CDC_RB);
+
+            count = (available < count) ? available : count;
+            break;
+        }
+
+        CDC_TX_Kick();
+
+        /* systick only wakes on ms edges, spin through the last one */
+        if (us_timeout - us_elapsed > 1000)
+        {
+            /* wfi still wakes on an isr pending since the check, none is lost while masked */
+            __disable_irq();
+
+            if (RB_Get_Count(&CDC_RB) < count)
+            {
+                __WFI();
+            }
+
+            __enable_irq();
+        }
     }
 
-    temp = count;
+    /* at most two spans around end of ring storage */
+    uint32_t remaining = count;
 
-    while (count--)
+    while (remaining)
     {
-        *buffer++ = CDC_RB.Storage[CDC_RB.Read_Index++];
-        if (CDC_RB.Read_Index == CDC_RB.Size)
+        const uint8_t *span;
+        uint32_t span_len = BL_CDC_Peek(&span);
+
+        if (span_len > remaining)
         {
-            CDC_RB.Read_Index = 0;
+            span_len = remaining;
         }
-        CDC_RB.Full_Flag = 0;
+
+        memcpy(buffer, span, span_len);
+        BL_CDC_Consume(span_len);
+
+        buffer += span_len;
+        remaining -= span_len;
     }
 
-    return temp;
+    return count;
 }
 
-/** called from CDC_Receive_FS() in @usbd_cdc_if.c */
+/** called from CDC_Receive_FS() in @usbd_cdc_if.c, re-arms out endpoint when ring has room */
 void CDC_Receive_FS_ISR(uint8_t *buff, uint32_t len)
 {
-    while (len--)
+    uint32_t space = CDC_RB.Size - RB_Get_Count(&CDC_RB);
+
+    /* never overwrite unread chars, only happens if packet size is exceeded */
+    if (len > space)
     {
-        CDC_RB.Storage[CDC_RB.Write_Index++] = *buff++;
-        if (CDC_RB.Write_Index == CDC_RB.Size)
-        {
-            CDC_RB.Write_Index = 0;
-        }
-        CDC_RB.Full_Flag = (CDC_RB.Write_Index == CDC_RB.Read_Index);
+        CDC_RB.Dropped += len - space;
+        len = space;
     }
+
+    uint32_t write_offset = CDC_RB.Write_Index & (CDC_RB.Size - 1);
+    uint32_t first = CDC_RB.Size - write_offset;
+
+    if (first > len)
+    {
+        first = len;
+    }
+
+    memcpy(&CDC_RB.Storage[write_offset], buff, first);
+    memcpy(CDC_RB.Storage, buff + first, len - first);
+
+    /* chars are in storage before reader sees new write index */
+    __DMB();
+
+    CDC_RB.Write_Index += len;
+
+    BL_COMM_RX_Event();
+
+    if (CDC_RB.Size - RB_Get_Count(&CDC_RB) >= CDC_DATA_FS_MAX_PACKET_SIZE)
+    {
+        USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+    }
+    else
+    {
+        CDC_RX_Parked = 1;
+    }
+}
+
+/** called from CDC_TransmitCplt_FS() in @usbd_cdc_if.c, chains next in transfer */
+void CDC_TransmitCplt_FS_ISR(void)
+{
+    CDC_TX_Service();
 }
 
-uint8_t BL_CDC_Init()
+static uint8_t BL_CDC_Init(void)
 {
+    /* class init arms out endpoint */
+    CDC_RX_Parked = 0;
+
     extern void MX_USB_DEVICE_Init(void);
     MX_USB_DEVICE_Init();
     return 1;
 }
 
-void BL_CDC_Deinit()
+static void BL_CDC_Deinit(void)
 {
-    extern USBD_HandleTypeDef hUsbDeviceFS;
+    uint32_t tick = HAL_GetTick();
+
+    /* last reply goes out before usb detaches */
+    while (RB_Get_Count(&CDC_TX_RB) && hUsbDeviceFS.pClassData != NULL && HAL_GetTick() - tick < CDC_TX_TIMEOUT)
+    {
+        CDC_TX_Flush_Queue();
+    }
+
     USBD_DeInit(&hUsbDeviceFS);
 }
+
+const struct BL_COMM_Transport_t BL_CDC_Transport = {
+    .Init = BL_CDC_Init,
+    .Deinit = BL_CDC_Deinit,
+    .Send = BL_CDC_Send_Chars,
+    .Receive = BL_CDC_Get_Chars,
+    /* usb core naks while cpu is stalled, nothing to poll */
+    .Poll = NULL,
+    .Max_Frame_Size = BL_CDC_RX_BUFFER_SIZE,
+    .Caps = BL_COMM_CAP_DMA | BL_COMM_CAP_FULL_DUPLEX,
+};
 #endif
@@ -264,7 +264,7 @@ static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
-  USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+  /* re-arms endpoint only if bootloader ring has room, else endpoint naks until it is drained */
   extern void CDC_Receive_FS_ISR(uint8_t *buff, uint32_t len);
   CDC_Receive_FS_ISR(Buf, *Len);
   return (USBD_OK);